@@ -1,19 +1,21 @@
 #pragma once
 #include "graphics_headers.h"
+#include "gpuresources.h"
 #include <SOIL2/SOIL2.h>
 
 class Texture
 {
 public:
     Texture();
-    Texture(const char* fileName);
-    bool loadTexture(const char* texFile);
-    GLuint getTextureID() { return m_TextureID; }
+    // A normal map gets a flat placeholder while it streams in
+    Texture(const char* fileName, bool normalMap = false);
+    // Drops the upload if the file is still streaming in
+    ~Texture();
+    GLuint getTextureID() { return m_texture.Get(); }
 
 
 private:
-    GLuint m_TextureID;
-    bool initializeTexture();
+    GpuTexture m_texture;   // swapped by TextureUploader when the file is in
 };
 
 
@@ -0,0 +1,419 @@
+#include "alloctracker.h"
+
+#ifdef ALLOC_TRACKING
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <dbghelp.h>
+#if defined(_MSC_VER)
+#pragma comment(lib, "dbghelp.lib")
+#endif
+#else
+#include <execinfo.h>
+#endif
+
+// Frames printed for an allocation that broke an allocation-free scope
+static const int kTraceDepth = 24;
+static const int kTopSites = 10;
+// Between an allocation and the code that asked for it: OnAllocate, the
+// Allocate helper and operator new. All three stay out of line so the
+// count holds.
+static const int kHookFrames = 3;
+
+#if defined(_MSC_VER)
+#define ALLOC_NOINLINE __declspec(noinline)
+#else
+#define ALLOC_NOINLINE __attribute__((noinline))
+#endif
+
+// The scope this thread is in, and whether it may allocate
+static thread_local const char* t_scope = NULL;
+static thread_local bool t_free = false;
+// Set while the tracker itself works, so what it allocates (symbol
+// lookups, printf buffers) isn't counted or checked
+static thread_local bool t_busy = false;
+// Set on the thread that calls BeginFrame; only its allocations count
+// towards the frame's. Workers (decoders, chunk generators) run across
+// frames, so theirs only go in the totals, scopes and call sites.
+static thread_local bool t_frameThread = false;
+
+// Fills frames with the stack above the innermost skip frames of the
+// caller's (the caller being the first)
+ALLOC_NOINLINE static int CaptureStack(void** frames, int max, int skip)
+{
+#if defined(_WIN32)
+    return (int)CaptureStackBackTrace((DWORD)(skip + 1), (DWORD)max, frames, NULL);
+#else
+    void* all[kTraceDepth + kHookFrames + 2];
+    int count = backtrace(all, std::min(max + skip + 1, kTraceDepth + kHookFrames + 2));
+    count = std::max(count - skip - 1, 0);
+    std::copy(all + skip + 1, all + skip + 1 + count, frames);
+    return count;
+#endif
+}
+
+static void PrintFrame(void* address)
+{
+#if defined(_WIN32)
+    static bool initialized = false;
+    HANDLE process = GetCurrentProcess();
+    if (!initialized)
+    {
+        SymSetOptions(SYMOPT_UNDNAME | SYMOPT_DEFERRED_LOADS | SYMOPT_LOAD_LINES);
+        SymInitialize(process, NULL, TRUE);
+        initialized = true;
+    }
+
+    char buffer[sizeof(SYMBOL_INFO) + 256];
+    SYMBOL_INFO* symbol = (SYMBOL_INFO*)buffer;
+    symbol->SizeOfStruct = sizeof(SYMBOL_INFO);
+    symbol->MaxNameLen = 255;
+    DWORD64 displacement = 0;
+    IMAGEHLP_LINE64 line;
+    line.SizeOfStruct = sizeof(line);
+    DWORD lineDisplacement = 0;
+    if (!SymFromAddr(process, (DWORD64)address, &displacement, symbol))
+        printf("    %p\n", address);
+    else if (SymGetLineFromAddr64(process, (DWORD64)address, &lineDisplacement, &line))
+        printf("    %s (%s:%lu)\n", symbol->Name, line.FileName, line.LineNumber);
+    else
+        printf("    %s\n", symbol->Name);
+#else
+    // Names need the executable linked with -rdynamic
+    char** symbols = backtrace_symbols(&address, 1);
+    printf("    %s\n", symbols != NULL ? symbols[0] : "?");
+    free(symbols);
+#endif
+}
+
+AllocTracker& AllocTracker::Get()
+{
+    static AllocTracker tracker;
+    return tracker;
+}
+
+AllocTracker::AllocTracker()
+{
+    m_strict = AllocStrictMode::Off;
+    m_strictFrom = 0;
+    m_allocations = 0;
+    m_bytes = 0;
+    m_frees = 0;
+    m_frame = -1;
+    m_frameAllocations = 0;
+    m_frameBytes = 0;
+    m_framesAllocating = 0;
+    m_lastAllocatingFrame = -1;
+    m_worstAllocations = 0;
+    m_worstBytes = 0;
+    m_lock.clear();
+    for (Scope& scope : m_scopes)
+    {
+        scope.name = NULL;
+        scope.count = 0;
+        scope.bytes = 0;
+    }
+    m_scopeCount = 0;
+    m_siteCount = 0;
+    m_sitesDropped = 0;
+}
+
+void AllocTracker::SetStrict(AllocStrictMode mode, int fromFrame)
+{
+    m_strict = mode;
+    m_strictFrom = fromFrame;
+}
+
+void AllocTracker::BeginFrame()
+{
+    t_frameThread = true;
+    // Frame -1 is everything before the first frame: loading
+    long long allocations = m_frameAllocations.exchange(0);
+    long long bytes = m_frameBytes.exchange(0);
+    if (m_frame >= 0 && allocations > 0)
+    {
+        m_framesAllocating++;
+        m_lastAllocatingFrame = m_frame;
+        m_worstAllocations = std::max(m_worstAllocations, allocations);
+        m_worstBytes = std::max(m_worstBytes, bytes);
+    }
+    m_frame++;
+}
+
+ALLOC_NOINLINE void AllocTracker::OnAllocate(size_t bytes)
+{
+    if (t_busy)
+        return;
+    t_busy = true;
+
+    m_allocations++;
+    m_bytes += bytes;
+    if (t_frameThread)
+    {
+        m_frameAllocations++;
+        m_frameBytes += bytes;
+    }
+
+    const char* name = t_scope != NULL ? t_scope : "(no scope)";
+    Scope* scope = FindScope(name);
+    if (scope != NULL)
+    {
+        scope->count++;
+        scope->bytes += bytes;
+    }
+
+    void* frames[kSiteDepth];
+    int depth = CaptureStack(frames, kSiteDepth, kHookFrames);
+    while (m_lock.test_and_set(std::memory_order_acquire))
+        ;
+    Site* site = FindSite(frames, depth, name);
+    if (site != NULL)
+    {
+        site->count++;
+        site->bytes += bytes;
+    }
+    bool report = t_free && m_strict != AllocStrictMode::Off && m_frame >= m_strictFrom &&
+        (site == NULL || !site->reported || m_strict == AllocStrictMode::Abort);
+    if (report && site != NULL)
+        site->reported = true;
+    m_lock.clear(std::memory_order_release);
+
+    if (report)
+        ReportViolation(site, bytes, name);
+    t_busy = false;
+}
+
+void AllocTracker::OnFree()
+{
+    if (!t_busy)
+        m_frees++;
+}
+
+AllocTracker::Scope* AllocTracker::FindScope(const char* name)
+{
+    int count = m_scopeCount.load(std::memory_order_acquire);
+    for (int i = 0; i < count; i++)
+    {
+        if (m_scopes[i].name == name)
+            return &m_scopes[i];
+    }
+
+    while (m_lock.test_and_set(std::memory_order_acquire))
+        ;
+    Scope* scope = NULL;
+    count = m_scopeCount.load(std::memory_order_relaxed);
+    for (int i = 0; i < count && scope == NULL; i++)
+    {
+        if (m_scopes[i].name == name)
+            scope = &m_scopes[i];
+    }
+    if (scope == NULL && count < kMaxScopes)
+    {
+        scope = &m_scopes[count];
+        scope->name = name;
+        m_scopeCount.store(count + 1, std::memory_order_release);
+    }
+    m_lock.clear(std::memory_order_release);
+    return scope;
+}
+
+// Under m_lock. NULL once the table is full.
+AllocTracker::Site* AllocTracker::FindSite(void* const* frames, int depth, const char* scope)
+{
+    for (int i = 0; i < m_siteCount; i++)
+    {
+        Site& site = m_sites[i];
+        if (site.scope == scope && site.depth == depth && std::equal(frames, frames + depth, site.frames))
+            return &site;
+    }
+    if (m_siteCount == kMaxSites)
+    {
+        m_sitesDropped++;
+        return NULL;
+    }
+
+    Site& site = m_sites[m_siteCount++];
+    std::copy(frames, frames + depth, site.frames);
+    site.depth = depth;
+    site.scope = scope;
+    site.count = 0;
+    site.bytes = 0;
+    site.reported = false;
+    return &site;
+}
+
+ALLOC_NOINLINE void AllocTracker::ReportViolation(Site* site, size_t bytes, const char* scope)
+{
+    printf("Allocation of %zu bytes in allocation-free scope %s, frame %d:\n", bytes, scope, m_frame.load());
+    void* frames[kTraceDepth];
+    int depth = CaptureStack(frames, kTraceDepth, kHookFrames + 1);
+    for (int i = 0; i < depth; i++)
+        PrintFrame(frames[i]);
+    fflush(stdout);
+
+    if (m_strict == AllocStrictMode::Abort)
+        abort();
+    if (site != NULL)
+        printf("  (reported once; later ones from here are only counted)\n");
+}
+
+void AllocTracker::PrintSummary() const
+{
+    t_busy = true;
+    int frames = std::max(m_frame.load() + 1, 1);
+    printf("Allocations: %lld (%.1f MB) and %lld frees, loading included\n", m_allocations.load(),
+        m_bytes.load() / 1048576.0, m_frees.load());
+    if (m_framesAllocating == 0)
+        printf("  none of the %d frames allocated\n", frames);
+    else
+        printf("  %d of %d frames allocated, the last was frame %d; the worst made %lld (%.1f KB)\n",
+            m_framesAllocating, frames, m_lastAllocatingFrame, m_worstAllocations, m_worstBytes / 1024.0);
+
+    int scopeCount = m_scopeCount.load();
+    for (int i = 0; i < scopeCount; i++)
+    {
+        const Scope& scope = m_scopes[i];
+        printf("  %-20s %10lld allocations %10.1f KB %10.2f a frame\n", scope.name, scope.count.load(),
+            scope.bytes.load() / 1024.0, (double)scope.count.load() / frames);
+    }
+
+    // Busiest call sites, by count
+    int order[kMaxSites];
+    for (int i = 0; i < m_siteCount; i++)
+        order[i] = i;
+    int top = std::min(kTopSites, m_siteCount);
+    std::partial_sort(order, order + top, order + m_siteCount, [this](int a, int b) {
+        return m_sites[a].count > m_sites[b].count;
+        });
+    if (top > 0)
+        printf("  top call sites:\n");
+    for (int i = 0; i < top; i++)
+    {
+        const Site& site = m_sites[order[i]];
+        printf("  %lld allocations, %.1f KB, in %s:\n", site.count, site.bytes / 1024.0, site.scope);
+        for (int f = 0; f < site.depth; f++)
+            PrintFrame(site.frames[f]);
+    }
+    if (m_sitesDropped > 0)
+        printf("  %lld allocations from call sites past the first %d weren't told apart\n", m_sitesDropped, kMaxSites);
+    t_busy = false;
+}
+
+AllocScope::AllocScope(const char* name, bool allocationFree)
+{
+    m_outerName = t_scope;
+    m_outerFree = t_free;
+    t_scope = name;
+    t_free = allocationFree;
+}
+
+AllocScope::~AllocScope()
+{
+    t_scope = m_outerName;
+    t_free = m_outerFree;
+}
+
+// The replacements. Alignment beyond max_align_t goes through the
+// platform's aligned allocator, which needs its own free.
+
+ALLOC_NOINLINE static void* Allocate(size_t size)
+{
+    void* p = malloc(size > 0 ? size : 1);
+    if (p != NULL)
+        AllocTracker::Get().OnAllocate(size);
+    return p;
+}
+
+static void Free(void* p)
+{
+    if (p == NULL)
+        return;
+    AllocTracker::Get().OnFree();
+    free(p);
+}
+
+ALLOC_NOINLINE static void* AllocateAligned(size_t size, size_t align)
+{
+    size = size > 0 ? size : 1;
+#if defined(_WIN32)
+    void* p = _aligned_malloc(size, align);
+#else
+    void* p = NULL;
+    if (posix_memalign(&p, std::max(align, sizeof(void*)), size) != 0)
+        p = NULL;
+#endif
+    if (p != NULL)
+        AllocTracker::Get().OnAllocate(size);
+    return p;
+}
+
+static void FreeAligned(void* p)
+{
+    if (p == NULL)
+        return;
+    AllocTracker::Get().OnFree();
+#if defined(_WIN32)
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+void* operator new(size_t size)
+{
+    void* p = Allocate(size);
+    if (p == NULL)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](size_t size)
+{
+    void* p = Allocate(size);
+    if (p == NULL)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return Allocate(size); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return Allocate(size); }
+void operator delete(void* p) noexcept { Free(p); }
+void operator delete[](void* p) noexcept { Free(p); }
+void operator delete(void* p, size_t) noexcept { Free(p); }
+void operator delete[](void* p, size_t) noexcept { Free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { Free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { Free(p); }
+
+void* operator new(size_t size, std::align_val_t align)
+{
+    void* p = AllocateAligned(size, (size_t)align);
+    if (p == NULL)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](size_t size, std::align_val_t align)
+{
+    void* p = AllocateAligned(size, (size_t)align);
+    if (p == NULL)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new(size_t size, std::align_val_t align, const std::nothrow_t&) noexcept { return AllocateAligned(size, (size_t)align); }
+void* operator new[](size_t size, std::align_val_t align, const std::nothrow_t&) noexcept { return AllocateAligned(size, (size_t)align); }
+void operator delete(void* p, std::align_val_t) noexcept { FreeAligned(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { FreeAligned(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { FreeAligned(p); }
+void operator delete[](void* p, size_t, std::align_val_t) noexcept { FreeAligned(p); }
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept { FreeAligned(p); }
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept { FreeAligned(p); }
+
+#endif /* ALLOC_TRACKING */
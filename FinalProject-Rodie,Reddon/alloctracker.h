@@ -0,0 +1,120 @@
+#ifndef ALLOCTRACKER_H
+#define ALLOCTRACKER_H
+
+#include <atomic>
+#include <cstddef>
+
+// Heap allocation tracking, compiled in only when ALLOC_TRACKING is
+// defined. The global operator new and delete are replaced to count every
+// allocation: per frame (on the thread that calls BeginFrame), per scope,
+// and per call site (the first few frames of its stack).
+//
+//     ALLOC_SCOPE("ProcessInput");        // counted under this name
+//     ALLOC_FREE_SCOPE("Render");         // and must not allocate
+//
+// The innermost scope wins, so an ALLOC_SCOPE inside an allocation-free one
+// is where allocating is expected (streaming, first-use compiles) and
+// names what did it. With --alloc-strict, an allocation inside an
+// allocation-free scope prints its stack, and aborts in abort mode.
+//
+// Without ALLOC_TRACKING the macros are empty and new/delete are the
+// library's own. Scope names must be string literals (only the pointer is
+// kept).
+
+enum class AllocStrictMode { Off, Log, Abort };
+
+#ifdef ALLOC_TRACKING
+
+class AllocTracker
+{
+public:
+    static AllocTracker& Get();
+
+    // Checked from frame fromFrame on; the frames before it grow the
+    // containers that are reused every frame after
+    void SetStrict(AllocStrictMode mode, int fromFrame);
+    // Closes the last frame's counts. Always from the same thread, the
+    // one whose allocations make up a frame.
+    void BeginFrame();
+    void PrintSummary() const;
+
+    // From the operator new and delete replacements
+    void OnAllocate(size_t bytes);
+    void OnFree();
+
+private:
+    AllocTracker();
+
+    struct Scope
+    {
+        const char* name;
+        std::atomic<long long> count;
+        std::atomic<long long> bytes;
+    };
+
+    static const int kSiteDepth = 4;        // frames of stack that tell call sites apart
+    struct Site
+    {
+        void* frames[kSiteDepth];
+        int depth;
+        const char* scope;
+        long long count;
+        long long bytes;
+        bool reported;                      // strict mode has printed it
+    };
+
+    Scope* FindScope(const char* name);
+    Site* FindSite(void* const* frames, int depth, const char* scope);
+    void ReportViolation(Site* site, size_t bytes, const char* scope);
+
+    static const int kMaxScopes = 32;
+    static const int kMaxSites = 1024;
+
+    AllocStrictMode m_strict;
+    int m_strictFrom;
+
+    std::atomic<long long> m_allocations;
+    std::atomic<long long> m_bytes;
+    std::atomic<long long> m_frees;
+
+    // The frame open now, and how the closed ones went
+    std::atomic<int> m_frame;
+    std::atomic<long long> m_frameAllocations;
+    std::atomic<long long> m_frameBytes;
+    int m_framesAllocating;
+    int m_lastAllocatingFrame;
+    long long m_worstAllocations;
+    long long m_worstBytes;
+
+    std::atomic_flag m_lock;                // over the scopes' names and the sites
+    Scope m_scopes[kMaxScopes];
+    std::atomic<int> m_scopeCount;
+    Site m_sites[kMaxSites];
+    int m_siteCount;
+    long long m_sitesDropped;
+};
+
+class AllocScope
+{
+public:
+    AllocScope(const char* name, bool allocationFree);
+    ~AllocScope();
+
+private:
+    const char* m_outerName;
+    bool m_outerFree;
+};
+
+#define ALLOC_CONCAT_INNER(a, b) a##b
+#define ALLOC_CONCAT(a, b) ALLOC_CONCAT_INNER(a, b)
+#define ALLOC_SCOPE(name) AllocScope ALLOC_CONCAT(allocScope_, __LINE__)(name, false)
+#define ALLOC_FREE_SCOPE(name) AllocScope ALLOC_CONCAT(allocScope_, __LINE__)(name, true)
+
+#else
+
+#define ALLOC_SCOPE(name)
+#define ALLOC_FREE_SCOPE(name)
+
+#endif /* ALLOC_TRACKING */
+
+#endif /* ALLOCTRACKER_H */
@@ -0,0 +1,607 @@
+#include "asteroidfield.h"
+#include "alloctracker.h"
+#include "profiler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <random>
+
+const float AsteroidField::kAsteroidScale = 0.05f;
+
+// The belts GenerateAsteroidBelts makes: 800 asteroids in each ring, given
+// here as asteroids per square unit, over a thin scatter everywhere else
+static const float kInnerMin = 6.5f, kInnerMax = 7.0f;
+static const float kOuterMin = 16.0f, kOuterMax = 17.0f;
+static const float kInnerDensity = 37.7f;
+static const float kOuterDensity = 7.7f;
+static const float kOpenDensity = 0.25f;
+static const float kMaxDensity = kInnerDensity;
+
+// Half the thickness of the rings and of the open field
+static const float kRingHeight = 0.25f;
+static const float kOpenHeight = 1.0f;
+
+static const float kTwoPi = 6.28318530718f;
+
+// The layouts glMultiDraw*Indirect reads
+struct DrawElementsCommand
+{
+    GLuint count;
+    GLuint instanceCount;
+    GLuint firstIndex;
+    GLint baseVertex;
+    GLuint baseInstance;
+};
+
+struct DrawArraysCommand
+{
+    GLuint count;
+    GLuint instanceCount;
+    GLuint first;
+    GLuint baseInstance;
+};
+
+static float Density(float radius)
+{
+    if (radius >= kInnerMin && radius <= kInnerMax)
+        return kInnerDensity;
+    if (radius >= kOuterMin && radius <= kOuterMax)
+        return kOuterDensity;
+    return kOpenDensity;
+}
+
+// splitmix64 of the chunk coordinates and the field's seed
+static uint32_t ChunkSeed(int cx, int cz, uint32_t seed)
+{
+    uint64_t x = ((uint64_t)(uint32_t)cx << 32 | (uint32_t)cz) ^ ((uint64_t)seed * 0x9E3779B97F4A7C15ull);
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return (uint32_t)(x ^ (x >> 31));
+}
+
+// [0, 1) from the generator's raw output. <random>'s distributions aren't
+// specified exactly and differ between standard libraries; mt19937 is.
+static float Unit(std::mt19937& rng)
+{
+    return (rng() >> 8) * (1.0f / 16777216.0f);
+}
+
+AsteroidField::AsteroidField()
+{
+    m_initialized = false;
+    m_synchronous = false;
+    m_meshRadius = 0.0f;
+    m_chunkRadius = 0.0f;
+    m_indexCount = 0;
+    m_pageCount = 0;
+    m_lastScan = glm::vec3(0.0f);
+    m_scanned = false;
+    m_changed = false;
+    m_commandsDirty = true;
+    m_meshCommands = 0;
+    m_impostorCommands = 0;
+    m_meshCount = 0;
+    m_impostorCount = 0;
+    m_version = 0;
+    m_stop = false;
+    m_pending = 0;
+    m_generatedChunks = 0;
+    m_generateSumMs = 0.0;
+    m_uploadedBytes = 0;
+    m_peakChunks = 0;
+    m_peakAsteroids = 0;
+    m_peakPages = 0;
+    m_budgetFrames = 0;
+    m_warnedFull = false;
+}
+
+AsteroidField::~AsteroidField()
+{
+    StopWorkers();
+    FreeChunks();
+}
+
+bool AsteroidField::Initialize(const AsteroidFieldSettings& settings, GLuint vbo, GLuint ibo, int indexCount, float meshRadius)
+{
+    if (m_initialized)
+        return true;
+
+    m_settings = settings;
+    m_settings.unloadRadius = std::max(m_settings.unloadRadius, m_settings.loadRadius);
+    m_meshRadius = meshRadius;
+    m_indexCount = indexCount;
+    m_chunkRadius = 0.5f * sqrtf(2.0f) * m_settings.chunkSize + kOpenHeight + GetAsteroidRadius();
+
+    m_pageCount = (std::max(m_settings.maxAsteroids, kPageSize) + kPageSize - 1) / kPageSize;
+    m_freePages.clear();
+    for (int page = m_pageCount - 1; page >= 0; page--)
+        m_freePages.push_back(page);   // popped lowest first, so early chunks sit together
+
+    m_instanceBuffer.Create("Asteroid field instances");
+    glBindBuffer(GL_ARRAY_BUFFER, m_instanceBuffer.Get());
+    glBufferData(GL_ARRAY_BUFFER, (size_t)m_pageCount * kPageSize * sizeof(glm::mat4), NULL, GL_DYNAMIC_DRAW);
+    m_instanceBuffer.SetBytes((size_t)m_pageCount * kPageSize * sizeof(glm::mat4));
+
+    // Every page can be one command of either kind
+    m_indirectBuffer.Create("Asteroid field commands");
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, m_indirectBuffer.Get());
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, (size_t)m_pageCount * (sizeof(DrawElementsCommand) + sizeof(DrawArraysCommand)),
+        NULL, GL_DYNAMIC_DRAW);
+    m_indirectBuffer.SetBytes((size_t)m_pageCount * (sizeof(DrawElementsCommand) + sizeof(DrawArraysCommand)));
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    m_commands.resize((size_t)m_pageCount * (sizeof(DrawElementsCommand) + sizeof(DrawArraysCommand)));
+
+    m_vao.Create("Asteroid field vertex array");
+    glBindVertexArray(m_vao.Get());
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, vertex));
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, normal));
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, texcoord));
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
+
+    // Model matrix as four vec4s, one per instance
+    glBindBuffer(GL_ARRAY_BUFFER, m_instanceBuffer.Get());
+    for (int i = 0; i < 4; i++)
+    {
+        glEnableVertexAttribArray(3 + i);
+        glVertexAttribPointer(3 + i, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4), (void*)(sizeof(glm::vec4) * i));
+        glVertexAttribDivisor(3 + i, 1);
+    }
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    m_stop = false;
+    int workers = std::max(m_settings.workers, 1);
+    for (int i = 0; i < workers; i++)
+        m_workers.push_back(std::thread(&AsteroidField::WorkerLoop, this));
+
+    printf("Asteroid field: %g unit chunks within %g of the ship, %d asteroid slots (%.1f MB), %d worker%s\n",
+        m_settings.chunkSize, m_settings.loadRadius, m_pageCount * kPageSize,
+        m_pageCount * kPageSize * sizeof(glm::mat4) / 1048576.0, workers, workers == 1 ? "" : "s");
+    m_initialized = true;
+    return true;
+}
+
+void AsteroidField::Shutdown()
+{
+    if (!m_initialized)
+        return;
+
+    StopWorkers();
+    FreeChunks();
+
+    m_vao.Reset();
+    m_instanceBuffer.Reset();
+    m_indirectBuffer.Reset();
+    m_initialized = false;
+}
+
+void AsteroidField::StopWorkers()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+    for (std::thread& worker : m_workers)
+        worker.join();
+    m_workers.clear();
+}
+
+// With the workers stopped. Dropped chunks are only in the queues.
+void AsteroidField::FreeChunks()
+{
+    for (Chunk* chunk : m_generated)
+    {
+        if (chunk->dropped)
+            delete chunk;
+    }
+    for (auto& entry : m_chunks)
+        delete entry.second;
+    m_chunks.clear();
+    m_toGenerate.clear();
+    m_generated.clear();
+    m_ready.clear();
+    m_resident.clear();
+    m_asteroids.clear();
+    m_pending = 0;
+}
+
+void AsteroidField::GenerateChunk(int cx, int cz, const AsteroidFieldSettings& settings, std::vector<glm::mat4>& out)
+{
+    std::mt19937 rng(ChunkSeed(cx, cz, settings.seed));
+    float size = settings.chunkSize;
+    float x0 = cx * size;
+    float z0 = cz * size;
+
+    // Candidates at the densest the field gets, each kept in proportion to
+    // the density where it lands
+    int candidates = (int)ceilf(kMaxDensity * size * size);
+    for (int i = 0; i < candidates; i++)
+    {
+        float x = x0 + Unit(rng) * size;
+        float z = z0 + Unit(rng) * size;
+        float density = Density(sqrtf(x * x + z * z));
+        if (Unit(rng) * kMaxDensity >= density)
+            continue;
+
+        float height = density > kOpenDensity ? kRingHeight : kOpenHeight;
+        float y = (2.0f * Unit(rng) - 1.0f) * height;
+
+        // Tumbled at random, so neighbours don't all face the same way
+        glm::vec3 axis = glm::vec3(Unit(rng), Unit(rng), Unit(rng)) * 2.0f - 1.0f;
+        float angle = Unit(rng) * kTwoPi;
+        if (glm::dot(axis, axis) < 1e-6f)
+            axis = glm::vec3(0.0f, 1.0f, 0.0f);
+
+        glm::mat4 model = glm::translate(glm::mat4(1.0f), glm::vec3(x, y, z));
+        model = glm::rotate(model, angle, glm::normalize(axis));
+        model = glm::scale(model, glm::vec3(kAsteroidScale));
+        out.push_back(model);
+    }
+}
+
+// From center to the nearest point of the chunk's square, in the XZ plane
+float AsteroidField::DistanceTo(int cx, int cz, const glm::vec3& center) const
+{
+    float size = m_settings.chunkSize;
+    float dx = std::max(std::max(cx * size - center.x, center.x - (cx + 1) * size), 0.0f);
+    float dz = std::max(std::max(cz * size - center.z, center.z - (cz + 1) * size), 0.0f);
+    return sqrtf(dx * dx + dz * dz);
+}
+
+glm::vec3 AsteroidField::GetChunkCenter(int i) const
+{
+    const Chunk* chunk = m_resident[i];
+    float size = m_settings.chunkSize;
+    return glm::vec3((chunk->cx + 0.5f) * size, 0.0f, (chunk->cz + 0.5f) * size);
+}
+
+void AsteroidField::SetChunkDraw(int i, ChunkDraw draw)
+{
+    Chunk* chunk = m_resident[i];
+    if (chunk->draw != draw)
+    {
+        chunk->draw = draw;
+        m_commandsDirty = true;
+    }
+}
+
+void AsteroidField::Update(const glm::vec3& center)
+{
+    if (!m_initialized)
+        return;
+
+    PROFILE_SCOPE("AsteroidFieldUpdate");
+    // Allocates only where chunks are made, moved or dropped; those places
+    // have their own ALLOC_SCOPE, a frame that does none of it stays checked
+    m_changed = false;
+    Scan(center);
+    Collect(m_synchronous);
+
+    // Nearest first, as they were queued. A chunk bigger than the whole
+    // budget still goes, alone.
+    size_t sent = 0;
+    while (!m_ready.empty())
+    {
+        Chunk* chunk = m_ready.front();
+        size_t bytes = chunk->asteroids.size() * sizeof(glm::mat4);
+        if (!m_synchronous && sent > 0 && sent + bytes > m_settings.uploadBudget)
+        {
+            m_budgetFrames++;
+            break;
+        }
+        if (!Upload(chunk))
+            break;      // out of pages until chunks behind the ship are dropped
+        m_ready.pop_front();
+        sent += bytes;
+    }
+
+    if (m_changed)
+    {
+        ALLOC_SCOPE("AsteroidField");
+        RebuildAsteroids();
+        m_commandsDirty = true;
+        m_peakChunks = std::max(m_peakChunks, (int)m_resident.size());
+        m_peakAsteroids = std::max(m_peakAsteroids, (int)m_asteroids.size());
+        m_peakPages = std::max(m_peakPages, m_pageCount - (int)m_freePages.size());
+    }
+}
+
+void AsteroidField::Finish(const glm::vec3& center)
+{
+    bool synchronous = m_synchronous;
+    m_synchronous = true;
+    m_scanned = false;
+    Update(center);
+    m_synchronous = synchronous;
+}
+
+// Drops what has left unloadRadius and queues what has come within
+// loadRadius. Only when center has moved far enough to change either.
+void AsteroidField::Scan(const glm::vec3& center)
+{
+    float size = m_settings.chunkSize;
+    if (m_scanned && glm::length(center - m_lastScan) < 0.5f * size)
+        return;
+    m_scanned = true;
+    m_lastScan = center;
+    ALLOC_SCOPE("AsteroidField");
+
+    for (auto it = m_chunks.begin(); it != m_chunks.end();)
+    {
+        Chunk* chunk = it->second;
+        if (DistanceTo(chunk->cx, chunk->cz, center) <= m_settings.unloadRadius)
+        {
+            ++it;
+            continue;
+        }
+        it = m_chunks.erase(it);
+        if (chunk->ready)
+        {
+            Release(chunk);
+            continue;
+        }
+
+        // Still queued: take it back. Being generated: discard it later.
+        bool unqueued = false;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto queued = std::find(m_toGenerate.begin(), m_toGenerate.end(), chunk);
+            if (queued != m_toGenerate.end())
+            {
+                m_toGenerate.erase(queued);
+                m_pending--;
+                unqueued = true;
+            }
+        }
+        if (unqueued)
+            delete chunk;
+        else
+            chunk->dropped = true;
+    }
+
+    int reach = (int)ceilf(m_settings.loadRadius / size);
+    int centerX = (int)floorf(center.x / size);
+    int centerZ = (int)floorf(center.z / size);
+    m_requests.clear();
+    for (int cz = centerZ - reach; cz <= centerZ + reach; cz++)
+    {
+        for (int cx = centerX - reach; cx <= centerX + reach; cx++)
+        {
+            if (DistanceTo(cx, cz, center) >= m_settings.loadRadius)
+                continue;
+            Chunk*& chunk = m_chunks[Key(cx, cz)];
+            if (chunk != NULL)
+                continue;
+            chunk = new Chunk();
+            chunk->cx = cx;
+            chunk->cz = cz;
+            m_requests.push_back(chunk);
+        }
+    }
+    if (m_requests.empty())
+        return;
+
+    std::sort(m_requests.begin(), m_requests.end(), [&](const Chunk* a, const Chunk* b) {
+        return DistanceTo(a->cx, a->cz, center) < DistanceTo(b->cx, b->cz, center);
+    });
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_toGenerate.insert(m_toGenerate.end(), m_requests.begin(), m_requests.end());
+        m_pending += (int)m_requests.size();
+    }
+    m_wake.notify_all();
+}
+
+// Moves generated chunks to m_ready; block waits for every queued one
+void AsteroidField::Collect(bool block)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (block)
+        m_doneSignal.wait(lock, [this] { return (int)m_generated.size() == m_pending; });
+
+    while (!m_generated.empty())
+    {
+        ALLOC_SCOPE("AsteroidField");
+        Chunk* chunk = m_generated.front();
+        m_generated.pop_front();
+        m_pending--;
+        m_generatedChunks++;
+        m_generateSumMs += chunk->generateMs;
+        if (chunk->dropped)
+        {
+            delete chunk;
+            continue;
+        }
+        chunk->ready = true;
+        m_ready.push_back(chunk);
+    }
+}
+
+bool AsteroidField::Upload(Chunk* chunk)
+{
+    int count = (int)chunk->asteroids.size();
+    int pages = (count + kPageSize - 1) / kPageSize;
+    if (pages > (int)m_freePages.size())
+    {
+        if (!m_warnedFull)
+        {
+            printf("Asteroid field: all %d slots in use, chunks wait until some are dropped\n", m_pageCount * kPageSize);
+            m_warnedFull = true;
+        }
+        return false;
+    }
+
+    ALLOC_SCOPE("AsteroidField");
+    glBindBuffer(GL_ARRAY_BUFFER, m_instanceBuffer.Get());
+    for (int p = 0; p < pages; p++)
+    {
+        int page = m_freePages.back();
+        m_freePages.pop_back();
+        chunk->pages.push_back(page);
+        int first = p * kPageSize;
+        int n = std::min(kPageSize, count - first);
+        glBufferSubData(GL_ARRAY_BUFFER, (size_t)page * kPageSize * sizeof(glm::mat4), n * sizeof(glm::mat4),
+            &chunk->asteroids[first]);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    chunk->resident = true;
+    m_resident.push_back(chunk);
+    m_uploadedBytes += count * sizeof(glm::mat4);
+    m_changed = true;
+    return true;
+}
+
+void AsteroidField::Release(Chunk* chunk)
+{
+    if (chunk->resident)
+    {
+        m_freePages.insert(m_freePages.end(), chunk->pages.begin(), chunk->pages.end());
+        m_resident.erase(std::find(m_resident.begin(), m_resident.end(), chunk));
+        m_changed = true;
+    }
+    else
+    {
+        m_ready.erase(std::find(m_ready.begin(), m_ready.end(), chunk));
+    }
+    delete chunk;
+}
+
+void AsteroidField::RebuildAsteroids()
+{
+    m_asteroids.clear();
+    for (const Chunk* chunk : m_resident)
+        m_asteroids.insert(m_asteroids.end(), chunk->asteroids.begin(), chunk->asteroids.end());
+    m_version++;
+}
+
+// One command per run of consecutive pages in a chunk; meshes at the start
+// of the indirect buffer, impostors after room for a command per page
+void AsteroidField::WriteCommands()
+{
+    if (!m_commandsDirty)
+        return;
+    m_commandsDirty = false;
+
+    DrawElementsCommand* meshes = (DrawElementsCommand*)m_commands.data();
+    DrawArraysCommand* impostors = (DrawArraysCommand*)(m_commands.data() + m_pageCount * sizeof(DrawElementsCommand));
+    m_meshCommands = m_impostorCommands = 0;
+    m_meshCount = m_impostorCount = 0;
+
+    for (const Chunk* chunk : m_resident)
+    {
+        if (chunk->draw == ChunkDraw::Hidden)
+            continue;
+        int remaining = (int)chunk->asteroids.size();
+        size_t p = 0;
+        while (p < chunk->pages.size())
+        {
+            // Full pages that follow each other in the buffer make one run
+            int first = chunk->pages[p];
+            int count = std::min(kPageSize, remaining);
+            remaining -= count;
+            p++;
+            while (p < chunk->pages.size() && chunk->pages[p] == chunk->pages[p - 1] + 1 && count % kPageSize == 0)
+            {
+                int n = std::min(kPageSize, remaining);
+                count += n;
+                remaining -= n;
+                p++;
+            }
+
+            GLuint baseInstance = (GLuint)(first * kPageSize);
+            if (chunk->draw == ChunkDraw::Meshes)
+            {
+                DrawElementsCommand command = { (GLuint)m_indexCount, (GLuint)count, 0, 0, baseInstance };
+                meshes[m_meshCommands++] = command;
+                m_meshCount += count;
+            }
+            else
+            {
+                DrawArraysCommand command = { 4, (GLuint)count, 0, baseInstance };
+                impostors[m_impostorCommands++] = command;
+                m_impostorCount += count;
+            }
+        }
+    }
+
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, m_indirectBuffer.Get());
+    if (m_meshCommands > 0)
+        glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, m_meshCommands * sizeof(DrawElementsCommand), meshes);
+    if (m_impostorCommands > 0)
+        glBufferSubData(GL_DRAW_INDIRECT_BUFFER, m_pageCount * sizeof(DrawElementsCommand),
+            m_impostorCommands * sizeof(DrawArraysCommand), impostors);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
+
+int AsteroidField::DrawMeshes()
+{
+    WriteCommands();
+    if (m_meshCommands == 0)
+        return 0;
+
+    glBindVertexArray(m_vao.Get());
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, m_indirectBuffer.Get());
+    glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*)0, m_meshCommands, 0);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    glBindVertexArray(0);
+    return 1;
+}
+
+int AsteroidField::DrawImpostors()
+{
+    WriteCommands();
+    if (m_impostorCommands == 0)
+        return 0;
+
+    glBindVertexArray(m_vao.Get());
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, m_indirectBuffer.Get());
+    glMultiDrawArraysIndirect(GL_TRIANGLE_STRIP, (void*)(m_pageCount * sizeof(DrawElementsCommand)), m_impostorCommands, 0);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    glBindVertexArray(0);
+    return 1;
+}
+
+void AsteroidField::WorkerLoop()
+{
+    for (;;)
+    {
+        Chunk* chunk;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wake.wait(lock, [this] { return m_stop || !m_toGenerate.empty(); });
+            if (m_stop)
+                return;
+            chunk = m_toGenerate.front();
+            m_toGenerate.pop_front();
+        }
+
+        Clock::time_point start = Clock::now();
+        GenerateChunk(chunk->cx, chunk->cz, m_settings, chunk->asteroids);
+        chunk->generateMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_generated.push_back(chunk);
+        }
+        m_doneSignal.notify_all();
+    }
+}
+
+void AsteroidField::PrintSummary() const
+{
+    if (m_generatedChunks == 0)
+        return;
+    printf("Asteroid field: %d chunks generated (avg %.3f ms), %.1f MB uploaded\n",
+        m_generatedChunks, m_generateSumMs / m_generatedChunks, m_uploadedBytes / 1048576.0);
+    printf("  peak %d chunks, %d asteroids in %d of %d pages; %d frame%s hit the %.0f KB budget\n",
+        m_peakChunks, m_peakAsteroids, m_peakPages, m_pageCount, m_budgetFrames,
+        m_budgetFrames == 1 ? "" : "s", m_settings.uploadBudget / 1024.0);
+}
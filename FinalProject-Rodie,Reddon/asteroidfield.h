@@ -0,0 +1,177 @@
+#ifndef ASTEROIDFIELD_H
+#define ASTEROIDFIELD_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "graphics_headers.h"
+#include "gpuresources.h"
+
+struct AsteroidFieldSettings
+{
+    float chunkSize = 2.0f;         // edge of a chunk's square in the XZ plane
+    float loadRadius = 24.0f;       // chunks closer than this are generated
+    float unloadRadius = 28.0f;     // and dropped once further than this
+    uint32_t seed = 1234;
+    size_t uploadBudget = 64 * 1024;    // instance bytes copied to the GPU per frame
+    int maxAsteroids = 32768;       // instance buffer slots, shared by every chunk
+    int workers = 2;
+};
+
+// The asteroid belts as an endless field, streamed in square chunks around
+// a point (the ship). Each chunk's asteroids come from its own seed, so a
+// chunk that is dropped and generated again is the same rock for rock. The
+// density is the old inner and outer rings plus a thin scatter everywhere
+// else.
+//
+// Chunks within loadRadius are generated on worker threads, nearest first,
+// and uploaded into pages of one fixed instance buffer, up to uploadBudget
+// bytes a frame. They are dropped past unloadRadius; the gap between the
+// two keeps a chunk on the edge from being generated and dropped over and
+// over. Memory is bounded by the chunks inside unloadRadius.
+//
+// Each resident chunk is drawn either as meshes or as IMPOSTOR squares,
+// one multi-draw for each, from the per-instance model matrices at
+// attributes 3-6 (the INSTANCED variants).
+class AsteroidField
+{
+public:
+    enum class ChunkDraw { Hidden, Meshes, Impostors };
+
+    AsteroidField();
+    // Stops the workers and releases the GL objects, as Shutdown does
+    ~AsteroidField();
+
+    // Needs a current GL context. vbo and ibo hold the asteroid mesh
+    // (Vertex layout, unsigned int indices); meshRadius is its bound.
+    bool Initialize(const AsteroidFieldSettings& settings, GLuint vbo, GLuint ibo, int indexCount, float meshRadius);
+    void Shutdown();
+
+    // Once a frame: queues chunks coming into range of center, drops those
+    // out of range and uploads finished ones within the budget
+    void Update(const glm::vec3& center);
+    // Generates and uploads everything in range of center, waiting for the
+    // workers
+    void Finish(const glm::vec3& center);
+    // Every Update finishes (benchmarks and headless captures)
+    void SetSynchronous(bool synchronous) { m_synchronous = synchronous; }
+
+    // A chunk's asteroids, appended to out. Only the chunk and the seed
+    // decide them, not the order chunks are generated in.
+    static void GenerateChunk(int cx, int cz, const AsteroidFieldSettings& settings, std::vector<glm::mat4>& out);
+
+    // Resident chunks, to be marked for drawing each frame
+    int GetChunkCount() const { return (int)m_resident.size(); }
+    glm::vec3 GetChunkCenter(int i) const;
+    // Around a chunk's center, enough to hold all of its asteroids
+    float GetChunkRadius() const { return m_chunkRadius; }
+    // World radius of one asteroid
+    float GetAsteroidRadius() const { return m_meshRadius * kAsteroidScale; }
+    void SetChunkDraw(int i, ChunkDraw draw);
+
+    // With an INSTANCED variant (IMPOSTOR for the second) bound and its
+    // textures set; return the draw calls made
+    int DrawMeshes();
+    int DrawImpostors();
+    int GetMeshCount() const { return m_meshCount; }
+    int GetImpostorCount() const { return m_impostorCount; }
+    int GetIndexCount() const { return m_indexCount; }
+
+    // Every resident asteroid, for collisions. The version changes whenever
+    // the set does.
+    const std::vector<glm::mat4>& GetAsteroids() const { return m_asteroids; }
+    unsigned GetVersion() const { return m_version; }
+
+    void PrintSummary() const;
+
+    static const int kPageSize = 16;        // instances per page of the buffer
+    static const float kAsteroidScale;    // of the mesh, for every asteroid
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Chunk
+    {
+        int cx, cz;
+        bool ready = false;         // generated; owned by the GL thread again
+        bool resident = false;      // uploaded
+        bool dropped = false;       // left range while a worker had it
+        std::vector<glm::mat4> asteroids;
+        std::vector<int> pages;     // where they are in the instance buffer
+        ChunkDraw draw = ChunkDraw::Meshes;
+        double generateMs = 0.0;
+    };
+
+    static uint64_t Key(int cx, int cz) { return (uint64_t)(uint32_t)cx << 32 | (uint32_t)cz; }
+    float DistanceTo(int cx, int cz, const glm::vec3& center) const;
+
+    void Scan(const glm::vec3& center);
+    void Collect(bool block);
+    bool Upload(Chunk* chunk);
+    void Release(Chunk* chunk);
+    void StopWorkers();
+    void FreeChunks();
+    void RebuildAsteroids();
+    void WriteCommands();
+    void WorkerLoop();
+
+    bool m_initialized;
+    bool m_synchronous;
+    AsteroidFieldSettings m_settings;
+    float m_meshRadius;
+    float m_chunkRadius;
+    int m_indexCount;
+
+    GpuVertexArray m_vao;
+    GpuBuffer m_instanceBuffer;     // m_pageCount pages of kPageSize model matrices
+    GpuBuffer m_indirectBuffer;     // mesh commands, then impostor commands
+    int m_pageCount;
+    std::vector<int> m_freePages;
+
+    std::unordered_map<uint64_t, Chunk*> m_chunks;  // queued, generating or resident
+    std::vector<Chunk*> m_resident;                 // uploaded, in upload order
+    std::deque<Chunk*> m_ready;                     // generated, waiting on the budget
+    std::vector<Chunk*> m_requests;                 // scratch for Scan
+    glm::vec3 m_lastScan;
+    bool m_scanned;
+    bool m_changed;             // chunks uploaded or released this Update
+
+    // Draw commands, rebuilt when a chunk changes how it is drawn
+    bool m_commandsDirty;
+    int m_meshCommands;
+    int m_impostorCommands;
+    int m_meshCount;
+    int m_impostorCount;
+    std::vector<unsigned char> m_commands;  // staging for the indirect buffer
+
+    std::vector<glm::mat4> m_asteroids;
+    unsigned m_version;
+
+    // Workers
+    std::vector<std::thread> m_workers;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_doneSignal;
+    std::deque<Chunk*> m_toGenerate;
+    std::deque<Chunk*> m_generated;
+    bool m_stop;
+    int m_pending;              // queued and not yet collected
+
+    // Statistics
+    int m_generatedChunks;
+    double m_generateSumMs;
+    size_t m_uploadedBytes;
+    int m_peakChunks;
+    int m_peakAsteroids;
+    int m_peakPages;
+    int m_budgetFrames;         // frames that left a chunk for the next
+    bool m_warnedFull;
+};
+
+#endif /* ASTEROIDFIELD_H */
@@ -0,0 +1,284 @@
+#include "benchmark.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+using namespace std;
+
+FlightScript::FlightScript()
+{
+    m_start = glm::vec3(0.0f, 0.0f, -20.0f);
+    m_duration = 0.0f;
+}
+
+bool FlightScript::Load(const char* path)
+{
+    ifstream file(path);
+    if (!file)
+    {
+        printf("Could not open flight script %s\n", path);
+        return false;
+    }
+
+    m_segments.clear();
+    m_duration = 0.0f;
+    glm::vec3 position = m_start;
+
+    string line;
+    int lineNumber = 0;
+    while (getline(file, line))
+    {
+        lineNumber++;
+        size_t comment = line.find('#');
+        if (comment != string::npos)
+            line.erase(comment);
+
+        istringstream in(line);
+        string command;
+        if (!(in >> command))
+            continue;
+
+        Segment segment = Segment();
+        bool ok = true;
+        if (command == "start")
+        {
+            ok = (bool)(in >> m_start.x >> m_start.y >> m_start.z) && m_segments.empty();
+            position = m_start;
+        }
+        else if (command == "fly")
+        {
+            glm::vec3 to;
+            ok = (bool)(in >> segment.duration >> to.x >> to.y >> to.z);
+            segment.orbit = false;
+            segment.from = position;
+            segment.to = to;
+            position = to;
+        }
+        else if (command == "orbit")
+        {
+            ok = (bool)(in >> segment.duration >> segment.planet >> segment.distance
+                >> segment.yawFrom >> segment.yawTo >> segment.pitch);
+            segment.orbit = true;
+        }
+        else
+            ok = false;
+
+        if (!ok || (command != "start" && segment.duration <= 0.0f))
+        {
+            printf("%s:%d: bad flight script line\n", path, lineNumber);
+            return false;
+        }
+        if (command == "start")
+            continue;
+
+        segment.startTime = m_duration;
+        m_duration += segment.duration;
+        m_segments.push_back(segment);
+    }
+
+    if (m_segments.empty())
+    {
+        printf("Flight script %s has no segments\n", path);
+        return false;
+    }
+    return true;
+}
+
+FlightSample FlightScript::Sample(float time) const
+{
+    // Find the segment holding time; past the end, hold the last pose
+    size_t index = 0;
+    while (index + 1 < m_segments.size() && time >= m_segments[index + 1].startTime)
+        index++;
+    const Segment& segment = m_segments[index];
+    float u = glm::clamp((time - segment.startTime) / segment.duration, 0.0f, 1.0f);
+
+    FlightSample sample;
+    sample.orbitDistance = 0.0f;
+    sample.orbitYaw = 0.0f;
+    sample.orbitPitch = 0.0f;
+
+    if (segment.orbit)
+    {
+        sample.mode = GameMode::Observation;
+        sample.planet = segment.planet;
+        sample.orbitDistance = segment.distance;
+        sample.orbitYaw = glm::mix(segment.yawFrom, segment.yawTo, u);
+        sample.orbitPitch = segment.pitch;
+
+        // The ship waits where the last fly segment left it
+        sample.shipPosition = m_start;
+        sample.shipForward = glm::vec3(0.0f, 0.0f, 1.0f);
+        for (size_t i = index; i-- > 0;)
+        {
+            if (!m_segments[i].orbit)
+            {
+                sample.shipPosition = m_segments[i].to;
+                sample.shipForward = glm::normalize(m_segments[i].to - m_segments[i].from);
+                break;
+            }
+        }
+        return sample;
+    }
+
+    sample.mode = GameMode::Exploration;
+    sample.shipPosition = glm::mix(segment.from, segment.to, u);
+    glm::vec3 travel = segment.to - segment.from;
+    sample.shipForward = glm::length(travel) > 1e-6f ? glm::normalize(travel) : glm::vec3(0.0f, 0.0f, 1.0f);
+    return sample;
+}
+
+vector<string> FlightScript::GetPlanetNames() const
+{
+    vector<string> names;
+    for (const Segment& segment : m_segments)
+        if (segment.orbit)
+            names.push_back(segment.planet);
+    return names;
+}
+
+FrameBenchmark::FrameBenchmark() : m_queries(2)
+{
+    m_frame = 0;
+    m_warmup = 0;
+    m_gpuDropped = 0;
+    for (bool& counted : m_pendingCounted)
+        counted = false;
+}
+
+void FrameBenchmark::BeginGpu()
+{
+    // A lost set is the one now current; its flag is the lost frame's until EndGpu
+    int lost = m_queries.Advance([this](int set, int count) { ReadGpu(set, count); });
+    if (lost > 0 && m_pendingCounted[m_queries.GetSet()])
+        m_gpuDropped++;
+    glQueryCounter(m_queries.Add(), GL_TIMESTAMP);
+}
+
+void FrameBenchmark::EndGpu()
+{
+    glQueryCounter(m_queries.Add(), GL_TIMESTAMP);
+    m_pendingCounted[m_queries.GetSet()] = m_frame >= m_warmup;
+}
+
+void FrameBenchmark::ReadGpu(int set, int count)
+{
+    GLuint64 begin = 0, end = 0;
+    if (count < 2 || !m_pendingCounted[set])
+        return;
+    glGetQueryObjectui64v(m_queries.GetQuery(set, 0), GL_QUERY_RESULT, &begin);
+    glGetQueryObjectui64v(m_queries.GetQuery(set, 1), GL_QUERY_RESULT, &end);
+    if (end >= begin)
+        m_gpuMs.push_back((end - begin) / 1e6);
+}
+
+void FrameBenchmark::EndFrame(double cpuMs, double frameMs, int drawCalls, long long triangles)
+{
+    if (m_frame >= m_warmup)
+    {
+        m_cpuMs.push_back(cpuMs);
+        m_frameMs.push_back(frameMs);
+        m_drawCalls.push_back((double)drawCalls);
+        m_triangles.push_back((double)triangles);
+    }
+
+    m_frame++;
+    m_queries.Resolve(false, [this](int set, int count) { ReadGpu(set, count); });
+}
+
+void FrameBenchmark::Finish()
+{
+    m_queries.Resolve(true, [this](int set, int count) { ReadGpu(set, count); });
+}
+
+struct Percentiles
+{
+    int samples;
+    double avg, p50, p95, p99, max;
+};
+
+static Percentiles Summarize(vector<double> values)
+{
+    Percentiles p = { (int)values.size(), 0.0, 0.0, 0.0, 0.0, 0.0 };
+    if (values.empty())
+        return p;
+
+    sort(values.begin(), values.end());
+    double sum = 0.0;
+    for (double v : values)
+        sum += v;
+
+    // Nearest-rank percentiles
+    auto rank = [&](double q) {
+        size_t i = (size_t)ceil(q * values.size());
+        return values[i > 0 ? i - 1 : 0];
+    };
+    p.avg = sum / values.size();
+    p.p50 = rank(0.50);
+    p.p95 = rank(0.95);
+    p.p99 = rank(0.99);
+    p.max = values.back();
+    return p;
+}
+
+// dropped < 0 leaves it out
+static void WriteStats(FILE* file, const char* name, const vector<double>& values, bool last, int dropped = -1)
+{
+    Percentiles p = Summarize(values);
+    fprintf(file, "  \"%s\": {\"samples\": %d, ", name, p.samples);
+    if (dropped >= 0)
+        fprintf(file, "\"dropped\": %d, ", dropped);
+    fprintf(file, "\"avg\": %.4f, \"p50\": %.4f, \"p95\": %.4f, \"p99\": %.4f, \"max\": %.4f}%s\n",
+        p.avg, p.p50, p.p95, p.p99, p.max, last ? "" : ",");
+}
+
+bool FrameBenchmark::WriteJson(const char* path, const char* script, float dt, int width, int height) const
+{
+    FILE* file = fopen(path, "w");
+    if (file == NULL)
+    {
+        printf("Could not write %s\n", path);
+        return false;
+    }
+
+    fprintf(file, "{\n");
+    // Windows paths: backslashes need escaping
+    fprintf(file, "  \"script\": \"");
+    for (const char* c = script; *c; c++)
+        fprintf(file, *c == '\\' || *c == '"' ? "\\%c" : "%c", *c);
+    fprintf(file, "\",\n");
+    fprintf(file, "  \"dt\": %.6f,\n", dt);
+    fprintf(file, "  \"width\": %d,\n", width);
+    fprintf(file, "  \"height\": %d,\n", height);
+    fprintf(file, "  \"frames\": %d,\n", (int)m_cpuMs.size());
+    // The script holds its starting pose through these
+    fprintf(file, "  \"warmup_frames\": %d,\n", min(m_warmup, m_frame));
+    WriteStats(file, "cpu_ms", m_cpuMs, false);
+    WriteStats(file, "gpu_ms", m_gpuMs, false, m_gpuDropped);
+    WriteStats(file, "frame_ms", m_frameMs, false);
+    WriteStats(file, "draw_calls", m_drawCalls, false);
+    WriteStats(file, "triangles", m_triangles, true);
+    fprintf(file, "}\n");
+    fclose(file);
+    return true;
+}
+
+void FrameBenchmark::PrintSummary() const
+{
+    Percentiles cpu = Summarize(m_cpuMs);
+    Percentiles gpu = Summarize(m_gpuMs);
+    Percentiles frame = Summarize(m_frameMs);
+    Percentiles draws = Summarize(m_drawCalls);
+    Percentiles tris = Summarize(m_triangles);
+
+    printf("Benchmark: %d frames (after %d warm-up)\n", (int)m_cpuMs.size(), min(m_warmup, m_frame));
+    printf("             avg      p50      p95      p99      max\n");
+    printf("  CPU ms  %7.3f  %7.3f  %7.3f  %7.3f  %7.3f\n", cpu.avg, cpu.p50, cpu.p95, cpu.p99, cpu.max);
+    printf("  GPU ms  %7.3f  %7.3f  %7.3f  %7.3f  %7.3f  (%d of %d frames dropped)\n", gpu.avg, gpu.p50, gpu.p95,
+        gpu.p99, gpu.max, m_gpuDropped, gpu.samples + m_gpuDropped);
+    printf("  frame   %7.3f  %7.3f  %7.3f  %7.3f  %7.3f\n", frame.avg, frame.p50, frame.p95, frame.p99, frame.max);
+    printf("  draw calls %.0f avg, %.0f max; triangles %.0f avg, %.0f max\n", draws.avg, draws.max, tris.avg, tris.max);
+}
@@ -0,0 +1,103 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <string>
+#include <vector>
+#include "graphics_headers.h"
+#include "gamemode.h"
+#include "gpuqueryring.h"
+
+// Where the scripted flight puts the ship and camera at a given time
+struct FlightSample
+{
+    GameMode mode;
+    // Exploration: ship pose
+    glm::vec3 shipPosition;
+    glm::vec3 shipForward;
+    // Observation: orbit camera around a planet
+    std::string planet;
+    float orbitDistance;
+    float orbitYaw;
+    float orbitPitch;
+};
+
+// A flight path read from a text file (see assets/bench_flight.txt). One
+// segment per line, played back to back:
+//
+//     start <x> <y> <z>                        ship position at t = 0
+//     fly <seconds> <x> <y> <z>                straight line to the point
+//     orbit <seconds> <planet> <distance> <yaw from> <yaw to> <pitch>
+//
+// Angles are in degrees. '#' starts a comment.
+class FlightScript
+{
+public:
+    FlightScript();
+
+    bool Load(const char* path);
+    float GetDuration() const { return m_duration; }
+    FlightSample Sample(float time) const;
+    // Every planet an orbit segment refers to, so callers can validate them
+    std::vector<std::string> GetPlanetNames() const;
+
+private:
+    struct Segment
+    {
+        bool orbit;
+        float startTime;
+        float duration;
+        glm::vec3 from;
+        glm::vec3 to;
+        std::string planet;
+        float distance;
+        float yawFrom;
+        float yawTo;
+        float pitch;
+    };
+
+    std::vector<Segment> m_segments;
+    glm::vec3 m_start;
+    float m_duration;
+};
+
+// Per-frame timings for --bench. CPU time comes from the engine; GPU time is
+// a pair of GL_TIMESTAMP queries around Render (timestamps don't collide with
+// the profiler's TIME_ELAPSED queries) from a GpuQueryRing, read back once
+// they are ready; a frame's timing is dropped only if its set is needed again
+// before then.
+class FrameBenchmark
+{
+public:
+    FrameBenchmark();
+
+    void SetWarmupFrames(int frames) { m_warmup = frames; }
+    // The frame about to run is a warm-up frame
+    bool IsWarmingUp() const { return m_frame < m_warmup; }
+
+    void BeginGpu();
+    void EndGpu();
+    // cpuMs excludes the time spent waiting in Swap; frameMs is wall time
+    void EndFrame(double cpuMs, double frameMs, int drawCalls, long long triangles);
+    // Waits for the outstanding GPU timestamps
+    void Finish();
+
+    bool WriteJson(const char* path, const char* script, float dt, int width, int height) const;
+    void PrintSummary() const;
+
+private:
+    void ReadGpu(int set, int count);
+
+    int m_frame;
+    int m_warmup;
+    std::vector<double> m_cpuMs;
+    std::vector<double> m_frameMs;
+    std::vector<double> m_gpuMs;
+    std::vector<double> m_drawCalls;
+    std::vector<double> m_triangles;
+    int m_gpuDropped;
+
+    GpuQueryRing m_queries;         // begin and end of each frame's Render
+    bool m_pendingCounted[GpuQueryRing::kSets];     // false for warm-up frames
+};
+
+#endif /* BENCHMARK_H */
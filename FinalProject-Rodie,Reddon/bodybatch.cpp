@@ -0,0 +1,450 @@
+#include "bodybatch.h"
+#include "framearena.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstddef>
+#include <utility>
+
+// glMultiDrawElementsIndirect and glMultiDrawArraysIndirect commands
+struct DrawElementsCommand
+{
+    GLuint count;
+    GLuint instanceCount;
+    GLuint firstIndex;
+    GLint baseVertex;
+    GLuint baseInstance;
+};
+
+struct DrawArraysCommand
+{
+    GLuint count;
+    GLuint instanceCount;
+    GLuint first;
+    GLuint baseInstance;
+};
+
+// Size and format of a texture's top level; all zero for no texture
+struct TextureFormat
+{
+    GLint width;
+    GLint height;
+    GLint format;
+
+    bool operator==(const TextureFormat& other) const
+    {
+        return width == other.width && height == other.height && format == other.format;
+    }
+};
+
+static TextureFormat FormatOf(GLuint texture)
+{
+    TextureFormat format = { 0, 0, 0 };
+    if (texture == 0)
+        return format;
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &format.width);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &format.height);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_INTERNAL_FORMAT, &format.format);
+    return format;
+}
+
+// Copies same-sized textures into the layers of a new array, every mip
+// level, sampled like the first of them. The textures have sized formats
+// and full mip chains, both from TextureUploader, so they copy straight
+// across.
+static GpuTexture CopyToArray(const std::vector<GLuint>& layers, const TextureFormat& format)
+{
+    int levels = 1 + (int)std::floor(std::log2((double)std::max(format.width, format.height)));
+    GpuTexture array;
+    array.Create("Body texture array");
+    glBindTexture(GL_TEXTURE_2D_ARRAY, array.Get());
+    glTexStorage3D(GL_TEXTURE_2D_ARRAY, levels, (GLenum)format.format, format.width, format.height, (GLsizei)layers.size());
+    array.SetBytes(GpuResources::TextureBytes((GLenum)format.format, format.width, format.height, (int)layers.size(), true));
+
+    for (size_t layer = 0; layer < layers.size(); layer++)
+    {
+        for (int level = 0; level < levels; level++)
+        {
+            GLsizei width = std::max(1, format.width >> level);
+            GLsizei height = std::max(1, format.height >> level);
+            glCopyImageSubData(layers[layer], GL_TEXTURE_2D, level, 0, 0, 0,
+                array.Get(), GL_TEXTURE_2D_ARRAY, level, 0, 0, (GLint)layer, width, height, 1);
+        }
+    }
+
+    GLint swizzle[4];
+    glBindTexture(GL_TEXTURE_2D, layers[0]);
+    glGetTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_RGBA, swizzle);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteriv(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_SWIZZLE_RGBA, swizzle);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    return array;
+}
+
+BodyBatch::BodyBatch()
+{
+    m_built = false;
+    m_procedural = false;
+    m_mode = BodyTextureMode::Separate;
+    m_indexCount = 0;
+    m_impostorCount = 0;
+}
+
+BodyBatch::~BodyBatch()
+{
+    for (size_t i = 0; i < m_handle.size(); i++)
+    {
+        if (m_handle[i] != 0)
+            glMakeTextureHandleNonResidentARB(m_handle[i]);
+        if (m_normalHandle[i] != 0)
+            glMakeTextureHandleNonResidentARB(m_normalHandle[i]);
+    }
+}
+
+BodyTextureMode BodyBatch::Resolve(BodyTextureMode requested)
+{
+    // Both batched paths need base-instance draws and glCopyImageSubData or
+    // glMultiDrawElementsIndirect, all core in 4.3
+    bool batching = GLEW_VERSION_4_3;
+    bool bindless = batching && GLEW_ARB_bindless_texture;
+
+    switch (requested)
+    {
+    case BodyTextureMode::Auto:
+        if (bindless)
+            return BodyTextureMode::Bindless;
+        return batching ? BodyTextureMode::Array : BodyTextureMode::Separate;
+    case BodyTextureMode::Bindless:
+        if (bindless)
+            return BodyTextureMode::Bindless;
+        printf("Bindless textures aren't supported here, using texture arrays\n");
+        // fall through
+    case BodyTextureMode::Array:
+        if (batching)
+            return BodyTextureMode::Array;
+        printf("Texture arrays need OpenGL 4.3, drawing bodies separately\n");
+        return BodyTextureMode::Separate;
+    default:
+        return BodyTextureMode::Separate;
+    }
+}
+
+bool BodyBatch::Build(BodyTextureMode mode, GLuint vbo, GLuint ibo, int indexCount,
+    const std::vector<GLuint>& textures, const std::vector<GLuint>& normalMaps)
+{
+    if (mode != BodyTextureMode::Array && mode != BodyTextureMode::Bindless)
+        return false;
+
+    m_mode = mode;
+    m_procedural = vbo == 0;
+    m_indexCount = indexCount;
+    size_t count = textures.size();
+    m_group.assign(count, 0);
+    m_layer.assign(count, 0);
+    m_handle.assign(count, 0);
+    m_normalHandle.assign(count, 0);
+    m_hasNormalMap.assign(count, false);
+    for (size_t i = 0; i < count; i++)
+        m_hasNormalMap[i] = normalMaps[i] != 0;
+
+    bool ok = mode == BodyTextureMode::Array ? BuildArrays(textures, normalMaps) : BuildHandles(textures, normalMaps);
+    GLenum error = glGetError();
+    if (!ok || error != GL_NO_ERROR)
+    {
+        printf("Could not batch the bodies (GL error 0x%x), drawing them separately\n", error);
+        m_mode = BodyTextureMode::Separate;
+        return false;
+    }
+
+    // Per-instance body index: with a base instance, instance i of a draw
+    // reads element baseInstance + i
+    std::vector<GLuint> indices(count);
+    for (size_t i = 0; i < count; i++)
+        indices[i] = (GLuint)i;
+    m_indexBuffer.Create("Body batch indices");
+    glBindBuffer(GL_ARRAY_BUFFER, m_indexBuffer.Get());
+    glBufferData(GL_ARRAY_BUFFER, count * sizeof(GLuint), indices.data(), GL_STATIC_DRAW);
+    m_indexBuffer.SetBytes(count * sizeof(GLuint));
+
+    m_vao.Create("Body batch vertex array");
+    glBindVertexArray(m_vao.Get());
+    if (!m_procedural)
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, vertex));
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, normal));
+        glEnableVertexAttribArray(2);
+        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, texcoord));
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, m_indexBuffer.Get());
+    glEnableVertexAttribArray(kBodyIndexAttrib);
+    glVertexAttribIPointer(kBodyIndexAttrib, 1, GL_UNSIGNED_INT, 0, (void*)0);
+    glVertexAttribDivisor(kBodyIndexAttrib, 1);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    // Refilled by every Upload, at this size
+    m_bodyBuffer.Create("Body batch bodies");
+    m_bodyBuffer.SetBytes(count * sizeof(GpuBody));
+
+    if (mode == BodyTextureMode::Bindless)
+    {
+        m_indirectBuffer.Create("Body batch commands");
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, m_indirectBuffer.Get());
+        if (m_procedural)
+        {
+            std::vector<DrawArraysCommand> commands(count);
+            for (size_t i = 0; i < count; i++)
+            {
+                DrawArraysCommand command = { (GLuint)indexCount, 1, 0, (GLuint)i };
+                commands[i] = command;
+            }
+            glBufferData(GL_DRAW_INDIRECT_BUFFER, commands.size() * sizeof(DrawArraysCommand), commands.data(), GL_STATIC_DRAW);
+            m_indirectBuffer.SetBytes(commands.size() * sizeof(DrawArraysCommand));
+        }
+        else
+        {
+            std::vector<DrawElementsCommand> commands(count);
+            for (size_t i = 0; i < count; i++)
+            {
+                DrawElementsCommand command = { (GLuint)indexCount, 1, 0, 0, (GLuint)i };
+                commands[i] = command;
+            }
+            glBufferData(GL_DRAW_INDIRECT_BUFFER, commands.size() * sizeof(DrawElementsCommand), commands.data(), GL_STATIC_DRAW);
+            m_indirectBuffer.SetBytes(commands.size() * sizeof(DrawElementsCommand));
+        }
+
+        // Upload puts the impostors last, so they are a tail of these
+        std::vector<DrawArraysCommand> impostors(count);
+        for (size_t i = 0; i < count; i++)
+        {
+            DrawArraysCommand command = { 4, 1, 0, (GLuint)i };
+            impostors[i] = command;
+        }
+        m_impostorIndirectBuffer.Create("Body batch impostor commands");
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, m_impostorIndirectBuffer.Get());
+        glBufferData(GL_DRAW_INDIRECT_BUFFER, impostors.size() * sizeof(DrawArraysCommand), impostors.data(), GL_STATIC_DRAW);
+        m_impostorIndirectBuffer.SetBytes(impostors.size() * sizeof(DrawArraysCommand));
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    }
+
+    printf("Body textures: %s, %d bodies in %d draw%s\n", BodyTextureModeName(mode), (int)count,
+        mode == BodyTextureMode::Bindless ? 1 : (int)m_groups.size(),
+        mode == BodyTextureMode::Bindless || m_groups.size() == 1 ? "" : "s");
+    m_built = true;
+    return true;
+}
+
+bool BodyBatch::BuildArrays(const std::vector<GLuint>& textures, const std::vector<GLuint>& normalMaps)
+{
+    struct Source
+    {
+        TextureFormat format;
+        TextureFormat normalFormat;     // zero if the group has no normal maps
+        std::vector<GLuint> layers;
+        std::vector<GLuint> normalLayers;
+    };
+    std::vector<Source> sources;
+
+    // Group by resolution and format, of both maps, so a body's layer is
+    // the same in its group's two arrays
+    for (size_t i = 0; i < textures.size(); i++)
+    {
+        TextureFormat format = FormatOf(textures[i]);
+        TextureFormat normalFormat = FormatOf(normalMaps[i]);
+
+        size_t s = 0;
+        while (s < sources.size() && !(sources[s].format == format && sources[s].normalFormat == normalFormat))
+            s++;
+        if (s == sources.size())
+        {
+            Source source;
+            source.format = format;
+            source.normalFormat = normalFormat;
+            sources.push_back(source);
+        }
+        m_group[i] = (int)s;
+        m_layer[i] = (GLuint)sources[s].layers.size();
+        sources[s].layers.push_back(textures[i]);
+        sources[s].normalLayers.push_back(normalMaps[i]);
+    }
+
+    int first = 0;
+    for (const Source& source : sources)
+    {
+        Group group;
+        group.first = first;
+        group.count = (int)source.layers.size();
+        group.meshes = group.count;
+        first += group.count;
+        group.array = CopyToArray(source.layers, source.format);
+        if (source.normalFormat.width != 0)
+            group.normalArray = CopyToArray(source.normalLayers, source.normalFormat);
+        m_groups.push_back(std::move(group));
+    }
+    return true;
+}
+
+bool BodyBatch::BuildHandles(const std::vector<GLuint>& textures, const std::vector<GLuint>& normalMaps)
+{
+    for (size_t i = 0; i < textures.size(); i++)
+    {
+        // The textures can't change from here on, which the uploader guarantees
+        m_handle[i] = glGetTextureHandleARB(textures[i]);
+        if (m_handle[i] == 0)
+            return false;
+        glMakeTextureHandleResidentARB(m_handle[i]);
+        if (normalMaps[i] != 0)
+        {
+            m_normalHandle[i] = glGetTextureHandleARB(normalMaps[i]);
+            if (m_normalHandle[i] == 0)
+                return false;
+            glMakeTextureHandleResidentARB(m_normalHandle[i]);
+        }
+    }
+    Group group;
+    group.first = 0;
+    group.count = group.meshes = (int)textures.size();
+    m_groups.push_back(std::move(group));
+    return true;
+}
+
+void BodyBatch::Upload(const std::vector<BatchedBody>& bodies)
+{
+    if (!m_built)
+        return;
+
+    // Texture groups stay contiguous, meshes before impostors in each;
+    // nearest first inside those
+    size_t count = m_group.size();
+    FrameVector<int> order(count);
+    for (size_t i = 0; i < count; i++)
+        order[i] = (int)i;
+    std::sort(order.begin(), order.end(), [&](int a, int b) {
+        if (m_group[a] != m_group[b])
+            return m_group[a] < m_group[b];
+        if (bodies[a].impostor != bodies[b].impostor)
+            return bodies[b].impostor;
+        return bodies[a].depth < bodies[b].depth;
+    });
+
+    for (Group& group : m_groups)
+        group.meshes = group.count;
+    m_impostorCount = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (bodies[i].impostor)
+        {
+            m_groups[m_group[i]].meshes--;
+            m_impostorCount++;
+        }
+    }
+
+    FrameVector<GpuBody> data(count);
+    for (size_t k = 0; k < count; k++)
+    {
+        int i = order[k];
+        GpuBody& body = data[k];
+        body.model = bodies[i].model;
+        body.lightColor = glm::vec4(bodies[i].lightColor, 0.0f);
+        body.nightColor = glm::vec4(bodies[i].nightColor, 0.0f);
+        body.lightDir = glm::vec4(bodies[i].lightDir, 0.0f);
+        body.texture = m_handle[i];
+        body.normalTexture = m_normalHandle[i];
+        body.layer = m_layer[i];
+        body.normalMap = m_hasNormalMap[i] ? 1 : 0;
+        body.pad[0] = body.pad[1] = 0;
+    }
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_bodyBuffer.Get());
+    glBufferData(GL_SHADER_STORAGE_BUFFER, data.size() * sizeof(GpuBody), data.data(), GL_STREAM_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+int BodyBatch::Draw()
+{
+    if (!m_built)
+        return 0;
+
+    int meshes = (int)m_group.size() - m_impostorCount;
+    if (meshes == 0)
+        return 0;
+
+    int draws = 0;
+    glBindVertexArray(m_vao.Get());
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, kBodyBinding, m_bodyBuffer.Get());
+    if (m_mode == BodyTextureMode::Bindless)
+    {
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, m_indirectBuffer.Get());
+        if (m_procedural)
+            glMultiDrawArraysIndirect(GL_TRIANGLES, (void*)0, meshes, 0);
+        else
+            glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*)0, meshes, 0);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+        draws = 1;
+    }
+    else
+    {
+        for (const Group& group : m_groups)
+        {
+            if (group.meshes == 0)
+                continue;
+            glActiveTexture(GL_TEXTURE1);
+            glBindTexture(GL_TEXTURE_2D_ARRAY, group.normalArray.Get());
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_2D_ARRAY, group.array.Get());
+            if (m_procedural)
+                glDrawArraysInstancedBaseInstance(GL_TRIANGLES, 0, m_indexCount, group.meshes, (GLuint)group.first);
+            else
+                glDrawElementsInstancedBaseInstance(GL_TRIANGLES, m_indexCount, GL_UNSIGNED_INT, (void*)0,
+                    group.meshes, (GLuint)group.first);
+            draws++;
+        }
+    }
+    glBindVertexArray(0);
+    return draws;
+}
+
+int BodyBatch::DrawImpostors()
+{
+    if (!m_built || m_impostorCount == 0)
+        return 0;
+
+    int draws = 0;
+    glBindVertexArray(m_vao.Get());
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, kBodyBinding, m_bodyBuffer.Get());
+    if (m_mode == BodyTextureMode::Bindless)
+    {
+        GLsizei first = (GLsizei)m_group.size() - m_impostorCount;
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, m_impostorIndirectBuffer.Get());
+        glMultiDrawArraysIndirect(GL_TRIANGLE_STRIP, (void*)(first * sizeof(DrawArraysCommand)), m_impostorCount, 0);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+        draws = 1;
+    }
+    else
+    {
+        for (const Group& group : m_groups)
+        {
+            int impostors = group.count - group.meshes;
+            if (impostors == 0)
+                continue;
+            glActiveTexture(GL_TEXTURE1);
+            glBindTexture(GL_TEXTURE_2D_ARRAY, group.normalArray.Get());
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_2D_ARRAY, group.array.Get());
+            glDrawArraysInstancedBaseInstance(GL_TRIANGLE_STRIP, 0, 4, impostors, (GLuint)(group.first + group.meshes));
+            draws++;
+        }
+    }
+    glBindVertexArray(0);
+    return draws;
+}
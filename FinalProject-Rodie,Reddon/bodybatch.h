@@ -0,0 +1,115 @@
+#ifndef BODYBATCH_H
+#define BODYBATCH_H
+
+#include <vector>
+
+#include "graphics_headers.h"
+#include "gpuresources.h"
+#include "bodytexturemode.h"
+
+// One body as the batch sees it, refreshed every frame
+struct BatchedBody
+{
+    glm::mat4 model;
+    glm::vec3 lightColor;
+    glm::vec3 nightColor;
+    glm::vec3 lightDir;
+    float depth;            // draw order: nearest first within a texture group
+    bool impostor;          // drawn by DrawImpostors rather than Draw
+};
+
+// Draws planets and moons from one shared sphere, with no texture binds in
+// between. Per-body data (model, lighting, texture) lives in a shader
+// storage buffer at binding kBodyBinding, indexed by a per-instance body
+// index at attribute kBodyIndexAttrib:
+//
+//   Array:    textures are copied into GL_TEXTURE_2D_ARRAY layers, one
+//             array per resolution, and each array is one instanced draw.
+//             Normal maps go into a second array at the same layers.
+//   Bindless: each body's texture handle is in its data and all bodies go
+//             out in one glMultiDrawElementsIndirect, one command per body
+//             so the handle is uniform within each command.
+//
+// Bodies marked as impostors are left to DrawImpostors, four vertices each
+// for the IMPOSTOR variants.
+class BodyBatch
+{
+public:
+    static const GLuint kBodyBinding = 0;
+    static const GLuint kBodyIndexAttrib = 7;
+
+    BodyBatch();
+    ~BodyBatch();
+
+    // Auto resolves to what the driver supports; Separate means no batch
+    static BodyTextureMode Resolve(BodyTextureMode requested);
+
+    // vbo/ibo hold the shared sphere (Vertex layout, unsigned int indices),
+    // or are both 0 for a procedural sphere of indexCount vertices.
+    // textures[i] is body i's finished GL_TEXTURE_2D and normalMaps[i] its
+    // normal map, or 0; build once they have all streamed in.
+    bool Build(BodyTextureMode mode, GLuint vbo, GLuint ibo, int indexCount,
+        const std::vector<GLuint>& textures, const std::vector<GLuint>& normalMaps);
+    bool IsBuilt() const { return m_built; }
+    BodyTextureMode GetMode() const { return m_mode; }
+
+    // bodies in the same order as the textures given to Build
+    void Upload(const std::vector<BatchedBody>& bodies);
+    // With the variant's program bound (and, for a procedural sphere, its
+    // spherePrecision set); returns the draw calls made
+    int Draw();
+    // The same for the bodies Upload was told are impostors
+    int DrawImpostors();
+
+    int GetBodyCount() const { return (int)m_group.size(); }
+    int GetImpostorCount() const { return m_impostorCount; }
+    int GetIndexCount() const { return m_indexCount; }
+
+private:
+    // Matches struct Body in the BATCHED shaders (std430)
+    struct GpuBody
+    {
+        glm::mat4 model;
+        glm::vec4 lightColor;
+        glm::vec4 nightColor;
+        glm::vec4 lightDir;
+        GLuint64 texture;   // bindless handles
+        GLuint64 normalTexture;
+        GLuint layer;       // texture array layer, of both arrays
+        GLuint normalMap;   // 1 if the body has one
+        GLuint pad[2];
+    };
+
+    struct Group
+    {
+        GpuTexture array;       // empty in bindless mode
+        GpuTexture normalArray; // empty if the group has no normal maps
+        int first;          // first instance in the sorted body data
+        int count;
+        int meshes;         // of count, drawn by Draw; the rest are impostors
+    };
+
+    bool BuildArrays(const std::vector<GLuint>& textures, const std::vector<GLuint>& normalMaps);
+    bool BuildHandles(const std::vector<GLuint>& textures, const std::vector<GLuint>& normalMaps);
+
+    bool m_built;
+    bool m_procedural;
+    BodyTextureMode m_mode;
+    int m_indexCount;
+
+    GpuVertexArray m_vao;
+    GpuBuffer m_bodyBuffer;         // SSBO of GpuBody
+    GpuBuffer m_indexBuffer;        // 0..n-1, the per-instance body index
+    GpuBuffer m_indirectBuffer;     // bindless: one command per body
+    GpuBuffer m_impostorIndirectBuffer;     // the same, as 4-vertex strips
+    int m_impostorCount;
+
+    std::vector<Group> m_groups;
+    std::vector<int> m_group;       // per body
+    std::vector<GLuint> m_layer;    // per body
+    std::vector<GLuint64> m_handle; // per body
+    std::vector<GLuint64> m_normalHandle;
+    std::vector<bool> m_hasNormalMap;
+};
+
+#endif /* BODYBATCH_H */
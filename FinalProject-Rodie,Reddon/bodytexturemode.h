@@ -0,0 +1,33 @@
+#ifndef BODYTEXTUREMODE_H
+#define BODYTEXTUREMODE_H
+
+#include <cstring>
+
+// How planet and moon textures are reached so they can share draws (--body-textures)
+enum class BodyTextureMode {
+    Auto,       // bindless where supported, otherwise arrays, otherwise separate
+    Bindless,   // ARB_bindless_texture handles in the per-body data, one multi-draw
+    Array,      // GL_TEXTURE_2D_ARRAY layers, one instanced draw per resolution
+    Separate    // each body binds its own texture and is drawn on its own
+};
+
+inline const char* BodyTextureModeName(BodyTextureMode mode)
+{
+    static const char* names[] = { "auto", "bindless", "array", "separate" };
+    return names[(int)mode];
+}
+
+inline bool ParseBodyTextureMode(const char* name, BodyTextureMode& mode)
+{
+    for (int i = 0; i <= (int)BodyTextureMode::Separate; i++)
+    {
+        if (strcmp(name, BodyTextureModeName((BodyTextureMode)i)) == 0)
+        {
+            mode = (BodyTextureMode)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+#endif /* BODYTEXTUREMODE_H */
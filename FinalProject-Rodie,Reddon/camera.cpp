@@ -28,18 +28,25 @@ glm::mat4 Camera::GetView()
     return view;
 }
 
-void Camera::ProcessKeyboard(std::string direction, float deltaTime)
+void Camera::ProcessKeyboard(CameraMove direction, float deltaTime)
 {
     float velocity = deltaTime * 5.0f;
 
-    if (direction == "FORWARD")
+    switch (direction)
+    {
+    case CameraMove::Forward:
         cameraPos += cameraFront * velocity;
-    if (direction == "BACKWARD")
+        break;
+    case CameraMove::Backward:
         cameraPos -= cameraFront * velocity;
-    if (direction == "LEFT")
+        break;
+    case CameraMove::Left:
         cameraPos -= cameraRight * velocity;
-    if (direction == "RIGHT")
+        break;
+    case CameraMove::Right:
         cameraPos += cameraRight * velocity;
+        break;
+    }
 
     view = glm::lookAt(cameraPos, cameraPos + cameraFront, cameraUp);
 }
@@ -3,6 +3,13 @@
 
 #include "graphics_headers.h"
 
+enum class CameraMove {
+    Forward,
+    Backward,
+    Left,
+    Right
+};
+
 class Camera
 {
 public:
@@ -11,7 +18,7 @@ public:
     bool Initialize(int w, int h);
     glm::mat4 GetProjection();
     glm::mat4 GetView();
-    void ProcessKeyboard(std::string direction, float deltaTime);
+    void ProcessKeyboard(CameraMove direction, float deltaTime);
     void ProcessMouseMovement(float xoffset, float yoffset, GLboolean constrainPitch = true);
     void ProcessMouseScroll(float yoffset);
     void UpdateView();
@@ -0,0 +1,279 @@
+#include "collision.h"
+#include "alloctracker.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+    const uint32_t kMinTableSize = 64;
+
+    uint32_t NextPowerOfTwo(uint32_t v)
+    {
+        uint32_t p = 1;
+        while (p < v)
+            p <<= 1;
+        return p;
+    }
+
+    // Deepest overlap between the ship spheres and one body sphere.
+    // Returns false if none of them touch it.
+    bool DeepestContact(const CollisionSphere* ship, int shipCount, const glm::vec3& bodyCenter,
+        float bodyRadius, ShipContact& contact)
+    {
+        bool touching = false;
+        contact.depth = 0.0f;
+        for (int s = 0; s < shipCount; s++) {
+            glm::vec3 d = ship[s].center - bodyCenter;
+            float reach = ship[s].radius + bodyRadius;
+            float distSq = glm::dot(d, d);
+            if (distSq >= reach * reach)
+                continue;
+
+            float dist = sqrtf(distSq);
+            float depth = reach - dist;
+            if (depth > contact.depth) {
+                contact.depth = depth;
+                contact.normal = dist > 1e-6f ? d / dist : glm::vec3(0.0f, 1.0f, 0.0f);
+                touching = true;
+            }
+        }
+        return touching;
+    }
+}
+
+AsteroidGrid::AsteroidGrid()
+{
+    m_cellSize = 1.0f;
+    m_minCellSize = 0.0f;
+    m_maxRadius = 0.0f;
+    m_count = 0;
+    m_tableMask = 0;
+    m_queryStamp = 0;
+}
+
+void AsteroidGrid::Reserve(size_t count)
+{
+    uint32_t tableSize = NextPowerOfTwo(std::max<uint32_t>(kMinTableSize, (uint32_t)count * 2));
+    m_tableMask = tableSize - 1;
+    m_cellStart.assign(tableSize + 1, 0);
+    m_bucketStamp.assign(tableSize, 0);
+    m_queryStamp = 0;
+    m_entries.resize(count);
+    m_entryHash.resize(count);
+    m_centers.resize(count);
+    m_radii.resize(count);
+}
+
+void AsteroidGrid::CellOf(const glm::vec3& p, int& x, int& y, int& z) const
+{
+    x = (int)floorf(p.x / m_cellSize);
+    y = (int)floorf(p.y / m_cellSize);
+    z = (int)floorf(p.z / m_cellSize);
+}
+
+uint32_t AsteroidGrid::Hash(int x, int y, int z) const
+{
+    return ((uint32_t)x * 73856093u ^ (uint32_t)y * 19349663u ^ (uint32_t)z * 83492791u) & m_tableMask;
+}
+
+void AsteroidGrid::Build(const glm::mat4* inner, size_t innerCount, const glm::mat4* outer, size_t outerCount,
+    float meshRadius)
+{
+    m_count = innerCount + outerCount;
+    if (m_count > m_centers.size() || m_cellStart.empty())
+        Reserve(m_count);   // only allocates when the belts grow
+
+    m_maxRadius = 0.0f;
+    for (size_t i = 0; i < m_count; i++) {
+        const glm::mat4& m = i < innerCount ? inner[i] : outer[i - innerCount];
+        m_centers[i] = glm::vec3(m[3]);
+        m_radii[i] = meshRadius * glm::length(glm::vec3(m[0]));
+        m_maxRadius = std::max(m_maxRadius, m_radii[i]);
+    }
+
+    // Cells at least as big as an asteroid and as the ship's query spheres,
+    // so a query touches a handful of cells
+    m_cellSize = std::max(std::max(2.0f * m_maxRadius, m_minCellSize), 1e-3f);
+
+    // Counting sort of asteroid indices by bucket
+    std::fill(m_cellStart.begin(), m_cellStart.end(), 0u);
+    for (size_t i = 0; i < m_count; i++) {
+        int x, y, z;
+        CellOf(m_centers[i], x, y, z);
+        m_entryHash[i] = Hash(x, y, z);
+        m_cellStart[m_entryHash[i]]++;
+    }
+
+    uint32_t sum = 0;
+    for (size_t h = 0; h + 1 < m_cellStart.size(); h++) {
+        uint32_t c = m_cellStart[h];
+        m_cellStart[h] = sum;
+        sum += c;
+    }
+
+    for (size_t i = 0; i < m_count; i++)
+        m_entries[m_cellStart[m_entryHash[i]]++] = (int)i;
+
+    // Scattering advanced each start to the next bucket's start; shift back
+    for (size_t h = m_cellStart.size() - 1; h > 0; h--)
+        m_cellStart[h] = m_cellStart[h - 1];
+    m_cellStart[0] = 0;
+}
+
+int AsteroidGrid::QuerySphere(const glm::vec3& center, float radius, int* out, int maxOut) const
+{
+    if (m_count == 0)
+        return 0;
+
+    float reach = radius + m_maxRadius;
+    int x0, y0, z0, x1, y1, z1;
+    CellOf(center - glm::vec3(reach), x0, y0, z0);
+    CellOf(center + glm::vec3(reach), x1, y1, z1);
+
+    // Different cells can share a bucket; visit each bucket once
+    if (++m_queryStamp == 0) {
+        std::fill(m_bucketStamp.begin(), m_bucketStamp.end(), 0u);
+        m_queryStamp = 1;
+    }
+    int found = 0;
+
+    for (int z = z0; z <= z1; z++) {
+        for (int y = y0; y <= y1; y++) {
+            for (int x = x0; x <= x1; x++) {
+                uint32_t h = Hash(x, y, z);
+                if (m_bucketStamp[h] == m_queryStamp)
+                    continue;
+                m_bucketStamp[h] = m_queryStamp;
+
+                for (uint32_t e = m_cellStart[h]; e < m_cellStart[h + 1]; e++) {
+                    int i = m_entries[e];
+                    glm::vec3 d = m_centers[i] - center;
+                    float r = radius + m_radii[i];
+                    if (glm::dot(d, d) > r * r)
+                        continue;
+                    if (found == maxOut)
+                        return found;
+                    out[found++] = i;
+                }
+            }
+        }
+    }
+
+    return found;
+}
+
+CollisionSystem::CollisionSystem()
+{
+    m_shipBoundRadius = 0.0f;
+    m_lastContactCount = 0;
+}
+
+void CollisionSystem::SetShipShape(const glm::vec3& boundsMin, const glm::vec3& boundsMax, int sphereCount)
+{
+    m_shipSpheres.clear();
+
+    glm::vec3 extent = boundsMax - boundsMin;
+    glm::vec3 center = (boundsMin + boundsMax) * 0.5f;
+
+    // Spheres along the longest axis, as thick as the other two allow
+    int axis = 0;
+    if (extent.y > extent[axis]) axis = 1;
+    if (extent.z > extent[axis]) axis = 2;
+    float radius = 0.0f;
+    for (int a = 0; a < 3; a++)
+        if (a != axis)
+            radius = std::max(radius, 0.5f * extent[a]);
+
+    float length = extent[axis];
+    if (sphereCount < 1 || length <= 2.0f * radius) {
+        m_shipSpheres.push_back({ center, std::max(radius, 0.5f * length) });
+    }
+    else {
+        float first = boundsMin[axis] + radius;
+        float step = sphereCount > 1 ? (length - 2.0f * radius) / (sphereCount - 1) : 0.0f;
+        for (int s = 0; s < sphereCount; s++) {
+            glm::vec3 c = center;
+            c[axis] = first + step * s;
+            m_shipSpheres.push_back({ c, radius });
+        }
+    }
+
+    m_shipBoundRadius = 0.0f;
+    for (const CollisionSphere& s : m_shipSpheres)
+        m_shipBoundRadius = std::max(m_shipBoundRadius, glm::length(s.center) + s.radius);
+}
+
+void CollisionSystem::BuildAsteroidGrid(const std::vector<glm::mat4>& inner, const std::vector<glm::mat4>& outer,
+    float meshRadius, float shipScale)
+{
+    ALLOC_SCOPE("Collision");
+    float largestShipSphere = 0.0f;
+    for (const CollisionSphere& s : m_shipSpheres)
+        largestShipSphere = std::max(largestShipSphere, s.radius);
+
+    m_grid.SetMinCellSize(2.0f * largestShipSphere * shipScale);
+    m_grid.Build(inner.data(), inner.size(), outer.data(), outer.size(), meshRadius);
+}
+
+int CollisionSystem::FindContacts(const glm::mat4& shipModel, const SpatialIndex* bodies, ShipContact* out, int maxOut)
+{
+    if (m_shipSpheres.empty())
+        return 0;
+
+    // Ship spheres in world space (the ship matrix has a uniform scale)
+    float scale = glm::length(glm::vec3(shipModel[0]));
+    CollisionSphere world[8];
+    int sphereCount = std::min((int)m_shipSpheres.size(), 8);
+    for (int s = 0; s < sphereCount; s++) {
+        world[s].center = glm::vec3(shipModel * glm::vec4(m_shipSpheres[s].center, 1.0f));
+        world[s].radius = m_shipSpheres[s].radius * scale;
+    }
+
+    glm::vec3 shipCenter = glm::vec3(shipModel[3]);
+    float shipRadius = m_shipBoundRadius * scale;
+    int count = 0;
+
+    // Planets, moons, sun, comet
+    if (bodies != NULL) {
+        uint32_t mask = kAllBodies & ~KindBit(BodyKind::Asteroid);
+        int hits = bodies->QueryRadius(shipCenter, shipRadius, m_bodyHits, 32, mask);
+        for (int h = 0; h < hits && count < maxOut; h++) {
+            int proxy = m_bodyHits[h].proxy;
+            ShipContact contact;
+            if (DeepestContact(world, sphereCount, bodies->GetCenter(proxy), bodies->GetRadius(proxy), contact)) {
+                contact.body = m_bodyHits[h].body;
+                out[count++] = contact;
+            }
+        }
+    }
+
+    // Asteroids
+    int candidates = m_grid.QuerySphere(shipCenter, shipRadius, m_candidates, 256);
+    for (int c = 0; c < candidates && count < maxOut; c++) {
+        int i = m_candidates[c];
+        ShipContact contact;
+        if (DeepestContact(world, sphereCount, m_grid.GetCenter(i), m_grid.GetRadius(i), contact)) {
+            contact.body = { BodyKind::Asteroid, i };
+            out[count++] = contact;
+        }
+    }
+
+    return count;
+}
+
+glm::vec3 CollisionSystem::Resolve(const glm::mat4& shipModel, const SpatialIndex* bodies)
+{
+    m_lastContactCount = FindContacts(shipModel, bodies, m_contacts, kMaxContacts);
+
+    // Push out along each normal, counting only what earlier contacts haven't
+    // already covered so touching two bodies doesn't double the push
+    glm::vec3 offset(0.0f);
+    for (int c = 0; c < m_lastContactCount; c++) {
+        const ShipContact& contact = m_contacts[c];
+        float covered = glm::dot(offset, contact.normal);
+        if (covered < contact.depth)
+            offset += contact.normal * (contact.depth - covered);
+    }
+    return offset;
+}
@@ -0,0 +1,101 @@
+#ifndef COLLISION_H
+#define COLLISION_H
+
+#include <cstdint>
+#include <vector>
+#include "graphics_headers.h"
+#include "spatial_index.h"
+
+struct CollisionSphere
+{
+    glm::vec3 center;
+    float radius;
+};
+
+struct ShipContact
+{
+    glm::vec3 normal;   // points from the body towards the ship
+    float depth;        // penetration along normal
+    BodyRef body;
+};
+
+// Uniform hash grid over the asteroid bounding spheres. Each asteroid goes in
+// the cell holding its centre; queries widen by the largest asteroid radius.
+// Build is a counting sort into arrays sized by Reserve, so rebuilding every
+// frame (N-body belts) doesn't allocate.
+class AsteroidGrid
+{
+public:
+    AsteroidGrid();
+
+    void Reserve(size_t count);
+    void SetMinCellSize(float size) { m_minCellSize = size; }
+    void Build(const glm::mat4* inner, size_t innerCount, const glm::mat4* outer, size_t outerCount,
+        float meshRadius);
+
+    // Writes the indices of asteroids overlapping the sphere; returns how many
+    int QuerySphere(const glm::vec3& center, float radius, int* out, int maxOut) const;
+
+    const glm::vec3& GetCenter(int i) const { return m_centers[i]; }
+    float GetRadius(int i) const { return m_radii[i]; }
+    size_t GetCount() const { return m_count; }
+
+private:
+    uint32_t Hash(int x, int y, int z) const;
+    void CellOf(const glm::vec3& p, int& x, int& y, int& z) const;
+
+    float m_cellSize;
+    float m_minCellSize;
+    float m_maxRadius;
+    size_t m_count;
+    uint32_t m_tableMask;
+    std::vector<uint32_t> m_cellStart;   // tableSize + 1 prefix sums
+    std::vector<int> m_entries;          // asteroid indices grouped by cell
+    std::vector<uint32_t> m_entryHash;
+    std::vector<glm::vec3> m_centers;
+    std::vector<float> m_radii;
+
+    // Which query last visited each bucket, so a bucket that several cells
+    // hash to is scanned once
+    mutable std::vector<uint32_t> m_bucketStamp;
+    mutable uint32_t m_queryStamp;
+};
+
+// Ship versus everything. The ship is a handful of spheres along its long
+// axis; planets, moons, the sun and the comet come from the spatial index and
+// asteroids from the hash grid. Resolve pushes the ship out of whatever it
+// hits, so it slides along surfaces instead of passing through.
+class CollisionSystem
+{
+public:
+    CollisionSystem();
+
+    // Fits spheres to the ship mesh's model-space bounds
+    void SetShipShape(const glm::vec3& boundsMin, const glm::vec3& boundsMax, int sphereCount = 3);
+    // Rebuilds the asteroid grid; call again whenever the asteroids move
+    void BuildAsteroidGrid(const std::vector<glm::mat4>& inner, const std::vector<glm::mat4>& outer,
+        float meshRadius, float shipScale);
+    AsteroidGrid& GetAsteroidGrid() { return m_grid; }
+
+    // Finds contacts for a ship at shipModel; returns how many were written
+    int FindContacts(const glm::mat4& shipModel, const SpatialIndex* bodies, ShipContact* out, int maxOut);
+    // Returns the world-space offset that moves the ship out of every contact
+    glm::vec3 Resolve(const glm::mat4& shipModel, const SpatialIndex* bodies);
+
+    int GetLastContactCount() const { return m_lastContactCount; }
+
+    static const int kMaxContacts = 32;
+
+private:
+    std::vector<CollisionSphere> m_shipSpheres;   // model space
+    float m_shipBoundRadius;                      // model space, around the origin
+    AsteroidGrid m_grid;
+    int m_lastContactCount;
+
+    // Scratch, sized once
+    ShipContact m_contacts[kMaxContacts];
+    int m_candidates[256];
+    SpatialHit m_bodyHits[32];
+};
+
+#endif /* COLLISION_H */
@@ -0,0 +1,319 @@
+#include "cometparticles.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <string>
+
+static const int kGroupSize = 256;
+
+// Shared by both programs: the particle layout and which slots hold ions
+static const char* kParticleCommon = R"(
+#version 430
+struct Particle
+{
+    vec4 position;  // w: age in seconds
+    vec4 velocity;  // w: lifetime, 0 until the slot is first used
+};
+
+const float kIonFraction = 0.3;
+
+uint Hash(uint x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+// By slot, so a particle stays what it is for its whole life
+bool IsIon(uint i)
+{
+    return float(Hash(i) >> 8) * (1.0 / 16777216.0) < kIonFraction;
+}
+)";
+
+static const char* kSimulateShader = R"(
+layout (local_size_x = 256) in;
+layout (std430, binding = 1) buffer Particles { Particle particles[]; };
+
+uniform uint emitFirst;     // this step's new particles are slots emitFirst..
+uniform uint emitCount;     // ..emitFirst + emitCount, wrapping at capacity
+uniform uint capacity;
+uniform float dt;
+uniform float lifetime;
+uniform uint seed;
+uniform vec3 cometPos;
+uniform vec3 lastCometPos;
+uniform vec3 cometVelocity;
+uniform vec3 sunPos;
+
+const float kComaRadius = 0.15;
+const float kIonPush = 3.0;     // solar wind, units/s^2
+const float kDustPush = 0.5;
+
+float Random(inout uint state)
+{
+    state = Hash(state);
+    return float(state >> 8) * (1.0 / 16777216.0);
+}
+
+void main()
+{
+    uint i = gl_GlobalInvocationID.x;
+    if (i >= capacity)
+        return;
+
+    Particle p = particles[i];
+    uint offset = (i + capacity - emitFirst) % capacity;
+    if (offset < emitCount)
+    {
+        // Spread along the comet's path over the step, thrown out of the
+        // sunlit side, moving with the comet
+        uint state = Hash(i ^ (seed * 0x9e3779b9u));
+        float t = (float(offset) + Random(state)) / float(emitCount);
+        float z = Random(state) * 2.0 - 1.0;
+        float phi = Random(state) * 6.28318531;
+        vec3 dir = vec3(sqrt(1.0 - z * z) * vec2(cos(phi), sin(phi)), z);
+        dir = normalize(dir - 0.7 * normalize(cometPos - sunPos));
+
+        p.position.xyz = mix(lastCometPos, cometPos, t) + dir * kComaRadius * Random(state);
+        p.position.w = (1.0 - t) * dt;
+        p.velocity.xyz = cometVelocity + dir * (0.2 + 0.4 * Random(state));
+        p.velocity.w = lifetime * (0.5 + 0.5 * Random(state));
+    }
+    else if (p.position.w < p.velocity.w)
+    {
+        vec3 away = normalize(p.position.xyz - sunPos);
+        p.velocity.xyz += away * (IsIon(i) ? kIonPush : kDustPush) * dt;
+        p.position.xyz += p.velocity.xyz * dt;
+        p.position.w += dt;
+    }
+    else
+    {
+        return;     // dead, and not due yet
+    }
+    particles[i] = p;
+}
+)";
+
+static const char* kRenderVertexShader = R"(
+layout (std430, binding = 1) readonly buffer Particles { Particle particles[]; };
+
+uniform mat4 projectionMatrix;
+uniform mat4 viewMatrix;
+uniform uint firstSlot;     // instance 0 draws this slot, wrapping at capacity
+uniform uint capacity;
+
+out vec2 corner;
+out vec3 color;
+
+const float kBrightness = 0.05;
+
+void main()
+{
+    uint slot = (firstSlot + uint(gl_InstanceID)) % capacity;
+    Particle p = particles[slot];
+    corner = vec2(gl_VertexID & 1, gl_VertexID >> 1) * 2.0 - 1.0;
+    float age = p.velocity.w > 0.0 ? p.position.w / p.velocity.w : 1.0;
+    if (age >= 1.0)
+    {
+        // Dead: all four corners outside the clip volume
+        gl_Position = vec4(0.0, 0.0, 2.0, 1.0);
+        color = vec3(0.0);
+        return;
+    }
+
+    // Spreads out and fades as it ages
+    bool ion = IsIon(slot);
+    vec4 viewPos = viewMatrix * vec4(p.position.xyz, 1.0);
+    viewPos.xy += corner * (ion ? 0.02 : 0.04) * (1.0 + 2.0 * age);
+    gl_Position = projectionMatrix * viewPos;
+    float fade = (1.0 - age) * (1.0 - age);
+    color = (ion ? vec3(0.35, 0.55, 1.0) : vec3(1.0, 0.85, 0.6)) * fade * kBrightness;
+}
+)";
+
+static const char* kRenderFragmentShader = R"(
+in vec2 corner;
+in vec3 color;
+out vec4 FragColor;
+
+void main()
+{
+    float d = dot(corner, corner);
+    if (d >= 1.0)
+        discard;
+#ifdef OVERDRAW
+    FragColor = vec4(0.1, 0.05, 0.025, 1.0); // one step of the overdraw view
+#else
+    FragColor = vec4(color * (1.0 - d), 1.0);
+#endif
+}
+)";
+
+CometParticles::CometParticles()
+{
+    m_simulate = NULL;
+    m_render = NULL;
+    m_initialized = false;
+    m_capacity = 0;
+    m_head = 0;
+    for (int& count : m_bucketCounts)
+        count = 0;
+    m_bucket = 0;
+    m_bucketAge = 0.0f;
+    m_live = 0;
+    m_carry = 0.0f;
+    m_step = 0;
+    m_lastCometPos = glm::vec3(0.0f);
+    m_hasLast = false;
+    m_emitFirst = m_emitCount = m_capacityLoc = m_dt = m_lifetime = m_seed = -1;
+    m_cometPos = m_lastCometPosLoc = m_cometVelocity = m_sunPos = -1;
+    m_projection = m_view = m_firstSlot = m_renderCapacity = -1;
+}
+
+CometParticles::~CometParticles()
+{
+    delete m_simulate;
+    delete m_render;
+}
+
+void CometParticles::BeginShaders(bool overdraw)
+{
+    m_simulate = new Shader();
+    m_simulate->Initialize();
+    m_simulate->AddShader(GL_COMPUTE_SHADER, (std::string(kParticleCommon) + kSimulateShader).c_str());
+    m_simulate->BeginFinalize();
+
+    m_render = new Shader();
+    m_render->Initialize();
+    if (overdraw)
+        m_render->SetDefines("#define OVERDRAW\n");
+    m_render->AddShader(GL_VERTEX_SHADER, (std::string(kParticleCommon) + kRenderVertexShader).c_str());
+    m_render->AddShader(GL_FRAGMENT_SHADER, (std::string("#version 430\n") + kRenderFragmentShader).c_str());
+    m_render->BeginFinalize();
+}
+
+bool CometParticles::Initialize(const CometParticleSettings& settings)
+{
+    if (m_simulate == NULL || !m_simulate->Finalize() || !m_render->Finalize())
+    {
+        printf("Comet particle shaders failed to build\n");
+        return false;
+    }
+
+    m_emitFirst = m_simulate->GetUniformLocation("emitFirst");
+    m_emitCount = m_simulate->GetUniformLocation("emitCount");
+    m_capacityLoc = m_simulate->GetUniformLocation("capacity");
+    m_dt = m_simulate->GetUniformLocation("dt");
+    m_lifetime = m_simulate->GetUniformLocation("lifetime");
+    m_seed = m_simulate->GetUniformLocation("seed");
+    m_cometPos = m_simulate->GetUniformLocation("cometPos");
+    m_lastCometPosLoc = m_simulate->GetUniformLocation("lastCometPos");
+    m_cometVelocity = m_simulate->GetUniformLocation("cometVelocity");
+    m_sunPos = m_simulate->GetUniformLocation("sunPos");
+    m_projection = m_render->GetUniformLocation("projectionMatrix");
+    m_view = m_render->GetUniformLocation("viewMatrix");
+    m_firstSlot = m_render->GetUniformLocation("firstSlot");
+    m_renderCapacity = m_render->GetUniformLocation("capacity");
+
+    // A slot comes round again after exactly lifetime seconds of emission,
+    // by which time its particle has died
+    m_settings = settings;
+    m_capacity = std::max((int)ceilf(settings.emissionRate * settings.lifetime), 1);
+
+    m_particleBuffer.Create("Comet particles");
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_particleBuffer.Get());
+    glBufferData(GL_SHADER_STORAGE_BUFFER, (size_t)m_capacity * 2 * sizeof(glm::vec4), NULL, GL_DYNAMIC_COPY);
+    m_particleBuffer.SetBytes((size_t)m_capacity * 2 * sizeof(glm::vec4));
+    // Zero lifetimes: every slot starts out dead
+    glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    m_vao.Create("Comet particle vertex array");
+
+    printf("Comet particles: %d (%.1f MB), %g a second living up to %g s\n", m_capacity,
+        m_capacity * 2 * sizeof(glm::vec4) / 1048576.0, settings.emissionRate, settings.lifetime);
+    m_initialized = true;
+    return true;
+}
+
+void CometParticles::Update(float dt, const glm::vec3& cometPos, const glm::vec3& sunPos)
+{
+    if (!m_initialized || dt <= 0.0f)
+    {
+        m_lastCometPos = cometPos;
+        m_hasLast = true;
+        return;
+    }
+
+    glm::vec3 lastCometPos = m_hasLast ? m_lastCometPos : cometPos;
+    float wanted = m_settings.emissionRate * dt + m_carry;
+    int count = std::min((int)wanted, m_capacity);
+    m_carry = count < m_capacity ? wanted - count : 0.0f;
+
+    m_simulate->Enable();
+    glUniform1ui(m_emitFirst, (GLuint)m_head);
+    glUniform1ui(m_emitCount, (GLuint)count);
+    glUniform1ui(m_capacityLoc, (GLuint)m_capacity);
+    glUniform1f(m_dt, dt);
+    glUniform1f(m_lifetime, m_settings.lifetime);
+    glUniform1ui(m_seed, m_step);
+    glUniform3fv(m_cometPos, 1, glm::value_ptr(cometPos));
+    glUniform3fv(m_lastCometPosLoc, 1, glm::value_ptr(lastCometPos));
+    glm::vec3 velocity = (cometPos - lastCometPos) / dt;
+    glUniform3fv(m_cometVelocity, 1, glm::value_ptr(velocity));
+    glUniform3fv(m_sunPos, 1, glm::value_ptr(sunPos));
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, kParticleBinding, m_particleBuffer.Get());
+    glDispatchCompute((m_capacity + kGroupSize - 1) / kGroupSize, 1, 1);
+    // Draw reads the buffer as shader storage too
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    m_head = (m_head + count) % m_capacity;
+    AgeBuckets(dt, count);
+    m_step++;
+    m_lastCometPos = cometPos;
+    m_hasLast = true;
+}
+
+// Moves the buckets on by dt, dropping those now wholly past lifetime, and
+// adds this step's count to the newest
+void CometParticles::AgeBuckets(float dt, int count)
+{
+    float bucketSeconds = m_settings.lifetime / kAgeBuckets;
+    m_bucketAge += dt;
+    for (int i = 0; i <= kAgeBuckets && m_bucketAge >= bucketSeconds; i++)
+    {
+        m_bucket = (m_bucket + 1) % (kAgeBuckets + 1);
+        m_live -= m_bucketCounts[m_bucket];
+        m_bucketCounts[m_bucket] = 0;
+        m_bucketAge -= bucketSeconds;
+    }
+    // A step longer than the whole ring leaves nothing to keep
+    m_bucketAge = std::min(m_bucketAge, bucketSeconds);
+    m_bucketCounts[m_bucket] += count;
+    m_live += count;
+}
+
+void CometParticles::Draw(const glm::mat4& projection, const glm::mat4& view)
+{
+    int live = GetLiveCount();
+    if (!m_initialized || live == 0)
+        return;
+
+    // The live stretch ends just behind the head
+    int first = (m_head - live + m_capacity) % m_capacity;
+    m_render->Enable();
+    glUniformMatrix4fv(m_projection, 1, GL_FALSE, glm::value_ptr(projection));
+    glUniformMatrix4fv(m_view, 1, GL_FALSE, glm::value_ptr(view));
+    glUniform1ui(m_firstSlot, (GLuint)first);
+    glUniform1ui(m_renderCapacity, (GLuint)m_capacity);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, kParticleBinding, m_particleBuffer.Get());
+    glBindVertexArray(m_vao.Get());
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, live);
+    glBindVertexArray(0);
+}
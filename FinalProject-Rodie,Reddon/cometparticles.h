@@ -0,0 +1,96 @@
+#ifndef COMETPARTICLES_H
+#define COMETPARTICLES_H
+
+#include <algorithm>
+#include "graphics_headers.h"
+#include "shader.h"
+#include "gpuresources.h"
+
+struct CometParticleSettings
+{
+    float emissionRate = 80000.0f;  // particles a second
+    float lifetime = 6.0f;          // seconds; each particle lives half to all of it
+};
+
+// The comet's coma and tail as particles that live entirely on the GPU. A
+// compute shader emits, pushes and ages them in a shader storage buffer at
+// binding kParticleBinding, and they are drawn from the same buffer as
+// camera-facing squares, one instance each, blended additively.
+//
+// The buffer holds emissionRate * lifetime particles and is filled as a
+// ring: each step's new particles overwrite the oldest slots, which have
+// always died by then. Dust is pushed gently away from the sun and curves
+// behind the comet; ions are pushed hard and stream straight out. Only the
+// slots emitted within the last lifetime can hold a live particle, so only
+// that stretch of the ring behind the head is drawn.
+class CometParticles
+{
+public:
+    static const GLuint kParticleBinding = 1;
+
+    CometParticles();
+    ~CometParticles();
+
+    // Starts compiling the programs (see Shader::BeginFinalize); overdraw
+    // draws every particle as one step of the overdraw view
+    void BeginShaders(bool overdraw);
+    // Needs a current GL context, after BeginShaders
+    bool Initialize(const CometParticleSettings& settings);
+
+    // Emits this step's particles around the comet and moves every particle
+    // on by dt. No per-particle work on the CPU.
+    void Update(float dt, const glm::vec3& cometPos, const glm::vec3& sunPos);
+    // With blending and depth writes set up by the caller
+    void Draw(const glm::mat4& projection, const glm::mat4& view);
+
+    int GetCapacity() const { return m_capacity; }
+    // Slots Draw draws: every one emitted recently enough to be alive
+    int GetLiveCount() const { return std::min(m_live, m_capacity); }
+
+private:
+    void AgeBuckets(float dt, int count);
+
+    Shader* m_simulate;
+    Shader* m_render;
+    bool m_initialized;
+    CometParticleSettings m_settings;
+    int m_capacity;
+
+    GpuBuffer m_particleBuffer;
+    GpuVertexArray m_vao;       // no attributes
+
+    int m_head;                 // next slot to emit into
+
+    // Emitted per lifetime / kAgeBuckets seconds, newest in m_bucket. One
+    // more bucket than that, so the oldest is dropped only once all of it
+    // is older than lifetime.
+    static const int kAgeBuckets = 64;
+    int m_bucketCounts[kAgeBuckets + 1];
+    int m_bucket;
+    float m_bucketAge;          // seconds into m_bucket
+    int m_live;                 // sum of m_bucketCounts
+    float m_carry;              // fraction of a particle owed from the last step
+    unsigned m_step;
+    glm::vec3 m_lastCometPos;
+    bool m_hasLast;
+
+    // Simulation uniforms
+    GLint m_emitFirst;
+    GLint m_emitCount;
+    GLint m_capacityLoc;
+    GLint m_dt;
+    GLint m_lifetime;
+    GLint m_seed;
+    GLint m_cometPos;
+    GLint m_lastCometPosLoc;
+    GLint m_cometVelocity;
+    GLint m_sunPos;
+
+    // Render uniforms
+    GLint m_projection;
+    GLint m_view;
+    GLint m_firstSlot;
+    GLint m_renderCapacity;
+};
+
+#endif /* COMETPARTICLES_H */
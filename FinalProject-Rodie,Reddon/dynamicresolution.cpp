@@ -0,0 +1,109 @@
+#include "dynamicresolution.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+// Smoothing of the measurements, per frame read back
+static const double kSmoothing = 0.2;
+// Fraction of the way to the ideal scale moved per frame read back
+static const float kDownRate = 0.5f;
+static const float kUpRate = 0.1f;
+// Only grow once the frame would take less than this much of the target
+static const double kHeadroom = 0.85;
+
+DynamicResolution::DynamicResolution() : m_queries(2)
+{
+    m_frame = 0;
+    m_scale = 1.0f;
+    m_gpuMs = 0.0;
+    m_costPerArea = 0.0;
+    m_measured = 0;
+    m_scaleSum = 0.0;
+    m_gpuSum = 0.0;
+    m_framesAtMin = 0;
+    m_dropped = 0;
+    for (float& scale : m_pendingScale)
+        scale = 1.0f;
+}
+
+void DynamicResolution::Initialize(const DynamicResolutionSettings& settings)
+{
+    m_settings = settings;
+    m_settings.maxScale = std::min(std::max(settings.maxScale, 0.05f), 1.0f);
+    m_settings.minScale = std::min(std::max(settings.minScale, 0.05f), m_settings.maxScale);
+    m_scale = m_settings.maxScale;
+    printf("Dynamic resolution: %.0f%% to %.0f%% of the output, aiming for %.1f ms of GPU time a frame\n",
+        m_settings.minScale * 100.0f, m_settings.maxScale * 100.0f, m_settings.targetMs);
+}
+
+void DynamicResolution::BeginFrame()
+{
+    if (m_queries.Advance([this](int set, int count) { Read(set, count); }) > 0)
+        m_dropped++;
+    glQueryCounter(m_queries.Add(), GL_TIMESTAMP);
+}
+
+void DynamicResolution::EndFrame()
+{
+    glQueryCounter(m_queries.Add(), GL_TIMESTAMP);
+    m_pendingScale[m_queries.GetSet()] = m_scale;
+    m_frame++;
+}
+
+void DynamicResolution::Read(int set, int count)
+{
+    if (count < 2)
+        return;
+    GLuint64 begin = 0, end = 0;
+    glGetQueryObjectui64v(m_queries.GetQuery(set, 0), GL_QUERY_RESULT, &begin);
+    glGetQueryObjectui64v(m_queries.GetQuery(set, 1), GL_QUERY_RESULT, &end);
+    if (end >= begin)
+        Measure((end - begin) / 1e6, m_pendingScale[set]);
+}
+
+float DynamicResolution::Update()
+{
+    m_queries.Resolve(false, [this](int set, int count) { Read(set, count); });
+
+    m_scaleSum += m_scale;
+    if (m_scale <= m_settings.minScale)
+        m_framesAtMin++;
+    return m_scale;
+}
+
+void DynamicResolution::Measure(double ms, float scale)
+{
+    double cost = ms / ((double)scale * scale);
+    if (m_measured == 0)
+    {
+        m_gpuMs = ms;
+        m_costPerArea = cost;
+    }
+    else
+    {
+        m_gpuMs += (ms - m_gpuMs) * kSmoothing;
+        m_costPerArea += (cost - m_costPerArea) * kSmoothing;
+    }
+    m_measured++;
+    m_gpuSum += ms;
+
+    // What the current scale is expected to cost, and the scale that would
+    // just meet the target
+    double predicted = m_costPerArea * m_scale * m_scale;
+    float ideal = (float)sqrt(m_settings.targetMs / std::max(m_costPerArea, 1e-6));
+    if (predicted > m_settings.targetMs)
+        m_scale += (ideal - m_scale) * kDownRate;
+    else if (predicted < m_settings.targetMs * kHeadroom)
+        m_scale += (ideal - m_scale) * kUpRate;
+    m_scale = std::min(std::max(m_scale, m_settings.minScale), m_settings.maxScale);
+}
+
+void DynamicResolution::PrintSummary() const
+{
+    if (m_frame == 0)
+        return;
+    printf("Dynamic resolution: %d frames, average scale %.2f, %d at the minimum; GPU %.2f ms average over %d measured (%d lost)\n",
+        m_frame, m_scaleSum / m_frame, m_framesAtMin, m_measured > 0 ? m_gpuSum / m_measured : 0.0,
+        m_measured, m_dropped);
+}
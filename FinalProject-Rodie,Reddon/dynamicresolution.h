@@ -0,0 +1,66 @@
+#ifndef DYNAMICRESOLUTION_H
+#define DYNAMICRESOLUTION_H
+
+#include "graphics_headers.h"
+#include "gpuqueryring.h"
+
+struct DynamicResolutionSettings
+{
+    float minScale = 0.5f;      // of the output's width and height
+    float maxScale = 1.0f;
+    float targetMs = 15.0f;     // GPU time a frame should take
+};
+
+// Picks the fraction of the output size to draw the scene at (see
+// PostProcess::SetRenderScale) from how long the GPU took over recent
+// frames.
+//
+// Each frame's GPU work is bracketed by a pair of GL_TIMESTAMP queries from
+// a GpuQueryRing, read back a few frames later and only once the result is
+// there, so measuring never stalls. Cost is taken to go with the pixel count, the
+// square of the scale: each frame read back updates a running cost per
+// unit of area, which gives the scale that would just meet the target. The
+// scale moves towards it quickly when over the target, slowly when well
+// under it, and not at all in between, so it doesn't hunt.
+class DynamicResolution
+{
+public:
+    DynamicResolution();
+
+    void Initialize(const DynamicResolutionSettings& settings);
+
+    // Around everything the GPU does for the frame
+    void BeginFrame();
+    void EndFrame();
+
+    // Reads what frames have finished and returns the scale to draw the
+    // next one at
+    float Update();
+    float GetScale() const { return m_scale; }
+    // Smoothed, 0 until the first frame has been read back
+    double GetGpuMs() const { return m_gpuMs; }
+
+    void PrintSummary() const;
+
+private:
+    void Read(int set, int count);
+    void Measure(double ms, float scale);
+
+    DynamicResolutionSettings m_settings;
+    GpuQueryRing m_queries;             // begin and end of each frame
+    float m_pendingScale[GpuQueryRing::kSets];  // what the frame was drawn at
+    int m_frame;
+
+    float m_scale;
+    double m_gpuMs;
+    double m_costPerArea;       // smoothed ms at scale 1
+
+    // Statistics
+    int m_measured;
+    double m_scaleSum;
+    double m_gpuSum;
+    int m_framesAtMin;
+    int m_dropped;              // results not back before their queries were needed
+};
+
+#endif /* DYNAMICRESOLUTION_H */
@@ -1,49 +1,200 @@
 ﻿#include "engine.h"
 #include "glm/ext.hpp"
+#include "framearena.h"
+#include "profiler.h"
+#include "programcache.h"
+#include "textureuploader.h"
 
-Engine::Engine(const char* name, int width, int height)
+#include <cmath>
+#include <string>
+
+// Benchmark frames that aren't measured: first-use shader and texture work
+static const int kBenchWarmupFrames = 10;
+// Frames that may allocate under --alloc-strict while containers find their size
+static const int kAllocWarmupFrames = 30;
+
+Engine::Engine(const char* name, int width, int height, const LaunchOptions& options)
 {
     m_WINDOW_NAME = name;
     m_WINDOW_WIDTH = width;
     m_WINDOW_HEIGHT = height;
+    m_options = options;
 
 }
 
 
 Engine::~Engine()
 {
-    delete m_window;
+    // The benchmark owns GL queries, so it goes before the context
+    delete m_bench;
+    delete m_flight;
+    m_bench = NULL;
+    m_flight = NULL;
+    delete m_recorder;
+    delete m_replay;
+    m_recorder = NULL;
+    m_replay = NULL;
+    // The uploader's staging buffer is a GL object too. Everything that
+    // holds one goes before the window, which takes the context with it.
+    TextureUploader::Get().Shutdown();
     delete m_graphics;
-    m_window = NULL;
+    delete m_window;
     m_graphics = NULL;
+    m_window = NULL;
+    GpuResources::Get().ReportLeaks();
 }
 
 bool Engine::Initialize()
 {
     // Start a window
-    m_window = new Window(m_WINDOW_NAME, &m_WINDOW_WIDTH, &m_WINDOW_HEIGHT);
+    m_window = new Window(m_WINDOW_NAME, &m_WINDOW_WIDTH, &m_WINDOW_HEIGHT, m_options.headless);
     if (!m_window->Initialize())
     {
         printf("The window failed to initialize.\n");
         return false;
     }
 
+    m_pacer.Initialize(m_window, m_options.present, m_options.fps);
+
+    // Before the graphics, so asset loading is captured too
+    if (m_options.profile != NULL)
+        Profiler::Get().Enable();
+
+    if (m_options.shaderCache != NULL)
+        ProgramCache::Get().Enable(m_options.shaderCache);
+
+#ifdef ALLOC_TRACKING
+    AllocTracker::Get().SetStrict(m_options.allocStrict, kAllocWarmupFrames);
+#else
+    if (m_options.allocStrict != AllocStrictMode::Off)
+    {
+        printf("--alloc-strict needs a build with ALLOC_TRACKING defined\n");
+        return false;
+    }
+#endif
+
+    if (m_options.vramBudget > 0.0f)
+        GpuResources::Get().SetBudget((size_t)(m_options.vramBudget * 1024.0f * 1024.0f));
+    else
+        GpuResources::Get().SetBudgetFromDriver();
+
+    // Textures stream in over the first frames instead of loading up front
+    TextureUploader::Get().Initialize((size_t)(m_options.textureBudget * 1024.0f * 1024.0f));
+
     // Start the graphics
     m_graphics = new Graphics();
+    m_graphics->SetDepthPrepass(m_options.depthPrepass);
+    m_graphics->SetOverdrawView(m_options.overdraw);
+    m_graphics->SetBodyTextureMode(m_options.bodyTextures);
+    m_graphics->SetProceduralSpheres(m_options.proceduralSpheres);
+    m_graphics->SetImpostorPixels(m_options.impostorPixels);
+    AsteroidFieldSettings field;
+    field.seed = m_options.asteroidSeed;
+    field.loadRadius = m_options.asteroidRadius;
+    field.unloadRadius = m_options.asteroidRadius + 2.0f * field.chunkSize;
+    field.uploadBudget = (size_t)(m_options.asteroidBudget * 1024.0f);
+    m_graphics->SetAsteroidFieldSettings(field);
+    CometParticleSettings comet;
+    comet.emissionRate = m_options.cometRate;
+    comet.lifetime = m_options.cometLifetime;
+    m_graphics->SetCometParticleSettings(comet);
+    PostProcessSettings post;
+    post.bloom = m_options.bloom;
+    post.tonemap = m_options.tonemap;
+    post.exposure = m_options.exposure;
+    m_graphics->SetPostProcessSettings(post);
+    DynamicResolutionSettings dynamic;
+    dynamic.minScale = m_options.dynresMin;
+    dynamic.maxScale = m_options.dynresMax;
+    dynamic.targetMs = m_options.dynresTarget;
+    m_graphics->SetDynamicResolution(m_options.dynamicResolution, dynamic);
+    m_graphics->SetOutputFramebuffer(m_window->GetFramebuffer());
     if (!m_graphics->Initialize(m_WINDOW_WIDTH, m_WINDOW_HEIGHT))
     {
         printf("The graphics failed to initialize.\n");
         return false;
     }
 
+    ProgramCache& cache = ProgramCache::Get();
+    if (cache.IsEnabled())
+        printf("Shader cache: %d of %d programs loaded from %s\n", cache.GetHits(),
+            cache.GetHits() + cache.GetMisses(), m_options.shaderCache);
+
+    // Benchmarks and headless captures shouldn't depend on how fast textures arrive
+    if (m_options.headless || m_options.bench != NULL)
+        TextureUploader::Get().Finish();
+    // Nor on how fast asteroid chunks arrive, and neither should recordings:
+    // the ship collides with whichever chunks are in, so a replay has to get
+    // the same ones on the same frames
+    bool deterministic = m_options.headless || m_options.bench != NULL ||
+        m_options.record != NULL || m_options.replay != NULL;
+    if (deterministic && m_graphics->GetAsteroidField() != NULL)
+        m_graphics->GetAsteroidField()->SetSynchronous(true);
+
+    if (m_options.nbody)
+        m_graphics->EnableNBody(m_options.nbodyTheta);
+
+    if (m_options.bench != NULL)
+    {
+        m_flight = new FlightScript();
+        if (!m_flight->Load(m_options.bench))
+            return false;
+        for (const std::string& planet : m_flight->GetPlanetNames())
+        {
+            if (m_graphics->GetPlanetIndex(planet) < 0)
+            {
+                printf("Flight script orbits unknown planet %s\n", planet.c_str());
+                return false;
+            }
+        }
+
+        m_bench = new FrameBenchmark();
+        m_bench->SetWarmupFrames(kBenchWarmupFrames);
+        if (m_options.frames == 0)
+            m_options.frames = kBenchWarmupFrames + (int)ceil(m_flight->GetDuration() / m_options.benchDt);
+        printf("Benchmark: %s, %.1f s at dt %.4f, %d frames\n", m_options.bench,
+            m_flight->GetDuration(), m_options.benchDt, m_options.frames);
+    }
+
+    if (m_options.bench != NULL && (m_options.record != NULL || m_options.replay != NULL))
+    {
+        printf("--bench can't be combined with --record or --replay\n");
+        return false;
+    }
+    if (m_options.bindings != NULL)
+    {
+        InputMap map;
+        if (!map.Load(m_options.bindings))
+            return false;
+        m_inputSystem.SetMap(map);
+    }
+    if (m_options.record != NULL)
+    {
+        m_recorder = new InputRecorder();
+        if (!m_recorder->Open(m_options.record))
+            return false;
+    }
+    if (m_options.replay != NULL)
+    {
+        m_replay = new InputReplay();
+        if (!m_replay->Open(m_options.replay))
+            return false;
+        printf("Replaying %s: %d frames", m_options.replay, m_replay->GetFrameCount());
+        if (m_options.replayFrom > 0)
+            printf(", fast-forwarding to frame %d", m_options.replayFrom);
+        printf("\n");
+    }
+
+    // Headless runs have no window to take input from
+    if (m_window->getWindow() == NULL)
+        return true;
+
     glfwSetCursorPosCallback(m_window->getWindow(), Engine::cursor_position_callback);
     glfwSetWindowUserPointer(m_window->getWindow(), this); // Enable access to Engine instance
-
-    glfwSetScrollCallback(m_window->getWindow(), [](GLFWwindow* window, double xoffset, double yoffset) {
-        Engine* engine = static_cast<Engine*>(glfwGetWindowUserPointer(window));
-        if (engine && engine->getCamera())
-            engine->getCamera()->ProcessMouseScroll(yoffset);
-        });
+    glfwSetScrollCallback(m_window->getWindow(), Engine::scroll_callback);
+    glfwSetKeyCallback(m_window->getWindow(), Engine::key_callback);
+    glfwSetMouseButtonCallback(m_window->getWindow(), Engine::mouse_button_callback);
+    glfwSetWindowFocusCallback(m_window->getWindow(), Engine::focus_callback);
 
     return true;
 }
@@ -52,136 +203,232 @@ void Engine::Run()
 {
     m_running = true;
 
-    while (!glfwWindowShouldClose(m_window->getWindow()))
+    int frame = 0;
+
+    Profiler& profiler = Profiler::Get();
+    FrameArena& arena = FrameArena::Get();
+
+    while (!m_window->ShouldClose())
     {
+        // No waiting while fast-forwarding a replay
+        if (!m_skipRender)
+            m_pacer.Pace();
+
+        // Last frame's scratch is all gone by now
+        arena.Reset();
+#ifdef ALLOC_TRACKING
+        AllocTracker::Get().BeginFrame();
+#endif
+
+        // Render targets follow the window, between frames
+        if (m_window->CheckResize(m_WINDOW_WIDTH, m_WINDOW_HEIGHT))
+            m_graphics->Resize(m_WINDOW_WIDTH, m_WINDOW_HEIGHT);
+
+        double frameStart = m_window->GetTime();
+        if (!BeginInputFrame())
+            break;
+
+        // Frames before --replay-from are simulated but not drawn or profiled
+        m_skipRender = m_replay != NULL && m_replay->GetPosition() <= m_options.replayFrom;
+        if (!m_skipRender)
+            profiler.BeginFrame();
         ProcessInput();
-        Display(m_window->getWindow(), glfwGetTime());
-        glfwPollEvents();
+        Display(m_window->getWindow(), m_window->GetTime());
+        PollInput();
+        EndInputFrame();
+        if (!m_skipRender)
+            profiler.EndFrame();
+
+        if (m_bench != NULL)
+        {
+            double frameSeconds = m_window->GetTime() - frameStart;
+            const RenderStats& stats = m_graphics->GetRenderStats();
+            m_bench->EndFrame((frameSeconds - m_swapSeconds) * 1000.0, frameSeconds * 1000.0,
+                stats.drawCalls, stats.triangles);
+        }
+
+        if (m_options.frames > 0 && ++frame >= m_options.frames)
+            m_window->RequestClose();
     }
     m_running = false;
 
+    m_pacer.PrintSummary();
+    TextureUploader::Get().PrintSummary();
+    if (m_graphics->GetAsteroidField() != NULL)
+        m_graphics->GetAsteroidField()->PrintSummary();
+    if (m_graphics->GetDynamicResolution() != NULL)
+        m_graphics->GetDynamicResolution()->PrintSummary();
+    GpuResources::Get().PrintSummary();
+    arena.PrintSummary();
+#ifdef ALLOC_TRACKING
+    AllocTracker::Get().PrintSummary();
+#endif
+
+    if (m_recorder != NULL)
+    {
+        m_recorder->Close();
+        printf("Recorded %d frames to %s\n", m_recorder->GetFrameCount(), m_options.record);
+    }
+    if (m_replay != NULL)
+        printf("Replayed %d of %d frames\n", m_replay->GetPosition(), m_replay->GetFrameCount());
+
+    if (profiler.IsEnabled())
+    {
+        profiler.Flush();
+        std::string base = m_options.profile;
+        if (profiler.WriteChromeTrace((base + ".json").c_str()) && profiler.WriteCsv((base + ".csv").c_str()))
+            printf("Wrote profile to %s.json and %s.csv\n", base.c_str(), base.c_str());
+        profiler.PrintSummary();
+    }
+
+    if (m_bench != NULL)
+    {
+        m_bench->Finish();
+        if (m_bench->WriteJson(m_options.benchOut, m_options.bench, m_options.benchDt, m_WINDOW_WIDTH, m_WINDOW_HEIGHT))
+            printf("Wrote benchmark results to %s\n", m_options.benchOut);
+        m_bench->PrintSummary();
+    }
+
+    if (m_options.screenshot != NULL && m_window->SaveFramebuffer(m_options.screenshot))
+        printf("Saved last frame to %s\n", m_options.screenshot);
+
 }
 
 void Engine::ProcessInput()
 {
-    float currentFrame = glfwGetTime();
-    deltaTime = currentFrame - lastFrame;
-    lastFrame = currentFrame;
+    PROFILE_SCOPE("ProcessInput");
+    ALLOC_SCOPE("ProcessInput");
+
+    // Benchmark: fixed step, and the script does the flying
+    if (m_flight != NULL)
+    {
+        deltaTime = m_options.benchDt;
+        ApplyFlightSample(m_flight->Sample(m_flightTime));
+        // Warm-up holds the starting pose, so the measured frames fly all of it
+        if (!m_bench->IsWarmingUp())
+            m_flightTime += deltaTime;
+        return;
+    }
+
+    deltaTime = m_input.dt;
 
     GLFWwindow* win = m_window->getWindow();
     Camera* cam = m_graphics->getCamera();
 
-    if (glfwGetKey(win, GLFW_KEY_ESCAPE) == GLFW_PRESS)
-        glfwSetWindowShouldClose(win, true);
+    // Headless: the simulation still advances, there is just nobody to steer
+    if (win == NULL && m_replay == NULL)
+        return;
+
+    // Quit still works live so a replay can be cut short
+    if (m_input.Down(Action::Quit) || m_inputSystem.IsDown(Action::Quit))
+        m_window->RequestClose();
+
+    // Mouse: orbit the planet when observing, drag to look around otherwise
+    if (currentMode == GameMode::Observation) {
+        orbitYaw += m_input.Value(Axis::LookX) * 0.2f;
+        orbitPitch -= m_input.Value(Axis::LookY) * 0.2f;
+
+        // Clamp pitch to avoid flipping
+        if (orbitPitch > 89.0f) orbitPitch = 89.0f;
+        if (orbitPitch < -89.0f) orbitPitch = -89.0f;
+    }
+    else if (m_input.Value(Axis::DragX) != 0.0f || m_input.Value(Axis::DragY) != 0.0f) {
+        cam->ProcessMouseMovement(m_input.Value(Axis::DragX), m_input.Value(Axis::DragY));
+    }
+    if (m_input.Value(Axis::Zoom) != 0.0f)
+        cam->ProcessMouseScroll(m_input.Value(Axis::Zoom));
 
     float camSpeed = 5.0f * deltaTime;
 
     //observation mode
     if (currentMode == GameMode::Observation) {
 
-        if (glfwGetKey(win, GLFW_KEY_W) == GLFW_PRESS)
-            cam->ProcessKeyboard("FORWARD", camSpeed);
-        if (glfwGetKey(win, GLFW_KEY_S) == GLFW_PRESS)
-            cam->ProcessKeyboard("BACKWARD", camSpeed);
-        if (glfwGetKey(win, GLFW_KEY_A) == GLFW_PRESS)
-            cam->ProcessKeyboard("LEFT", camSpeed);
-        if (glfwGetKey(win, GLFW_KEY_D) == GLFW_PRESS)
-            cam->ProcessKeyboard("RIGHT", camSpeed);
+        if (m_input.Down(Action::Forward))
+            cam->ProcessKeyboard(CameraMove::Forward, camSpeed);
+        if (m_input.Down(Action::Backward))
+            cam->ProcessKeyboard(CameraMove::Backward, camSpeed);
+        if (m_input.Down(Action::Left))
+            cam->ProcessKeyboard(CameraMove::Left, camSpeed);
+        if (m_input.Down(Action::Right))
+            cam->ProcessKeyboard(CameraMove::Right, camSpeed);
     }
     //exploration mode
     else if (currentMode == GameMode::Exploration) {
         Mesh* ship = m_graphics->getMesh();
         float shipSpeed = 65.0f * deltaTime;
-        if (glfwGetKey(win, GLFW_KEY_LEFT_SHIFT) == GLFW_PRESS)
+        if (m_input.Down(Action::Boost))
             shipSpeed *= 3.0f;
 
         // Movement
-        if (glfwGetKey(win, GLFW_KEY_W) == GLFW_PRESS)
+        if (m_input.Down(Action::Forward))
             ship->MoveForward(shipSpeed);
-        if (glfwGetKey(win, GLFW_KEY_S) == GLFW_PRESS)
+        if (m_input.Down(Action::Backward))
             ship->MoveForward(-shipSpeed);
 
         // Rotation
-        if (glfwGetKey(win, GLFW_KEY_A) == GLFW_PRESS)
+        if (m_input.Down(Action::Left))
             ship->Rotate(0.0f, 60.0f * deltaTime, 0.0f); // yaw left
-        if (glfwGetKey(win, GLFW_KEY_D) == GLFW_PRESS)
+        if (m_input.Down(Action::Right))
             ship->Rotate(0.0f, -60.0f * deltaTime, 0.0f); // yaw right
 
-        if (glfwGetKey(win, GLFW_KEY_Q) == GLFW_PRESS)
+        if (m_input.Down(Action::RollLeft))
             ship->Rotate(0.0f, 0.0f, 60.0f * deltaTime); // roll left
-        if (glfwGetKey(win, GLFW_KEY_E) == GLFW_PRESS)
+        if (m_input.Down(Action::RollRight))
             ship->Rotate(0.0f, 0.0f, -60.0f * deltaTime); // roll right
 
-        if (glfwGetKey(win, GLFW_KEY_UP) == GLFW_PRESS)
+        if (m_input.Down(Action::PitchUp))
             ship->Rotate(-60.0f * deltaTime, 0.0f, 0.0f); // pitch up
-        if (glfwGetKey(win, GLFW_KEY_DOWN) == GLFW_PRESS)
+        if (m_input.Down(Action::PitchDown))
             ship->Rotate(60.0f * deltaTime, 0.0f, 0.0f); // pitch down
 
-        if (glfwGetKey(win, GLFW_KEY_SPACE) == GLFW_PRESS)
+        if (m_input.Down(Action::Brake))
             ship->Brake(); // brake to halt
     }
 
-    bool tabPressed = glfwGetKey(win, GLFW_KEY_TAB) == GLFW_PRESS;
-
-    if (glfwGetKey(win, GLFW_KEY_TAB) == GLFW_PRESS) {
-        if (tabPressed && !tabPressedLastFrame) {
-            tabPressedLastFrame = true;
+    if (m_input.Pressed(Action::ToggleMode)) {
+        if (currentMode == GameMode::Exploration) {
+            currentMode = GameMode::Observation;
+            std::cout << "Switched to Observation Mode\n";
+            cachedCamPos = cam->cameraPos;
+            cachedCamFront = cam->cameraFront;
+            cachedCamUp = cam->cameraUp;
 
-            if (currentMode == GameMode::Exploration) {
-                currentMode = GameMode::Observation;
-                std::cout << "Switched to Observation Mode\n";
-                cachedCamPos = cam->cameraPos;
-                cachedCamFront = cam->cameraFront;
-                cachedCamUp = cam->cameraUp;
+            // Find closest planet to ship
+            glm::mat4 shipModel = m_graphics->GetStarshipModelMatrix();
+            glm::vec3 shipPos = glm::vec3(shipModel[3]);
 
-                // Find closest planet to ship
-                glm::mat4 shipModel = m_graphics->GetStarshipModelMatrix();
-                glm::vec3 shipPos = glm::vec3(shipModel[3]);
+            // Find and store index of closest planet
+            observedPlanetIndex = m_graphics->GetClosestPlanetIndex(shipPos);
 
-                // Find and store index of closest planet
-                float minDist = std::numeric_limits<float>::max();
-                for (int i = 0; i < planetSpheres.size(); ++i) {
-                    glm::vec3 planetPos = glm::vec3(planetSpheres[i]->GetModel()[3]);
-                    float dist = glm::distance(shipPos, planetPos);
-                    if (dist < minDist) {
-                        minDist = dist;
-                        observedPlanetIndex = i;
-                    }
-                }
+            orbitDistance = 5.0f; // or scale based on planet
 
-                orbitDistance = 5.0f; // or scale based on planet
+            // Place camera in front of ship, looking at closest planet
+            glm::vec3 forward = glm::normalize(glm::vec3(shipModel[2]));
+            glm::vec3 cameraPos = shipPos + forward * 2.5f;
 
-                // Place camera in front of ship, looking at closest planet
-                glm::vec3 forward = glm::normalize(glm::vec3(shipModel[2]));
-                glm::vec3 cameraPos = shipPos + forward * 2.5f;
+            cam->SetPosition(cameraPos);
+            cam->FaceDirection(orbitTarget);
 
-                cam->SetPosition(cameraPos);
-                cam->FaceDirection(orbitTarget);
 
 
 
+            m_inputSystem.ResetCursor();
 
-                firstMouse = true;
-
-            }
-            else {
-                currentMode = GameMode::Exploration;
-                std::cout << "Switched to Exploration Mode\n";
+        }
+        else {
+            currentMode = GameMode::Exploration;
+            std::cout << "Switched to Exploration Mode\n";
 
 
-                Camera* cam = m_graphics->getCamera();
-                cam->SetPosition(cachedCamPos);
-                cam->cameraFront = cachedCamFront;
-                cam->cameraUp = cachedCamUp;
-                cam->UpdateView();
+            Camera* cam = m_graphics->getCamera();
+            cam->SetPosition(cachedCamPos);
+            cam->cameraFront = cachedCamFront;
+            cam->cameraUp = cachedCamUp;
+            cam->UpdateView();
 
-                firstMouse = true;
-            }
+            m_inputSystem.ResetCursor();
         }
     }
-    if (!tabPressed) {
-        tabPressedLastFrame = false;
-    }
 
 
 
@@ -193,20 +440,33 @@ void Engine::ProcessInput()
 unsigned int Engine::getDT()
 {
     
-    return glfwGetTime();
+    return m_window->GetTime();
 }
 
 long long Engine::GetCurrentTimeMillis()
 {
     
-    return (long long)glfwGetTime();
+    return (long long)m_window->GetTime();
 }
 
 void Engine::Display(GLFWwindow* window, double time) {
 
     m_graphics->SetGameMode(currentMode);
-    m_graphics->Render();
-    m_window->Swap();
+    if (!m_skipRender)
+    {
+        if (m_bench != NULL)
+            m_bench->BeginGpu();
+        m_graphics->Render();
+        if (m_bench != NULL)
+            m_bench->EndGpu();
+        // --screenshot saves the last frame, so keep each one until the next
+        if (m_options.screenshot != NULL)
+            m_window->CaptureFrame();
+        PROFILE_SCOPE("Swap");
+        double swapStart = m_window->GetTime();
+        m_window->Swap();
+        m_swapSeconds = m_window->GetTime() - swapStart;
+    }
     m_graphics->HierarchicalUpdate2(deltaTime);
 
     if (currentMode == GameMode::Exploration) {
@@ -243,34 +503,107 @@ void Engine::Display(GLFWwindow* window, double time) {
     }
 }
 
+void Engine::ApplyFlightSample(const FlightSample& sample)
+{
+    currentMode = sample.mode;
+
+    // The ship keeps its scale; Display puts the chase camera behind it
+    Mesh* ship = m_graphics->getMesh();
+    float scale = glm::length(glm::vec3(ship->GetModel()[0]));
+    glm::vec3 forward = sample.shipForward;
+    glm::vec3 right = glm::cross(glm::vec3(0.0f, 1.0f, 0.0f), forward);
+    right = glm::length(right) > 1e-4f ? glm::normalize(right) : glm::vec3(1.0f, 0.0f, 0.0f);
+    glm::vec3 up = glm::cross(forward, right);
+
+    glm::mat4 model(1.0f);
+    model[0] = glm::vec4(right * scale, 0.0f);
+    model[1] = glm::vec4(up * scale, 0.0f);
+    model[2] = glm::vec4(forward * scale, 0.0f);
+    model[3] = glm::vec4(sample.shipPosition, 1.0f);
+    ship->Update(model);
+
+    if (sample.mode == GameMode::Observation)
+    {
+        observedPlanetIndex = m_graphics->GetPlanetIndex(sample.planet);
+        orbitDistance = sample.orbitDistance;
+        orbitYaw = sample.orbitYaw;
+        orbitPitch = sample.orbitPitch;
+    }
+}
+
 void Engine::cursor_position_callback(GLFWwindow* window, double xpos, double ypos)
 {
     Engine* engine = static_cast<Engine*>(glfwGetWindowUserPointer(window));
-    Camera* cam = engine->m_graphics->getCamera();
+    engine->m_inputSystem.OnCursor(xpos, ypos);
+}
+
+void Engine::scroll_callback(GLFWwindow* window, double /*xoffset*/, double yoffset)
+{
+    Engine* engine = static_cast<Engine*>(glfwGetWindowUserPointer(window));
+    engine->m_inputSystem.OnScroll(yoffset);
+}
 
-    if (engine->firstMouse)
+void Engine::key_callback(GLFWwindow* window, int key, int /*scancode*/, int action, int /*mods*/)
+{
+    Engine* engine = static_cast<Engine*>(glfwGetWindowUserPointer(window));
+    engine->m_inputSystem.OnKey(key, action);
+}
+
+void Engine::mouse_button_callback(GLFWwindow* window, int button, int action, int /*mods*/)
+{
+    Engine* engine = static_cast<Engine*>(glfwGetWindowUserPointer(window));
+    engine->m_inputSystem.OnMouseButton(button, action);
+}
+
+void Engine::focus_callback(GLFWwindow* window, int focused)
+{
+    Engine* engine = static_cast<Engine*>(glfwGetWindowUserPointer(window));
+    if (!focused)
+        engine->m_inputSystem.ReleaseAll();
+}
+
+bool Engine::BeginInputFrame()
+{
+    if (m_replay != NULL)
     {
-        engine->lastX = xpos;
-        engine->lastY = ypos;
-        engine->firstMouse = false;
-        return;
+        if (!m_replay->ReadFrame(m_input))
+            return false;
+        return true;
     }
 
-    float xoffset = xpos - engine->lastX;
-    float yoffset = engine->lastY - ypos; // reversed: y-coordinates go from bottom to top
+    float currentFrame = m_window->GetTime();
+    m_input.dt = currentFrame - lastFrame;
+    lastFrame = currentFrame;
 
-    engine->lastX = xpos;
-    engine->lastY = ypos;
-    if (engine->currentMode == GameMode::Observation) {
-        engine->orbitYaw += xoffset * 0.2f;
-        engine->orbitPitch -= yoffset * 0.2f;
+    // Everything the callbacks gathered during the last poll
+    m_inputSystem.Snapshot(m_input);
+    return true;
+}
 
-        // Clamp pitch to avoid flipping
-        if (engine->orbitPitch > 89.0f) engine->orbitPitch = 89.0f;
-        if (engine->orbitPitch < -89.0f) engine->orbitPitch = -89.0f;
-    }
+// Runs the callbacks. While replaying they still feed the input system, so
+// Quit works, but the frames come from the log.
+void Engine::PollInput()
+{
+    if (m_window->getWindow() != NULL)
+        glfwPollEvents();
+}
 
-    else if (glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS) {
-        cam->ProcessMouseMovement(xoffset, yoffset);  // Only rotate while dragging
+void Engine::EndInputFrame()
+{
+    uint8_t mode = (uint8_t)currentMode;
+    if (m_replay != NULL)
+    {
+        if (mode != m_input.mode && !m_replayDiverged)
+        {
+            printf("Replay diverged at frame %d: game mode %d, recorded %d\n",
+                m_replay->GetPosition() - 1, (int)mode, (int)m_input.mode);
+            m_replayDiverged = true;
+        }
+        return;
     }
+
+    m_input.modeChanged = mode != m_input.mode;
+    m_input.mode = mode;
+    if (m_recorder != NULL)
+        m_recorder->WriteFrame(m_input);
 }
@@ -6,13 +6,18 @@
 #include "window.h"
 #include "graphics.h"
 #include "gamemode.h"
+#include "options.h"
+#include "benchmark.h"
+#include "input.h"
+#include "input_record.h"
+#include "framepacer.h"
 
 
 
 class Engine
 {
 public:
-    Engine(const char* name, int width, int height);
+    Engine(const char* name, int width, int height, const LaunchOptions& options = LaunchOptions());
 
     ~Engine();
     bool Initialize();
@@ -22,12 +27,15 @@ public:
     long long GetCurrentTimeMillis();
     void Display(GLFWwindow*, double);
     static void cursor_position_callback(GLFWwindow* window, double xpos, double ypos);
+    static void scroll_callback(GLFWwindow* window, double xoffset, double yoffset);
+    static void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods);
+    static void mouse_button_callback(GLFWwindow* window, int button, int action, int mods);
+    static void focus_callback(GLFWwindow* window, int focused);
     Camera* getCamera() { return m_graphics->getCamera(); }
 
     glm::vec3 cachedCamPos;
     glm::vec3 cachedCamFront;
     glm::vec3 cachedCamUp;
-    bool tabPressedLastFrame = false;
 
     GameMode currentMode = GameMode::Exploration;
     float orbitYaw = 90.0f;    // horizontal angle
@@ -45,9 +53,7 @@ private:
     int m_WINDOW_WIDTH;
     int m_WINDOW_HEIGHT;
     bool m_FULLSCREEN;
-
-    double lastX = 400, lastY = 300;
-    bool firstMouse = true;
+    LaunchOptions m_options;
 
     float deltaTime = 0.0f;
     float lastFrame = 0.0f;
@@ -58,6 +64,27 @@ private:
     Graphics* m_graphics;
 
     bool m_running;
+
+    // --bench: the script replaces keyboard and mouse input
+    void ApplyFlightSample(const FlightSample& sample);
+    FlightScript* m_flight = NULL;
+    FrameBenchmark* m_bench = NULL;
+    float m_flightTime = 0.0f;
+    double m_swapSeconds = 0.0;
+
+    FramePacer m_pacer;
+
+    // The callbacks feed m_inputSystem; each frame's actions and axes land in
+    // m_input, which --record logs and --replay fills from the log instead
+    bool BeginInputFrame();
+    void PollInput();
+    void EndInputFrame();
+    InputSystem m_inputSystem;
+    InputFrame m_input;
+    InputRecorder* m_recorder = NULL;
+    InputReplay* m_replay = NULL;
+    bool m_skipRender = false;      // fast-forwarding to --replay-from
+    bool m_replayDiverged = false;
 };
 
 #endif // ENGINE_H
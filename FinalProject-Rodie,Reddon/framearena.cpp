@@ -0,0 +1,90 @@
+#include "framearena.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+
+// Enough for every frame today; Reset grows it if a frame needs more
+static const size_t kDefaultCapacity = 256 * 1024;
+
+FrameArena& FrameArena::Get()
+{
+    static FrameArena arena;
+    return arena;
+}
+
+FrameArena::FrameArena()
+{
+    m_block = NULL;
+    m_capacity = 0;
+    m_used = 0;
+    m_frameBytes = 0;
+    m_frames = 0;
+    m_grows = 0;
+    m_peakBytes = 0;
+    Reserve(kDefaultCapacity);
+}
+
+FrameArena::~FrameArena()
+{
+    for (char* block : m_overflow)
+        delete[] block;
+    delete[] m_block;
+}
+
+void FrameArena::Reserve(size_t bytes)
+{
+    for (char* block : m_overflow)
+        delete[] block;
+    m_overflow.clear();
+    delete[] m_block;
+    m_block = new char[bytes];
+    m_capacity = bytes;
+    m_used = 0;
+    m_frameBytes = 0;
+}
+
+void FrameArena::Reset()
+{
+    m_frames++;
+    m_peakBytes = std::max(m_peakBytes, m_frameBytes);
+    if (!m_overflow.empty())
+    {
+        // Room for the whole of that frame in the one block, with some over
+        m_grows++;
+        Reserve(std::max(m_capacity * 2, m_frameBytes + m_frameBytes / 2));
+        return;
+    }
+    m_used = 0;
+    m_frameBytes = 0;
+}
+
+void* FrameArena::Allocate(size_t bytes, size_t align)
+{
+    uintptr_t base = (uintptr_t)m_block;
+    size_t start = (size_t)(((base + m_used + align - 1) & ~(uintptr_t)(align - 1)) - base);
+    if (start + bytes <= m_capacity)
+    {
+        m_frameBytes += start + bytes - m_used;
+        m_used = start + bytes;
+        return m_block + start;
+    }
+
+    // Out of block: this allocation gets one of its own until the Reset.
+    // new[] is aligned for anything that needs no more than max_align_t.
+    // Not exempt: a frame that gets here after the warm-up is reported.
+    char* block = new char[bytes + align];
+    m_overflow.push_back(block);
+    m_frameBytes += bytes + align;
+    uintptr_t aligned = ((uintptr_t)block + align - 1) & ~(uintptr_t)(align - 1);
+    return (void*)aligned;
+}
+
+void FrameArena::PrintSummary() const
+{
+    if (m_frames == 0)
+        return;
+    printf("Frame arena: %.0f KB, peak %.1f KB in a frame, grew %d time%s over %d frames\n",
+        m_capacity / 1024.0, std::max(m_peakBytes, m_frameBytes) / 1024.0, m_grows,
+        m_grows == 1 ? "" : "s", m_frames);
+}
@@ -0,0 +1,76 @@
+#ifndef FRAMEARENA_H
+#define FRAMEARENA_H
+
+#include <cstddef>
+#include <vector>
+
+// Scratch memory for one frame. Allocating bumps a pointer through one
+// block; nothing is freed on its own, Reset at the start of each frame
+// takes everything back at once. Anything allocated from it, and any
+// FrameVector, must be gone by the next Reset.
+//
+// A frame that needs more than the block gets extra blocks from the heap,
+// and the next Reset replaces the block with one big enough for that
+// frame, so once the frames settle down nothing reaches the heap.
+//
+// Main thread only.
+class FrameArena
+{
+public:
+    static FrameArena& Get();
+
+    // Replaces the block; only between frames
+    void Reserve(size_t bytes);
+    void Reset();
+    void* Allocate(size_t bytes, size_t align);
+
+    size_t GetCapacity() const { return m_capacity; }
+    size_t GetPeakBytes() const { return m_peakBytes; }
+
+    void PrintSummary() const;
+
+private:
+    FrameArena();
+    ~FrameArena();
+
+    char* m_block;
+    size_t m_capacity;
+    size_t m_used;
+    std::vector<char*> m_overflow;  // this frame's extra blocks
+    size_t m_frameBytes;            // asked for this frame, with padding
+
+    // Statistics
+    int m_frames;
+    int m_grows;
+    size_t m_peakBytes;
+};
+
+// STL allocator over FrameArena. Deallocate does nothing, so a growing
+// container leaves its old storage behind until the Reset; reserve what is
+// known up front.
+template <class T>
+class FrameAllocator
+{
+public:
+    typedef T value_type;
+
+    FrameAllocator() {}
+    template <class U>
+    FrameAllocator(const FrameAllocator<U>&) {}
+
+    T* allocate(size_t count)
+    {
+        return (T*)FrameArena::Get().Allocate(count * sizeof(T), alignof(T));
+    }
+    void deallocate(T*, size_t) {}
+
+    template <class U>
+    bool operator==(const FrameAllocator<U>&) const { return true; }
+    template <class U>
+    bool operator!=(const FrameAllocator<U>&) const { return false; }
+};
+
+template <class T>
+using FrameVector = std::vector<T, FrameAllocator<T>>;
+
+#endif /* FRAMEARENA_H */
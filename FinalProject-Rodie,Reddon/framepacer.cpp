@@ -0,0 +1,201 @@
+#include "framepacer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <thread>
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <timeapi.h>
+#if defined(_MSC_VER)
+#pragma comment(lib, "winmm.lib")
+#endif
+#endif
+
+// Sleep is trusted to within this much at first; the pacer then learns how
+// late the scheduler actually wakes it
+static const double kInitialSpinSeconds = 0.002;
+static const double kMaxSpinSeconds = 0.004;
+
+FramePacer::FramePacer()
+{
+    m_window = NULL;
+    m_mode = PresentMode::VSync;
+    m_targetFps = 60.0;
+    m_budgetMs = 0.0;
+    m_epoch = Clock::now();
+    m_lastFrame = -1.0;
+    m_deadline = 0.0;
+    m_spinSeconds = kInitialSpinSeconds;
+    m_wasThrottled = false;
+    m_frames = 0;
+    m_overBudget = 0;
+    m_throttled = 0;
+    m_meanMs = 0.0;
+    m_m2 = 0.0;
+    m_minMs = 0.0;
+    m_maxMs = 0.0;
+    m_timerPeriodSet = false;
+}
+
+FramePacer::~FramePacer()
+{
+#if defined(_WIN32)
+    if (m_timerPeriodSet)
+        timeEndPeriod(1);
+#endif
+}
+
+void FramePacer::Initialize(Window* window, PresentMode mode, double targetFps)
+{
+    m_window = window;
+    m_mode = mode;
+    m_targetFps = targetFps;
+
+#if defined(_WIN32)
+    // Default timer resolution is ~15.6 ms, far too coarse to sleep by
+    m_timerPeriodSet = timeBeginPeriod(1) == TIMERR_NOERROR;
+#endif
+
+    GLFWwindow* win = window->getWindow();
+    if (win == NULL)
+    {
+        // Headless: nothing to sync to
+        if (m_mode == PresentMode::VSync || m_mode == PresentMode::Adaptive)
+            m_mode = PresentMode::Uncapped;
+    }
+    else
+    {
+        if (m_mode == PresentMode::Adaptive &&
+            !glfwExtensionSupported("WGL_EXT_swap_control_tear") &&
+            !glfwExtensionSupported("GLX_EXT_swap_control_tear"))
+        {
+            printf("Adaptive vsync isn't supported here, using vsync\n");
+            m_mode = PresentMode::VSync;
+        }
+
+        int interval = 0;
+        if (m_mode == PresentMode::VSync)
+            interval = 1;
+        else if (m_mode == PresentMode::Adaptive)
+            interval = -1;
+        glfwSwapInterval(interval);
+    }
+
+    m_budgetMs = 0.0;
+    if (m_mode == PresentMode::Limit)
+        m_budgetMs = 1000.0 / m_targetFps;
+    else if (m_mode != PresentMode::Uncapped)
+    {
+        const GLFWvidmode* video = glfwGetVideoMode(glfwGetPrimaryMonitor());
+        if (video != NULL && video->refreshRate > 0)
+            m_budgetMs = 1000.0 / video->refreshRate;
+    }
+}
+
+double FramePacer::Now() const
+{
+    return std::chrono::duration<double>(Clock::now() - m_epoch).count();
+}
+
+void FramePacer::Pace()
+{
+    double fps = m_mode == PresentMode::Limit ? m_targetFps : 0.0;
+
+    bool throttled = false;
+    GLFWwindow* win = m_window != NULL ? m_window->getWindow() : NULL;
+    if (win != NULL)
+    {
+        if (glfwGetWindowAttrib(win, GLFW_ICONIFIED))
+        {
+            fps = kIconifiedFps;
+            throttled = true;
+        }
+        else if (!glfwGetWindowAttrib(win, GLFW_FOCUSED) && (fps == 0.0 || fps > kUnfocusedFps))
+        {
+            fps = kUnfocusedFps;
+            throttled = true;
+        }
+    }
+
+    double now = Now();
+    if (fps > 0.0)
+    {
+        double period = 1.0 / fps;
+        // Schedule against the previous deadline so rounding doesn't drift,
+        // but don't try to catch up after a long frame
+        m_deadline += period;
+        if (m_deadline < now || m_lastFrame < 0.0)
+            m_deadline = now;
+        WaitUntil(m_deadline);
+        now = Now();
+    }
+    else
+        m_deadline = now;
+
+    if (m_lastFrame >= 0.0)
+    {
+        if (throttled || m_wasThrottled)
+            m_throttled++;
+        else
+            AddSample((now - m_lastFrame) * 1000.0);
+    }
+    m_lastFrame = now;
+    m_wasThrottled = throttled;
+}
+
+void FramePacer::WaitUntil(double deadline)
+{
+    double remaining = deadline - Now();
+    if (remaining > m_spinSeconds)
+    {
+        double sleepFor = remaining - m_spinSeconds;
+        double before = Now();
+        std::this_thread::sleep_for(std::chrono::duration<double>(sleepFor));
+        double oversleep = (Now() - before) - sleepFor;
+
+        // Spin for the worst recent oversleep, slowly forgetting old spikes
+        m_spinSeconds = std::max(m_spinSeconds * 0.99, oversleep * 1.25);
+        m_spinSeconds = std::min(std::max(m_spinSeconds, 0.0002), kMaxSpinSeconds);
+    }
+
+    while (Now() < deadline)
+        std::this_thread::yield();
+}
+
+void FramePacer::AddSample(double ms)
+{
+    m_frames++;
+    double delta = ms - m_meanMs;
+    m_meanMs += delta / m_frames;
+    m_m2 += delta * (ms - m_meanMs);
+    if (m_frames == 1 || ms < m_minMs)
+        m_minMs = ms;
+    if (m_frames == 1 || ms > m_maxMs)
+        m_maxMs = ms;
+    // Half a frame late is a visible hitch
+    if (m_budgetMs > 0.0 && ms > m_budgetMs * 1.5)
+        m_overBudget++;
+}
+
+double FramePacer::GetStdDevMs() const
+{
+    return m_frames > 1 ? sqrt(m_m2 / (m_frames - 1)) : 0.0;
+}
+
+void FramePacer::PrintSummary() const
+{
+    if (m_frames == 0)
+        return;
+    printf("Frame pacing (%s", PresentModeName(m_mode));
+    if (m_mode == PresentMode::Limit)
+        printf(" %.0f fps", m_targetFps);
+    printf("): %d frames, mean %.3f ms, std dev %.3f ms, min %.3f ms, max %.3f ms",
+        m_frames, m_meanMs, GetStdDevMs(), m_minMs, m_maxMs);
+    if (m_budgetMs > 0.0)
+        printf(", %d over %.2f ms budget", m_overBudget, m_budgetMs * 1.5);
+    if (m_throttled > 0)
+        printf(", %d throttled in the background", m_throttled);
+    printf("\n");
+}
@@ -0,0 +1,58 @@
+#ifndef FRAMEPACER_H
+#define FRAMEPACER_H
+
+#include <chrono>
+#include "window.h"
+#include "presentmode.h"
+
+// Frame pacing for Engine::Run. Pace() is called once at the top of every
+// frame: it waits until the frame is due and records how long the previous
+// one took. While the window is minimized or in the background the frame
+// rate is capped regardless of mode, so an idle game doesn't burn a core.
+class FramePacer
+{
+public:
+    FramePacer();
+    ~FramePacer();
+
+    void Initialize(Window* window, PresentMode mode, double targetFps);
+    void Pace();
+
+    // Interval statistics over the frames that weren't throttled
+    int GetFrameCount() const { return m_frames; }
+    double GetMeanMs() const { return m_meanMs; }
+    double GetStdDevMs() const;
+    void PrintSummary() const;
+
+    static constexpr double kUnfocusedFps = 30.0;
+    static constexpr double kIconifiedFps = 10.0;
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    double Now() const;
+    void WaitUntil(double deadline);
+    void AddSample(double ms);
+
+    Window* m_window;
+    PresentMode m_mode;
+    double m_targetFps;     // Limit only
+    double m_budgetMs;      // expected frame time, 0 when uncapped
+    Clock::time_point m_epoch;
+
+    double m_lastFrame;     // when the previous Pace() returned
+    double m_deadline;      // when the next frame is due
+    double m_spinSeconds;   // how much of a wait to spin rather than sleep
+    bool m_wasThrottled;
+
+    int m_frames;
+    int m_overBudget;
+    int m_throttled;
+    double m_meanMs;
+    double m_m2;            // Welford sum of squared differences
+    double m_minMs;
+    double m_maxMs;
+    bool m_timerPeriodSet;
+};
+
+#endif /* FRAMEPACER_H */
@@ -0,0 +1,44 @@
+#include "gpuqueryring.h"
+
+GpuQueryRing::GpuQueryRing(int queriesPerSet)
+{
+    m_perSet = queriesPerSet;
+    for (int i = 0; i < kSets; i++)
+        m_count[i] = 0;
+    // The first Advance starts at set 0
+    m_set = kSets - 1;
+}
+
+GpuQueryRing::~GpuQueryRing()
+{
+    Release();
+}
+
+void GpuQueryRing::Release()
+{
+    if (!m_queries.empty())
+        glDeleteQueries((GLsizei)m_queries.size(), m_queries.data());
+    m_queries.clear();
+    for (int i = 0; i < kSets; i++)
+        m_count[i] = 0;
+}
+
+GLuint GpuQueryRing::Add()
+{
+    if (m_queries.empty())
+    {
+        m_queries.resize((size_t)kSets * m_perSet);
+        glGenQueries((GLsizei)m_queries.size(), m_queries.data());
+    }
+    int& count = m_count[m_set];
+    if (count >= m_perSet)
+        return 0;
+    return GetQuery(m_set, count++);
+}
+
+bool GpuQueryRing::IsReady(int set) const
+{
+    GLint available = 0;
+    glGetQueryObjectiv(GetQuery(set, m_count[set] - 1), GL_QUERY_RESULT_AVAILABLE, &available);
+    return available != 0;
+}
@@ -0,0 +1,91 @@
+#ifndef GPUQUERYRING_H
+#define GPUQUERYRING_H
+
+#include <vector>
+#include "graphics_headers.h"
+
+// GL queries for reading GPU timings back without stalling. Each frame
+// issues its queries from the next of a ring of sets; a set is read a few
+// frames later, once its results are there, and only given up when the
+// ring comes round to it again still unread.
+//
+// Queries finish in the order they were issued, so the last one in a set
+// says whether the whole set is ready, and sets are read oldest first,
+// stopping at the first that isn't. What the owner keeps about each query
+// (a name, a scale, whether it counts) is indexed by GetSet and the
+// query's place in the set, and handed back through the read callback:
+//
+//     ring.Resolve(false, [&](int set, int count) { ... GetQuery(set, i) ... });
+class GpuQueryRing
+{
+public:
+    static const int kSets = 4;             // deep enough for deferred drivers
+
+    explicit GpuQueryRing(int queriesPerSet);
+    // Releases the queries, so the context must still be current
+    ~GpuQueryRing();
+
+    // Moves on to the next set. What it still holds is read if it has
+    // come back; otherwise it is lost, and the count of its queries is
+    // returned (0 when nothing was lost).
+    template <class Read>
+    int Advance(Read read);
+
+    // The next query of the current set, counted as issued from now on; 0
+    // once the set is full. Needs a current context.
+    GLuint Add();
+
+    int GetSet() const { return m_set; }
+    int GetCount(int set) const { return m_count[set]; }
+    GLuint GetQuery(int set, int index) const { return m_queries[set * m_perSet + index]; }
+
+    // Reads every set that is ready, oldest first; wait reads them all,
+    // blocking until they are done
+    template <class Read>
+    void Resolve(bool wait, Read read);
+
+    // Deletes the queries, unread results and all; for an owner that
+    // outlives the context. Add makes them again if needed.
+    void Release();
+
+private:
+    bool IsReady(int set) const;
+
+    int m_perSet;
+    std::vector<GLuint> m_queries;          // [set * m_perSet + index], empty until first used
+    int m_count[kSets];                     // issued and not yet read
+    int m_set;
+};
+
+template <class Read>
+int GpuQueryRing::Advance(Read read)
+{
+    m_set = (m_set + 1) % kSets;
+    int count = m_count[m_set];
+    if (count == 0)
+        return 0;
+    bool ready = IsReady(m_set);
+    m_count[m_set] = 0;
+    if (!ready)
+        return count;
+    read(m_set, count);
+    return 0;
+}
+
+template <class Read>
+void GpuQueryRing::Resolve(bool wait, Read read)
+{
+    for (int i = 1; i <= kSets; i++)
+    {
+        int set = (m_set + i) % kSets;
+        int count = m_count[set];
+        if (count == 0)
+            continue;
+        if (!wait && !IsReady(set))
+            break;
+        m_count[set] = 0;
+        read(set, count);
+    }
+}
+
+#endif /* GPUQUERYRING_H */
@@ -0,0 +1,223 @@
+#include "gpuresources.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+// Warn above this much of the budget, and again after falling below the second
+static const float kWarnPressure = 0.9f;
+static const float kRearmPressure = 0.8f;
+
+GpuResources& GpuResources::Get()
+{
+    static GpuResources resources;
+    return resources;
+}
+
+GpuResources::GpuResources()
+{
+    m_bytes = 0;
+    m_peakBytes = 0;
+    m_budget = 0;
+    m_overBudget = false;
+}
+
+GLuint GpuResources::Create(GpuResourceType type, const char* label)
+{
+    GLuint id = 0;
+    switch (type)
+    {
+    case GpuResourceType::Buffer: glGenBuffers(1, &id); break;
+    case GpuResourceType::Texture: glGenTextures(1, &id); break;
+    case GpuResourceType::VertexArray: glGenVertexArrays(1, &id); break;
+    case GpuResourceType::Program: id = glCreateProgram(); break;
+    case GpuResourceType::Framebuffer: glGenFramebuffers(1, &id); break;
+    case GpuResourceType::Renderbuffer: glGenRenderbuffers(1, &id); break;
+    default: break;
+    }
+    if (id == 0)
+    {
+        printf("Failed to create a GL %s for %s\n", TypeName(type), label);
+        return 0;
+    }
+
+    Record record = { label, 0 };
+    m_live[(int)type][id] = record;
+    m_totals[(int)type].live++;
+    m_totals[(int)type].created++;
+    return id;
+}
+
+void GpuResources::Destroy(GpuResourceType type, GLuint id)
+{
+    switch (type)
+    {
+    case GpuResourceType::Buffer: glDeleteBuffers(1, &id); break;
+    case GpuResourceType::Texture: glDeleteTextures(1, &id); break;
+    case GpuResourceType::VertexArray: glDeleteVertexArrays(1, &id); break;
+    case GpuResourceType::Program: glDeleteProgram(id); break;
+    case GpuResourceType::Framebuffer: glDeleteFramebuffers(1, &id); break;
+    case GpuResourceType::Renderbuffer: glDeleteRenderbuffers(1, &id); break;
+    default: break;
+    }
+
+    auto it = m_live[(int)type].find(id);
+    if (it == m_live[(int)type].end())
+        return;
+    m_totals[(int)type].live--;
+    m_totals[(int)type].bytes -= it->second.bytes;
+    m_bytes -= it->second.bytes;
+    m_live[(int)type].erase(it);
+    if (m_overBudget && GetPressure() < kRearmPressure)
+        m_overBudget = false;
+}
+
+void GpuResources::SetBytes(GpuResourceType type, GLuint id, size_t bytes)
+{
+    auto it = m_live[(int)type].find(id);
+    if (it == m_live[(int)type].end())
+        return;
+    m_totals[(int)type].bytes += bytes - it->second.bytes;
+    m_bytes += bytes - it->second.bytes;
+    it->second.bytes = bytes;
+    m_peakBytes = std::max(m_peakBytes, m_bytes);
+    CheckBudget();
+}
+
+void GpuResources::SetBudget(size_t bytes)
+{
+    m_budget = bytes;
+    m_overBudget = false;
+    CheckBudget();
+}
+
+void GpuResources::SetBudgetFromDriver()
+{
+    GLint kb = 0;
+    if (GLEW_NVX_gpu_memory_info)
+        glGetIntegerv(GL_GPU_MEMORY_INFO_DEDICATED_VIDMEM_NVX, &kb);
+    SetBudget((size_t)std::max(kb, 0) * 1024);
+}
+
+float GpuResources::GetPressure() const
+{
+    return m_budget > 0 ? (float)((double)m_bytes / m_budget) : 0.0f;
+}
+
+bool GpuResources::QueryDriverFree(size_t& freeBytes) const
+{
+    // Both report kilobytes; ATI's first value is the total free in the pool
+    GLint kb[4] = { 0, 0, 0, 0 };
+    if (GLEW_NVX_gpu_memory_info)
+        glGetIntegerv(GL_GPU_MEMORY_INFO_CURRENT_AVAILABLE_VIDMEM_NVX, kb);
+    else if (GLEW_ATI_meminfo)
+        glGetIntegerv(GL_TEXTURE_FREE_MEMORY_ATI, kb);
+    else
+        return false;
+    freeBytes = (size_t)std::max(kb[0], 0) * 1024;
+    return true;
+}
+
+void GpuResources::CheckBudget()
+{
+    if (m_budget == 0 || m_overBudget || GetPressure() < kWarnPressure)
+        return;
+    m_overBudget = true;
+    printf("GPU memory: %.1f MB tracked, %.0f%% of the %.1f MB budget\n",
+        m_bytes / 1048576.0, GetPressure() * 100.0f, m_budget / 1048576.0);
+}
+
+void GpuResources::PrintSummary() const
+{
+    printf("GPU resources: %.1f MB tracked (peak %.1f MB)", m_bytes / 1048576.0, m_peakBytes / 1048576.0);
+    if (m_budget > 0)
+        printf(", %.0f%% of a %.1f MB budget", GetPressure() * 100.0f, m_budget / 1048576.0);
+    size_t freeBytes = 0;
+    if (QueryDriverFree(freeBytes))
+        printf(", %.1f MB free on the device", freeBytes / 1048576.0);
+    printf("\n");
+    for (int t = 0; t < kTypes; t++)
+    {
+        if (m_totals[t].created == 0)
+            continue;
+        printf("  %-13s %5d live of %5d created, %8.1f MB\n", TypeName((GpuResourceType)t),
+            m_totals[t].live, m_totals[t].created, m_totals[t].bytes / 1048576.0);
+    }
+}
+
+int GpuResources::ReportLeaks() const
+{
+    struct Leak
+    {
+        GpuResourceType type;
+        const char* label;
+        int count;
+        size_t bytes;
+    };
+    std::vector<Leak> leaks;
+    int total = 0;
+    for (int t = 0; t < kTypes; t++)
+    {
+        for (const auto& live : m_live[t])
+        {
+            auto it = std::find_if(leaks.begin(), leaks.end(), [&](const Leak& l) {
+                return (int)l.type == t && strcmp(l.label, live.second.label) == 0;
+                });
+            if (it == leaks.end())
+                leaks.push_back({ (GpuResourceType)t, live.second.label, 1, live.second.bytes });
+            else
+            {
+                it->count++;
+                it->bytes += live.second.bytes;
+            }
+            total++;
+        }
+    }
+    if (total == 0)
+        return 0;
+
+    printf("GPU resources leaked: %d object%s, %.1f MB\n", total, total == 1 ? "" : "s", m_bytes / 1048576.0);
+    for (const Leak& leak : leaks)
+        printf("  %-13s %5d x %-28s %8.1f MB\n", TypeName(leak.type), leak.count, leak.label, leak.bytes / 1048576.0);
+    return total;
+}
+
+size_t GpuResources::TextureBytes(GLenum internalFormat, int width, int height, int layers, bool mipmapped)
+{
+    size_t texel;
+    switch (internalFormat)
+    {
+    case GL_R8: texel = 1; break;
+    case GL_RG8: case GL_R16F: texel = 2; break;
+    case GL_RGBA16F: case GL_RG32F: texel = 8; break;
+    case GL_RGBA32F: texel = 16; break;
+    // RGB8 is padded to four bytes by every driver that matters
+    default: texel = 4; break;
+    }
+
+    size_t bytes = 0;
+    for (;;)
+    {
+        bytes += (size_t)width * height * layers * texel;
+        if (!mipmapped || (width == 1 && height == 1))
+            break;
+        width = std::max(width / 2, 1);
+        height = std::max(height / 2, 1);
+    }
+    return bytes;
+}
+
+const char* GpuResources::TypeName(GpuResourceType type)
+{
+    switch (type)
+    {
+    case GpuResourceType::Buffer: return "buffer";
+    case GpuResourceType::Texture: return "texture";
+    case GpuResourceType::VertexArray: return "vertex array";
+    case GpuResourceType::Program: return "program";
+    case GpuResourceType::Framebuffer: return "framebuffer";
+    case GpuResourceType::Renderbuffer: return "renderbuffer";
+    default: return "?";
+    }
+}
@@ -0,0 +1,140 @@
+#ifndef GPURESOURCES_H
+#define GPURESOURCES_H
+
+#include <unordered_map>
+#include "graphics_headers.h"
+
+enum class GpuResourceType { Buffer, Texture, VertexArray, Program, Framebuffer, Renderbuffer, Count };
+
+// Every GL buffer, texture, vertex array, program and framebuffer is made
+// and deleted here, through the GpuHandle types below, so it knows what is
+// alive: a count and an estimate of the bytes behind each type, and the
+// label each object was made with. What is still alive at shutdown is a
+// leak and is listed by ReportLeaks.
+//
+// Byte counts are what the owner says it allocated (GpuHandle::SetBytes),
+// not what the driver reports, so they leave out padding and the driver's
+// own copies. Against a budget they show pressure building before the
+// driver starts paging textures out; the budget defaults to the dedicated
+// memory the driver reports (NVX_gpu_memory_info), if it does.
+//
+// Labels must be string literals (only the pointer is kept).
+class GpuResources
+{
+public:
+    static GpuResources& Get();
+
+    // Needs a current GL context
+    GLuint Create(GpuResourceType type, const char* label);
+    void Destroy(GpuResourceType type, GLuint id);
+    void SetBytes(GpuResourceType type, GLuint id, size_t bytes);
+
+    int GetLiveCount(GpuResourceType type) const { return m_totals[(int)type].live; }
+    size_t GetBytes(GpuResourceType type) const { return m_totals[(int)type].bytes; }
+    size_t GetBytes() const { return m_bytes; }
+    size_t GetPeakBytes() const { return m_peakBytes; }
+
+    // 0 for none. Warns once each time GetPressure crosses 90%.
+    void SetBudget(size_t bytes);
+    // The driver's dedicated memory, or 0 if it doesn't say; call with a
+    // current context
+    void SetBudgetFromDriver();
+    size_t GetBudget() const { return m_budget; }
+    // Tracked bytes over the budget, 0 without one
+    float GetPressure() const;
+    // What the driver says is free, in bytes; false if it doesn't say
+    bool QueryDriverFree(size_t& freeBytes) const;
+
+    void PrintSummary() const;
+    // Lists what is still alive, grouped by label; returns how many. Only
+    // reads the records, so it can run after the context is gone.
+    int ReportLeaks() const;
+
+    // Bytes of a width x height texture (times layers), with a full mip
+    // chain below it if mipmapped
+    static size_t TextureBytes(GLenum internalFormat, int width, int height, int layers = 1, bool mipmapped = false);
+    static const char* TypeName(GpuResourceType type);
+
+private:
+    GpuResources();
+    void CheckBudget();
+
+    struct Record
+    {
+        const char* label;
+        size_t bytes;
+    };
+    struct Totals
+    {
+        int live = 0;
+        int created = 0;
+        size_t bytes = 0;
+    };
+    static const int kTypes = (int)GpuResourceType::Count;
+
+    std::unordered_map<GLuint, Record> m_live[kTypes];
+    Totals m_totals[kTypes];
+    size_t m_bytes;
+    size_t m_peakBytes;
+    size_t m_budget;
+    bool m_overBudget;      // warned, until pressure falls back
+};
+
+// Owns one GL object of a type: created with Create, deleted when the
+// handle is destroyed, reset or assigned over. Move-only. Must be released
+// while the context is current.
+template <GpuResourceType Type>
+class GpuHandle
+{
+public:
+    GpuHandle() : m_id(0) {}
+    ~GpuHandle() { Reset(); }
+
+    GpuHandle(GpuHandle&& other) noexcept : m_id(other.m_id) { other.m_id = 0; }
+    GpuHandle& operator=(GpuHandle&& other) noexcept
+    {
+        if (this != &other)
+        {
+            Reset();
+            m_id = other.m_id;
+            other.m_id = 0;
+        }
+        return *this;
+    }
+    GpuHandle(const GpuHandle&) = delete;
+    GpuHandle& operator=(const GpuHandle&) = delete;
+
+    // Replaces whatever the handle held
+    void Create(const char* label)
+    {
+        Reset();
+        m_id = GpuResources::Get().Create(Type, label);
+    }
+    void Reset()
+    {
+        if (m_id != 0)
+            GpuResources::Get().Destroy(Type, m_id);
+        m_id = 0;
+    }
+    // For the accounting; the latest size replaces the last
+    void SetBytes(size_t bytes) const
+    {
+        if (m_id != 0)
+            GpuResources::Get().SetBytes(Type, m_id, bytes);
+    }
+
+    GLuint Get() const { return m_id; }
+    explicit operator bool() const { return m_id != 0; }
+
+private:
+    GLuint m_id;
+};
+
+typedef GpuHandle<GpuResourceType::Buffer> GpuBuffer;
+typedef GpuHandle<GpuResourceType::Texture> GpuTexture;
+typedef GpuHandle<GpuResourceType::VertexArray> GpuVertexArray;
+typedef GpuHandle<GpuResourceType::Program> GpuProgram;
+typedef GpuHandle<GpuResourceType::Framebuffer> GpuFramebuffer;
+typedef GpuHandle<GpuResourceType::Renderbuffer> GpuRenderbuffer;
+
+#endif /* GPURESOURCES_H */
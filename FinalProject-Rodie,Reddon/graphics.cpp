@@ -1,9 +1,125 @@
 #include "graphics.h"
+#include "alloctracker.h"
+#include "framearena.h"
+#include "profiler.h"
+#include "textureuploader.h"
+#include <algorithm>
 #include <glm/gtx/string_cast.hpp> 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
 #endif
 
+// Gravity for the N-body belts, in scene units. The sun's GM is roughly what
+// the planets' orbitRadius/orbitSpeed pairs imply (omega^2 * r^3).
+static const float kSunGM = 600.0f;
+static const float kPlanetGMPerVolume = 0.6f;   // times scale^3
+static const float kAsteroidGM = 1e-5f;
+
+// Lighting for everything except the planets, which set their own
+static const glm::vec3 kAmbientColor = glm::vec3(0.3f);
+static const glm::vec3 kSunLightColor = glm::vec3(1.0f);
+static const glm::vec3 kSunLightDir = glm::normalize(glm::vec3(1.0f, -1.0f, -1.0f));
+
+static const char* kSkyboxVertexShader = R"(
+#version 430
+layout (location = 0) in vec3 aPos;
+out vec3 TexCoords;
+uniform mat4 projection;
+uniform mat4 view;
+void main()
+{
+    TexCoords = aPos;
+    vec4 pos = projection * view * vec4(aPos, 1.0);
+    gl_Position = pos.xyww;
+}
+)";
+
+static const char* kSkyboxFragmentShader = R"(
+#version 430
+in vec3 TexCoords;
+out vec4 FragColor;
+uniform samplerCube skybox;
+void main()
+{
+#ifdef OVERDRAW
+    FragColor = vec4(0.1, 0.05, 0.025, 1.0); // one step of the overdraw view
+#else
+    FragColor = texture(skybox, TexCoords);
+#endif
+}
+)";
+
+// Normal maps by surface texture. Anything not listed is drawn without one.
+struct NormalMapEntry {
+	const char* texture;
+	const char* normalMap;
+};
+static const NormalMapEntry kNormalMaps[] = {
+	{ "assets/Mercury.jpg", "assets/Mercury-n.jpg" },
+	{ "assets/Venus.jpg", "assets/Venus-n.jpg" },
+	{ "assets/2k_earth_daymap.jpg", "assets/2k_earth_daymap-n.jpg" },
+	{ "assets/2k_moon.jpg", "assets/2k_moon-n.jpg" },
+	{ "assets/Mars.jpg", "assets/Mars-n.jpg" },
+	{ "assets/Jupiter.jpg", "assets/Jupiter-n.jpg" },
+	{ "assets/Uranus.jpg", "assets/Uranus-n.jpg" },
+	{ "assets/Neptune.jpg", "assets/Neptune-n.jpg" },
+};
+
+static const char* NormalMapFor(const char* texture)
+{
+	std::string path = texture;
+	std::replace(path.begin(), path.end(), '\\', '/');
+	for (const NormalMapEntry& entry : kNormalMaps) {
+		if (path == entry.texture)
+			return entry.normalMap;
+	}
+	return NULL;
+}
+
+static Sphere* LoadBody(int prec, const char* texture)
+{
+	Sphere* sphere = new Sphere(prec, texture);
+	const char* normalMap = NormalMapFor(texture);
+	if (normalMap != NULL)
+		sphere->setNormalMap(normalMap);
+	return sphere;
+}
+
+// Object shader features for drawing a sphere or mesh, before the pass's
+static unsigned SphereFeatures(const Sphere* sphere)
+{
+	return (sphere->hasTex ? SHADER_TEXTURED : 0) |
+		(sphere->hasNormalMap() ? SHADER_NORMAL_MAP : 0) |
+		(sphere->isProcedural() ? SHADER_PROCEDURAL_SPHERE : 0);
+}
+
+static unsigned MeshFeatures(const Mesh* mesh)
+{
+	return (mesh->hasTex ? SHADER_TEXTURED : 0) |
+		(mesh->hasNormalMap() ? SHADER_NORMAL_MAP | SHADER_DERIVATIVE_TANGENTS : 0);
+}
+
+// The textures a Sphere or Mesh binds in Render, for drawing it as an impostor
+template <class T>
+static void BindObjectTextures(T* object)
+{
+	if (object->hasNormalMap()) {
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, object->getNormalMapID());
+	}
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, object->hasTex ? object->getTextureID() : 0);
+}
+
+static Mesh* LoadMesh(const char* obj, const char* texture)
+{
+	Mesh* mesh = new Mesh(glm::vec3(0.0f), obj, texture);
+	const char* normalMap = NormalMapFor(texture);
+	if (normalMap != NULL)
+		mesh->setNormalMap(normalMap);
+	return mesh;
+}
+
 std::vector<CelestialBody> planets;
 std::vector<Sphere*> planetSpheres;
 std::vector<Moon> moons;
@@ -15,33 +131,45 @@ Graphics::Graphics()
 
 }
 
+// Everything here holds GL objects, so this runs while the context is current
 Graphics::~Graphics()
 {
-
+	TextureUploader::Get().Cancel(&cubemapTexture);
+	delete m_dynamicResolution;
+	delete m_postProcess;
+	delete m_cometParticles;
+	delete m_collision;
+	delete m_spatialIndex;
+	delete m_nbody;
+	delete m_bodyBatch;
+	delete m_asteroidField;
+
+	for (Sphere* sphere : planetSpheres)
+		delete sphere;
+	planetSpheres.clear();
+	for (Moon& moon : moons)
+		delete moon.sphere;
+	moons.clear();
+	delete halleysComet.body;
+	halleysComet.body = NULL;
+	delete m_sphere;
+	delete m_asteroid;
+	delete m_mesh;
+	Sphere::ReleaseShared();
+
+	delete skyboxShader;
+	delete skyboxOverdrawShader;
+	delete m_variants;
+	delete m_camera;
 }
 
 bool Graphics::Initialize(int width, int height)
 {
+	PROFILE_SCOPE("Graphics::Initialize");
 	currentMode = GameMode::Exploration; // Default mode
 
-	// Used for the linux OS
-#if !defined(__APPLE__) && !defined(MACOSX)
-  // cout << glewGetString(GLEW_VERSION) << endl;
-	glewExperimental = GL_TRUE;
-
-	auto status = glewInit();
-
-	// This is here to grab the error that comes from glew init.
-	// This error is an GL_INVALID_ENUM that has no effects on the performance
-	glGetError();
-
-	//Check for error
-	if (status != GLEW_OK)
-	{
-		std::cerr << "GLEW Error: " << glewGetErrorString(status) << "\n";
-		return false;
-	}
-#endif
+	// GLEW is loaded by the Window, which knows whether the context came from
+	// GLFW or from the headless EGL path
 
 
 
@@ -52,34 +180,109 @@ bool Graphics::Initialize(int width, int height)
 		printf("Camera Failed to Initialize\n");
 		return false;
 	}
+	m_viewportHeight = height;
 
-	// Set up the shaders
-	m_shader = new Shader();
-	if (!m_shader->Initialize())
-	{
-		printf("Shader Failed to Initialize\n");
-		return false;
-	}
-
-	// Add the vertex shader
-	if (!m_shader->AddShader(GL_VERTEX_SHADER))
+	// Set up the shaders. Every program is started before any is waited on,
+	// so with KHR_parallel_shader_compile they build side by side, and the
+	// program cache skips compiling altogether after the first run.
 	{
-		printf("Vertex Shader failed to Initialize\n");
-		return false;
-	}
+		PROFILE_SCOPE("LoadShaders");
+		Shader::EnableParallelCompile();
+
+		m_variants = new ShaderVariants();
+
+		// Skybox Shader
+		skyboxShader = new Shader();
+		skyboxShader->Initialize();
+		skyboxShader->AddShader(GL_VERTEX_SHADER, kSkyboxVertexShader);
+		skyboxShader->AddShader(GL_FRAGMENT_SHADER, kSkyboxFragmentShader);
+		skyboxShader->BeginFinalize();
+
+		if (m_overdrawView)
+		{
+			skyboxOverdrawShader = new Shader();
+			skyboxOverdrawShader->Initialize();
+			skyboxOverdrawShader->SetDefines("#define OVERDRAW\n");
+			skyboxOverdrawShader->AddShader(GL_VERTEX_SHADER, kSkyboxVertexShader);
+			skyboxOverdrawShader->AddShader(GL_FRAGMENT_SHADER, kSkyboxFragmentShader);
+			skyboxOverdrawShader->BeginFinalize();
+		}
 
-	// Add the fragment shader
-	if (!m_shader->AddShader(GL_FRAGMENT_SHADER))
-	{
-		printf("Fragment Shader failed to Initialize\n");
-		return false;
-	}
+		// The object shader variants Render draws with; any other
+		// combination is compiled the first time it is asked for
+		unsigned sphere = m_proceduralSpheres ? SHADER_PROCEDURAL_SPHERE : 0;
+		std::vector<unsigned> variants = {
+			SHADER_EMISSIVE | SHADER_TEXTURED | sphere,
+			SHADER_TEXTURED,
+			SHADER_TEXTURED | SHADER_INSTANCED,
+			SHADER_TEXTURED | SHADER_NIGHT_BLEND | sphere,
+			SHADER_TEXTURED | SHADER_NORMAL_MAP | sphere,
+			SHADER_TEXTURED | SHADER_NIGHT_BLEND | SHADER_NORMAL_MAP | sphere
+		};
+		if (m_depthPrepass)
+		{
+			variants.push_back(SHADER_DEPTH_ONLY);
+			variants.push_back(SHADER_DEPTH_ONLY | SHADER_INSTANCED);
+			variants.push_back(SHADER_DEPTH_ONLY | sphere);
+		}
+		if (m_overdrawView)
+		{
+			variants.push_back(SHADER_OVERDRAW);
+			variants.push_back(SHADER_OVERDRAW | SHADER_INSTANCED);
+			variants.push_back(SHADER_OVERDRAW | sphere);
+		}
+		m_bodyTextureMode = BodyBatch::Resolve(m_bodyTextureMode);
+		if (m_bodyTextureMode != BodyTextureMode::Separate)
+		{
+			variants.push_back(BodyBatchFeatures() | sphere);
+			if (m_depthPrepass)
+				variants.push_back(SHADER_DEPTH_ONLY | SHADER_BATCHED | sphere);
+			if (m_overdrawView)
+				variants.push_back(SHADER_OVERDRAW | SHADER_BATCHED | sphere);
+		}
+		if (m_impostorPixels > 0.0f)
+		{
+			// An impostor of each
+			size_t count = variants.size();
+			for (size_t i = 0; i < count; i++)
+				variants.push_back(variants[i] | SHADER_IMPOSTOR);
+		}
+		m_cometParticles = new CometParticles();
+		m_cometParticles->BeginShaders(m_overdrawView);
+		if (m_overdrawView && m_dynamicResolutionWanted)
+			printf("Dynamic resolution is off in the overdraw view\n");
+		m_postSettings.upscale = m_dynamicResolutionWanted && !m_overdrawView;
+		if (!m_overdrawView && (m_postSettings.bloom || m_postSettings.tonemap || m_postSettings.upscale)) {
+			m_postProcess = new PostProcess();
+			m_postProcess->BeginShaders(m_postSettings);
+		}
 
-	// Connect the program
-	if (!m_shader->Finalize())
-	{
-		printf("Program to Finalize\n");
-		return false;
+		if (!m_variants->Precompile(variants))
+		{
+			printf("Program to Finalize\n");
+			return false;
+		}
+		skyboxShader->Finalize();
+		m_skyboxView = skyboxShader->GetUniformLocation("view");
+		m_skyboxProjection = skyboxShader->GetUniformLocation("projection");
+		m_skyboxSampler = skyboxShader->GetUniformLocation("skybox");
+		if (skyboxOverdrawShader != NULL) {
+			skyboxOverdrawShader->Finalize();
+			m_skyboxOverdrawView = skyboxOverdrawShader->GetUniformLocation("view");
+			m_skyboxOverdrawProjection = skyboxOverdrawShader->GetUniformLocation("projection");
+		}
+		if (!m_cometParticles->Initialize(m_cometSettings)) {
+			delete m_cometParticles;
+			m_cometParticles = NULL;
+		}
+		if (m_postProcess != NULL && !m_postProcess->Initialize(width, height)) {
+			delete m_postProcess;
+			m_postProcess = NULL;
+		}
+		if (m_postProcess != NULL && m_postSettings.upscale) {
+			m_dynamicResolution = new DynamicResolution();
+			m_dynamicResolution->Initialize(m_dynamicSettings);
+		}
 	}
 
 	// Populate location bindings of the shader uniform/attribs
@@ -87,39 +290,6 @@ bool Graphics::Initialize(int width, int height)
 		printf("Some shader attribs not located!\n");
 	}
 
-	// Skybox Shader
-	skyboxShader = new Shader();
-	skyboxShader->Initialize();
-	const char* skyboxVertexShader = R"(
-#version 460
-layout (location = 0) in vec3 aPos;
-out vec3 TexCoords;
-uniform mat4 projection;
-uniform mat4 view;
-void main()
-{
-    TexCoords = aPos;
-    vec4 pos = projection * view * vec4(aPos, 1.0);
-    gl_Position = pos.xyww;
-}
-)";
-
-	const char* skyboxFragmentShader = R"(
-#version 460
-in vec3 TexCoords;
-out vec4 FragColor;
-uniform samplerCube skybox;
-void main()
-{
-    FragColor = texture(skybox, TexCoords);
-}
-)";
-
-	skyboxShader->AddShader(GL_VERTEX_SHADER, skyboxVertexShader);
-	skyboxShader->AddShader(GL_FRAGMENT_SHADER, skyboxFragmentShader);
-
-	skyboxShader->Finalize();
-
 	float skyboxVertices[] = {
 		-1.0f,  1.0f, -1.0f, -1.0f, -1.0f, -1.0f,  1.0f, -1.0f, -1.0f,
 		 1.0f, -1.0f, -1.0f,  1.0f,  1.0f, -1.0f, -1.0f,  1.0f, -1.0f,
@@ -134,14 +304,18 @@ void main()
 		-1.0f, -1.0f, -1.0f, -1.0f, -1.0f,  1.0f,  1.0f, -1.0f, -1.0f,
 		 1.0f, -1.0f, -1.0f, -1.0f, -1.0f,  1.0f,  1.0f, -1.0f,  1.0f
 	};
-	glGenVertexArrays(1, &skyboxVAO);
-	glGenBuffers(1, &skyboxVBO);
-	glBindVertexArray(skyboxVAO);
-	glBindBuffer(GL_ARRAY_BUFFER, skyboxVBO);
+	skyboxVAO.Create("Skybox vertex array");
+	skyboxVBO.Create("Skybox vertices");
+	glBindVertexArray(skyboxVAO.Get());
+	glBindBuffer(GL_ARRAY_BUFFER, skyboxVBO.Get());
 	glBufferData(GL_ARRAY_BUFFER, sizeof(skyboxVertices), &skyboxVertices, GL_STATIC_DRAW);
+	skyboxVBO.SetBytes(sizeof(skyboxVertices));
 	glEnableVertexAttribArray(0);
 	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
 
+	// Impostors are built from gl_VertexID and the model matrix alone
+	m_impostorVAO.Create("Impostor vertex array");
+
 	std::vector<std::string> faces = {
 		"assets/skybox_right.jpg",   // POSITIVE_X
 		"assets/skybox_left.jpg",    // NEGATIVE_X
@@ -150,63 +324,103 @@ void main()
 		"assets/skybox_front.jpg",   // POSITIVE_Z
 		"assets/skybox_back.jpg"     // NEGATIVE_Z
 	};
-	cubemapTexture = loadCubemap(faces);
+	{
+		PROFILE_SCOPE("LoadSkybox");
+		loadCubemap(faces);
+	}
 
 
 	// Starship
-	m_mesh = new Mesh(glm::vec3(0.0f), "assets\\SpaceShip-1.obj", "assets\\SpaceShip-1.png");
+	{
+		PROFILE_SCOPE("LoadShip");
+		m_mesh = LoadMesh("assets\\SpaceShip-1.obj", "assets\\SpaceShip-1.png");
+	}
 	glm::mat4 model = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, 0.0f, -20.0f)) *
 		glm::scale(glm::vec3(0.025f));
 	m_mesh->Update(model);
 
 
+	// Every sphere from here on, if they are to be computed in the shader
+	Sphere::SetProcedural(m_proceduralSpheres);
+
 	// The Sun
-	m_sphere = new Sphere(64, "assets\\2k_sun.jpg");
+	{
+		PROFILE_SCOPE("LoadSun");
+		m_sphere = new Sphere(64, "assets\\2k_sun.jpg");
+	}
 
 	// Create a single asteroid mesh
-	m_asteroid = new Mesh(glm::vec3(0.0f), "assets\\asteroid.obj", "assets\\asteroid.jpg");
-	GenerateAsteroidBelts();
-	SetupAsteroidInstancing();
+	{
+		PROFILE_SCOPE("LoadAsteroids");
+		m_asteroid = LoadMesh("assets\\asteroid.obj", "assets\\asteroid.jpg");
+		m_asteroidField = new AsteroidField();
+		if (m_asteroidField->Initialize(m_fieldSettings, m_asteroid->getVBO(), m_asteroid->getIBO(),
+			m_asteroid->GetIndexCount(), m_asteroid->GetBoundingRadius())) {
+			// Whatever is in range of the ship is there from the first frame
+			m_asteroidField->Finish(glm::vec3(m_mesh->GetModel()[3]));
+		}
+		else {
+			delete m_asteroidField;
+			m_asteroidField = NULL;
+			GenerateAsteroidBelts();
+			SetupAsteroidInstancing();
+		}
+	}
 
 	
+	// Warm white light on the inner planets, soft blue on the ice giants
 	planets = {
-		{ "Mercury", 2.0f, 4.74f, 10.83f, 0.2f, 0.01f, "assets/Mercury.jpg", glm::vec3(10.0f, 5.0f, 0.0f), glm::vec3(0.01f) },
-		{ "Venus",   3.0f, 3.5f, -6.52f, 0.45f, 177.4f, "assets/Venus.jpg", glm::vec3(10.0f, 5.0f, 0.0f), glm::vec3(0.01f) },
-		{ "Earth",   4.0f, 2.98f, 15.0f, 0.5f, 23.5f, "assets/2k_earth_daymap.jpg", glm::vec3(10.0f, 5.0f, 0.0f), glm::vec3(0.01f) },
-		{ "Mars",    5.0f, 2.41f, 14.6f, 0.35f, 25.0f, "assets/Mars.jpg", glm::vec3(0.0f, 10.0f, 0.0f), glm::vec3(0.0f, 0.05f, 0.2f) },
-		{ "Jupiter", 7.0f, 1.31f, 25.0f, 1.0f, 3.1f, "assets/Jupiter.jpg", glm::vec3(0.0f, 10.0f, 0.0f), glm::vec3(0.0f, 0.05f, 0.2f) },
-		{ "Saturn",  9.0f, 0.97f, 22.0f, 0.9f, 26.7f, "assets/Saturn.jpg", glm::vec3(0.0f, 10.0f, 0.0f), glm::vec3(0.0f, 0.05f, 0.2f) },
-		{ "Uranus",  11.0f, 0.68f, -17.2f, 0.7f, 97.8f, "assets/Uranus.jpg", glm::vec3(0.0f, 1.0f, 10.0f), glm::vec3(0.3f, 0.3f, 1.0f) },
-		{ "Neptune", 13.0f, 0.54f, 16.1f, 0.65f, 28.3f, "assets/Neptune.jpg", glm::vec3(0.0f, 1.0f, 10.0f), glm::vec3(0.3f, 0.3f, 1.0f) }
+		{ "Mercury", 2.0f, 4.74f, 10.83f, 0.2f, 0.01f, "assets/Mercury.jpg", glm::vec3(1.0f, 0.8f, 0.4f), glm::vec3(0.05f) },
+		{ "Venus",   3.0f, 3.5f, -6.52f, 0.45f, 177.4f, "assets/Venus.jpg", glm::vec3(1.0f, 0.8f, 0.4f), glm::vec3(0.05f) },
+		{ "Earth",   4.0f, 2.98f, 15.0f, 0.5f, 23.5f, "assets/2k_earth_daymap.jpg", glm::vec3(1.0f, 0.8f, 0.4f), glm::vec3(0.05f) },
+		{ "Mars",    5.0f, 2.41f, 14.6f, 0.35f, 25.0f, "assets/Mars.jpg", glm::vec3(0.6f, 0.6f, 0.5f), glm::vec3(0.02f, 0.05f, 0.08f) },
+		{ "Jupiter", 7.0f, 1.31f, 25.0f, 1.0f, 3.1f, "assets/Jupiter.jpg", glm::vec3(0.6f, 0.6f, 0.5f), glm::vec3(0.02f, 0.05f, 0.08f) },
+		{ "Saturn",  9.0f, 0.97f, 22.0f, 0.9f, 26.7f, "assets/Saturn.jpg", glm::vec3(0.6f, 0.6f, 0.5f), glm::vec3(0.02f, 0.05f, 0.08f) },
+		{ "Uranus",  11.0f, 0.68f, -17.2f, 0.7f, 97.8f, "assets/Uranus.jpg", glm::vec3(0.2f, 0.4f, 1.0f), glm::vec3(0.1f, 0.1f, 0.2f) },
+		{ "Neptune", 13.0f, 0.54f, 16.1f, 0.65f, 28.3f, "assets/Neptune.jpg", glm::vec3(0.2f, 0.4f, 1.0f), glm::vec3(0.1f, 0.1f, 0.2f) }
 	};
 
 
-	for (const auto& p : planets) {
-		Sphere* s = new Sphere(48, p.texturePath.c_str());
-		planetSpheres.push_back(s);
-	}
+	{
+		PROFILE_SCOPE("LoadPlanetsAndMoons");
+		for (const auto& p : planets) {
+			Sphere* s = LoadBody(48, p.texturePath.c_str());
+			planetSpheres.push_back(s);
+		}
 
-	// Earth's Moon
-	moons.push_back({ 2, new Sphere(32, "assets/2k_moon.jpg"), 1.5f, 3.0f, 0.2f, 30.f, "" });
+		// Earth's Moon
+		moons.push_back({ 2, LoadBody(32, "assets/2k_moon.jpg"), 1.5f, 3.0f, 0.2f, 30.f, "" });
 
 
-	// Mars: Phobos & Deimos
-	moons.push_back({ 3, new Sphere(32, "assets/Mercury.jpg"), 0.6f, 4.5f, 0.05f, 20.f, "" });  // Phobos-like
-	moons.push_back({ 3, new Sphere(32, "assets/Mercury.jpg"), 1.0f, 3.2f, 0.07f, -10.f, "" }); // Deimos-like
+		// Mars: Phobos & Deimos
+		moons.push_back({ 3, LoadBody(32, "assets/Mercury.jpg"), 0.6f, 4.5f, 0.05f, 20.f, "" });  // Phobos-like
+		moons.push_back({ 3, LoadBody(32, "assets/Mercury.jpg"), 1.0f, 3.2f, 0.07f, -10.f, "" }); // Deimos-like
 
-	// Jupiter: Europa & Ganymede
-	moons.push_back({ 4, new Sphere(32, "assets/Mercury.jpg"), 1.5f, 3.0f, 0.1f, 15.f, "" });   // Europa
-	moons.push_back({ 4, new Sphere(32, "assets/Mercury.jpg"), 2.2f, 2.2f, 0.12f, -15.f, "" });  // Ganymede
+		// Jupiter: Europa & Ganymede
+		moons.push_back({ 4, LoadBody(32, "assets/Mercury.jpg"), 1.5f, 3.0f, 0.1f, 15.f, "" });   // Europa
+		moons.push_back({ 4, LoadBody(32, "assets/Mercury.jpg"), 2.2f, 2.2f, 0.12f, -15.f, "" });  // Ganymede
 
-	halleysComet = {
-	new Sphere(32, "assets/2k_moon.jpg"),
-	20.0f,  
-	6.0f,   
-	0.2f,   
-	0.15f,  
-	1.0f    
-	};
+		halleysComet = {
+		new Sphere(32, "assets/2k_moon.jpg"),
+		20.0f,  
+		6.0f,   
+		0.2f,   
+		0.15f,  
+		1.0f    
+		};
+	}
+
+	for (size_t i = 0; i < planets.size(); ++i)
+		m_planetIndexByName[planets[i].name] = (int)i;
 
+	// Place everything once so the index starts from real positions
+	HierarchicalUpdate2(0.0);
+	BuildSpatialIndex();
+
+	m_collision = new CollisionSystem();
+	m_collision->SetShipShape(m_mesh->GetBoundsMin(), m_mesh->GetBoundsMax());
+	m_collision->BuildAsteroidGrid(innerAsteroidTransforms, outerAsteroidTransforms,
+		m_asteroid->GetBoundingRadius(), glm::length(glm::vec3(m_mesh->GetModel()[0])));
 
 	//enable depth testing
 	glEnable(GL_DEPTH_TEST);
@@ -216,8 +430,10 @@ void main()
 }
 
 void Graphics::HierarchicalUpdate2(double dt) {
+	PROFILE_SCOPE("HierarchicalUpdate2");
+	ALLOC_FREE_SCOPE("HierarchicalUpdate2");
 	totalTime += dt;  
-	modelStack = std::stack<glm::mat4>();
+	std::stack<glm::mat4, FrameVector<glm::mat4>> modelStack;
 	glm::mat4 identity = glm::mat4(1.0f);
 	modelStack.push(identity);
 
@@ -250,6 +466,11 @@ void Graphics::HierarchicalUpdate2(double dt) {
 		m.sphere->Update(moonModel);
 	}
 
+	if (m_nbody != NULL)
+		UpdateNBody(dt);
+	if (m_asteroidField != NULL)
+		m_asteroidField->Update(glm::vec3(m_mesh->GetModel()[3]));
+
 
 	float flySpeed = halleysComet.speed;
 	float radiusX = 20.0f;
@@ -294,300 +515,550 @@ halleysComet.body->Update(cometModel);
 
 	previousCometPosition = currentCometPosition;
 
-	// Update the comet trail
-	cometTrailPositions.push_front(currentCometPosition);  // new head of the trail
-
-	// Keep only the most recent N positions
-	if (cometTrailPositions.size() > maxTrailLength)
-		cometTrailPositions.pop_back();
+	RefitSpatialIndex();
+	ResolveShipCollisions();
 
+	if (m_cometParticles != NULL) {
+		PROFILE_GPU_SCOPE("CometSimulate");
+		m_cometParticles->Update((float)dt, currentCometPosition, glm::vec3(0.0f));
+	}
 }
 
 
 
 
-void Graphics::ComputeTransforms(double dt, std::vector<float> speed, std::vector<float> dist,
-	std::vector<float> rotSpeed, glm::vec3 rotVector, std::vector<float> scale, glm::mat4& tmat, glm::mat4& rmat, glm::mat4& smat) {
+void Graphics::ComputeTransforms(double dt, const glm::vec3& speed, const glm::vec3& dist,
+	float rotSpeed, glm::vec3 rotVector, const glm::vec3& scale, glm::mat4& tmat, glm::mat4& rmat, glm::mat4& smat) {
 	tmat = glm::translate(glm::mat4(1.f),
 		glm::vec3(cos(speed[0] * dt) * dist[0], sin(speed[1] * dt) * dist[1], sin(speed[2] * dt) * dist[2])
 	);
-	rmat = glm::rotate(glm::mat4(1.f), rotSpeed[0] * (float)dt, rotVector);
+	rmat = glm::rotate(glm::mat4(1.f), rotSpeed * (float)dt, rotVector);
 	smat = glm::scale(glm::vec3(scale[0], scale[1], scale[2]));
 }
 
+void Graphics::Resize(int width, int height)
+{
+	if (m_postProcess != NULL)
+		m_postProcess->Resize(width, height);
+	glViewport(0, 0, width, height);
+}
+
 void Graphics::Render()
 {
+	PROFILE_SCOPE("Render");
+	ALLOC_FREE_SCOPE("Render");
+	m_renderStats = RenderStats();
+
+	// Stream in this frame's share of any textures still loading
+	TextureUploader::Get().Update();
 
+	if (m_dynamicResolution != NULL) {
+		m_postProcess->SetRenderScale(m_dynamicResolution->Update());
+		m_dynamicResolution->BeginFrame();
+	}
+	if (m_postProcess != NULL)
+		m_postProcess->BeginScene();
 	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-	m_shader->Enable();  
-
-	glm::vec3 lightDir = glm::normalize(glm::vec3(1.0, -1.0, -1.0));
-	glm::vec3 nightDir = -lightDir;
-
-
-	glm::vec3 ambientColor = glm::vec3(0.3f);  
-	glm::vec3 overrideColor = glm::vec3(0.0f); 
-
-	if (m_lightDir != -1) glUniform3fv(m_lightDir, 1, glm::value_ptr(lightDir));
-	if (m_ambientColor != -1) glUniform3fv(m_ambientColor, 1, glm::value_ptr(ambientColor));
-	if (m_overrideColor != -1) glUniform3fv(m_overrideColor, 1, glm::value_ptr(overrideColor));
-
-	GLint locNightColor = m_shader->GetUniformLocation("nightColor");
-	GLint locLightDir = m_shader->GetUniformLocation("lightDir");
-	GLint locNightDir = m_shader->GetUniformLocation("nightDir");
-
-	if (locLightDir != -1) glUniform3fv(locLightDir, 1, glm::value_ptr(lightDir));
-	if (locNightDir != -1) glUniform3fv(locNightDir, 1, glm::value_ptr(nightDir));
-
+	// New frame: every variant's per-frame uniforms are stale
+	m_frame++;
+	m_activeVariant = NULL;
+
+	// The batch copies (or takes handles to) the final textures, so it
+	// waits until the uploader has swapped them all in
+	if (m_bodyTextureMode != BodyTextureMode::Separate && m_bodyBatch == NULL &&
+		TextureUploader::Get().IsIdle())
+		BuildBodyBatch();
+
+	CollectOpaqueDraws();
+
+	// Lay down the depth of everything opaque first, so the shading pass
+	// below only shades each pixel's nearest surface
+	if (m_depthPrepass) {
+		PROFILE_GPU_SCOPE("DepthPrepass");
+		m_passFeatures = SHADER_DEPTH_ONLY;
+		glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+		for (const OpaqueDraw& draw : m_opaqueDraws)
+			DrawOpaque(draw);
+		DrawAsteroidBelt();
+		DrawAsteroidField();
+		glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+
+		glDepthFunc(GL_LEQUAL);
+		glDepthMask(GL_FALSE);
+	}
 
-	// --- SKYBOX ---
-	glDepthFunc(GL_LEQUAL);
-	skyboxShader->Enable();
+	// Overdraw view: every shaded fragment adds a step of color, so the
+	// brighter a pixel, the more times it was shaded
+	m_passFeatures = m_overdrawView ? SHADER_OVERDRAW : 0;
+	if (m_overdrawView) {
+		glEnable(GL_BLEND);
+		glBlendFunc(GL_ONE, GL_ONE);
+	}
 
-	glm::mat4 view = glm::mat4(glm::mat3(m_camera->GetView())); // remove translation
-	glm::mat4 projection = m_camera->GetProjection();
+	{
+		PROFILE_GPU_SCOPE("Opaque");
+		for (const OpaqueDraw& draw : m_opaqueDraws)
+			DrawOpaque(draw);
+	}
 
-	glUniformMatrix4fv(skyboxShader->GetUniformLocation("view"), 1, GL_FALSE, glm::value_ptr(view));
-	glUniformMatrix4fv(skyboxShader->GetUniformLocation("projection"), 1, GL_FALSE, glm::value_ptr(projection));
-	glUniform1i(skyboxShader->GetUniformLocation("skybox"), 0);
+	DrawAsteroidBelt();
+	DrawAsteroidField();
 
-	glBindVertexArray(skyboxVAO);
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_CUBE_MAP, cubemapTexture);
-	glDrawArrays(GL_TRIANGLES, 0, 36);
-	glBindVertexArray(0);
+	glDepthMask(GL_TRUE);
+	glDepthFunc(GL_LESS);
 
-	glDepthFunc(GL_LESS);  // reset depth
+	DrawSkybox();
 
+	DrawCometParticles();
 
-	
-	m_shader->Enable();
+	if (m_overdrawView)
+		glDisable(GL_BLEND);
+	m_passFeatures = 0;
 
-	glUniformMatrix4fv(m_projectionMatrix, 1, GL_FALSE, glm::value_ptr(m_camera->GetProjection()));
-	glUniformMatrix4fv(m_viewMatrix, 1, GL_FALSE, glm::value_ptr(m_camera->GetView()));
+	if (m_postProcess != NULL)
+		m_renderStats.drawCalls += m_postProcess->Apply(m_outputFramebuffer);
+	if (m_dynamicResolution != NULL)
+		m_dynamicResolution->EndFrame();
+	m_activeVariant = NULL;
 
-	
-	if (m_mesh != NULL) {
-		glUniform1i(m_hasTexture, false);
-		glUniformMatrix4fv(m_modelMatrix, 1, GL_FALSE, glm::value_ptr(m_mesh->GetModel()));
+	auto error = glGetError();
+	if (error != GL_NO_ERROR)
+		printf("GL error after Render: %s\n", ErrorString(error));
+}
 
-		if (m_mesh->hasTex) {
-			glActiveTexture(GL_TEXTURE0);
-			glBindTexture(GL_TEXTURE_2D, m_mesh->getTextureID()); 
+void Graphics::CollectOpaqueDraws()
+{
+	PROFILE_SCOPE("SortOpaque");
+	glm::mat4 view = m_camera->GetView();
+	m_opaqueDraws.clear();
+	m_impostorScale = m_camera->GetProjection()[1][1] * m_viewportHeight * 0.5f;
+
+	// radius is the bounding radius before the model's scale
+	auto add = [&](OpaqueKind kind, int index, const glm::mat4& model, float radius) {
+		glm::vec3 viewPos = glm::vec3(view * model[3]);
+		float scale = glm::length(glm::vec3(model[0]));
+		OpaqueDraw draw = { -viewPos.z - radius * scale, kind, index,
+			kind != OpaqueKind::Ship && IsImpostorSized(viewPos, radius * scale) };
+		m_opaqueDraws.push_back(draw);
+	};
 
-			GLuint sampler = m_shader->GetUniformLocation("sp");
-			if (sampler == INVALID_UNIFORM_LOCATION) {
-				printf("Sampler not found\n");
+	if (m_mesh != NULL)
+		add(OpaqueKind::Ship, 0, m_mesh->GetModel(), m_mesh->GetBoundingRadius());
+	if (m_sphere != NULL)
+		add(OpaqueKind::Sun, 0, m_sphere->GetModel(), 1.0f);
+	if (m_bodyBatch != NULL) {
+		// One draw for all the meshes and one for all the impostors, each
+		// placed by its nearest body; the batch sorts front to back inside
+		m_batchBodies.resize(planetSpheres.size() + moons.size());
+		float nearestMesh = 0.0f, nearestImpostor = 0.0f;
+		int meshCount = 0, impostorCount = 0;
+		for (size_t i = 0; i < m_batchBodies.size(); ++i) {
+			BatchedBody& body = m_batchBodies[i];
+			if (i < planetSpheres.size()) {
+				body.model = planetSpheres[i]->GetModel();
+				PlanetLighting((int)i, body.lightColor, body.nightColor, body.lightDir);
 			}
-			glUniform1i(sampler, 0);
+			else {
+				// Moons get the plain sun light; a black night side makes
+				// NIGHT_BLEND the same as plain lighting
+				body.model = moons[i - planetSpheres.size()].sphere->GetModel();
+				body.lightColor = kSunLightColor;
+				body.nightColor = glm::vec3(0.0f);
+				body.lightDir = kSunLightDir;
+			}
+			glm::vec3 viewPos = glm::vec3(view * body.model[3]);
+			float radius = glm::length(glm::vec3(body.model[0]));
+			body.depth = -viewPos.z - radius;
+			body.impostor = IsImpostorSized(viewPos, radius);
+
+			if (body.impostor) {
+				if (impostorCount++ == 0 || body.depth < nearestImpostor)
+					nearestImpostor = body.depth;
+			}
+			else if (meshCount++ == 0 || body.depth < nearestMesh)
+				nearestMesh = body.depth;
 		}
-
-		m_mesh->Render(m_positionAttrib, m_normalAttrib, m_tcAttrib, m_hasTexture);
+		m_bodyBatch->Upload(m_batchBodies);
+		if (meshCount > 0) {
+			OpaqueDraw draw = { nearestMesh, OpaqueKind::Bodies, 0, false };
+			m_opaqueDraws.push_back(draw);
+		}
+		if (impostorCount > 0) {
+			OpaqueDraw draw = { nearestImpostor, OpaqueKind::BodyImpostors, 0, true };
+			m_opaqueDraws.push_back(draw);
+		}
+	}
+	else {
+		for (size_t i = 0; i < planetSpheres.size(); ++i)
+			add(OpaqueKind::Planet, (int)i, planetSpheres[i]->GetModel(), 1.0f);
+		for (size_t i = 0; i < moons.size(); ++i)
+			add(OpaqueKind::Moon, (int)i, moons[i].sphere->GetModel(), 1.0f);
 	}
 
-	
+	float asteroidRadius = m_asteroid->GetBoundingRadius();
 	int count = std::min(100, static_cast<int>(innerAsteroidTransforms.size()));
-	for (int i = 0; i < count; ++i) {
-		m_asteroid->Update(innerAsteroidTransforms[i]);
-
-		glUniform1i(m_shader->GetUniformLocation("isInstanced"), false);
-		glUniformMatrix4fv(m_modelMatrix, 1, GL_FALSE, glm::value_ptr(m_asteroid->GetModel()));
-
-		if (m_asteroid->hasTex) {
-			glActiveTexture(GL_TEXTURE0);
-			glBindTexture(GL_TEXTURE_2D, m_asteroid->getTextureID());
-			GLuint sampler = m_shader->GetUniformLocation("sp");
-			glUniform1i(sampler, 0);
+	for (int i = 0; i < count; ++i)
+		add(OpaqueKind::InnerAsteroid, i, innerAsteroidTransforms[i], asteroidRadius);
+	int outerCount = std::min(10000, static_cast<int>(outerAsteroidTransforms.size()));
+	for (int i = 0; i < outerCount; ++i)
+		add(OpaqueKind::OuterAsteroid, i, outerAsteroidTransforms[i], asteroidRadius);
+	PartitionAsteroidBelt(view);
+
+	if (m_asteroidField != NULL) {
+		// Whole chunks are meshes or impostors, by the nearest any of their
+		// asteroids can be, so nothing is re-uploaded as the view moves
+		float chunkRadius = m_asteroidField->GetChunkRadius();
+		float asteroidRadius = m_asteroidField->GetAsteroidRadius();
+		for (int i = 0; i < m_asteroidField->GetChunkCount(); ++i) {
+			glm::vec3 viewPos = glm::vec3(view * glm::vec4(m_asteroidField->GetChunkCenter(i), 1.0f));
+			float distance = glm::length(viewPos);
+			AsteroidField::ChunkDraw chunkDraw = AsteroidField::ChunkDraw::Meshes;
+			if (viewPos.z > chunkRadius)
+				chunkDraw = AsteroidField::ChunkDraw::Hidden;  // wholly behind the camera
+			else if (distance > chunkRadius &&
+				IsImpostorSized(viewPos * ((distance - chunkRadius) / distance), asteroidRadius))
+				chunkDraw = AsteroidField::ChunkDraw::Impostors;
+			m_asteroidField->SetChunkDraw(i, chunkDraw);
 		}
-
-		m_asteroid->Render(m_positionAttrib, m_normalAttrib, m_tcAttrib, m_hasTexture);
 	}
 
+	std::sort(m_opaqueDraws.begin(), m_opaqueDraws.end(),
+		[](const OpaqueDraw& a, const OpaqueDraw& b) { return a.depth < b.depth; });
+}
 
-	
-	std::cout << "lightDir = " << glm::to_string(lightDir) << std::endl;
-
-	
-	if (!innerAsteroidTransforms.empty()) {
-		
-		glUniform1i(m_hasTexture, true);
-		glUniformMatrix4fv(m_modelMatrix, 1, GL_FALSE, glm::value_ptr(glm::mat4(1.0f)));
-
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, m_asteroid->getTextureID());
-		GLuint sampler = m_shader->GetUniformLocation("sp");
-		glUniform1i(sampler, 0);
-
-		glBindVertexArray(m_asteroid->getVAO());
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_asteroid->getIBO());
-
-		glDrawElementsInstanced(GL_TRIANGLES, m_asteroid->GetIndexCount(), GL_UNSIGNED_INT, 0, innerAsteroidTransforms.size());
+void Graphics::DrawOpaque(const OpaqueDraw& draw)
+{
+	unsigned impostor = draw.impostor ? SHADER_IMPOSTOR : 0;
+	switch (draw.kind) {
+	case OpaqueKind::Ship: {
+		ShaderVariant* variant = UseVariant(MeshFeatures(m_mesh));
+		if (variant == NULL)
+			break;
+		glUniformMatrix4fv(variant->modelMatrix, 1, GL_FALSE, glm::value_ptr(m_mesh->GetModel()));
+		m_mesh->Render(m_positionAttrib, m_normalAttrib, m_tcAttrib, -1);
+		CountDraw(m_mesh->GetIndexCount() / 3);
+		break;
+	}
 
+	case OpaqueKind::Sun: {
+		// make Sun emissive
+		ShaderVariant* variant = UseVariant(SHADER_EMISSIVE | SphereFeatures(m_sphere) | impostor);
+		if (variant == NULL)
+			break;
+		glUniformMatrix4fv(variant->modelMatrix, 1, GL_FALSE, glm::value_ptr(m_sphere->GetModel()));
+		if (draw.impostor) {
+			BindObjectTextures(m_sphere);
+			DrawImpostor(variant, 1.0f);
+			break;
+		}
+		glUniform1i(variant->spherePrecision, m_sphere->getPrecision());
+		m_sphere->Render(m_positionAttrib, m_normalAttrib, m_tcAttrib, -1);
+		CountDraw(m_sphere->getNumIndices() / 3);
+		break;
 	}
 
-	
-	
-	int outerCount = std::min(10000, static_cast<int>(outerAsteroidTransforms.size()));
-	for (int i = 0; i < outerCount; ++i) {
-		glm::mat4 scaled = outerAsteroidTransforms[i] * glm::scale(glm::vec3(1.0f)); // or whatever size you want
-		m_asteroid->Update(scaled);
-
-		glUniform1i(m_shader->GetUniformLocation("isInstanced"), false);
-		glUniformMatrix4fv(m_modelMatrix, 1, GL_FALSE, glm::value_ptr(m_asteroid->GetModel()));
-
-		if (m_asteroid->hasTex) {
-			glActiveTexture(GL_TEXTURE0);
-			glBindTexture(GL_TEXTURE_2D, m_asteroid->getTextureID());
-			GLuint sampler = m_shader->GetUniformLocation("sp");
-			glUniform1i(sampler, 0);
+	case OpaqueKind::Planet: {
+		Sphere* planet = planetSpheres[draw.index];
+		glm::mat4 model = planet->GetModel();
+		glm::vec3 lightColor, nightColor, lightDir;
+		PlanetLighting(draw.index, lightColor, nightColor, lightDir);
+
+		ShaderVariant* variant = UseVariant(SHADER_NIGHT_BLEND | SphereFeatures(planet) | impostor);
+		if (variant == NULL)
+			break;
+		glUniform3fv(variant->lightColor, 1, glm::value_ptr(lightColor));
+		glUniform3fv(variant->nightColor, 1, glm::value_ptr(nightColor));
+		glUniform3fv(variant->lightDir, 1, glm::value_ptr(lightDir));
+		glUniformMatrix4fv(variant->modelMatrix, 1, GL_FALSE, glm::value_ptr(model));
+		if (draw.impostor) {
+			BindObjectTextures(planet);
+			DrawImpostor(variant, 1.0f);
+			break;
 		}
+		glUniform1i(variant->spherePrecision, planet->getPrecision());
 
-		m_asteroid->Render(m_positionAttrib, m_normalAttrib, m_tcAttrib, m_hasTexture);
+		planet->Render(m_positionAttrib, m_normalAttrib, m_tcAttrib, -1);
+		CountDraw(planet->getNumIndices() / 3);
+		break;
 	}
 
-	
-	if (m_sphere != NULL) {
-		GLint emissiveLoc = m_shader->GetUniformLocation("isEmissive");
-		glUniform1i(emissiveLoc, true); // make Sun emissive
-
-		glUniformMatrix4fv(m_modelMatrix, 1, GL_FALSE, glm::value_ptr(m_sphere->GetModel()));
-		if (m_sphere->hasTex) {
-			glActiveTexture(GL_TEXTURE0);
-			glBindTexture(GL_TEXTURE_2D, m_sphere->getTextureID());
-			GLuint sampler = m_shader->GetUniformLocation("sp");
-			glUniform1i(sampler, 0);
+	case OpaqueKind::Moon: {
+		Moon& m = moons[draw.index];
+		ShaderVariant* variant = UseVariant(SphereFeatures(m.sphere) | impostor);
+		if (variant == NULL)
+			break;
+		glUniformMatrix4fv(variant->modelMatrix, 1, GL_FALSE, glm::value_ptr(m.sphere->GetModel()));
+		if (draw.impostor) {
+			BindObjectTextures(m.sphere);
+			DrawImpostor(variant, 1.0f);
+			break;
 		}
-		m_sphere->Render(m_positionAttrib, m_normalAttrib, m_tcAttrib, m_hasTexture);
+		glUniform1i(variant->spherePrecision, m.sphere->getPrecision());
+		m.sphere->Render(m_positionAttrib, m_normalAttrib, m_tcAttrib, -1);
+		CountDraw(m.sphere->getNumIndices() / 3);
+		break;
+	}
 
-		glUniform1i(emissiveLoc, false); // reset for other objects
+	case OpaqueKind::Bodies: {
+		Sphere* shape = planetSpheres[0];
+		ShaderVariant* variant = UseVariant(BodyBatchFeatures() |
+			(shape->isProcedural() ? SHADER_PROCEDURAL_SPHERE : 0));
+		if (variant == NULL)
+			break;
+		glUniform1i(variant->spherePrecision, shape->getPrecision());
+		m_renderStats.drawCalls += m_bodyBatch->Draw();
+		m_renderStats.triangles += (long long)(m_bodyBatch->GetIndexCount() / 3) *
+			(m_bodyBatch->GetBodyCount() - m_bodyBatch->GetImpostorCount());
+		break;
 	}
 
+	case OpaqueKind::BodyImpostors: {
+		ShaderVariant* variant = UseVariant(BodyBatchFeatures() | SHADER_IMPOSTOR);
+		if (variant == NULL)
+			break;
+		glUniform1f(variant->impostorRadius, 1.0f);
+		m_renderStats.drawCalls += m_bodyBatch->DrawImpostors();
+		m_renderStats.triangles += 2LL * m_bodyBatch->GetImpostorCount();
+		break;
+	}
 
+	case OpaqueKind::InnerAsteroid:
+	case OpaqueKind::OuterAsteroid: {
+		const std::vector<glm::mat4>& belt = draw.kind == OpaqueKind::InnerAsteroid ?
+			innerAsteroidTransforms : outerAsteroidTransforms;
+		m_asteroid->Update(belt[draw.index]);
+
+		ShaderVariant* variant = UseVariant(MeshFeatures(m_asteroid) | impostor);
+		if (variant == NULL)
+			break;
+		glUniformMatrix4fv(variant->modelMatrix, 1, GL_FALSE, glm::value_ptr(m_asteroid->GetModel()));
+		if (draw.impostor) {
+			BindObjectTextures(m_asteroid);
+			DrawImpostor(variant, m_asteroid->GetBoundingRadius());
+			break;
+		}
+		m_asteroid->Render(m_positionAttrib, m_normalAttrib, m_tcAttrib, -1);
+		CountDraw(m_asteroid->GetIndexCount() / 3);
+		break;
+	}
+	}
+}
 
+void Graphics::PlanetLighting(int index, glm::vec3& lightColor, glm::vec3& nightColor, glm::vec3& lightDir) const
+{
 	glm::vec3 sunPos = glm::vec3(0.0f); // Sun is at origin
+	glm::vec3 objPos = glm::vec3(planetSpheres[index]->GetModel()[3]);
+	lightDir = glm::normalize(objPos - sunPos);
+	lightColor = planets[index].lightColor;
+	nightColor = planets[index].nightColor;
+}
 
-	for (size_t i = 0; i < planetSpheres.size(); ++i) {
-		Sphere* planet = planetSpheres[i];
-		const std::string& name = planets[i].name;
-		glm::mat4 model = planet->GetModel();
-		glm::vec3 objPos = glm::vec3(model[3]);
-		glm::vec3 lightDir = glm::normalize(objPos - sunPos);
-		glm::vec3 nightDir = -lightDir;
-
-		glm::vec3 lightColor, nightColor;
+unsigned Graphics::BodyBatchFeatures() const
+{
+	return SHADER_NIGHT_BLEND | SHADER_NORMAL_MAP |
+		(m_bodyTextureMode == BodyTextureMode::Bindless ? SHADER_BINDLESS : SHADER_TEXTURE_ARRAY);
+}
 
-		if (name == "Mercury" || name == "Venus" || name == "Earth") {
-			lightColor = glm::vec3(1.0f, 0.8f, 0.4f);       // warm white
-			nightColor = glm::vec3(0.05f);                 // soft ambient
-		}
-		else if (name == "Mars" || name == "Jupiter" || name == "Saturn") {
-			lightColor = glm::vec3(0.6f, 0.6f, 0.5f);       
-			nightColor = glm::vec3(0.02f, 0.05f, 0.08f);
-		}
-		else if (name == "Uranus" || name == "Neptune") {
-			lightColor = glm::vec3(0.2f, 0.4f, 1.0f);       // soft blue
-			nightColor = glm::vec3(0.1f, 0.1f, 0.2f);
-		}
+void Graphics::BuildBodyBatch()
+{
+	ALLOC_SCOPE("BuildBodyBatch");
+	// Planets then moons, all drawn from the planets' sphere
+	std::vector<GLuint> textures, normalMaps;
+	for (Sphere* planet : planetSpheres) {
+		textures.push_back(planet->hasTex ? planet->getTextureID() : 0);
+		normalMaps.push_back(planet->hasNormalMap() ? planet->getNormalMapID() : 0);
+	}
+	for (const Moon& m : moons) {
+		textures.push_back(m.sphere->hasTex ? m.sphere->getTextureID() : 0);
+		normalMaps.push_back(m.sphere->hasNormalMap() ? m.sphere->getNormalMapID() : 0);
+	}
+	if (planetSpheres.empty() || std::find(textures.begin(), textures.end(), 0u) != textures.end()) {
+		m_bodyTextureMode = BodyTextureMode::Separate;
+		return;
+	}
 
+	Sphere* shape = planetSpheres[0];
+	m_bodyBatch = new BodyBatch();
+	if (!m_bodyBatch->Build(m_bodyTextureMode, shape->getVBO(), shape->getIBO(), shape->getNumIndices(), textures, normalMaps)) {
+		delete m_bodyBatch;
+		m_bodyBatch = NULL;
+		m_bodyTextureMode = BodyTextureMode::Separate;
+	}
+}
 
-		glUniform3fv(m_lightColor, 1, glm::value_ptr(lightColor));
-		glUniform3fv(m_nightColor, 1, glm::value_ptr(nightColor));
-		glUniform3fv(m_ambientColor, 1, glm::value_ptr(ambientColor));
-		glUniform3fv(m_lightDir, 1, glm::value_ptr(lightDir));
-		glUniformMatrix4fv(m_modelMatrix, 1, GL_FALSE, glm::value_ptr(model));
+// Whether a sphere of world radius radius, centred at viewPos in view
+// space, covers less than m_impostorPixels of radius on screen
+bool Graphics::IsImpostorSized(const glm::vec3& viewPos, float radius) const
+{
+	float distance = glm::length(viewPos);
+	return distance > radius && radius * m_impostorScale < m_impostorPixels * distance;
+}
 
-		if (planet->hasTex) {
-			glActiveTexture(GL_TEXTURE0);
-			glBindTexture(GL_TEXTURE_2D, planet->getTextureID());
-			glUniform1i(m_shader->GetUniformLocation("sp"), 0);
-		}
+// The model matrix, any per-body uniforms and the textures are set
+void Graphics::DrawImpostor(ShaderVariant* variant, float radius)
+{
+	glUniform1f(variant->impostorRadius, radius);
+	glBindVertexArray(m_impostorVAO.Get());
+	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	CountDraw(2);
+}
 
-		planet->Render(m_positionAttrib, m_normalAttrib, m_tcAttrib, m_hasTexture);
+// Splits the inner belt's instances into meshes then impostors. The
+// uploaded copy is reordered; innerAsteroidTransforms keeps its order for
+// the spatial index and N-body.
+void Graphics::PartitionAsteroidBelt(const glm::mat4& view)
+{
+	m_beltMeshes = (int)innerAsteroidTransforms.size();
+	if (m_impostorPixels <= 0.0f || innerAsteroidTransforms.empty())
+		return;
+
+	float radius = m_asteroid->GetBoundingRadius();
+	size_t nearEnd = 0, farStart = innerAsteroidTransforms.size();
+	FrameVector<glm::mat4> instances(farStart);
+	for (const glm::mat4& model : innerAsteroidTransforms) {
+		glm::vec3 viewPos = glm::vec3(view * model[3]);
+		if (IsImpostorSized(viewPos, radius * glm::length(glm::vec3(model[0]))))
+			instances[--farStart] = model;
+		else
+			instances[nearEnd++] = model;
 	}
+	m_beltMeshes = (int)nearEnd;
 
+	glBindBuffer(GL_ARRAY_BUFFER, innerAsteroidVBO.Get());
+	glBufferSubData(GL_ARRAY_BUFFER, 0, instances.size() * sizeof(glm::mat4), instances.data());
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
 
+// The whole inner belt in one instanced draw, and its impostors in
+// another. It spans every depth, so it goes after the sorted draws.
+void Graphics::DrawAsteroidBelt()
+{
+	if (innerAsteroidTransforms.empty())
+		return;
 
+	PROFILE_GPU_SCOPE("AsteroidBelt");
+	// Model matrices come from the per-instance attributes
+	if (UseVariant(MeshFeatures(m_asteroid) | SHADER_INSTANCED) == NULL)
+		return;
 
+	if (m_asteroid->hasNormalMap()) {
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, m_asteroid->getNormalMapID());
+	}
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, m_asteroid->getTextureID());
 
+	glBindVertexArray(m_asteroid->getVAO());
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_asteroid->getIBO());
 
-	for (Moon& m : moons) {
-		glUniformMatrix4fv(m_modelMatrix, 1, GL_FALSE, glm::value_ptr(m.sphere->GetModel()));
-		if (m.sphere->hasTex) {
-			glActiveTexture(GL_TEXTURE0);
-			glBindTexture(GL_TEXTURE_2D, m.sphere->getTextureID());
-			GLuint sampler = m_shader->GetUniformLocation("sp");
-			glUniform1i(sampler, 0);
-		}
-		m.sphere->Render(m_positionAttrib, m_normalAttrib, m_tcAttrib, m_hasTexture);
+	if (m_beltMeshes > 0) {
+		glDrawElementsInstanced(GL_TRIANGLES, m_asteroid->GetIndexCount(), GL_UNSIGNED_INT, 0, m_beltMeshes);
+		CountDraw((long long)(m_asteroid->GetIndexCount() / 3) * m_beltMeshes);
 	}
 
-	glUniformMatrix4fv(m_modelMatrix, 1, GL_FALSE, glm::value_ptr(halleysComet.body->GetModel()));
-	if (halleysComet.body->hasTex) {
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, halleysComet.body->getTextureID());
-		GLuint sampler = m_shader->GetUniformLocation("sp");
-		glUniform1i(sampler, 0);
+	int impostors = (int)innerAsteroidTransforms.size() - m_beltMeshes;
+	ShaderVariant* variant = impostors > 0 ?
+		UseVariant(MeshFeatures(m_asteroid) | SHADER_INSTANCED | SHADER_IMPOSTOR) : NULL;
+	if (variant != NULL) {
+		glUniform1f(variant->impostorRadius, m_asteroid->GetBoundingRadius());
+		glDrawArraysInstancedBaseInstance(GL_TRIANGLE_STRIP, 0, 4, impostors, m_beltMeshes);
+		CountDraw(2LL * impostors);
 	}
-	
-	RenderCometTail(currentCometPosition, glm::vec3(0.0f)); 
+}
 
-	
-	auto error = glGetError();
-	if (error != GL_NO_ERROR)
-	{
-		string val = ErrorString(error);
-		
+// Every resident chunk of the field: one multi-draw of meshes and one of
+// impostors. Like the belt it spans every depth, so it goes after the
+// sorted draws.
+void Graphics::DrawAsteroidField()
+{
+	if (m_asteroidField == NULL || m_asteroidField->GetChunkCount() == 0)
+		return;
+
+	PROFILE_GPU_SCOPE("AsteroidFieldDraw");
+	if (UseVariant(MeshFeatures(m_asteroid) | SHADER_INSTANCED) == NULL)
+		return;
+	BindObjectTextures(m_asteroid);
+
+	m_renderStats.drawCalls += m_asteroidField->DrawMeshes();
+	m_renderStats.triangles += (long long)(m_asteroidField->GetIndexCount() / 3) * m_asteroidField->GetMeshCount();
+
+	ShaderVariant* variant = m_asteroidField->GetImpostorCount() > 0 ?
+		UseVariant(MeshFeatures(m_asteroid) | SHADER_INSTANCED | SHADER_IMPOSTOR) : NULL;
+	if (variant != NULL) {
+		glUniform1f(variant->impostorRadius, m_asteroid->GetBoundingRadius());
+		m_renderStats.drawCalls += m_asteroidField->DrawImpostors();
+		m_renderStats.triangles += 2LL * m_asteroidField->GetImpostorCount();
 	}
 }
 
+// Drawn after everything opaque: it sits at the far plane, so early depth
+// testing skips every pixel already covered and only open sky is shaded
+void Graphics::DrawSkybox()
+{
+	PROFILE_GPU_SCOPE("Skybox");
+	glDepthFunc(GL_LEQUAL);
+	Shader* shader = m_overdrawView ? skyboxOverdrawShader : skyboxShader;
+	shader->Enable();
 
-bool Graphics::collectShPrLocs() {
+	glm::mat4 view = glm::mat4(glm::mat3(m_camera->GetView())); // remove translation
+	glm::mat4 projection = m_camera->GetProjection();
 
-	m_lightColor = m_shader->GetUniformLocation("lightColor");
-	m_lightDir = m_shader->GetUniformLocation("lightDir");
-	m_ambientColor = m_shader->GetUniformLocation("ambientColor");
-	m_overrideColor = m_shader->GetUniformLocation("overrideColor");
-	m_nightColor = m_shader->GetUniformLocation("nightColor");
-	m_nightDir = m_shader->GetUniformLocation("nightDir");
+	if (m_overdrawView) {
+		glUniformMatrix4fv(m_skyboxOverdrawView, 1, GL_FALSE, glm::value_ptr(view));
+		glUniformMatrix4fv(m_skyboxOverdrawProjection, 1, GL_FALSE, glm::value_ptr(projection));
+	}
+	else {
+		glUniformMatrix4fv(m_skyboxView, 1, GL_FALSE, glm::value_ptr(view));
+		glUniformMatrix4fv(m_skyboxProjection, 1, GL_FALSE, glm::value_ptr(projection));
+		glUniform1i(m_skyboxSampler, 0);
+	}
 
+	glBindVertexArray(skyboxVAO.Get());
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, cubemapTexture.Get());
+	glDrawArrays(GL_TRIANGLES, 0, 36);
+	CountDraw(12);
+	glBindVertexArray(0);
 
+	glDepthFunc(GL_LESS);  // reset depth
+	m_activeVariant = NULL;
+}
 
+// Additive, so the particles need no sorting; they are depth tested against
+// everything opaque but write no depth themselves
+void Graphics::DrawCometParticles()
+{
+	if (m_cometParticles == NULL)
+		return;
 
-	bool anyProblem = true;
-	// Locate the projection matrix in the shader
-	m_projectionMatrix = m_shader->GetUniformLocation("projectionMatrix");
-	if (m_projectionMatrix == INVALID_UNIFORM_LOCATION)
-	{
-		printf("m_projectionMatrix not found\n");
-		anyProblem = false;
+	PROFILE_GPU_SCOPE("CometParticles");
+	if (!m_overdrawView) {
+		glEnable(GL_BLEND);
+		glBlendFunc(GL_ONE, GL_ONE);
 	}
+	glDepthMask(GL_FALSE);
 
-	m_overrideColor = m_shader->GetUniformLocation("overrideColor");
-	if (m_overrideColor == INVALID_UNIFORM_LOCATION)
-	{
-		printf("overrideColor uniform not found\n");
-		anyProblem = false;
-	}
+	m_cometParticles->Draw(m_camera->GetProjection(), m_camera->GetView());
+	if (m_cometParticles->GetLiveCount() > 0)
+		CountDraw(2LL * m_cometParticles->GetLiveCount());
 
-	// Locate the view matrix in the shader
-	m_viewMatrix = m_shader->GetUniformLocation("viewMatrix");
-	if (m_viewMatrix == INVALID_UNIFORM_LOCATION)
-	{
-		printf("m_viewMatrix not found\n");
-		anyProblem = false;
-	}
+	glDepthMask(GL_TRUE);
+	if (!m_overdrawView)
+		glDisable(GL_BLEND);
+	m_activeVariant = NULL;
+}
 
-	// Locate the model matrix in the shader
-	m_modelMatrix = m_shader->GetUniformLocation("modelMatrix");
-	if (m_modelMatrix == INVALID_UNIFORM_LOCATION)
-	{
-		printf("m_modelMatrix not found\n");
-		anyProblem = false;
-	}
 
-	m_positionAttrib = m_shader->GetAttribLocation("v_position");
+bool Graphics::collectShPrLocs() {
+
+	// Uniform locations are per variant (see ShaderVariants); the vertex
+	// layout is the same in all of them
+	Shader* shader = m_variants->Get(SHADER_TEXTURED)->shader;
+
+	bool anyProblem = true;
+	m_positionAttrib = shader->GetAttribLocation("v_position");
 	if (m_positionAttrib == -1)
 	{
 		printf("v_position attribute not found\n");
@@ -595,27 +1066,49 @@ bool Graphics::collectShPrLocs() {
 	}
 
 	// Locate the color vertex attribute
-	m_normalAttrib = m_shader->GetAttribLocation("v_normal");
+	m_normalAttrib = shader->GetAttribLocation("v_normal");
 
 
 	// Locate the color vertex attribute
-	m_tcAttrib = m_shader->GetAttribLocation("v_tc");
+	m_tcAttrib = shader->GetAttribLocation("v_tc");
 	if (m_tcAttrib == -1)
 	{
 		printf("v_texcoord attribute not found\n");
 		anyProblem = false;
 	}
 
-	m_hasTexture = m_shader->GetUniformLocation("hasTexture");
-	if (m_hasTexture == INVALID_UNIFORM_LOCATION) {
-		printf("hasTexture uniform not found\n");
-		anyProblem = false;
+	return anyProblem;
+}
+
+ShaderVariant* Graphics::UseVariant(unsigned features)
+{
+	// Variants compile on first use and one can fail (reported once, when
+	// it does): draw with the plain one for the same geometry instead, and
+	// skip the draw if even that doesn't build
+	ShaderVariant* variant = m_variants->Get(features | m_passFeatures);
+	if (variant == NULL)
+		variant = m_variants->Get(ShaderVariants::Fallback(features | m_passFeatures));
+	if (variant == NULL)
+		return NULL;
+	if (variant != m_activeVariant)
+	{
+		variant->shader->Enable();
+		m_activeVariant = variant;
 	}
 
-	return anyProblem;
+	if (variant->frame != m_frame)
+	{
+		variant->frame = m_frame;
+		glUniformMatrix4fv(variant->projectionMatrix, 1, GL_FALSE, glm::value_ptr(m_camera->GetProjection()));
+		glUniformMatrix4fv(variant->viewMatrix, 1, GL_FALSE, glm::value_ptr(m_camera->GetView()));
+		glUniform3fv(variant->ambientColor, 1, glm::value_ptr(kAmbientColor));
+		glUniform3fv(variant->lightColor, 1, glm::value_ptr(kSunLightColor));
+		glUniform3fv(variant->lightDir, 1, glm::value_ptr(kSunLightDir));
+	}
+	return variant;
 }
 
-std::string Graphics::ErrorString(GLenum error)
+const char* Graphics::ErrorString(GLenum error)
 {
 	if (error == GL_INVALID_ENUM)
 	{
@@ -651,111 +1144,11 @@ glm::mat4 Graphics::GetStarshipModelMatrix() const {
 	return m_mesh->GetModel();
 }
 
-void Graphics::RenderCometTail(const glm::vec3& cometPos, const glm::vec3& sunPos)
-{
-	if (cometTrailPositions.size() < 2) return;
-
-	glDisable(GL_DEPTH_TEST); 
-
-	glLineWidth(6.0f);  
-
-
-	for (size_t i = 0; i < cometTrailPositions.size() - 1; ++i)
-	{
-		const glm::vec3& start = cometTrailPositions[i];
-		const glm::vec3& end = cometTrailPositions[i + 1];
-
-		// Fade from yellow to transparent black
-		float alpha = 1.0f - static_cast<float>(i) / cometTrailPositions.size();
-		glm::vec3 color = glm::mix(glm::vec3(1.0f, 1.0f, 0.2f), glm::vec3(0.0f), 1.0f - alpha);
-
-		GLfloat tailVertices[] = {
-			start.x, start.y, start.z,
-			end.x,   end.y,   end.z
-		};
-
-		GLuint tailVAO, tailVBO;
-		glGenVertexArrays(1, &tailVAO);
-		glGenBuffers(1, &tailVBO);
-
-		glBindVertexArray(tailVAO);
-		glBindBuffer(GL_ARRAY_BUFFER, tailVBO);
-		glBufferData(GL_ARRAY_BUFFER, sizeof(tailVertices), tailVertices, GL_STATIC_DRAW);
-
-		glEnableVertexAttribArray(m_positionAttrib);
-		glVertexAttribPointer(m_positionAttrib, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
-
-		glUniform1i(m_hasTexture, false);
-		glUniform3f(m_overrideColor, color.r, color.g, color.b);
-		// faded color
-
-		glDrawArrays(GL_LINES, 0, 2);
-
-		glDisableVertexAttribArray(m_positionAttrib);
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-		glBindVertexArray(0);
-		glDeleteBuffers(1, &tailVBO);
-		glDeleteVertexArrays(1, &tailVAO);
-	}
-
-	glUniform3f(m_overrideColor, 0.0f, 0.0f, 0.0f);
-	// reset
-	glEnable(GL_DEPTH_TEST);  // restore
-}
-
-
-GLuint Graphics::loadCubemap(std::vector<std::string> faces) {
-	GLuint textureID;
-	glGenTextures(1, &textureID);
-	glBindTexture(GL_TEXTURE_CUBE_MAP, textureID);
-
-	for (GLuint i = 0; i < faces.size(); i++) {
-		int width, height;
-		unsigned char* data = SOIL_load_image(faces[i].c_str(), &width, &height, 0, SOIL_LOAD_RGB);
-		if (data) {
-			glTexImage2D(
-				GL_TEXTURE_CUBE_MAP_POSITIVE_X + i,
-				0,
-				GL_RGB,
-				width,
-				height,
-				0,
-				GL_RGB,
-				GL_UNSIGNED_BYTE,
-				data
-			);
-			SOIL_free_image_data(data);
-			std::cout << "Loaded cubemap face: " << faces[i] << std::endl;
-		}
-		else {
-			std::cerr << " Failed to load cubemap texture at: " << faces[i] << std::endl;
-
-			// Fallback: make an empty black texture instead of passing null
-			unsigned char black[] = { 0, 0, 0 };
-			glTexImage2D(
-				GL_TEXTURE_CUBE_MAP_POSITIVE_X + i,
-				0,
-				GL_RGB,
-				1,
-				1,
-				0,
-				GL_RGB,
-				GL_UNSIGNED_BYTE,
-				black
-			);
-		}
-	}
-
-	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-
-	return textureID;
+// The sky is black until the faces have streamed in
+void Graphics::loadCubemap(const std::vector<std::string>& faces) {
+	TextureUploader::Get().QueueCubemap(faces, &cubemapTexture);
 }
-void Graphics::GenerateAsteroidBelts() {
-	const int numInner = 800, numOuter = 800;
+void Graphics::GenerateAsteroidBelts(int numInner, int numOuter) {
 	float innerMin = 6.5f, innerMax = 7.0f;
 	float outerMin = 16.0f, outerMax = 17.0f;
 
@@ -785,17 +1178,74 @@ void Graphics::GenerateAsteroidBelts() {
 }
 
 
+void Graphics::EnableNBody(float theta) {
+	// Particles have to persist, so the streamed field gives way to the
+	// two generated belts
+	if (m_asteroidField != NULL) {
+		m_asteroidField->Shutdown();
+		delete m_asteroidField;
+		m_asteroidField = NULL;
+		GenerateAsteroidBelts();
+		SetupAsteroidInstancing();
+		BuildSpatialIndex();
+	}
+
+	if (m_nbody == NULL)
+		m_nbody = new NBodySystem();
+
+	NBodySettings settings;
+	settings.theta = theta;
+	m_nbody->SetSettings(settings);
+	m_nbody->Clear();
+
+	// Seed from the generated belts, each asteroid on a circular orbit
+	for (const glm::mat4& m : innerAsteroidTransforms)
+		m_nbody->AddOrbitingParticle(glm::vec3(m[3]), kAsteroidGM, kSunGM);
+	for (const glm::mat4& m : outerAsteroidTransforms)
+		m_nbody->AddOrbitingParticle(glm::vec3(m[3]), kAsteroidGM, kSunGM);
+
+	m_nbodyAttractors.reserve(planets.size() + 1);
+
+	std::cout << "N-body belts enabled: " << m_nbody->GetParticleCount()
+		<< " particles, theta " << theta << std::endl;
+}
+
+void Graphics::UpdateNBody(double dt) {
+	m_nbodyAttractors.clear();
+	m_nbodyAttractors.push_back({ glm::vec3(0.0f), kSunGM });
+	for (size_t i = 0; i < planets.size(); ++i) {
+		float s = planets[i].scale;
+		m_nbodyAttractors.push_back({ glm::vec3(planetSpheres[i]->GetModel()[3]), kPlanetGMPerVolume * s * s * s });
+	}
+	m_nbody->SetAttractors(m_nbodyAttractors);
+	m_nbody->Step((float)dt);
+
+	// Only the translation changes; keep each asteroid's scale
+	size_t inner = innerAsteroidTransforms.size();
+	for (size_t i = 0; i < inner; ++i)
+		innerAsteroidTransforms[i][3] = glm::vec4(m_nbody->GetPosition(i), 1.0f);
+	for (size_t i = 0; i < outerAsteroidTransforms.size(); ++i)
+		outerAsteroidTransforms[i][3] = glm::vec4(m_nbody->GetPosition(inner + i), 1.0f);
+
+	glBindBuffer(GL_ARRAY_BUFFER, innerAsteroidVBO.Get());
+	glBufferSubData(GL_ARRAY_BUFFER, 0, inner * sizeof(glm::mat4), innerAsteroidTransforms.data());
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+
 void Graphics::SetupAsteroidInstancing() {
 	// Generate buffers
-	glGenBuffers(1, &innerAsteroidVBO);
-	glBindBuffer(GL_ARRAY_BUFFER, innerAsteroidVBO);
-	glBufferData(GL_ARRAY_BUFFER, innerAsteroidTransforms.size() * sizeof(glm::mat4), innerAsteroidTransforms.data(), GL_STATIC_DRAW);
+	// Rewritten every frame with impostors (PartitionAsteroidBelt) or N-body
+	innerAsteroidVBO.Create("Asteroid belt instances");
+	glBindBuffer(GL_ARRAY_BUFFER, innerAsteroidVBO.Get());
+	glBufferData(GL_ARRAY_BUFFER, innerAsteroidTransforms.size() * sizeof(glm::mat4), innerAsteroidTransforms.data(), GL_DYNAMIC_DRAW);
+	innerAsteroidVBO.SetBytes(innerAsteroidTransforms.size() * sizeof(glm::mat4));
 
 	// Bind VAO for the asteroid mesh
 	glBindVertexArray(m_asteroid->getVAO());
 
 	// Bind the instance buffer before defining attributes
-	glBindBuffer(GL_ARRAY_BUFFER, innerAsteroidVBO);
+	glBindBuffer(GL_ARRAY_BUFFER, innerAsteroidVBO.Get());
 
 	// Set up mat4 as 4 vec4s
 	for (int i = 0; i < 4; ++i) {
@@ -810,27 +1260,124 @@ void Graphics::SetupAsteroidInstancing() {
 
 
 glm::vec3 Graphics::GetPlanetPosition(const std::string& name) {
-	for (size_t i = 0; i < planets.size(); ++i) {
-		if (planets[i].name == name) {
-			return glm::vec3(planetSpheres[i]->GetModel()[3]);
-		}
-	}
+	int index = GetPlanetIndex(name);
+	if (index >= 0)
+		return glm::vec3(planetSpheres[index]->GetModel()[3]);
 	return glm::vec3(0.0f); // fallback
 }
 
+int Graphics::GetPlanetIndex(const std::string& name) {
+	auto it = m_planetIndexByName.find(name);
+	return it != m_planetIndexByName.end() ? it->second : -1;
+}
+
+int Graphics::GetClosestPlanetIndex(const glm::vec3& position) {
+	SpatialHit hit;
+	if (m_spatialIndex == NULL || !m_spatialIndex->QueryNearest(position, hit, KindBit(BodyKind::Planet)))
+		return -1;
+	return hit.body.index;
+}
+
 std::string Graphics::GetClosestPlanetName(const glm::vec3& position) {
-	float minDist = std::numeric_limits<float>::max();
-	std::string closestPlanet;
+	int index = GetClosestPlanetIndex(position);
+	return index >= 0 ? planets[index].name : std::string();
+}
 
-	for (size_t i = 0; i < planetSpheres.size(); ++i) {
-		glm::vec3 planetPos = glm::vec3(planetSpheres[i]->GetModel()[3]);
-		float dist = glm::distance(position, planetPos);
+void Graphics::ResolveShipCollisions() {
+	if (m_collision == NULL)
+		return;
 
-		if (dist < minDist) {
-			minDist = dist;
-			closestPlanet = planets[i].name;
-		}
+	// N-body belts move, so the grid has to follow them; the field only
+	// needs it again when chunks come or go
+	if (m_nbody != NULL) {
+		m_collision->BuildAsteroidGrid(innerAsteroidTransforms, outerAsteroidTransforms,
+			m_asteroid->GetBoundingRadius(), glm::length(glm::vec3(m_mesh->GetModel()[0])));
 	}
+	else if (m_asteroidField != NULL && m_asteroidField->GetVersion() != m_asteroidGridVersion) {
+		m_asteroidGridVersion = m_asteroidField->GetVersion();
+		m_collision->BuildAsteroidGrid(m_asteroidField->GetAsteroids(), std::vector<glm::mat4>(),
+			m_asteroid->GetBoundingRadius(), glm::length(glm::vec3(m_mesh->GetModel()[0])));
+	}
+
+	glm::vec3 offset = m_collision->Resolve(m_mesh->GetModel(), m_spatialIndex);
+	if (m_collision->GetLastContactCount() > 0)
+		m_mesh->Translate(offset);
+}
+
+void Graphics::BuildSpatialIndex() {
+	if (m_spatialIndex == NULL)
+		m_spatialIndex = new SpatialIndex();
+	m_spatialIndex->Clear();
+
+	m_sunProxy = m_spatialIndex->CreateProxy(m_sphere->GetPosition(), 1.5f, { BodyKind::Sun, 0 });
+
+	m_planetProxies.clear();
+	for (size_t i = 0; i < planetSpheres.size(); ++i)
+		m_planetProxies.push_back(m_spatialIndex->CreateProxy(planetSpheres[i]->GetPosition(), planets[i].scale, { BodyKind::Planet, (int)i }));
+
+	m_moonProxies.clear();
+	for (size_t i = 0; i < moons.size(); ++i)
+		m_moonProxies.push_back(m_spatialIndex->CreateProxy(moons[i].sphere->GetPosition(), moons[i].scale, { BodyKind::Moon, (int)i }));
 
-	return closestPlanet;
+	// The comet is drawn at unit scale (see HierarchicalUpdate2)
+	m_cometProxy = m_spatialIndex->CreateProxy(halleysComet.body->GetPosition(), 1.0f, { BodyKind::Comet, 0 });
+
+	// Asteroid radius is the mesh bound times the instance scale
+	float meshRadius = m_asteroid->GetBoundingRadius();
+	m_asteroidProxies.clear();
+	m_asteroidProxies.reserve(innerAsteroidTransforms.size() + outerAsteroidTransforms.size());
+	for (const glm::mat4& m : innerAsteroidTransforms) {
+		int index = (int)m_asteroidProxies.size();
+		m_asteroidProxies.push_back(m_spatialIndex->CreateProxy(glm::vec3(m[3]), meshRadius * glm::length(glm::vec3(m[0])), { BodyKind::Asteroid, index }));
+	}
+	for (const glm::mat4& m : outerAsteroidTransforms) {
+		int index = (int)m_asteroidProxies.size();
+		m_asteroidProxies.push_back(m_spatialIndex->CreateProxy(glm::vec3(m[3]), meshRadius * glm::length(glm::vec3(m[0])), { BodyKind::Asteroid, index }));
+	}
+
+	m_fieldProxies.clear();
+	if (m_asteroidField != NULL)
+		SyncFieldProxies();
+}
+
+// The streamed field's asteroids come and go with its chunks; their proxies
+// are made again whenever the resident set changes
+void Graphics::SyncFieldProxies() {
+	ALLOC_SCOPE("AsteroidField");
+	for (int proxy : m_fieldProxies)
+		m_spatialIndex->DestroyProxy(proxy);
+	m_fieldProxies.clear();
+
+	float radius = m_asteroidField->GetAsteroidRadius();
+	const std::vector<glm::mat4>& asteroids = m_asteroidField->GetAsteroids();
+	m_fieldProxies.reserve(asteroids.size());
+	for (size_t i = 0; i < asteroids.size(); ++i)
+		m_fieldProxies.push_back(m_spatialIndex->CreateProxy(glm::vec3(asteroids[i][3]), radius, { BodyKind::Asteroid, (int)i }));
+	m_fieldProxyVersion = m_asteroidField->GetVersion();
+}
+
+void Graphics::RefitSpatialIndex() {
+	if (m_spatialIndex == NULL)
+		return;
+
+	m_spatialIndex->MoveProxy(m_sunProxy, m_sphere->GetPosition(), 1.5f);
+	for (size_t i = 0; i < m_planetProxies.size(); ++i)
+		m_spatialIndex->MoveProxy(m_planetProxies[i], planetSpheres[i]->GetPosition(), planets[i].scale);
+	for (size_t i = 0; i < m_moonProxies.size(); ++i)
+		m_spatialIndex->MoveProxy(m_moonProxies[i], moons[i].sphere->GetPosition(), moons[i].scale);
+	m_spatialIndex->MoveProxy(m_cometProxy, halleysComet.body->GetPosition(), 1.0f);
+
+	if (m_asteroidField != NULL && m_asteroidField->GetVersion() != m_fieldProxyVersion)
+		SyncFieldProxies();
+
+	// Belts are static unless the N-body mode is moving them
+	if (m_nbody == NULL)
+		return;
+
+	size_t inner = innerAsteroidTransforms.size();
+	for (size_t i = 0; i < m_asteroidProxies.size(); ++i) {
+		int proxy = m_asteroidProxies[i];
+		const glm::mat4& m = i < inner ? innerAsteroidTransforms[i] : outerAsteroidTransforms[i - inner];
+		m_spatialIndex->MoveProxy(proxy, glm::vec3(m[3]), m_spatialIndex->GetRadius(proxy));
+	}
 }
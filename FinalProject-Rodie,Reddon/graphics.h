@@ -3,16 +3,26 @@
 
 #include <iostream>
 #include <stack>
+#include <unordered_map>
 #include <vector>
 using namespace std;
 
 #include "graphics_headers.h"
 #include "camera.h"
 #include "shader.h"
+#include "shadervariants.h"
+#include "bodybatch.h"
+#include "asteroidfield.h"
+#include "cometparticles.h"
+#include "postprocess.h"
+#include "dynamicresolution.h"
 #include "object.h"
 #include "sphere.h"
 #include "mesh.h"
 #include "gamemode.h"
+#include "nbody.h"
+#include "spatial_index.h"
+#include "collision.h"
 
 
 #define numVBOs 2;
@@ -36,8 +46,9 @@ struct CelestialBody {
     float scale;
     float axialTilt;
     std::string texturePath;
-    glm::vec3 lightColor = glm::vec3(1.0f); 
-    glm::vec3 nightColor = glm::vec3(0.1f);
+    // The sun's light on the day side, and what is left on the night side
+    glm::vec3 lightColor = glm::vec3(1.0f);
+    glm::vec3 nightColor = glm::vec3(0.0f);
 };
 
 
@@ -59,6 +70,12 @@ extern Comet halleysComet;
 
 
 
+// What the last Render submitted
+struct RenderStats {
+    int drawCalls = 0;
+    long long triangles = 0;
+};
+
 class Graphics
 {
 public:
@@ -67,74 +84,177 @@ public:
     bool Initialize(int width, int height);
     void HierarchicalUpdate2(double dt);
     void Render();
-    void GenerateAsteroidBelts();
+    void GenerateAsteroidBelts(int innerCount = 800, int outerCount = 800);
     glm::mat4 GetStarshipModelMatrix() const;
     void SetupAsteroidInstancing();
-  
-    GLint m_lightColor;
-    GLint m_lightDir;
-    GLint m_ambientColor;
-    GLint m_overrideColor;
-
+    void EnableNBody(float theta);
+    // Both must be set before Initialize, which builds the shaders they need
+    void SetDepthPrepass(bool enabled) { m_depthPrepass = enabled; }
+    void SetOverdrawView(bool enabled) { m_overdrawView = enabled; }
+    void SetBodyTextureMode(BodyTextureMode mode) { m_bodyTextureMode = mode; }
+    void SetProceduralSpheres(bool enabled) { m_proceduralSpheres = enabled; }
+    void SetImpostorPixels(float pixels) { m_impostorPixels = pixels; }
+    void SetAsteroidFieldSettings(const AsteroidFieldSettings& settings) { m_fieldSettings = settings; }
+    void SetCometParticleSettings(const CometParticleSettings& settings) { m_cometSettings = settings; }
+    // With neither pass on the scene is drawn straight to the output
+    void SetPostProcessSettings(const PostProcessSettings& settings) { m_postSettings = settings; }
+    // The scene drawn below the output size when the GPU is over its time
+    void SetDynamicResolution(bool enabled, const DynamicResolutionSettings& settings) { m_dynamicResolutionWanted = enabled; m_dynamicSettings = settings; }
+    // Where each frame ends up (see Window::GetFramebuffer)
+    void SetOutputFramebuffer(GLuint fbo) { m_outputFramebuffer = fbo; }
+    // The output changed size; between frames
+    void Resize(int width, int height);
 
     Camera* getCamera() { return m_camera; }
     Mesh* getMesh() { return m_mesh; }
-    void RenderCometTail(const glm::vec3& cometPos, const glm::vec3& sunPos);
     void SetGameMode(GameMode mode) { currentMode = mode; }
     glm::vec3 GetPlanetPosition(const std::string& name);
     std::string GetClosestPlanetName(const glm::vec3& position);
+    int GetClosestPlanetIndex(const glm::vec3& position);
+    SpatialIndex* GetSpatialIndex() { return m_spatialIndex; }
+    // NULL once --nbody has swapped in the fixed belts
+    AsteroidField* GetAsteroidField() { return m_asteroidField; }
+    // NULL unless SetDynamicResolution was given true
+    DynamicResolution* GetDynamicResolution() { return m_dynamicResolution; }
+    const RenderStats& GetRenderStats() const { return m_renderStats; }
+    int GetPlanetIndex(const std::string& name);
 
 private:
-    std::string ErrorString(GLenum error);
+    // --microbench regenerates the belts in place
+    friend class MicroBenchAccess;
+
+    const char* ErrorString(GLenum error);
+    void CountDraw(long long triangles) { m_renderStats.drawCalls++; m_renderStats.triangles += triangles; }
+    RenderStats m_renderStats;
     GameMode currentMode;
 
     bool collectShPrLocs();
-    void ComputeTransforms(double dt, std::vector<float> speed, std::vector<float> dist,
-        std::vector<float> rotSpeed, glm::vec3 rotVector, std::vector<float> scale,
+    // Binds the variant for a feature mask, uploading the per-frame uniforms
+    // the first time it is used in a frame
+    ShaderVariant* UseVariant(unsigned features);
+
+    // Opaque draws, sorted front to back each frame so early depth testing
+    // rejects as much hidden surface as it can
+    enum class OpaqueKind { Ship, Sun, Planet, Moon, Bodies, BodyImpostors, InnerAsteroid, OuterAsteroid };
+    struct OpaqueDraw {
+        float depth;        // view depth of the nearest point of its bounding sphere
+        OpaqueKind kind;
+        int index;          // into planetSpheres, moons or an asteroid belt
+        bool impostor;      // small enough on screen to be an IMPOSTOR square
+    };
+    void CollectOpaqueDraws();
+    void DrawOpaque(const OpaqueDraw& draw);
+    void DrawAsteroidBelt();
+    void DrawAsteroidField();
+    void DrawSkybox();
+    void DrawCometParticles();
+    std::vector<OpaqueDraw> m_opaqueDraws;
+    unsigned m_passFeatures = 0;    // added to every variant: DEPTH_ONLY or OVERDRAW
+    bool m_depthPrepass = false;    // --depth-prepass
+    bool m_overdrawView = false;    // --overdraw
+    bool m_proceduralSpheres = false;   // --procedural-spheres
+
+    // Spheres, and asteroids, under m_impostorPixels of radius on screen
+    // are drawn as IMPOSTOR squares, four vertices each. The field decides
+    // per chunk; the N-body inner belt is split every frame: meshes first
+    // in its instance buffer, then impostors.
+    bool IsImpostorSized(const glm::vec3& viewPos, float radius) const;
+    void DrawImpostor(ShaderVariant* variant, float radius);
+    void PartitionAsteroidBelt(const glm::mat4& view);
+    float m_impostorPixels = 12.0f;     // --impostor-pixels, 0 = never
+    float m_impostorScale = 0.0f;       // pixels of radius per unit of radius/distance, this frame
+    int m_viewportHeight = 0;
+    GpuVertexArray m_impostorVAO;       // no attributes
+    int m_beltMeshes = 0;
+
+    // Planets then moons in one batch (--body-textures), built once their
+    // textures have streamed in. Until then, and with Separate, each body
+    // is its own Planet or Moon draw.
+    void BuildBodyBatch();
+    unsigned BodyBatchFeatures() const;
+    void PlanetLighting(int index, glm::vec3& lightColor, glm::vec3& nightColor, glm::vec3& lightDir) const;
+    BodyTextureMode m_bodyTextureMode = BodyTextureMode::Auto;
+    BodyBatch* m_bodyBatch = NULL;
+    std::vector<BatchedBody> m_batchBodies;
+    void ComputeTransforms(double dt, const glm::vec3& speed, const glm::vec3& dist,
+        float rotSpeed, glm::vec3 rotVector, const glm::vec3& scale,
         glm::mat4& tmat, glm::mat4& rmat, glm::mat4& smat);
-    GLuint loadCubemap(std::vector<std::string> faces);
+    void loadCubemap(const std::vector<std::string>& faces);
 
-    stack<glm::mat4> modelStack;
+    Camera* m_camera = NULL;
+    ShaderVariants* m_variants = NULL;
+    ShaderVariant* m_activeVariant = NULL;
+    unsigned m_frame = 0;
+    Mesh* m_mesh = NULL;
+    Mesh* m_asteroid = NULL;
 
-    Camera* m_camera;
-    Shader* m_shader;
-    Mesh* m_mesh;
-    Mesh* m_asteroid;
+    // Streamed around the ship. N-body needs a fixed set of particles, so
+    // EnableNBody replaces it with the two generated belts below.
+    AsteroidField* m_asteroidField = NULL;
+    AsteroidFieldSettings m_fieldSettings;
+    unsigned m_asteroidGridVersion = 0;     // field version the collision grid was built from
 
     std::vector<glm::mat4> innerAsteroidTransforms;
     std::vector<glm::mat4> outerAsteroidTransforms;
 
 
-    GLint m_projectionMatrix;
-    GLint m_viewMatrix;
-    GLint m_modelMatrix;
     GLint m_positionAttrib;
     GLint m_normalAttrib;
     GLint m_tcAttrib;
-    GLint m_hasTexture;
-    GLuint innerAsteroidVBO, outerAsteroidVBO;
+    GpuBuffer innerAsteroidVBO;
+
+    // Optional N-body belts (--nbody). Particles [0, inner) are the inner belt.
+    void UpdateNBody(double dt);
+    NBodySystem* m_nbody = NULL;
+    std::vector<Attractor> m_nbodyAttractors;
+
+    // Every body and asteroid, refit each frame in HierarchicalUpdate2.
+    // Asteroid BodyRef indices run through the inner belt then the outer
+    // belt, or, with the streamed field, through its GetAsteroids.
+    void BuildSpatialIndex();
+    void RefitSpatialIndex();
+    void SyncFieldProxies();
+    SpatialIndex* m_spatialIndex = NULL;
+    int m_sunProxy = -1;
+    int m_cometProxy = -1;
+    std::vector<int> m_planetProxies;
+    std::vector<int> m_moonProxies;
+    std::vector<int> m_asteroidProxies;
+    std::vector<int> m_fieldProxies;
+    unsigned m_fieldProxyVersion = 0;       // field version m_fieldProxies were made from
+    std::unordered_map<std::string, int> m_planetIndexByName;
+
+    // Ship against planets (spatial index) and asteroids (hash grid)
+    void ResolveShipCollisions();
+    CollisionSystem* m_collision = NULL;
 
     double totalTime = 0.0; 
 
-    GLint m_nightColor;
-    GLint m_nightDir;
-
-
-    GLint overrideColorLoc;
-
-
     glm::vec3 currentCometPosition = glm::vec3(0.0f);
     glm::vec3 previousCometPosition = glm::vec3(0.0f);
     glm::vec3 cometVelocity = glm::vec3(0.0f);
 
-    std::deque<glm::vec3> cometTrailPositions;  
-    const size_t maxTrailLength = 50;           
+    // The coma and tail, simulated and drawn on the GPU. NULL if the
+    // context has no compute shaders.
+    CometParticles* m_cometParticles = NULL;
+    CometParticleSettings m_cometSettings;
+
+    // The scene is drawn in HDR and bloomed and tone mapped into
+    // m_outputFramebuffer. NULL with the overdraw view, which has to count
+    // raw fragments.
+    PostProcess* m_postProcess = NULL;
+    PostProcessSettings m_postSettings;
+    GLuint m_outputFramebuffer = 0;
+
+    // Sets m_postProcess's render scale each frame
+    DynamicResolution* m_dynamicResolution = NULL;
+    DynamicResolutionSettings m_dynamicSettings;
+    bool m_dynamicResolutionWanted = false;
 
 
 
 
-    Sphere* m_sphere;
-    Sphere* m_sphere2;
+    Sphere* m_sphere = NULL;
    
     //Sphere* m_sphere3;
 
@@ -143,9 +263,17 @@ private:
 
 
     // Skybox members
-    GLuint skyboxVAO, skyboxVBO;
-    GLuint cubemapTexture;
-    Shader* skyboxShader;
+    GpuVertexArray skyboxVAO;
+    GpuBuffer skyboxVBO;
+    GpuTexture cubemapTexture;
+    Shader* skyboxShader = NULL;
+    Shader* skyboxOverdrawShader = NULL;
+    // Looked up once the programs are linked, not every frame
+    GLint m_skyboxView = -1;
+    GLint m_skyboxProjection = -1;
+    GLint m_skyboxSampler = -1;
+    GLint m_skyboxOverdrawView = -1;
+    GLint m_skyboxOverdrawProjection = -1;
 };
 
 #endif /* GRAPHICS_H */
@@ -0,0 +1,300 @@
+#include "input.h"
+
+#include <GLFW/glfw3.h>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+static const char* kActionNames[] = {
+    "quit", "forward", "backward", "left", "right", "roll_left", "roll_right",
+    "pitch_up", "pitch_down", "brake", "boost", "toggle_mode", "drag"
+};
+
+static const struct { const char* name; int key; } kKeyNames[] = {
+    { "SPACE", GLFW_KEY_SPACE }, { "ESCAPE", GLFW_KEY_ESCAPE }, { "ENTER", GLFW_KEY_ENTER },
+    { "TAB", GLFW_KEY_TAB }, { "BACKSPACE", GLFW_KEY_BACKSPACE },
+    { "RIGHT", GLFW_KEY_RIGHT }, { "LEFT", GLFW_KEY_LEFT }, { "DOWN", GLFW_KEY_DOWN }, { "UP", GLFW_KEY_UP },
+    { "LEFT_SHIFT", GLFW_KEY_LEFT_SHIFT }, { "LEFT_CONTROL", GLFW_KEY_LEFT_CONTROL }, { "LEFT_ALT", GLFW_KEY_LEFT_ALT },
+    { "RIGHT_SHIFT", GLFW_KEY_RIGHT_SHIFT }, { "RIGHT_CONTROL", GLFW_KEY_RIGHT_CONTROL }, { "RIGHT_ALT", GLFW_KEY_RIGHT_ALT },
+};
+
+static bool SameName(const char* a, const char* b)
+{
+    for (; *a && *b; a++, b++)
+    {
+        if (toupper((unsigned char)*a) != toupper((unsigned char)*b))
+            return false;
+    }
+    return *a == *b;
+}
+
+bool InputFrame::HasAxes() const
+{
+    for (float value : axes)
+    {
+        if (value != 0.0f)
+            return true;
+    }
+    return false;
+}
+
+InputMap::InputMap()
+{
+    SetDefaults();
+}
+
+void InputMap::SetDefaults()
+{
+    m_bindings.clear();
+    Bind(Action::Quit, GLFW_KEY_ESCAPE);
+    Bind(Action::Forward, GLFW_KEY_W);
+    Bind(Action::Backward, GLFW_KEY_S);
+    Bind(Action::Left, GLFW_KEY_A);
+    Bind(Action::Right, GLFW_KEY_D);
+    Bind(Action::RollLeft, GLFW_KEY_Q);
+    Bind(Action::RollRight, GLFW_KEY_E);
+    Bind(Action::PitchUp, GLFW_KEY_UP);
+    Bind(Action::PitchDown, GLFW_KEY_DOWN);
+    Bind(Action::Brake, GLFW_KEY_SPACE);
+    Bind(Action::Boost, GLFW_KEY_LEFT_SHIFT);
+    Bind(Action::ToggleMode, GLFW_KEY_TAB);
+    Bind(Action::Drag, MouseButton(GLFW_MOUSE_BUTTON_LEFT));
+}
+
+void InputMap::Bind(Action action, int key)
+{
+    // A key drives one action: take it away from whatever had it
+    for (Binding& binding : m_bindings)
+    {
+        if (binding.key == key)
+        {
+            binding.action = action;
+            return;
+        }
+    }
+    m_bindings.push_back({ key, action });
+}
+
+void InputMap::Clear(Action action)
+{
+    for (size_t i = 0; i < m_bindings.size();)
+    {
+        if (m_bindings[i].action == action)
+            m_bindings.erase(m_bindings.begin() + i);
+        else
+            i++;
+    }
+}
+
+bool InputMap::Load(const char* path)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        printf("Could not open key bindings %s\n", path);
+        return false;
+    }
+
+    std::string line;
+    int lineNumber = 0;
+    while (std::getline(file, line))
+    {
+        lineNumber++;
+        size_t comment = line.find('#');
+        if (comment != std::string::npos)
+            line.erase(comment);
+
+        std::istringstream words(line);
+        std::string actionName;
+        if (!(words >> actionName))
+            continue;
+
+        int action = -1;
+        for (int i = 0; i < (int)Action::Count; i++)
+        {
+            if (SameName(actionName.c_str(), kActionNames[i]))
+                action = i;
+        }
+        if (action < 0)
+        {
+            printf("%s:%d: unknown action %s\n", path, lineNumber, actionName.c_str());
+            return false;
+        }
+
+        Clear((Action)action);
+        std::string keyName;
+        while (words >> keyName)
+        {
+            int key = KeyFromName(keyName.c_str());
+            if (key < 0)
+            {
+                printf("%s:%d: unknown key %s\n", path, lineNumber, keyName.c_str());
+                return false;
+            }
+            Bind((Action)action, key);
+        }
+    }
+    return true;
+}
+
+int InputMap::GetAction(int key) const
+{
+    for (const Binding& binding : m_bindings)
+    {
+        if (binding.key == key)
+            return (int)binding.action;
+    }
+    return -1;
+}
+
+const char* InputMap::ActionName(Action action)
+{
+    return kActionNames[(int)action];
+}
+
+int InputMap::KeyFromName(const char* name)
+{
+    // Letters and digits are their ASCII codes in GLFW
+    if (name[0] != '\0' && name[1] == '\0' && isalnum((unsigned char)name[0]))
+        return toupper((unsigned char)name[0]);
+
+    if ((name[0] == 'F' || name[0] == 'f') && isdigit((unsigned char)name[1]))
+    {
+        int n = atoi(name + 1);
+        if (n >= 1 && n <= 12)
+            return GLFW_KEY_F1 + n - 1;
+    }
+
+    if (SameName(name, "MOUSE_LEFT"))
+        return MouseButton(GLFW_MOUSE_BUTTON_LEFT);
+    if (SameName(name, "MOUSE_RIGHT"))
+        return MouseButton(GLFW_MOUSE_BUTTON_RIGHT);
+    if (SameName(name, "MOUSE_MIDDLE"))
+        return MouseButton(GLFW_MOUSE_BUTTON_MIDDLE);
+
+    for (const auto& entry : kKeyNames)
+    {
+        if (SameName(name, entry.name))
+            return entry.key;
+    }
+    return -1;
+}
+
+InputSystem::InputSystem()
+{
+    m_held.reserve(16);
+    m_actions = 0;
+    m_latched = 0;
+    for (float& value : m_axes)
+        value = 0.0f;
+    m_haveCursor = false;
+    m_lastX = 0.0;
+    m_lastY = 0.0;
+}
+
+void InputSystem::SetMap(const InputMap& map)
+{
+    m_map = map;
+    ReleaseAll();
+}
+
+void InputSystem::SetHeld(int key, bool down)
+{
+    int action = m_map.GetAction(key);
+    if (action < 0)
+        return;
+
+    uint16_t bit = (uint16_t)(1u << action);
+    if (down)
+    {
+        for (int held : m_held)
+        {
+            if (held == key)
+                return;
+        }
+        m_held.push_back(key);
+        m_actions |= bit;
+        m_latched |= bit;
+        return;
+    }
+
+    // Released: the action stays down while another of its keys is held
+    bool stillDown = false;
+    for (size_t i = 0; i < m_held.size();)
+    {
+        if (m_held[i] == key)
+        {
+            m_held[i] = m_held.back();
+            m_held.pop_back();
+            continue;
+        }
+        if (m_map.GetAction(m_held[i]) == action)
+            stillDown = true;
+        i++;
+    }
+    if (!stillDown)
+        m_actions &= (uint16_t)~bit;
+}
+
+void InputSystem::OnKey(int key, int action)
+{
+    // GLFW_REPEAT changes nothing
+    if (action == GLFW_PRESS || action == GLFW_RELEASE)
+        SetHeld(key, action == GLFW_PRESS);
+}
+
+void InputSystem::OnMouseButton(int button, int action)
+{
+    if (action == GLFW_PRESS || action == GLFW_RELEASE)
+        SetHeld(InputMap::MouseButton(button), action == GLFW_PRESS);
+}
+
+void InputSystem::OnCursor(double x, double y)
+{
+    if (!m_haveCursor)
+    {
+        m_lastX = x;
+        m_lastY = y;
+        m_haveCursor = true;
+        return;
+    }
+
+    float dx = (float)(x - m_lastX);
+    float dy = (float)(m_lastY - y); // reversed: y-coordinates go from bottom to top
+    m_lastX = x;
+    m_lastY = y;
+
+    m_axes[(int)Axis::LookX] += dx;
+    m_axes[(int)Axis::LookY] += dy;
+    if (IsDown(Action::Drag))
+    {
+        m_axes[(int)Axis::DragX] += dx;
+        m_axes[(int)Axis::DragY] += dy;
+    }
+}
+
+void InputSystem::OnScroll(double yoffset)
+{
+    m_axes[(int)Axis::Zoom] += (float)yoffset;
+}
+
+void InputSystem::ReleaseAll()
+{
+    m_held.clear();
+    m_actions = 0;
+}
+
+void InputSystem::Snapshot(InputFrame& frame)
+{
+    frame.previous = frame.actions;
+    frame.actions = m_actions | m_latched;
+    m_latched = 0;
+    for (int i = 0; i < (int)Axis::Count; i++)
+    {
+        frame.axes[i] = m_axes[i];
+        m_axes[i] = 0.0f;
+    }
+}
@@ -0,0 +1,107 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <cstdint>
+#include <vector>
+
+// Things the player can do, one bit each in InputFrame::actions
+enum class Action {
+    Quit, Forward, Backward, Left, Right, RollLeft, RollRight,
+    PitchUp, PitchDown, Brake, Boost, ToggleMode, Drag,
+    Count
+};
+
+// Analog input, summed over a frame's mouse events
+enum class Axis {
+    LookX, LookY,   // cursor movement in pixels, y up
+    DragX, DragY,   // the same, counted only while Drag is held
+    Zoom,           // scroll wheel
+    Count
+};
+
+// Everything the game takes from the player in one frame. Plain data, so it
+// can be logged (--record), replayed, or handed to another thread.
+struct InputFrame
+{
+    float dt = 0.0f;
+    uint16_t actions = 0;
+    uint16_t previous = 0;      // actions of the frame before, for Pressed()
+    float axes[(int)Axis::Count] = {};
+    uint8_t mode = 0;           // GameMode at the end of the frame
+    bool modeChanged = false;
+
+    bool Down(Action action) const { return (actions >> (int)action) & 1; }
+    bool Pressed(Action action) const { return Down(action) && !((previous >> (int)action) & 1); }
+    float Value(Axis axis) const { return axes[(int)axis]; }
+    bool HasAxes() const;
+};
+
+// Which keys and mouse buttons trigger which action. A key drives one action;
+// an action can have several keys. Keys are GLFW key codes, or MouseButton(n).
+class InputMap
+{
+public:
+    InputMap();
+
+    void SetDefaults();
+    void Bind(Action action, int key);
+    void Clear(Action action);
+    // Lines of "action key [key ...]", e.g. "forward W UP"; '#' starts a comment.
+    // Actions that appear are rebound, the rest keep their keys.
+    bool Load(const char* path);
+
+    int GetAction(int key) const;   // -1 when unbound
+
+    static int MouseButton(int button) { return kMouseButtonBase + button; }
+    static const char* ActionName(Action action);
+    static int KeyFromName(const char* name);   // -1 when unknown
+
+private:
+    static const int kMouseButtonBase = 0x1000;
+
+    struct Binding
+    {
+        int key;
+        Action action;
+    };
+    std::vector<Binding> m_bindings;
+};
+
+// Collects GLFW key, mouse button, cursor and scroll callbacks. Events update
+// the held actions and add to the axes as they arrive; Snapshot() hands the
+// result to the frame, so nothing is polled.
+class InputSystem
+{
+public:
+    InputSystem();
+
+    void SetMap(const InputMap& map);
+
+    void OnKey(int key, int action);
+    void OnMouseButton(int button, int action);
+    void OnCursor(double x, double y);
+    void OnScroll(double yoffset);
+    // Focus lost: the release events won't come
+    void ReleaseAll();
+    // The next cursor event only sets the reference point (no jump)
+    void ResetCursor() { m_haveCursor = false; }
+
+    // Live state, between snapshots
+    bool IsDown(Action action) const { return (m_actions >> (int)action) & 1; }
+
+    void Snapshot(InputFrame& frame);
+
+private:
+    void SetHeld(int key, bool down);
+
+    InputMap m_map;
+    std::vector<int> m_held;    // bound keys currently down
+    uint16_t m_actions;         // held now
+    uint16_t m_latched;         // pressed since the last snapshot, so taps shorter than a frame count
+    float m_axes[(int)Axis::Count];
+    bool m_haveCursor;
+    double m_lastX;
+    double m_lastY;
+};
+
+#endif /* INPUT_H */
@@ -0,0 +1,154 @@
+#include "input_record.h"
+
+#include <cstring>
+
+static const char kMagic[4] = { 'S', 'S', 'I', 'N' };
+static const uint16_t kVersion = 2;
+
+static const uint8_t kHasAxes = 1;
+static const uint8_t kModeChanged = 2;
+
+static const size_t kAxesSize = (size_t)Axis::Count * sizeof(float);
+
+InputRecorder::InputRecorder()
+{
+    m_file = NULL;
+    m_frames = 0;
+}
+
+InputRecorder::~InputRecorder()
+{
+    Close();
+}
+
+bool InputRecorder::Open(const char* path)
+{
+    m_file = fopen(path, "wb");
+    if (m_file == NULL)
+    {
+        printf("Could not create input recording %s\n", path);
+        return false;
+    }
+    uint16_t header[2] = { kVersion, 0 };
+    fwrite(kMagic, 1, sizeof(kMagic), m_file);
+    fwrite(header, sizeof(uint16_t), 2, m_file);
+    m_frames = 0;
+    return true;
+}
+
+void InputRecorder::WriteFrame(const InputFrame& frame)
+{
+    if (m_file == NULL)
+        return;
+
+    uint8_t flags = 0;
+    if (frame.HasAxes())
+        flags |= kHasAxes;
+    if (frame.modeChanged)
+        flags |= kModeChanged;
+
+    fwrite(&flags, 1, 1, m_file);
+    fwrite(&frame.dt, sizeof(float), 1, m_file);
+    fwrite(&frame.actions, sizeof(uint16_t), 1, m_file);
+    if (flags & kHasAxes)
+        fwrite(frame.axes, sizeof(float), (size_t)Axis::Count, m_file);
+    if (flags & kModeChanged)
+        fwrite(&frame.mode, 1, 1, m_file);
+    m_frames++;
+}
+
+void InputRecorder::Close()
+{
+    if (m_file == NULL)
+        return;
+    fclose(m_file);
+    m_file = NULL;
+}
+
+InputReplay::InputReplay()
+{
+    m_next = 0;
+}
+
+bool InputReplay::Open(const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        printf("Could not open input recording %s\n", path);
+        return false;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    m_data.resize(size > 0 ? (size_t)size : 0);
+    size_t read = fread(m_data.data(), 1, m_data.size(), file);
+    fclose(file);
+
+    uint16_t version = 0;
+    if (read != m_data.size() || m_data.size() < 8 || memcmp(m_data.data(), kMagic, 4) != 0)
+    {
+        printf("%s is not an input recording\n", path);
+        return false;
+    }
+    memcpy(&version, &m_data[4], sizeof(uint16_t));
+    if (version != kVersion)
+    {
+        printf("%s is recording version %d, expected %d\n", path, version, kVersion);
+        return false;
+    }
+
+    // Index the frames so a truncated file is caught now, not mid-replay
+    m_offsets.clear();
+    size_t pos = 8;
+    while (pos < m_data.size())
+    {
+        size_t start = pos;
+        if (pos + 7 > m_data.size())
+            break;
+        uint8_t flags = m_data[pos];
+        pos += 7;
+        if (flags & kHasAxes)
+            pos += kAxesSize;
+        if (flags & kModeChanged)
+            pos += 1;
+        if (pos > m_data.size())
+            break;
+        m_offsets.push_back(start);
+    }
+    if (pos != m_data.size())
+        printf("%s: ignoring a truncated frame at the end\n", path);
+
+    m_next = 0;
+    return true;
+}
+
+bool InputReplay::ReadFrame(InputFrame& frame)
+{
+    if (m_next >= (int)m_offsets.size())
+        return false;
+
+    const uint8_t* p = &m_data[m_offsets[m_next++]];
+    uint8_t flags = *p++;
+    memcpy(&frame.dt, p, sizeof(float));
+    p += sizeof(float);
+    frame.previous = frame.actions;
+    memcpy(&frame.actions, p, sizeof(uint16_t));
+    p += sizeof(uint16_t);
+
+    if (flags & kHasAxes)
+    {
+        memcpy(frame.axes, p, kAxesSize);
+        p += kAxesSize;
+    }
+    else
+    {
+        for (float& value : frame.axes)
+            value = 0.0f;
+    }
+
+    frame.modeChanged = (flags & kModeChanged) != 0;
+    if (frame.modeChanged)
+        frame.mode = *p;
+    return true;
+}
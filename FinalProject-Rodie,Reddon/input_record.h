@@ -0,0 +1,50 @@
+#ifndef INPUT_RECORD_H
+#define INPUT_RECORD_H
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+#include "input.h"
+
+// Session log (--record). Written in the machine's own byte order, so it
+// replays only on one with the same (every x86 and ARM target here is
+// little-endian). One record per frame:
+//
+//     u8 flags (1 = axes follow, 2 = mode changed), f32 dt, u16 actions,
+//     [f32 * Axis::Count], [u8 mode]
+//
+// Typically 7 bytes a frame, so a ten minute session is a few hundred KB.
+class InputRecorder
+{
+public:
+    InputRecorder();
+    ~InputRecorder();
+
+    bool Open(const char* path);
+    void WriteFrame(const InputFrame& frame);
+    void Close();
+    int GetFrameCount() const { return m_frames; }
+
+private:
+    FILE* m_file;
+    int m_frames;
+};
+
+// Reads a whole log up front (--replay)
+class InputReplay
+{
+public:
+    InputReplay();
+
+    bool Open(const char* path);
+    bool ReadFrame(InputFrame& frame);
+    int GetFrameCount() const { return (int)m_offsets.size(); }
+    int GetPosition() const { return m_next; }
+
+private:
+    std::vector<uint8_t> m_data;
+    std::vector<size_t> m_offsets;  // start of each frame record
+    int m_next;
+};
+
+#endif /* INPUT_RECORD_H */
@@ -1,12 +1,39 @@
 #include <iostream>
 
 #include "engine.h"
+#include "options.h"
+#include "microbench.h"
 
 
 int main(int argc, char** argv)
 {
+    LaunchOptions options;
+    if (!ParseOptions(argc, argv, options))
+    {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+
+    if (options.nbodyBench)
+    {
+        NBodySystem::RunBenchmark();
+        return 0;
+    }
+
+    if (options.microbench)
+    {
+        // Spheres, meshes and the scene need a GL context; nobody needs to see it
+        Window window("Micro-benchmarks", &options.width, &options.height, true);
+        if (!window.Initialize())
+        {
+            printf("The headless context failed to start.\n");
+            return 1;
+        }
+        return RunMicroBenchmarks(options.microbenchFilter, options.microbenchOut);
+    }
+
     // Start an engine and run it then cleanup after
-    Engine* engine = new Engine("Tutorial Window Name", 800, 600);
+    Engine* engine = new Engine("Tutorial Window Name", options.width, options.height, options);
     if (!engine->Initialize())
     {
         printf("The engine failed to start.\n");
@@ -19,4 +46,3 @@ int main(int argc, char** argv)
     engine = NULL;
     return 0;
 }
-
@@ -1,4 +1,5 @@
 #include "mesh.h"
+#include <algorithm>
 
 Mesh::Mesh()
 {
@@ -63,6 +64,8 @@ Mesh::~Mesh()
 {
 	Vertices.clear();
 	Indices.clear();
+	delete m_texture;
+	delete m_normalMap;
 }
 
 void Mesh::Update(glm::mat4 inmodel)
@@ -76,17 +79,22 @@ glm::mat4 Mesh::GetModel()
 	return model;
 }
 
+void Mesh::setNormalMap(const char* fname)
+{
+	m_normalMap = new Texture(fname, true);
+}
+
 
 void Mesh::Render(GLint posAttribLoc, GLint normAttribLoc, GLint tcAttribLoc, GLint hasTextureLoc)
 {
-	glBindVertexArray(vao);
+	glBindVertexArray(vao.Get());
 	// Enable vertex attibute arrays for each vertex attrib
 	glEnableVertexAttribArray(posAttribLoc);
 	glEnableVertexAttribArray(normAttribLoc);
 	glEnableVertexAttribArray(tcAttribLoc);
 
 	// Bind your VBO
-	glBindBuffer(GL_ARRAY_BUFFER, VB);
+	glBindBuffer(GL_ARRAY_BUFFER, VB.Get());
 
 	// Set vertex attribute pointers to the load correct data
 	glVertexAttribPointer(posAttribLoc, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, vertex));
@@ -103,10 +111,15 @@ void Mesh::Render(GLint posAttribLoc, GLint normAttribLoc, GLint tcAttribLoc, GL
 		glUniform1i(hasTextureLoc, false);
 	}
 
+	if (m_normalMap != NULL) {
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, m_normalMap->getTextureID());
+		glActiveTexture(GL_TEXTURE0);
+	}
 
 
 	// Bind your Element Array
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, IB);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, IB.Get());
 
 	// Render
 	glDrawElements(GL_TRIANGLES, Indices.size(), GL_UNSIGNED_INT, 0);
@@ -122,17 +135,19 @@ void Mesh::Render(GLint posAttribLoc, GLint normAttribLoc, GLint tcAttribLoc, GL
 bool Mesh::InitBuffers() {
 
 	// For OpenGL 3
-	glGenVertexArrays(1, &vao);
-	glBindVertexArray(vao);
+	vao.Create("Mesh vertex array");
+	glBindVertexArray(vao.Get());
 
-	glGenBuffers(1, &VB);
-	glBindBuffer(GL_ARRAY_BUFFER, VB);
+	VB.Create("Mesh vertices");
+	glBindBuffer(GL_ARRAY_BUFFER, VB.Get());
 	glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * Vertices.size(), &Vertices[0], GL_STATIC_DRAW);
+	VB.SetBytes(sizeof(Vertex) * Vertices.size());
 
 
-	glGenBuffers(1, &IB);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, IB);
+	IB.Create("Mesh indices");
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, IB.Get());
 	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(unsigned int) * Indices.size(), &Indices[0], GL_STATIC_DRAW);
+	IB.SetBytes(sizeof(unsigned int) * Indices.size());
 
 	return true;
 }
@@ -174,6 +189,13 @@ bool Mesh::loadModelFromFile(const char* path) {
 				glm::vec2 texCoord(tex.x, tex.y);  // Discard tex.z
 
 				Vertices.push_back(Vertex(position, normal, texCoord));
+				boundingRadius = std::max(boundingRadius, glm::length(position));
+				if (Vertices.size() == 1) {
+					boundsMin = position;
+					boundsMax = position;
+				}
+				boundsMin = glm::min(boundsMin, position);
+				boundsMax = glm::max(boundsMax, position);
 
 				
 				if (iTotalVerts + Vertices.size() < 5) {
@@ -216,6 +238,11 @@ void Mesh::MoveForward(float amount) {
 }
 
 
+void Mesh::Translate(const glm::vec3& worldOffset) {
+	model[3] += glm::vec4(worldOffset, 0.0f);
+}
+
+
 void Mesh::Brake() {
 	
 	glm::vec3 position = glm::vec3(model[3]); 
@@ -19,6 +19,7 @@ public:
     void Rotate(float 
         , float yaw, float roll);
     void MoveForward(float amount);
+    void Translate(const glm::vec3& worldOffset);
     void Brake();
     glm::mat4 GetModel();
 
@@ -26,25 +27,42 @@ public:
     bool loadModelFromFile(const char* path);
 
     bool hasTex;
-    GLuint getIBO() const { return IB; }
+    GLuint getVBO() const { return VB.Get(); }
+    GLuint getIBO() const { return IB.Get(); }
     GLuint getTextureID() { return m_texture->getTextureID(); }
-    GLuint getVAO() const { return vao; }
+
+    // Tangent-space normal map on unit 1. Meshes have no tangents; the
+    // shader builds the frame from screen-space derivatives.
+    void setNormalMap(const char* fname);
+    bool hasNormalMap() const { return m_normalMap != NULL; }
+    GLuint getNormalMapID() { return m_normalMap->getTextureID(); }
+    GLuint getVAO() const { return vao.Get(); }
     int GetIndexCount() const { return Indices.size(); }
+    float GetBoundingRadius() const { return boundingRadius; }
+    glm::vec3 GetBoundsMin() const { return boundsMin; }
+    glm::vec3 GetBoundsMax() const { return boundsMax; }
 
 
 private:
+    // --microbench reloads meshes in place
+    friend class MicroBenchAccess;
+
     glm::vec3 pivotLocation;
     glm::mat4 model;
     std::vector<Vertex> Vertices;
     std::vector<unsigned int> Indices;
-    GLuint VB;
-    GLuint IB;
+    GpuBuffer VB;
+    GpuBuffer IB;
 
-    Texture* m_texture;
+    Texture* m_texture = NULL;
+    Texture* m_normalMap = NULL;
 
-    GLuint vao;
+    GpuVertexArray vao;
 
     float angle;
+    float boundingRadius = 0.0f;   // model space, around the origin
+    glm::vec3 boundsMin = glm::vec3(0.0f);
+    glm::vec3 boundsMax = glm::vec3(0.0f);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,212 @@
+#include "microbench.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+using namespace std;
+
+const volatile void* g_microBenchSink = NULL;
+
+MicroBenchState::MicroBenchState(int64_t iterations, int arg)
+{
+    m_iterations = iterations;
+    m_done = 0;
+    m_arg = arg;
+    m_running = false;
+    m_seconds = 0.0;
+    m_items = 0;
+    m_error = NULL;
+}
+
+void MicroBenchState::PauseTiming()
+{
+    if (!m_running)
+        return;
+    m_seconds += chrono::duration<double>(Clock::now() - m_start).count();
+    m_running = false;
+}
+
+void MicroBenchState::ResumeTiming()
+{
+    m_running = true;
+    m_start = Clock::now();
+}
+
+MicroBenchmark::MicroBenchmark(const char* name, MicroBenchFunction function)
+{
+    m_name = name;
+    m_function = function;
+}
+
+MicroBenchmark* MicroBenchmark::Arg(int arg)
+{
+    m_args.push_back(arg);
+    return this;
+}
+
+// Function-local so registration from other files' static initializers is safe
+static vector<MicroBenchmark*>& Registry()
+{
+    static vector<MicroBenchmark*> benchmarks;
+    return benchmarks;
+}
+
+MicroBenchmark* RegisterMicroBenchmark(const char* name, MicroBenchFunction function)
+{
+    MicroBenchmark* benchmark = new MicroBenchmark(name, function);
+    Registry().push_back(benchmark);
+    return benchmark;
+}
+
+struct MicroBenchResult
+{
+    string name;
+    int64_t iterations;
+    double medianNs;
+    double minNs;
+    double cvPercent;
+    double itemsPerSecond;
+    const char* error;
+};
+
+static MicroBenchResult RunOne(const MicroBenchmark& benchmark, int arg, bool hasArg)
+{
+    MicroBenchResult result;
+    result.name = benchmark.GetName();
+    if (hasArg)
+        result.name += "/" + to_string(arg);
+    result.iterations = 1;
+    result.medianNs = result.minNs = result.cvPercent = result.itemsPerSecond = 0.0;
+    result.error = NULL;
+
+    // Grow the iteration count until one run is long enough to time reliably
+    int64_t iterations = 1;
+    for (;;)
+    {
+        MicroBenchState state(iterations, arg);
+        benchmark.GetFunction()(state);
+        if (state.GetError() != NULL)
+        {
+            result.error = state.GetError();
+            return result;
+        }
+        double seconds = state.GetSeconds();
+        if (seconds >= kMinRunSeconds || iterations >= (int64_t)1 << 30)
+            break;
+        double scale = seconds > 0.0 ? 1.4 * kMinRunSeconds / seconds : 10.0;
+        iterations = (int64_t)ceil(iterations * min(max(scale, 2.0), 10.0));
+    }
+    result.iterations = iterations;
+
+    // The calibration runs doubled as warm-up; now the measured repetitions
+    vector<double> perIteration;
+    double itemsPerSecond = 0.0;
+    for (int r = 0; r < kRepetitions; r++)
+    {
+        MicroBenchState state(iterations, arg);
+        benchmark.GetFunction()(state);
+        double seconds = state.GetSeconds();
+        perIteration.push_back(seconds * 1e9 / iterations);
+        if (state.GetItemsProcessed() > 0 && seconds > 0.0)
+            itemsPerSecond += state.GetItemsProcessed() / seconds / kRepetitions;
+    }
+
+    sort(perIteration.begin(), perIteration.end());
+    double mean = 0.0;
+    for (double ns : perIteration)
+        mean += ns / perIteration.size();
+    double variance = 0.0;
+    for (double ns : perIteration)
+        variance += (ns - mean) * (ns - mean) / perIteration.size();
+
+    result.medianNs = perIteration[perIteration.size() / 2];
+    result.minNs = perIteration.front();
+    result.cvPercent = mean > 0.0 ? 100.0 * sqrt(variance) / mean : 0.0;
+    result.itemsPerSecond = itemsPerSecond;
+    return result;
+}
+
+static void PrintTime(double ns)
+{
+    if (ns >= 1e6)
+        printf("%10.3f ms", ns / 1e6);
+    else if (ns >= 1e3)
+        printf("%10.3f us", ns / 1e3);
+    else
+        printf("%10.1f ns", ns);
+}
+
+int RunMicroBenchmarks(const char* filter, const char* jsonPath)
+{
+    vector<MicroBenchResult> results;
+
+    printf("%-40s %13s %13s %7s %12s %14s\n", "benchmark", "median", "min", "cv", "iterations", "items/s");
+    for (const MicroBenchmark* benchmark : Registry())
+    {
+        vector<int> args = benchmark->GetArgs();
+        bool hasArgs = !args.empty();
+        if (!hasArgs)
+            args.push_back(0);
+
+        for (int arg : args)
+        {
+            string name = benchmark->GetName();
+            if (hasArgs)
+                name += "/" + to_string(arg);
+            if (filter != NULL && name.find(filter) == string::npos)
+                continue;
+
+            MicroBenchResult result = RunOne(*benchmark, arg, hasArgs);
+            results.push_back(result);
+
+            printf("%-40s ", result.name.c_str());
+            if (result.error != NULL)
+            {
+                printf("skipped: %s\n", result.error);
+                continue;
+            }
+            PrintTime(result.medianNs);
+            printf("   ");
+            PrintTime(result.minNs);
+            printf(" %6.1f%% %12lld", result.cvPercent, (long long)result.iterations);
+            if (result.itemsPerSecond > 0.0)
+                printf(" %14.4g", result.itemsPerSecond);
+            printf("\n");
+            fflush(stdout);
+        }
+    }
+
+    if (results.empty())
+    {
+        printf("No benchmark matches \"%s\"\n", filter != NULL ? filter : "");
+        return 1;
+    }
+
+    if (jsonPath != NULL)
+    {
+        FILE* file = fopen(jsonPath, "w");
+        if (file == NULL)
+        {
+            printf("Could not write %s\n", jsonPath);
+            return 1;
+        }
+        fprintf(file, "{\n  \"repetitions\": %d,\n  \"benchmarks\": [", kRepetitions);
+        for (size_t i = 0; i < results.size(); i++)
+        {
+            const MicroBenchResult& r = results[i];
+            fprintf(file, "%s\n    {\"name\": \"%s\", ", i == 0 ? "" : ",", r.name.c_str());
+            if (r.error != NULL)
+                fprintf(file, "\"error\": \"%s\"}", r.error);
+            else
+                fprintf(file, "\"iterations\": %lld, \"median_ns\": %.1f, \"min_ns\": %.1f, \"cv_percent\": %.2f, \"items_per_second\": %.1f}",
+                    (long long)r.iterations, r.medianNs, r.minNs, r.cvPercent, r.itemsPerSecond);
+        }
+        fprintf(file, "\n  ]\n}\n");
+        fclose(file);
+        printf("Wrote %s\n", jsonPath);
+    }
+    return 0;
+}
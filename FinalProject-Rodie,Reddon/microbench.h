@@ -0,0 +1,112 @@
+#ifndef MICROBENCH_H
+#define MICROBENCH_H
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+// A small Google Benchmark-style harness for --microbench.
+//
+//     static void BM_SphereInit(MicroBenchState& state) {
+//         ...setup...
+//         while (state.KeepRunning()) { ...timed... }
+//     }
+//     MICROBENCH(BM_SphereInit)->Arg(16)->Arg(48);
+//
+// Each benchmark picks an iteration count that runs for at least
+// kMinRunSeconds, throws away one warm-up run, then reports the median of
+// kRepetitions runs and their spread, so numbers can be compared between
+// commits on the same machine.
+
+class MicroBenchState
+{
+public:
+    MicroBenchState(int64_t iterations, int arg);
+
+    bool KeepRunning()
+    {
+        if (m_done == 0 && !m_running)
+        {
+            m_running = true;
+            m_start = Clock::now();
+        }
+        if (m_done < m_iterations)
+        {
+            m_done++;
+            return true;
+        }
+        PauseTiming();
+        return false;
+    }
+
+    // For per-iteration resets that shouldn't count
+    void PauseTiming();
+    void ResumeTiming();
+
+    int GetArg() const { return m_arg; }
+    int64_t GetIterations() const { return m_iterations; }
+    void SetItemsProcessed(int64_t items) { m_items = items; }
+    void SkipWithError(const char* message) { m_error = message; }
+
+    double GetSeconds() const { return m_seconds; }
+    int64_t GetItemsProcessed() const { return m_items; }
+    const char* GetError() const { return m_error; }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    int64_t m_iterations;
+    int64_t m_done;
+    int m_arg;
+    bool m_running;
+    Clock::time_point m_start;
+    double m_seconds;
+    int64_t m_items;
+    const char* m_error;
+};
+
+typedef void (*MicroBenchFunction)(MicroBenchState& state);
+
+class MicroBenchmark
+{
+public:
+    MicroBenchmark(const char* name, MicroBenchFunction function);
+
+    MicroBenchmark* Arg(int arg);
+
+    const char* GetName() const { return m_name; }
+    MicroBenchFunction GetFunction() const { return m_function; }
+    const std::vector<int>& GetArgs() const { return m_args; }
+
+private:
+    const char* m_name;
+    MicroBenchFunction m_function;
+    std::vector<int> m_args;
+};
+
+MicroBenchmark* RegisterMicroBenchmark(const char* name, MicroBenchFunction function);
+
+// Runs every benchmark whose name contains filter (NULL = all); writes JSON
+// when jsonPath is set. Returns the process exit code.
+int RunMicroBenchmarks(const char* filter, const char* jsonPath);
+
+// Keeps the compiler from discarding a result that is never read
+extern const volatile void* g_microBenchSink;
+template <class T>
+inline void DoNotOptimize(const T& value)
+{
+    g_microBenchSink = &value;
+#if defined(__GNUC__)
+    asm volatile("" : : "r"(&value) : "memory");
+#endif
+}
+
+static const double kMinRunSeconds = 0.1;
+static const int kRepetitions = 5;
+
+#define MICROBENCH_CONCAT_INNER(a, b) a##b
+#define MICROBENCH_CONCAT(a, b) MICROBENCH_CONCAT_INNER(a, b)
+#define MICROBENCH(function) \
+    static MicroBenchmark* MICROBENCH_CONCAT(microbench_, __LINE__) = RegisterMicroBenchmark(#function, function)
+
+#endif /* MICROBENCH_H */
@@ -0,0 +1,486 @@
+// The --microbench suite: hot CPU paths timed in isolation. GL objects are
+// created once per benchmark on the headless context main sets up; only the
+// CPU work is inside the timed loops.
+
+#include "microbench.h"
+#include "collision.h"
+#include "framearena.h"
+#include "graphics.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <random>
+
+// Forward slashes work on every platform; run from the project directory
+static const char* kShipObj = "assets/SpaceShip-1.obj";
+static const char* kAsteroidObj = "assets/Asteroid.obj";
+
+class MicroBenchAccess
+{
+public:
+    // swap() rather than clear() so every run allocates like a new object
+    static void ResetSphere(Sphere& sphere)
+    {
+        std::vector<glm::vec3>().swap(sphere.vertices);
+        std::vector<glm::vec2>().swap(sphere.texCoords);
+        std::vector<glm::vec3>().swap(sphere.normals);
+        std::vector<int>().swap(sphere.indices);
+    }
+    static void InitSphere(Sphere& sphere, int prec) { sphere.init(prec); }
+
+    static void ResetSphereVertices(Sphere& sphere)
+    {
+        std::vector<Vertex>().swap(sphere.Vertices);
+        std::vector<unsigned int>().swap(sphere.Indices);
+    }
+    static void SetupSphereVertices(Sphere& sphere) { sphere.setupVertices(); }
+
+    static void ResetMesh(Mesh& mesh)
+    {
+        std::vector<Vertex>().swap(mesh.Vertices);
+        std::vector<unsigned int>().swap(mesh.Indices);
+        mesh.boundingRadius = 0.0f;
+        mesh.boundsMin = glm::vec3(0.0f);
+        mesh.boundsMax = glm::vec3(0.0f);
+    }
+
+    static std::vector<glm::mat4>& InnerBelt(Graphics& graphics) { return graphics.innerAsteroidTransforms; }
+    static std::vector<glm::mat4>& OuterBelt(Graphics& graphics) { return graphics.outerAsteroidTransforms; }
+
+    static glm::vec3 ShipPosition(Graphics& graphics) { return glm::vec3(graphics.m_mesh->GetModel()[3]); }
+    static void RefitSpatialIndex(Graphics& graphics) { graphics.RefitSpatialIndex(); }
+};
+
+// The game logs freely through cout; keep it out of the timings and the table
+class QuietCout
+{
+public:
+    QuietCout() { m_buffer = std::cout.rdbuf(NULL); }
+    ~QuietCout() { std::cout.rdbuf(m_buffer); std::cout.clear(); }
+
+private:
+    std::streambuf* m_buffer;
+};
+
+// One scratch object per precision/path, reused by every run
+static Sphere* ScratchSphere(int prec)
+{
+    static std::map<int, Sphere*> spheres;
+    Sphere*& sphere = spheres[prec];
+    if (sphere == NULL)
+        sphere = new Sphere(prec);
+    return sphere;
+}
+
+static Mesh* ScratchMesh(const char* path)
+{
+    static std::map<std::string, Mesh*> meshes;
+    Mesh*& mesh = meshes[path];
+    if (mesh == NULL)
+        mesh = new Mesh(glm::vec3(0.0f), path);
+    return mesh;
+}
+
+// The whole scene, once. Graphics fills the global planet/moon lists, so
+// there can only be one.
+static Graphics* SharedGraphics()
+{
+    static Graphics* graphics = NULL;
+    static bool tried = false;
+    if (!tried)
+    {
+        tried = true;
+        graphics = new Graphics();
+        if (!graphics->Initialize(800, 600))
+            graphics = NULL;
+    }
+    return graphics;
+}
+
+static void BM_SphereInit(MicroBenchState& state)
+{
+    QuietCout quiet;
+    int prec = state.GetArg();
+    Sphere* sphere = ScratchSphere(prec);
+    while (state.KeepRunning())
+    {
+        state.PauseTiming();
+        MicroBenchAccess::ResetSphere(*sphere);
+        state.ResumeTiming();
+        MicroBenchAccess::InitSphere(*sphere, prec);
+    }
+    state.SetItemsProcessed(state.GetIterations() * sphere->getNumVertices());
+}
+MICROBENCH(BM_SphereInit)->Arg(16)->Arg(32)->Arg(48)->Arg(64)->Arg(128);
+
+static void BM_SphereSetupVertices(MicroBenchState& state)
+{
+    QuietCout quiet;
+    Sphere* sphere = ScratchSphere(state.GetArg());
+    while (state.KeepRunning())
+    {
+        state.PauseTiming();
+        MicroBenchAccess::ResetSphereVertices(*sphere);
+        state.ResumeTiming();
+        MicroBenchAccess::SetupSphereVertices(*sphere);
+    }
+    state.SetItemsProcessed(state.GetIterations() * sphere->getNumIndices());
+}
+MICROBENCH(BM_SphereSetupVertices)->Arg(16)->Arg(32)->Arg(48)->Arg(64)->Arg(128);
+
+static void LoadMesh(MicroBenchState& state, const char* path)
+{
+    // Mesh can't be built from a missing file, so check first
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        state.SkipWithError("OBJ not found (run from the project directory)");
+        return;
+    }
+    fclose(file);
+
+    QuietCout quiet;
+    Mesh* mesh = ScratchMesh(path);
+    while (state.KeepRunning())
+    {
+        state.PauseTiming();
+        MicroBenchAccess::ResetMesh(*mesh);
+        state.ResumeTiming();
+        mesh->loadModelFromFile(path);
+    }
+    state.SetItemsProcessed(state.GetIterations() * mesh->GetIndexCount());
+}
+
+static void BM_MeshLoadShip(MicroBenchState& state)
+{
+    LoadMesh(state, kShipObj);
+}
+MICROBENCH(BM_MeshLoadShip);
+
+static void BM_MeshLoadAsteroid(MicroBenchState& state)
+{
+    LoadMesh(state, kAsteroidObj);
+}
+MICROBENCH(BM_MeshLoadAsteroid);
+
+static void BM_HierarchicalUpdate2(MicroBenchState& state)
+{
+    QuietCout quiet;
+    Graphics* graphics = SharedGraphics();
+    if (graphics == NULL)
+    {
+        state.SkipWithError("graphics failed to initialize");
+        return;
+    }
+    // Each call is a frame: give its scratch back as Engine::Run does, or
+    // the arena runs out and every call after times the heap
+    FrameArena& arena = FrameArena::Get();
+    while (state.KeepRunning())
+    {
+        state.PauseTiming();
+        arena.Reset();
+        state.ResumeTiming();
+        graphics->HierarchicalUpdate2(1.0 / 60.0);
+    }
+}
+MICROBENCH(BM_HierarchicalUpdate2);
+
+// Arg is the asteroid count per belt (the game uses 800)
+static void BM_GenerateAsteroidBelts(MicroBenchState& state)
+{
+    QuietCout quiet;
+    Graphics* graphics = SharedGraphics();
+    if (graphics == NULL)
+    {
+        state.SkipWithError("graphics failed to initialize");
+        return;
+    }
+
+    // Borrow the belt vectors; the scene gets its own back afterwards
+    std::vector<glm::mat4> inner, outer;
+    inner.swap(MicroBenchAccess::InnerBelt(*graphics));
+    outer.swap(MicroBenchAccess::OuterBelt(*graphics));
+
+    int count = state.GetArg();
+    while (state.KeepRunning())
+    {
+        state.PauseTiming();
+        std::vector<glm::mat4>().swap(MicroBenchAccess::InnerBelt(*graphics));
+        std::vector<glm::mat4>().swap(MicroBenchAccess::OuterBelt(*graphics));
+        srand(1234);
+        state.ResumeTiming();
+        graphics->GenerateAsteroidBelts(count, count);
+    }
+    state.SetItemsProcessed(state.GetIterations() * 2 * count);
+
+    inner.swap(MicroBenchAccess::InnerBelt(*graphics));
+    outer.swap(MicroBenchAccess::OuterBelt(*graphics));
+}
+MICROBENCH(BM_GenerateAsteroidBelts)->Arg(800)->Arg(8000)->Arg(80000);
+
+// Arg is the chunk's x on the z = 0 row: 3 is in the inner belt, 8 in the
+// outer and 50 in open space
+static void BM_GenerateAsteroidChunk(MicroBenchState& state)
+{
+    AsteroidFieldSettings settings;
+    std::vector<glm::mat4> asteroids;
+    int64_t count = 0;
+    while (state.KeepRunning())
+    {
+        asteroids.clear();
+        AsteroidField::GenerateChunk(state.GetArg(), 0, settings, asteroids);
+        count += asteroids.size();
+    }
+    state.SetItemsProcessed(count);
+}
+MICROBENCH(BM_GenerateAsteroidChunk)->Arg(3)->Arg(8)->Arg(50);
+
+// Same query points every run: a disc a little wider than Neptune's orbit
+static const std::vector<glm::vec3>& QueryPoints()
+{
+    static std::vector<glm::vec3> points;
+    if (points.empty())
+    {
+        std::mt19937 rng(42u);
+        std::uniform_real_distribution<float> coord(-25.0f, 25.0f);
+        std::uniform_real_distribution<float> height(-2.0f, 2.0f);
+        for (int i = 0; i < 1024; i++)
+            points.push_back(glm::vec3(coord(rng), height(rng), coord(rng)));
+    }
+    return points;
+}
+
+static int NearestPlanetLinear(const glm::vec3& position)
+{
+    int best = -1;
+    float bestDistance = 0.0f;
+    for (size_t i = 0; i < planetSpheres.size(); i++)
+    {
+        glm::vec3 d = planetSpheres[i]->GetPosition() - position;
+        float distance = glm::dot(d, d);
+        if (best < 0 || distance < bestDistance)
+        {
+            best = (int)i;
+            bestDistance = distance;
+        }
+    }
+    return best;
+}
+
+static void BM_NearestPlanetSpatialIndex(MicroBenchState& state)
+{
+    QuietCout quiet;
+    Graphics* graphics = SharedGraphics();
+    if (graphics == NULL)
+    {
+        state.SkipWithError("graphics failed to initialize");
+        return;
+    }
+
+    const std::vector<glm::vec3>& points = QueryPoints();
+    for (const glm::vec3& p : points)
+    {
+        if (graphics->GetClosestPlanetIndex(p) != NearestPlanetLinear(p))
+        {
+            state.SkipWithError("spatial index disagrees with the linear scan");
+            return;
+        }
+    }
+
+    size_t i = 0;
+    while (state.KeepRunning())
+    {
+        int index = graphics->GetClosestPlanetIndex(points[i]);
+        DoNotOptimize(index);
+        i = (i + 1) & (points.size() - 1);
+    }
+    state.SetItemsProcessed(state.GetIterations());
+}
+MICROBENCH(BM_NearestPlanetSpatialIndex);
+
+// Baseline for the above: what GetClosestPlanetName used to do
+static void BM_NearestPlanetLinear(MicroBenchState& state)
+{
+    QuietCout quiet;
+    if (SharedGraphics() == NULL)
+    {
+        state.SkipWithError("graphics failed to initialize");
+        return;
+    }
+
+    const std::vector<glm::vec3>& points = QueryPoints();
+    size_t i = 0;
+    while (state.KeepRunning())
+    {
+        int index = NearestPlanetLinear(points[i]);
+        DoNotOptimize(index);
+        i = (i + 1) & (points.size() - 1);
+    }
+    state.SetItemsProcessed(state.GetIterations());
+}
+MICROBENCH(BM_NearestPlanetLinear);
+
+// The streamed field's asteroids through the spatial index, checked against
+// linear scans of the resident asteroids around the ship and again after the
+// field has moved on, so the refit has to pick up the new chunks
+static bool FieldQueriesMatch(Graphics& graphics, std::vector<glm::vec3>& points)
+{
+    const AsteroidField* field = graphics.GetAsteroidField();
+    const SpatialIndex* index = graphics.GetSpatialIndex();
+    const std::vector<glm::mat4>& asteroids = field->GetAsteroids();
+    const float kQueryRadius = 0.5f;
+    const float reach = kQueryRadius + field->GetAsteroidRadius();
+
+    std::mt19937 rng(11u);
+    std::uniform_real_distribution<float> offset(-1.0f, 1.0f);
+    points.clear();
+    for (int c = 0; c < field->GetChunkCount(); c++)
+    {
+        glm::vec3 center = field->GetChunkCenter(c);
+        float r = field->GetChunkRadius();
+        for (int i = 0; i < 8; i++)
+            points.push_back(center + r * glm::vec3(offset(rng), 0.1f * offset(rng), offset(rng)));
+    }
+
+    SpatialHit hits[256];
+    const int maxHits = (int)(sizeof(hits) / sizeof(hits[0]));
+    for (const glm::vec3& p : points)
+    {
+        float best = -1.0f;
+        int overlapping = 0;
+        for (const glm::mat4& m : asteroids)
+        {
+            glm::vec3 d = glm::vec3(m[3]) - p;
+            float distance = glm::dot(d, d);
+            if (best < 0.0f || distance < best)
+                best = distance;
+            if (distance <= reach * reach)
+                overlapping++;
+        }
+
+        SpatialHit hit;
+        bool found = index->QueryNearest(p, hit, KindBit(BodyKind::Asteroid));
+        if (found != (best >= 0.0f))
+            return false;
+        if (!found)
+            continue;
+        if (fabsf(hit.distanceSq - best) > 1e-4f * (1.0f + best))
+            return false;
+        if (index->QueryRadius(p, kQueryRadius, hits, maxHits, KindBit(BodyKind::Asteroid)) != std::min(overlapping, maxHits))
+            return false;
+
+        // Aimed at the nearest asteroid, a ray can't miss the field
+        glm::vec3 target = glm::vec3(asteroids[hit.body.index][3]);
+        SpatialHit rayHit;
+        if (!index->Raycast(p, target - p, 2.0f, rayHit, KindBit(BodyKind::Asteroid)))
+            return false;
+    }
+    return true;
+}
+
+static void BM_NearestAsteroidFieldSpatialIndex(MicroBenchState& state)
+{
+    QuietCout quiet;
+    Graphics* graphics = SharedGraphics();
+    if (graphics == NULL)
+    {
+        state.SkipWithError("graphics failed to initialize");
+        return;
+    }
+    AsteroidField* field = graphics->GetAsteroidField();
+    if (field == NULL || field->GetAsteroids().empty())
+    {
+        state.SkipWithError("no streamed asteroid field");
+        return;
+    }
+
+    std::vector<glm::vec3> points;
+    glm::vec3 ship = MicroBenchAccess::ShipPosition(*graphics);
+    glm::vec3 away = ship + glm::vec3(6.0f * field->GetChunkRadius(), 0.0f, 0.0f);
+    bool match = FieldQueriesMatch(*graphics, points);
+    field->Finish(away);
+    MicroBenchAccess::RefitSpatialIndex(*graphics);
+    match = match && FieldQueriesMatch(*graphics, points);
+    field->Finish(ship);
+    MicroBenchAccess::RefitSpatialIndex(*graphics);
+    match = match && FieldQueriesMatch(*graphics, points);
+    if (!match)
+    {
+        state.SkipWithError("spatial index disagrees with the field's asteroids");
+        return;
+    }
+
+    const SpatialIndex* index = graphics->GetSpatialIndex();
+    size_t i = 0;
+    while (state.KeepRunning())
+    {
+        SpatialHit hit;
+        bool found = index->QueryNearest(points[i], hit, KindBit(BodyKind::Asteroid));
+        DoNotOptimize(found);
+        i = (i + 1) % points.size();
+    }
+    state.SetItemsProcessed(state.GetIterations());
+}
+MICROBENCH(BM_NearestAsteroidFieldSpatialIndex);
+
+// Arg is the asteroid count. A flat ring like the belts, queried with a
+// ship-sized sphere at points along it; checked against a linear scan first.
+static void BM_AsteroidGridQuery(MicroBenchState& state)
+{
+    const float kShipRadius = 0.15f;
+
+    std::mt19937 rng(7u);
+    std::uniform_real_distribution<float> angle(0.0f, 6.2831853f);
+    std::uniform_real_distribution<float> radius(8.0f, 12.0f);
+    std::uniform_real_distribution<float> height(-0.3f, 0.3f);
+    std::uniform_real_distribution<float> size(0.01f, 0.04f);
+
+    std::vector<glm::mat4> asteroids(state.GetArg());
+    for (glm::mat4& m : asteroids)
+    {
+        float a = angle(rng), r = radius(rng);
+        m = glm::translate(glm::mat4(1.0f), glm::vec3(r * cosf(a), height(rng), r * sinf(a)));
+        m = glm::scale(m, glm::vec3(size(rng)));
+    }
+
+    AsteroidGrid grid;
+    grid.SetMinCellSize(2.0f * kShipRadius);
+    grid.Build(asteroids.data(), asteroids.size(), NULL, 0, 1.0f);
+
+    std::vector<glm::vec3> points;
+    for (int i = 0; i < 1024; i++)
+    {
+        float a = angle(rng), r = radius(rng);
+        points.push_back(glm::vec3(r * cosf(a), height(rng), r * sinf(a)));
+    }
+
+    int hits[CollisionSystem::kMaxContacts * 8];
+    const int maxHits = (int)(sizeof(hits) / sizeof(hits[0]));
+    for (const glm::vec3& p : points)
+    {
+        int expected = 0;
+        for (size_t i = 0; i < grid.GetCount(); i++)
+        {
+            glm::vec3 d = grid.GetCenter((int)i) - p;
+            float reach = kShipRadius + grid.GetRadius((int)i);
+            if (glm::dot(d, d) <= reach * reach)
+                expected++;
+        }
+        if (grid.QuerySphere(p, kShipRadius, hits, maxHits) != std::min(expected, maxHits))
+        {
+            state.SkipWithError("asteroid grid disagrees with the linear scan");
+            return;
+        }
+    }
+
+    size_t i = 0;
+    while (state.KeepRunning())
+    {
+        int count = grid.QuerySphere(points[i], kShipRadius, hits, maxHits);
+        DoNotOptimize(count);
+        i = (i + 1) & (points.size() - 1);
+    }
+    state.SetItemsProcessed(state.GetIterations());
+}
+MICROBENCH(BM_AsteroidGridQuery)->Arg(1000)->Arg(10000)->Arg(100000);
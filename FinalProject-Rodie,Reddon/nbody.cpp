@@ -0,0 +1,527 @@
+#include "nbody.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <thread>
+
+namespace
+{
+    const int kMaxDepth = 32;
+    // Depth-first, each opened node swaps itself for at most 8 children, so
+    // the traversal stack never holds more than 7 per level plus the root
+    const int kStackSize = kMaxDepth * 7 + 8;
+    const size_t kParticleGrain = 2048;   // below this a range isn't worth a thread
+
+    inline int Octant(const glm::vec3& p, const glm::vec3& center)
+    {
+        return (p.x >= center.x ? 1 : 0) | (p.y >= center.y ? 2 : 0) | (p.z >= center.z ? 4 : 0);
+    }
+
+    inline glm::vec3 ChildCenter(const glm::vec3& center, float childHalf, int octant)
+    {
+        return center + glm::vec3(
+            (octant & 1) ? childHalf : -childHalf,
+            (octant & 2) ? childHalf : -childHalf,
+            (octant & 4) ? childHalf : -childHalf);
+    }
+}
+
+template <typename Fn>
+void NBodySystem::ParallelFor(size_t count, size_t grain, Fn fn)
+{
+    if (count == 0)
+        return;
+
+    size_t workers = (size_t)ThreadCount();
+    size_t maxWorkers = (count + grain - 1) / grain;
+    if (workers > maxWorkers)
+        workers = maxWorkers;
+
+    if (workers <= 1) {
+        fn((size_t)0, count);
+        return;
+    }
+
+    size_t chunk = (count + workers - 1) / workers;
+    StartWorkers((int)workers - 1);
+    {
+        std::lock_guard<std::mutex> lock(m_poolMutex);
+        m_jobRun = [](void* f, size_t begin, size_t end) { (*(Fn*)f)(begin, end); };
+        m_jobFn = &fn;
+        m_jobCount = count;
+        m_jobChunk = chunk;
+        m_jobWorkers = (int)workers - 1;
+        m_poolPending = m_jobWorkers;
+        m_poolGeneration++;
+    }
+    m_poolWake.notify_all();
+
+    fn((size_t)0, std::min(chunk, count));
+
+    std::unique_lock<std::mutex> lock(m_poolMutex);
+    m_poolDone.wait(lock, [this] { return m_poolPending == 0; });
+}
+
+NBodySystem::NBodySystem()
+{
+    m_accelerationValid = false;
+    m_octantPools.resize(8);
+    m_poolGeneration = 0;
+    m_poolStop = false;
+    m_poolPending = 0;
+    m_jobRun = NULL;
+    m_jobFn = NULL;
+    m_jobCount = 0;
+    m_jobChunk = 0;
+    m_jobWorkers = 0;
+}
+
+NBodySystem::~NBodySystem()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_poolMutex);
+        m_poolStop = true;
+    }
+    m_poolWake.notify_all();
+    for (std::thread& worker : m_workers)
+        worker.join();
+}
+
+// Only grows; called between jobs
+void NBodySystem::StartWorkers(int count)
+{
+    std::lock_guard<std::mutex> lock(m_poolMutex);
+    while ((int)m_workers.size() < count)
+        m_workers.push_back(std::thread(&NBodySystem::WorkerLoop, this, (int)m_workers.size(), m_poolGeneration));
+}
+
+void NBodySystem::WorkerLoop(int index, unsigned generation)
+{
+    for (;;)
+    {
+        size_t begin, end;
+        {
+            std::unique_lock<std::mutex> lock(m_poolMutex);
+            m_poolWake.wait(lock, [&] { return m_poolStop || m_poolGeneration != generation; });
+            if (m_poolStop)
+                return;
+            generation = m_poolGeneration;
+            if (index >= m_jobWorkers)
+                continue;       // this job has fewer chunks than there are workers
+            begin = (size_t)(index + 1) * m_jobChunk;
+            end = std::min(m_jobCount, begin + m_jobChunk);
+        }
+
+        if (begin < end)
+            m_jobRun(m_jobFn, begin, end);
+
+        std::lock_guard<std::mutex> lock(m_poolMutex);
+        if (--m_poolPending == 0)
+            m_poolDone.notify_one();
+    }
+}
+
+void NBodySystem::Clear()
+{
+    m_position.clear();
+    m_velocity.clear();
+    m_acceleration.clear();
+    m_gm.clear();
+    m_nodes.clear();
+    m_accelerationValid = false;
+}
+
+void NBodySystem::AddParticle(const glm::vec3& position, const glm::vec3& velocity, float gm)
+{
+    m_position.push_back(position);
+    m_velocity.push_back(velocity);
+    m_acceleration.push_back(glm::vec3(0.0f));
+    m_gm.push_back(gm);
+    m_accelerationValid = false;
+}
+
+void NBodySystem::AddOrbitingParticle(const glm::vec3& position, float gm, float centralGM)
+{
+    // Counter-clockwise (seen from +Y) circular orbit in the XZ plane, the same
+    // direction glm::rotate around +Y moves the planets.
+    glm::vec3 radial = glm::vec3(position.x, 0.0f, position.z);
+    float r = glm::length(radial);
+    glm::vec3 velocity(0.0f);
+    if (r > 0.0f) {
+        glm::vec3 tangent = glm::vec3(radial.z, 0.0f, -radial.x) / r;
+        velocity = tangent * sqrtf(centralGM / r);
+    }
+    AddParticle(position, velocity, gm);
+}
+
+void NBodySystem::Step(float dt)
+{
+    if (m_position.empty() || dt <= 0.0f)
+        return;
+
+    // A long hitch (window drag, loading) must not blow up the integration
+    float maxDt = m_settings.maxStep * m_settings.maxSubsteps;
+    if (dt > maxDt)
+        dt = maxDt;
+
+    int substeps = (int)ceilf(dt / m_settings.maxStep);
+    if (substeps < 1)
+        substeps = 1;
+    float h = dt / substeps;
+
+    if (!m_accelerationValid) {
+        BuildTree();
+        ComputeAccelerations();
+        m_accelerationValid = true;
+    }
+
+    for (int s = 0; s < substeps; s++)
+        Integrate(h);
+}
+
+void NBodySystem::Integrate(float h)
+{
+    float halfH = 0.5f * h;
+
+    // kick + drift
+    ParallelFor(m_position.size(), kParticleGrain, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            m_velocity[i] += m_acceleration[i] * halfH;
+            m_position[i] += m_velocity[i] * h;
+        }
+    });
+
+    BuildTree();
+    ComputeAccelerations();
+
+    // kick
+    ParallelFor(m_position.size(), kParticleGrain, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+            m_velocity[i] += m_acceleration[i] * halfH;
+    });
+}
+
+void NBodySystem::BuildTree()
+{
+    m_nodes.clear();
+    size_t n = m_position.size();
+    if (n == 0 || !m_settings.selfGravity)
+        return;
+
+    m_order.resize(n);
+    m_scratch.resize(n);
+    m_sortedPosition.resize(n);
+    m_sortedGM.resize(n);
+
+    // Root cell is the bounding cube of every particle
+    glm::vec3 lo = m_position[0], hi = m_position[0];
+    for (size_t i = 1; i < n; i++) {
+        lo = glm::min(lo, m_position[i]);
+        hi = glm::max(hi, m_position[i]);
+    }
+    glm::vec3 center = (lo + hi) * 0.5f;
+    glm::vec3 extent = hi - lo;
+    float half = 0.5f * std::max(extent.x, std::max(extent.y, extent.z)) * 1.001f + 1e-4f;
+
+    // Split the root into its eight octants serially, then build each octant's
+    // subtree on its own thread into a private pool.
+    uint32_t counts[8] = { 0 };
+    for (size_t i = 0; i < n; i++)
+        counts[Octant(m_position[i], center)]++;
+
+    uint32_t offsets[9] = { 0 };
+    for (int o = 0; o < 8; o++)
+        offsets[o + 1] = offsets[o] + counts[o];
+
+    uint32_t cursor[8];
+    std::copy(offsets, offsets + 8, cursor);
+    for (size_t i = 0; i < n; i++)
+        m_order[cursor[Octant(m_position[i], center)]++] = (uint32_t)i;
+
+    float childHalf = half * 0.5f;
+    ParallelFor(8, 1, [&](size_t begin, size_t end) {
+        for (size_t o = begin; o < end; o++) {
+            std::vector<Node>& pool = m_octantPools[o];
+            pool.clear();
+            if (counts[o] == 0)
+                continue;
+            pool.push_back(Node());
+            BuildNode(pool, 0, offsets[o], offsets[o + 1], ChildCenter(center, childHalf, (int)o), childHalf, 1);
+        }
+    });
+
+    // Stitch the pools together: root, then the octant roots (contiguous, as
+    // children must be), then the rest of each pool with its indices shifted.
+    Node root;
+    root.center = center;
+    root.halfSize = half;
+    root.firstChild = 1;
+    root.childCount = 0;
+    root.begin = 0;
+    root.end = (uint32_t)n;
+    root.gm = 0.0f;
+    root.com = glm::vec3(0.0f);
+
+    size_t total = 1;
+    for (int o = 0; o < 8; o++)
+        total += m_octantPools[o].size();
+    m_nodes.reserve(total);
+    m_nodes.push_back(root);
+
+    int restOffset[8];
+    int next = 1;
+    for (int o = 0; o < 8; o++)
+        if (!m_octantPools[o].empty())
+            next++;
+    for (int o = 0; o < 8; o++) {
+        restOffset[o] = next;
+        if (!m_octantPools[o].empty())
+            next += (int)m_octantPools[o].size() - 1;
+    }
+
+    m_nodes.resize(total);
+    int rootChild = 0;
+    for (int o = 0; o < 8; o++) {
+        const std::vector<Node>& pool = m_octantPools[o];
+        if (pool.empty())
+            continue;
+
+        int rootSlot = 1 + rootChild++;
+        for (size_t j = 0; j < pool.size(); j++) {
+            Node node = pool[j];
+            if (node.firstChild >= 0)
+                node.firstChild = restOffset[o] + node.firstChild - 1;
+            int slot = (j == 0) ? rootSlot : restOffset[o] + (int)j - 1;
+            m_nodes[slot] = node;
+        }
+
+        m_nodes[0].gm += pool[0].gm;
+        m_nodes[0].com += pool[0].com * pool[0].gm;
+    }
+    m_nodes[0].childCount = rootChild;
+    if (m_nodes[0].gm > 0.0f)
+        m_nodes[0].com /= m_nodes[0].gm;
+    else
+        m_nodes[0].com = center;
+}
+
+void NBodySystem::BuildNode(std::vector<Node>& pool, int slot, uint32_t begin, uint32_t end,
+    const glm::vec3& center, float halfSize, int depth)
+{
+    // pool[slot] has been reserved by the caller; children are appended
+    uint32_t count = end - begin;
+
+    Node node;
+    node.center = center;
+    node.halfSize = halfSize;
+    node.begin = begin;
+    node.end = end;
+    node.gm = 0.0f;
+    node.com = glm::vec3(0.0f);
+
+    if ((int)count <= m_settings.leafSize || depth >= kMaxDepth) {
+        // Leaf: copy its particles into tree order
+        for (uint32_t k = begin; k < end; k++) {
+            uint32_t i = m_order[k];
+            m_sortedPosition[k] = m_position[i];
+            m_sortedGM[k] = m_gm[i];
+            node.gm += m_gm[i];
+            node.com += m_position[i] * m_gm[i];
+        }
+        node.firstChild = -1;
+        node.childCount = 0;
+    }
+    else {
+        // Partition this node's slice of m_order by octant
+        uint32_t counts[8] = { 0 };
+        for (uint32_t k = begin; k < end; k++)
+            counts[Octant(m_position[m_order[k]], center)]++;
+
+        uint32_t offsets[9];
+        offsets[0] = begin;
+        for (int o = 0; o < 8; o++)
+            offsets[o + 1] = offsets[o] + counts[o];
+
+        uint32_t cursor[8];
+        std::copy(offsets, offsets + 8, cursor);
+        for (uint32_t k = begin; k < end; k++) {
+            uint32_t i = m_order[k];
+            m_scratch[cursor[Octant(m_position[i], center)]++] = i;
+        }
+        std::copy(m_scratch.begin() + begin, m_scratch.begin() + end, m_order.begin() + begin);
+
+        // Reserve contiguous slots for the non-empty children, then fill them
+        int childCount = 0;
+        for (int o = 0; o < 8; o++)
+            if (counts[o] > 0)
+                childCount++;
+
+        int firstChild = (int)pool.size();
+        node.firstChild = firstChild;
+        node.childCount = childCount;
+        pool.resize(pool.size() + childCount);
+
+        float childHalf = halfSize * 0.5f;
+        int c = 0;
+        for (int o = 0; o < 8; o++) {
+            if (counts[o] == 0)
+                continue;
+
+            BuildNode(pool, firstChild + c, offsets[o], offsets[o + 1], ChildCenter(center, childHalf, o), childHalf, depth + 1);
+            const Node& child = pool[firstChild + c];
+            node.gm += child.gm;
+            node.com += child.com * child.gm;
+            c++;
+        }
+    }
+
+    if (node.gm > 0.0f)
+        node.com /= node.gm;
+    else
+        node.com = center;
+
+    pool[slot] = node;
+}
+
+void NBodySystem::ComputeAccelerations()
+{
+    size_t n = m_position.size();
+
+    if (m_settings.selfGravity && !m_nodes.empty()) {
+        // Walk particles in tree order so neighbouring threads touch
+        // neighbouring nodes
+        ParallelFor(n, kParticleGrain, [&](size_t begin, size_t end) {
+            for (size_t k = begin; k < end; k++) {
+                uint32_t i = m_order[k];
+                const glm::vec3& p = m_position[i];
+                m_acceleration[i] = AttractorAcceleration(p) + TreeAcceleration(p, (uint32_t)k);
+            }
+        });
+    }
+    else {
+        ParallelFor(n, kParticleGrain, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++)
+                m_acceleration[i] = AttractorAcceleration(m_position[i]);
+        });
+    }
+}
+
+glm::vec3 NBodySystem::TreeAcceleration(const glm::vec3& p, uint32_t self) const
+{
+    float eps2 = m_settings.softening * m_settings.softening;
+    float theta2 = m_settings.theta * m_settings.theta;
+
+    glm::vec3 acc(0.0f);
+    int stack[kStackSize];
+    int top = 0;
+    stack[top++] = 0;
+
+    while (top > 0) {
+        const Node& node = m_nodes[stack[--top]];
+
+        if (node.firstChild >= 0) {
+            glm::vec3 d = node.com - p;
+            float r2 = glm::dot(d, d);
+            float size = 2.0f * node.halfSize;
+
+            if (size * size < theta2 * r2) {
+                // Far enough away to treat the whole cell as one mass
+                r2 += eps2;
+                acc += d * (node.gm / (r2 * sqrtf(r2)));
+                continue;
+            }
+            if (top + node.childCount <= kStackSize) {
+                for (int c = 0; c < node.childCount; c++)
+                    stack[top++] = node.firstChild + c;
+                continue;
+            }
+            // Only if the tree were deeper than kMaxDepth allows: sum the
+            // cell's particles directly (its slice of tree order, like a
+            // leaf's) rather than run off the end of the stack
+        }
+
+        for (uint32_t k = node.begin; k < node.end; k++) {
+            if (k == self)
+                continue;
+            glm::vec3 d = m_sortedPosition[k] - p;
+            float r2 = glm::dot(d, d) + eps2;
+            acc += d * (m_sortedGM[k] / (r2 * sqrtf(r2)));
+        }
+    }
+
+    return acc;
+}
+
+glm::vec3 NBodySystem::AttractorAcceleration(const glm::vec3& p) const
+{
+    float eps2 = m_settings.softening * m_settings.softening;
+
+    glm::vec3 acc(0.0f);
+    for (const Attractor& a : m_attractors) {
+        glm::vec3 d = a.position - p;
+        float r2 = glm::dot(d, d) + eps2;
+        acc += d * (a.gm / (r2 * sqrtf(r2)));
+    }
+    return acc;
+}
+
+int NBodySystem::ThreadCount() const
+{
+    if (m_settings.threads > 0)
+        return m_settings.threads;
+
+    unsigned int hw = std::thread::hardware_concurrency();
+    return hw > 0 ? (int)hw : 1;
+}
+
+void NBodySystem::RunBenchmark()
+{
+    const size_t sizes[] = { 10000, 100000, 1000000 };
+    const float sunGM = 600.0f;
+
+    NBodySettings settings;
+    int hwThreads = (int)std::max(1u, std::thread::hardware_concurrency());
+
+    printf("Barnes-Hut N-body benchmark (theta %.2f, leaf %d, %d hardware threads)\n",
+        settings.theta, settings.leafSize, hwThreads);
+    printf("%10s %14s %14s %9s %18s\n", "particles", "1 thread ms", "all threads ms", "speedup", "ns per n*log2(n)");
+
+    for (size_t n : sizes) {
+        double ms[2] = { 0.0, 0.0 };
+        int threadCounts[2] = { 1, hwThreads };
+
+        for (int t = 0; t < 2; t++) {
+            NBodySystem system;
+            settings.threads = threadCounts[t];
+            system.SetSettings(settings);
+            system.SetAttractors({ { glm::vec3(0.0f), sunGM } });
+
+            // Same thin disc every run so the numbers compare between commits
+            std::mt19937 rng(1234u);
+            std::uniform_real_distribution<float> angle(0.0f, 6.2831853f);
+            std::uniform_real_distribution<float> radius(5.0f, 20.0f);
+            std::uniform_real_distribution<float> height(-0.25f, 0.25f);
+            for (size_t i = 0; i < n; i++) {
+                float a = angle(rng);
+                float r = radius(rng);
+                system.AddOrbitingParticle(glm::vec3(cosf(a) * r, height(rng), sinf(a) * r), 1e-6f, sunGM);
+            }
+
+            // Warm-up step builds the first tree and the starting accelerations
+            system.Step(settings.maxStep);
+
+            int repeats = n >= 1000000 ? 1 : 3;
+            auto start = std::chrono::steady_clock::now();
+            for (int r = 0; r < repeats; r++)
+                system.Step(settings.maxStep);
+            auto stop = std::chrono::steady_clock::now();
+            ms[t] = std::chrono::duration<double, std::milli>(stop - start).count() / repeats;
+        }
+
+        double nlogn = (double)n * log2((double)n);
+        printf("%10zu %14.2f %14.2f %8.2fx %18.2f\n",
+            n, ms[0], ms[1], ms[0] / ms[1], ms[1] * 1e6 / nlogn);
+    }
+}
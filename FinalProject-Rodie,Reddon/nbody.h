@@ -0,0 +1,122 @@
+#ifndef NBODY_H
+#define NBODY_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "graphics_headers.h"
+
+// A body that pulls on the belt but is moved by someone else (sun, planets).
+struct Attractor
+{
+    glm::vec3 position;
+    float gm;   // gravitational parameter G*M
+};
+
+struct NBodySettings
+{
+    float theta = 0.6f;             // Barnes-Hut opening angle, 0 = exact
+    float softening = 0.05f;        // keeps close encounters finite
+    float maxStep = 1.0f / 120.0f;  // largest integrator substep
+    int maxSubsteps = 8;            // frame dt is clamped to maxStep * maxSubsteps
+    int leafSize = 8;               // particles per octree leaf
+    int threads = 0;                // 0 = use every hardware thread
+    bool selfGravity = true;        // particles also attract each other
+};
+
+// Asteroid belt particles moving under gravity from the sun, the planets and
+// each other. Mutual forces use a Barnes-Hut octree rebuilt every step, and
+// the integrator is kick-drift-kick leapfrog (symplectic, so orbits don't
+// slowly spiral in or out the way they do with explicit Euler).
+class NBodySystem
+{
+public:
+    NBodySystem();
+    ~NBodySystem();
+
+    void SetSettings(const NBodySettings& settings) { m_settings = settings; }
+    const NBodySettings& GetSettings() const { return m_settings; }
+    void SetTheta(float theta) { m_settings.theta = theta; }
+
+    void Clear();
+    void AddParticle(const glm::vec3& position, const glm::vec3& velocity, float gm);
+    // Adds a particle with the velocity of a circular orbit around centralGM at the origin
+    void AddOrbitingParticle(const glm::vec3& position, float gm, float centralGM);
+    void SetAttractors(const std::vector<Attractor>& attractors) { m_attractors = attractors; }
+
+    void Step(float dt);
+
+    size_t GetParticleCount() const { return m_position.size(); }
+    const glm::vec3& GetPosition(size_t i) const { return m_position[i]; }
+    const glm::vec3& GetVelocity(size_t i) const { return m_velocity[i]; }
+    size_t GetNodeCount() const { return m_nodes.size(); }
+
+    // Times one step at 10k, 100k and 1M particles on one thread and on all
+    // threads and prints the scaling against n log n.
+    static void RunBenchmark();
+
+private:
+    struct Node
+    {
+        glm::vec3 com;      // centre of mass
+        float gm;           // total mass
+        glm::vec3 center;   // cell centre
+        float halfSize;     // half of the cell edge
+        int firstChild;     // children are contiguous, -1 for a leaf
+        int childCount;
+        uint32_t begin;     // leaf particle range in the sorted arrays
+        uint32_t end;
+    };
+
+    void Integrate(float dt);
+    void BuildTree();
+    void BuildNode(std::vector<Node>& pool, int slot, uint32_t begin, uint32_t end,
+        const glm::vec3& center, float halfSize, int depth);
+    void ComputeAccelerations();
+    glm::vec3 TreeAcceleration(const glm::vec3& p, uint32_t self) const;
+    glm::vec3 AttractorAcceleration(const glm::vec3& p) const;
+
+    template <typename Fn>
+    void ParallelFor(size_t count, size_t grain, Fn fn);
+    int ThreadCount() const;
+
+    // Worker threads, started the first time ParallelFor needs them and
+    // kept until the system is destroyed. Each job splits a range into
+    // m_jobWorkers + 1 chunks; the caller takes chunk 0, worker w chunk w + 1.
+    void StartWorkers(int count);
+    void WorkerLoop(int index, unsigned generation);
+    std::vector<std::thread> m_workers;
+    std::mutex m_poolMutex;
+    std::condition_variable m_poolWake;
+    std::condition_variable m_poolDone;
+    unsigned m_poolGeneration;      // bumped for every job
+    bool m_poolStop;
+    int m_poolPending;              // workers still on the current job
+    void (*m_jobRun)(void* fn, size_t begin, size_t end);
+    void* m_jobFn;
+    size_t m_jobCount;
+    size_t m_jobChunk;
+    int m_jobWorkers;
+
+    NBodySettings m_settings;
+    std::vector<Attractor> m_attractors;
+
+    std::vector<glm::vec3> m_position;
+    std::vector<glm::vec3> m_velocity;
+    std::vector<glm::vec3> m_acceleration;
+    std::vector<float> m_gm;
+    bool m_accelerationValid;
+
+    // Octree, rebuilt every step. Particles are copied into tree order so
+    // the leaf loops read memory linearly.
+    std::vector<Node> m_nodes;
+    std::vector<uint32_t> m_order;      // sorted slot -> particle index
+    std::vector<uint32_t> m_scratch;
+    std::vector<glm::vec3> m_sortedPosition;
+    std::vector<float> m_sortedGM;
+    std::vector<std::vector<Node>> m_octantPools;
+};
+
+#endif /* NBODY_H */
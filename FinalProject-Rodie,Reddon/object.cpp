@@ -53,21 +53,21 @@ glm::mat4 Object::GetModel()
 void Object::Render(GLint posAttribLoc, GLint colAttribLoc)
 {
 
-	glBindVertexArray(vao);
+	glBindVertexArray(vao.Get());
 
 	// Enable vertex attibute arrays for each vertex attrib
 	glEnableVertexAttribArray(posAttribLoc);
 	glEnableVertexAttribArray(colAttribLoc);
 
 	// Bind your VBO
-	glBindBuffer(GL_ARRAY_BUFFER, VB);
+	glBindBuffer(GL_ARRAY_BUFFER, VB.Get());
 
 	// Set vertex attribute pointers to the load correct data
 	glVertexAttribPointer(posAttribLoc, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), 0);
 	glVertexAttribPointer(colAttribLoc, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, normal));
 
 	// Bind your Element Array
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, IB);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, IB.Get());
 
 	// Render
 	glDrawElements(GL_TRIANGLES, Indices.size(), GL_UNSIGNED_INT, 0);
@@ -81,16 +81,18 @@ void Object::Render(GLint posAttribLoc, GLint colAttribLoc)
 bool Object::InitBuffers() {
 
 	// For OpenGL 3
-	glGenVertexArrays(1, &vao);
-	glBindVertexArray(vao);
+	vao.Create("Object vertex array");
+	glBindVertexArray(vao.Get());
 
-	glGenBuffers(1, &VB);
-	glBindBuffer(GL_ARRAY_BUFFER, VB);
+	VB.Create("Object vertices");
+	glBindBuffer(GL_ARRAY_BUFFER, VB.Get());
 	glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * Vertices.size(), &Vertices[0], GL_STATIC_DRAW);
+	VB.SetBytes(sizeof(Vertex) * Vertices.size());
 
-	glGenBuffers(1, &IB);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, IB);
+	IB.Create("Object indices");
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, IB.Get());
 	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(unsigned int) * Indices.size(), &Indices[0], GL_STATIC_DRAW);
+	IB.SetBytes(sizeof(unsigned int) * Indices.size());
 
 	return true;
 }
@@ -3,6 +3,7 @@
 
 #include <vector>
 #include "graphics_headers.h"
+#include "gpuresources.h"
 
 class Object
 {
@@ -24,10 +25,10 @@ private:
     glm::mat4 model;
     std::vector<Vertex> Vertices;
     std::vector<unsigned int> Indices;
-    GLuint VB;
-    GLuint IB;
+    GpuBuffer VB;
+    GpuBuffer IB;
 
-    GLuint vao;
+    GpuVertexArray vao;
 
     float angle;
 };
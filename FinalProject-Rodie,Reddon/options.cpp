@@ -0,0 +1,345 @@
+#include "options.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// "none", or passes separated by commas
+static bool ParsePostPasses(const char* text, bool& bloom, bool& tonemap)
+{
+    bloom = false;
+    tonemap = false;
+    if (strcmp(text, "none") == 0)
+        return true;
+    while (*text != '\0')
+    {
+        size_t length = strcspn(text, ",");
+        if (length == 5 && strncmp(text, "bloom", 5) == 0)
+            bloom = true;
+        else if (length == 7 && strncmp(text, "tonemap", 7) == 0)
+            tonemap = true;
+        else
+            return false;
+        text += length;
+        if (*text == ',')
+            text++;
+    }
+    return bloom || tonemap;
+}
+
+bool ParseOptions(int argc, char** argv, LaunchOptions& options)
+{
+    bool presentGiven = false;
+    bool fpsGiven = false;
+    bool dynresMinGiven = false;
+    bool dynresMaxGiven = false;
+    for (int i = 1; i < argc; i++)
+    {
+        const char* arg = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (strcmp(arg, "--nbody") == 0)
+            options.nbody = true;
+        else if (strcmp(arg, "--theta") == 0)
+        {
+            // Checked here rather than with the others, as a bare --theta
+            // is an easy slip next to --nbody
+            if (hasValue)
+                options.nbodyTheta = (float)atof(argv[++i]);
+            if (!hasValue || options.nbodyTheta < 0.0f)
+            {
+                printf("Bad --theta, expected an opening angle of 0 or more\n");
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--nbody-bench") == 0)
+            options.nbodyBench = true;
+        else if (strcmp(arg, "--headless") == 0)
+            options.headless = true;
+        else if (strcmp(arg, "--size") == 0 && hasValue)
+        {
+            if (sscanf(argv[++i], "%dx%d", &options.width, &options.height) != 2 ||
+                options.width <= 0 || options.height <= 0)
+            {
+                printf("Bad --size, expected <width>x<height>\n");
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--frames") == 0 && hasValue)
+            options.frames = atoi(argv[++i]);
+        else if (strcmp(arg, "--screenshot") == 0 && hasValue)
+            options.screenshot = argv[++i];
+        else if (strcmp(arg, "--present") == 0 && hasValue)
+        {
+            if (!ParsePresentMode(argv[++i], options.present))
+            {
+                printf("Bad --present, expected vsync, adaptive, uncapped or limit\n");
+                return false;
+            }
+            presentGiven = true;
+        }
+        else if (strcmp(arg, "--fps") == 0 && hasValue)
+        {
+            options.fps = (float)atof(argv[++i]);
+            if (options.fps <= 0.0f)
+            {
+                printf("Bad --fps, expected a positive frame rate\n");
+                return false;
+            }
+            fpsGiven = true;
+        }
+        else if (strcmp(arg, "--depth-prepass") == 0)
+            options.depthPrepass = true;
+        else if (strcmp(arg, "--overdraw") == 0)
+            options.overdraw = true;
+        else if (strcmp(arg, "--procedural-spheres") == 0)
+            options.proceduralSpheres = true;
+        else if (strcmp(arg, "--impostor-pixels") == 0 && hasValue)
+        {
+            options.impostorPixels = (float)atof(argv[++i]);
+            if (options.impostorPixels < 0.0f)
+            {
+                printf("Bad --impostor-pixels, expected a radius in pixels (0 = never)\n");
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--asteroid-seed") == 0 && hasValue)
+            options.asteroidSeed = (unsigned)strtoul(argv[++i], NULL, 10);
+        else if (strcmp(arg, "--asteroid-radius") == 0 && hasValue)
+        {
+            options.asteroidRadius = (float)atof(argv[++i]);
+            if (options.asteroidRadius <= 0.0f)
+            {
+                printf("Bad --asteroid-radius, expected a positive distance\n");
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--asteroid-budget") == 0 && hasValue)
+        {
+            options.asteroidBudget = (float)atof(argv[++i]);
+            if (options.asteroidBudget <= 0.0f)
+            {
+                printf("Bad --asteroid-budget, expected a positive number of KB\n");
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--comet-rate") == 0 && hasValue)
+        {
+            options.cometRate = (float)atof(argv[++i]);
+            if (options.cometRate <= 0.0f)
+            {
+                printf("Bad --comet-rate, expected a positive number of particles a second\n");
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--comet-lifetime") == 0 && hasValue)
+        {
+            options.cometLifetime = (float)atof(argv[++i]);
+            if (options.cometLifetime <= 0.0f)
+            {
+                printf("Bad --comet-lifetime, expected a positive number of seconds\n");
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--post") == 0 && hasValue)
+        {
+            if (!ParsePostPasses(argv[++i], options.bloom, options.tonemap))
+            {
+                printf("Bad --post, expected bloom, tonemap, both separated by a comma, or none\n");
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--exposure") == 0 && hasValue)
+        {
+            options.exposure = (float)atof(argv[++i]);
+            if (options.exposure <= 0.0f)
+            {
+                printf("Bad --exposure, expected a positive multiplier\n");
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--dynamic-resolution") == 0)
+            options.dynamicResolution = true;
+        else if (strcmp(arg, "--dynres-min") == 0 && hasValue)
+        {
+            options.dynresMin = (float)atof(argv[++i]);
+            if (options.dynresMin <= 0.0f || options.dynresMin > 1.0f)
+            {
+                printf("Bad --dynres-min, expected a scale above 0 and up to 1\n");
+                return false;
+            }
+            dynresMinGiven = true;
+            options.dynamicResolution = true;
+        }
+        else if (strcmp(arg, "--dynres-max") == 0 && hasValue)
+        {
+            options.dynresMax = (float)atof(argv[++i]);
+            if (options.dynresMax <= 0.0f || options.dynresMax > 1.0f)
+            {
+                printf("Bad --dynres-max, expected a scale above 0 and up to 1\n");
+                return false;
+            }
+            dynresMaxGiven = true;
+            options.dynamicResolution = true;
+        }
+        else if (strcmp(arg, "--dynres-target") == 0 && hasValue)
+        {
+            options.dynresTarget = (float)atof(argv[++i]);
+            if (options.dynresTarget <= 0.0f)
+            {
+                printf("Bad --dynres-target, expected a positive number of milliseconds\n");
+                return false;
+            }
+            options.dynamicResolution = true;
+        }
+        else if (strcmp(arg, "--texture-budget") == 0 && hasValue)
+        {
+            options.textureBudget = (float)atof(argv[++i]);
+            if (options.textureBudget <= 0.0f)
+            {
+                printf("Bad --texture-budget, expected a positive number of MB\n");
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--vram-budget") == 0 && hasValue)
+        {
+            options.vramBudget = (float)atof(argv[++i]);
+            if (options.vramBudget <= 0.0f)
+            {
+                printf("Bad --vram-budget, expected a positive number of MB\n");
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--body-textures") == 0 && hasValue)
+        {
+            if (!ParseBodyTextureMode(argv[++i], options.bodyTextures))
+            {
+                printf("Bad --body-textures, expected auto, bindless, array or separate\n");
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--shader-cache") == 0 && hasValue)
+            options.shaderCache = argv[++i];
+        else if (strcmp(arg, "--no-shader-cache") == 0)
+            options.shaderCache = NULL;
+        else if (strcmp(arg, "--profile") == 0 && hasValue)
+            options.profile = argv[++i];
+        else if (strcmp(arg, "--alloc-strict") == 0 && hasValue)
+        {
+            const char* mode = argv[++i];
+            if (strcmp(mode, "log") == 0)
+                options.allocStrict = AllocStrictMode::Log;
+            else if (strcmp(mode, "abort") == 0)
+                options.allocStrict = AllocStrictMode::Abort;
+            else
+            {
+                printf("Bad --alloc-strict, expected log or abort\n");
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--bench") == 0)
+        {
+            // The script path is optional
+            if (hasValue && strncmp(argv[i + 1], "--", 2) != 0)
+                options.bench = argv[++i];
+            else
+                options.bench = "assets/bench_flight.txt";
+        }
+        else if (strcmp(arg, "--bench-dt") == 0 && hasValue)
+        {
+            options.benchDt = (float)atof(argv[++i]);
+            if (options.benchDt <= 0.0f)
+            {
+                printf("Bad --bench-dt, expected a positive number of seconds\n");
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--bench-out") == 0 && hasValue)
+            options.benchOut = argv[++i];
+        else if (strcmp(arg, "--microbench") == 0)
+        {
+            options.microbench = true;
+            if (hasValue && strncmp(argv[i + 1], "--", 2) != 0)
+                options.microbenchFilter = argv[++i];
+        }
+        else if (strcmp(arg, "--microbench-out") == 0 && hasValue)
+            options.microbenchOut = argv[++i];
+        else if (strcmp(arg, "--bindings") == 0 && hasValue)
+            options.bindings = argv[++i];
+        else if (strcmp(arg, "--record") == 0 && hasValue)
+            options.record = argv[++i];
+        else if (strcmp(arg, "--replay") == 0 && hasValue)
+            options.replay = argv[++i];
+        else if (strcmp(arg, "--replay-from") == 0 && hasValue)
+            options.replayFrom = atoi(argv[++i]);
+        else if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0)
+            return false;
+        else
+        {
+            printf("Unknown option: %s\n", arg);
+            return false;
+        }
+    }
+    if (fpsGiven && !presentGiven)
+        options.present = PresentMode::Limit;
+    // Name the flag that was given; the other one is at its default
+    if (options.dynresMin > options.dynresMax)
+    {
+        if (!dynresMinGiven)
+            printf("Bad --dynres-max, it is below the smallest scale (%g)\n", options.dynresMin);
+        else if (!dynresMaxGiven)
+            printf("Bad --dynres-min, it is above the largest scale (%g)\n", options.dynresMax);
+        else
+            printf("Bad --dynres-min, it is above --dynres-max\n");
+        return false;
+    }
+    // A benchmark or replay runs as long as its script or log unless --frames says otherwise
+    if (options.headless && options.frames == 0 && options.bench == NULL && options.replay == NULL)
+        options.frames = 600;
+    return true;
+}
+
+void PrintUsage(const char* program)
+{
+    printf("Usage: %s [options]\n", program);
+    printf("  --nbody           asteroid belts move under gravity (Barnes-Hut)\n");
+    printf("  --theta <value>   Barnes-Hut opening angle (default 0.6)\n");
+    printf("  --nbody-bench     run the N-body scaling benchmark and exit\n");
+    printf("  --size <w>x<h>    window / framebuffer size (default 800x600)\n");
+    printf("  --headless        render offscreen with no window or input (EGL on Linux)\n");
+    printf("  --frames <n>      stop after n frames (headless default 600)\n");
+    printf("  --screenshot <f>  save the last frame as a PPM image on exit\n");
+    printf("  --present <mode>  vsync (default), adaptive, uncapped or limit\n");
+    printf("  --fps <n>         frame rate for --present limit (default 60; implies it)\n");
+    printf("  --depth-prepass   draw opaque depth first so each pixel is shaded once\n");
+    printf("  --overdraw        show how many times each pixel is shaded (brighter = more)\n");
+    printf("  --procedural-spheres  build sphere vertices in the shader, with no vertex buffers\n");
+    printf("  --impostor-pixels <n>  ray-trace spheres under n pixels of radius on a square (default 12, 0 = never)\n");
+    printf("  --asteroid-seed <n>    seed of the asteroid field (default 1234)\n");
+    printf("  --asteroid-radius <r>  asteroids are generated within r of the ship (default 24)\n");
+    printf("  --asteroid-budget <KB> asteroid data uploaded to the GPU per frame (default 64)\n");
+    printf("  --comet-rate <n>       comet particles emitted a second (default 80000)\n");
+    printf("  --comet-lifetime <s>   how long a comet particle lives at most (default 6)\n");
+    printf("  --post <passes>   bloom,tonemap (default), either one, or none\n");
+    printf("  --exposure <x>    scene brightness before tone mapping (default 1)\n");
+    printf("  --dynamic-resolution  draw the scene smaller when the GPU is over its time, then upscale\n");
+    printf("  --dynres-min <s>  smallest scale of the output size (default 0.5; implies --dynamic-resolution)\n");
+    printf("  --dynres-max <s>  largest scale (default 1; implies --dynamic-resolution)\n");
+    printf("  --dynres-target <ms>  GPU time a frame should take (default 15; implies --dynamic-resolution)\n");
+    printf("  --texture-budget <MB>  texture data streamed to the GPU per frame (default 8)\n");
+    printf("  --vram-budget <MB>  GPU memory to warn at 90%% of (default: the driver's dedicated memory, if it says)\n");
+    printf("  --body-textures <mode>  auto (default), bindless, array or separate\n");
+    printf("  --shader-cache <dir>  where compiled shader programs are cached (default shader_cache)\n");
+    printf("  --no-shader-cache     always compile the shaders\n");
+    printf("  --profile <name>  profile CPU/GPU scopes, write <name>.json (Chrome trace) and <name>.csv\n");
+    printf("  --alloc-strict <mode>  log or abort on a heap allocation in render or update (ALLOC_TRACKING builds)\n");
+    printf("  --bench [script]  fly a scripted path (default assets/bench_flight.txt) and report frame times\n");
+    printf("  --bench-dt <s>    fixed simulation step for --bench (default 1/60)\n");
+    printf("  --bench-out <f>   where --bench writes its JSON results (default bench_results.json)\n");
+    printf("  --microbench [filter]  time the hot CPU paths (names containing filter) and exit\n");
+    printf("  --microbench-out <f>   also write the micro-benchmark results as JSON\n");
+    printf("  --bindings <file> rebind keys and mouse buttons (format in assets/bindings.txt)\n");
+    printf("  --record <file>   save every frame's keys, mouse, dt and mode changes to a log\n");
+    printf("  --replay <file>   play a --record log back instead of reading input\n");
+    printf("  --replay-from <n> simulate the replay up to frame n without drawing it\n");
+}
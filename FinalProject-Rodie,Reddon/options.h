@@ -0,0 +1,86 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include <cstddef>
+#include "presentmode.h"
+#include "bodytexturemode.h"
+#include "alloctracker.h"
+
+// Settings that can be changed from the command line.
+struct LaunchOptions
+{
+    // N-body asteroid belts
+    bool nbody = false;        // --nbody
+    float nbodyTheta = 0.6f;   // --theta <value>
+    bool nbodyBench = false;   // --nbody-bench
+
+    // Window / headless rendering
+    int width = 800;           // --size <w>x<h>
+    int height = 600;
+    bool headless = false;     // --headless
+    int frames = 0;            // --frames <n>, 0 = until closed (headless default 600)
+    const char* screenshot = NULL;  // --screenshot <file.ppm>, written on exit
+
+    // Frame pacing
+    PresentMode present = PresentMode::VSync;  // --present <vsync|adaptive|uncapped|limit>
+    float fps = 60.0f;              // --fps <n>, target for limit (implies it without --present)
+
+    // Fill rate
+    bool depthPrepass = false;      // --depth-prepass
+    bool overdraw = false;          // --overdraw
+    bool proceduralSpheres = false; // --procedural-spheres
+    float impostorPixels = 12.0f;   // --impostor-pixels <n>, 0 = never
+
+    // Asteroid field
+    unsigned asteroidSeed = 1234;   // --asteroid-seed <n>
+    float asteroidRadius = 24.0f;   // --asteroid-radius <units>, around the ship
+    float asteroidBudget = 64.0f;   // --asteroid-budget <KB>, instance data uploaded per frame
+
+    // Comet particles
+    float cometRate = 80000.0f;     // --comet-rate <n>, particles emitted a second
+    float cometLifetime = 6.0f;     // --comet-lifetime <s>
+
+    // Post-processing
+    bool bloom = true;              // --post <bloom,tonemap|none>
+    bool tonemap = true;
+    float exposure = 1.0f;          // --exposure <x>
+
+    // Dynamic resolution
+    bool dynamicResolution = false; // --dynamic-resolution (implied by the others)
+    float dynresMin = 0.5f;         // --dynres-min <scale>
+    float dynresMax = 1.0f;         // --dynres-max <scale>
+    float dynresTarget = 15.0f;     // --dynres-target <ms>, of GPU time a frame
+
+    // Texture streaming
+    float textureBudget = 8.0f;     // --texture-budget <MB>, copied to the GPU per frame
+    float vramBudget = 0.0f;        // --vram-budget <MB>, 0 for what the driver reports
+    BodyTextureMode bodyTextures = BodyTextureMode::Auto;  // --body-textures <auto|bindless|array|separate>
+
+    // Linked shader programs are kept here between runs
+    const char* shaderCache = "shader_cache";   // --shader-cache <dir>, --no-shader-cache
+
+    // Profiling
+    const char* profile = NULL;     // --profile <name>, writes name.json and name.csv
+    AllocStrictMode allocStrict = AllocStrictMode::Off;   // --alloc-strict <log|abort>, ALLOC_TRACKING builds
+
+    // Scripted-flight benchmark
+    const char* bench = NULL;       // --bench [script], replaces input with the script
+    float benchDt = 1.0f / 60.0f;   // --bench-dt <seconds>, fixed simulation step
+    const char* benchOut = "bench_results.json";  // --bench-out <file.json>
+
+    // CPU micro-benchmarks
+    bool microbench = false;        // --microbench [filter]
+    const char* microbenchFilter = NULL;
+    const char* microbenchOut = NULL;   // --microbench-out <file.json>
+
+    // Input
+    const char* bindings = NULL;    // --bindings <file>, see assets/bindings.txt
+    const char* record = NULL;      // --record <file>
+    const char* replay = NULL;      // --replay <file>, in place of keyboard and mouse
+    int replayFrom = 0;             // --replay-from <frame>, simulate up to it without drawing
+};
+
+bool ParseOptions(int argc, char** argv, LaunchOptions& options);
+void PrintUsage(const char* program);
+
+#endif /* OPTIONS_H */
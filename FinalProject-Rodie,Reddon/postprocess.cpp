@@ -0,0 +1,506 @@
+#include "postprocess.h"
+#include "profiler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <string>
+
+// One triangle over the whole target, uv 0-1 across it
+static const char* kFullscreenVertexShader = R"(
+#version 330
+out vec2 uv;
+
+void main()
+{
+    vec2 corner = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+    uv = corner;
+    gl_Position = vec4(corner * 2.0 - 1.0, 0.0, 1.0);
+}
+)";
+
+// Sources are only partly in use (see PostProcess::Target). Taps are in the
+// source's uv, kept inside the used part so nothing left over from a larger
+// frame bleeds in at the edges.
+static const char* kSourceRegion = R"(
+uniform sampler2D source;
+uniform vec4 sourceRegion;  // xy: the used part's size in uv, zw: the last uv inside it
+
+vec3 Tap(vec2 p)
+{
+    return texture(source, min(p, sourceRegion.zw)).rgb;
+}
+)";
+
+// Center and four diagonal taps one source texel out, each a bilinear
+// average of four texels. The first pass (PREFILTER) takes a single tap,
+// the average of the four full-resolution texels under the pixel, and
+// keeps only what is over the threshold; the passes after it do the
+// blurring.
+static const char* kDownsampleShader = R"(
+in vec2 uv;
+out vec4 FragColor;
+
+uniform vec2 texel;         // of the source
+uniform float threshold;
+
+vec3 Prefilter(vec3 color)
+{
+    // Quadratic knee from threshold / 2 up to the threshold, linear above
+    float brightness = max(color.r, max(color.g, color.b));
+    float knee = threshold * 0.5;
+    float soft = clamp(brightness - threshold + knee, 0.0, 2.0 * knee);
+    soft = soft * soft / (4.0 * knee + 1e-4);
+    return color * max(soft, brightness - threshold) / max(brightness, 1e-4);
+}
+
+void main()
+{
+    vec2 p = uv * sourceRegion.xy;
+#ifdef PREFILTER
+    FragColor = vec4(Prefilter(Tap(p)), 1.0);
+#else
+    vec3 sum = Tap(p) * 4.0;
+    sum += Tap(p - texel);
+    sum += Tap(p + texel);
+    sum += Tap(p + vec2(texel.x, -texel.y));
+    sum += Tap(p - vec2(texel.x, -texel.y));
+    FragColor = vec4(sum * 0.125, 1.0);
+#endif
+}
+)";
+
+// Four taps a source texel out along the axes and four half a texel out on
+// the diagonals, the diagonals weighted double
+static const char* kUpsampleShader = R"(
+in vec2 uv;
+out vec4 FragColor;
+
+uniform vec2 texel;         // of the source
+
+void main()
+{
+    vec2 p = uv * sourceRegion.xy;
+    vec2 h = texel * 0.5;
+    vec3 sum = Tap(p + vec2(-texel.x, 0.0));
+    sum += Tap(p + vec2(texel.x, 0.0));
+    sum += Tap(p + vec2(0.0, -texel.y));
+    sum += Tap(p + vec2(0.0, texel.y));
+    sum += Tap(p + vec2(-h.x, h.y)) * 2.0;
+    sum += Tap(p + vec2(h.x, h.y)) * 2.0;
+    sum += Tap(p + vec2(h.x, -h.y)) * 2.0;
+    sum += Tap(p + vec2(-h.x, -h.y)) * 2.0;
+    FragColor = vec4(sum / 12.0, 1.0);
+}
+)";
+
+// BLOOM and TONEMAP are compiled in rather than uniforms: software GL
+// runs both sides of a branch, even a uniform one
+static const char* kCompositeShader = R"(
+#version 330
+in vec2 uv;
+out vec4 FragColor;
+
+uniform sampler2D scene;
+uniform sampler2D bloom;
+uniform vec4 sceneRegion;   // as sourceRegion
+uniform vec4 bloomRegion;
+uniform float bloomStrength;
+uniform float exposure;
+
+// Narkowicz's fit of the ACES filmic curve
+vec3 ACESFilm(vec3 x)
+{
+    return clamp((x * (2.51 * x + 0.03)) / (x * (2.43 * x + 0.59) + 0.14), 0.0, 1.0);
+}
+
+void main()
+{
+    vec3 color = texture(scene, min(uv * sceneRegion.xy, sceneRegion.zw)).rgb;
+#ifdef BLOOM
+    color += texture(bloom, min(uv * bloomRegion.xy, bloomRegion.zw)).rgb * bloomStrength;
+#endif
+    color *= exposure;
+#ifdef TONEMAP
+    FragColor = vec4(ACESFilm(color), 1.0);
+#else
+    FragColor = vec4(clamp(color, 0.0, 1.0), 1.0);
+#endif
+}
+)";
+
+// Bilinear stretch of the center, pushed away from the average of its four
+// neighbours one source texel out, but no further than the darkest and
+// brightest of the five
+static const char* kSharpenShader = R"(
+in vec2 uv;
+out vec4 FragColor;
+
+uniform vec2 texel;         // of the source
+uniform float amount;
+
+void main()
+{
+    vec2 p = uv * sourceRegion.xy;
+    vec3 center = Tap(p);
+    vec3 north = Tap(p + vec2(0.0, texel.y));
+    vec3 south = Tap(p - vec2(0.0, texel.y));
+    vec3 east = Tap(p + vec2(texel.x, 0.0));
+    vec3 west = Tap(p - vec2(texel.x, 0.0));
+    vec3 lo = min(center, min(min(north, south), min(east, west)));
+    vec3 hi = max(center, max(max(north, south), max(east, west)));
+    vec3 sharpened = center + (center - (north + south + east + west) * 0.25) * amount;
+    FragColor = vec4(clamp(sharpened, lo, hi), 1.0);
+}
+)";
+
+// Three 10-11 bit floats in 32 bits: HDR range for the bandwidth of RGBA8
+static const GLenum kHdrFormat = GL_R11F_G11F_B10F;
+
+static Shader* StartProgram(const char* fragment, const char* defines, bool region)
+{
+    Shader* shader = new Shader();
+    shader->Initialize();
+    shader->SetDefines(defines);
+    shader->AddShader(GL_VERTEX_SHADER, kFullscreenVertexShader);
+    if (region)
+        shader->AddShader(GL_FRAGMENT_SHADER, (std::string("#version 330\n") + kSourceRegion + fragment).c_str());
+    else
+        shader->AddShader(GL_FRAGMENT_SHADER, fragment);
+    shader->BeginFinalize();
+    return shader;
+}
+
+PostProcess::PostProcess()
+{
+    m_prefilter = NULL;
+    m_downsample = NULL;
+    m_upsample = NULL;
+    m_sharpen = NULL;
+    m_shadersStarted = false;
+    m_initialized = false;
+    m_maxBloomLevels = 0;
+    m_renderScale = 1.0f;
+    m_bloom = NULL;
+    m_prefilterRegion = m_prefilterThreshold = m_downRegion = m_downTexel = m_upRegion = m_upTexel = -1;
+    m_sharpenRegion = m_sharpenTexel = m_sharpenAmount = -1;
+}
+
+PostProcess::~PostProcess()
+{
+    delete m_prefilter;
+    delete m_downsample;
+    delete m_upsample;
+    delete m_sharpen;
+    delete m_composite.shader;
+    delete[] m_bloom;
+}
+
+void PostProcess::BeginShaders(const PostProcessSettings& settings)
+{
+    // Only the programs these settings use; every combination of passes is
+    // its own program (see Composite)
+    m_settings = settings;
+    m_shadersStarted = true;
+    if (settings.bloom)
+    {
+        m_prefilter = StartProgram(kDownsampleShader, "#define PREFILTER\n", true);
+        m_downsample = StartProgram(kDownsampleShader, "", true);
+        m_upsample = StartProgram(kUpsampleShader, "", true);
+    }
+    // Neither effect, but drawn small: the clamp on its way to the upscale
+    if (settings.bloom || settings.tonemap || settings.upscale)
+    {
+        std::string defines;
+        if (settings.bloom)
+            defines += "#define BLOOM\n";
+        if (settings.tonemap)
+            defines += "#define TONEMAP\n";
+        m_composite.shader = StartProgram(kCompositeShader, defines.c_str(), false);
+    }
+    if (settings.upscale)
+        m_sharpen = StartProgram(kSharpenShader, "", true);
+}
+
+bool PostProcess::Initialize(int width, int height)
+{
+    bool built = m_shadersStarted;
+    Shader* programs[] = { m_prefilter, m_downsample, m_upsample, m_composite.shader, m_sharpen };
+    for (Shader* shader : programs)
+        built = built && (shader == NULL || shader->Finalize());
+    if (!built)
+    {
+        printf("Post-processing shaders failed to build\n");
+        return false;
+    }
+
+    // Samplers never change
+    Shader* sourced[] = { m_prefilter, m_downsample, m_upsample, m_sharpen };
+    for (Shader* shader : sourced)
+    {
+        if (shader == NULL)
+            continue;
+        shader->Enable();
+        glUniform1i(shader->GetUniformLocation("source"), 0);
+    }
+    if (m_settings.bloom)
+    {
+        m_prefilterRegion = m_prefilter->GetUniformLocation("sourceRegion");
+        m_prefilterThreshold = m_prefilter->GetUniformLocation("threshold");
+        m_downRegion = m_downsample->GetUniformLocation("sourceRegion");
+        m_downTexel = m_downsample->GetUniformLocation("texel");
+        m_upRegion = m_upsample->GetUniformLocation("sourceRegion");
+        m_upTexel = m_upsample->GetUniformLocation("texel");
+    }
+    if (m_sharpen != NULL)
+    {
+        m_sharpenRegion = m_sharpen->GetUniformLocation("sourceRegion");
+        m_sharpenTexel = m_sharpen->GetUniformLocation("texel");
+        m_sharpenAmount = m_sharpen->GetUniformLocation("amount");
+    }
+    if (m_composite.shader != NULL)
+    {
+        Shader* composite = m_composite.shader;
+        m_composite.sceneRegion = composite->GetUniformLocation("sceneRegion");
+        m_composite.exposure = composite->GetUniformLocation("exposure");
+        composite->Enable();
+        glUniform1i(composite->GetUniformLocation("scene"), 0);
+        if (m_settings.bloom)
+        {
+            m_composite.bloomRegion = composite->GetUniformLocation("bloomRegion");
+            m_composite.bloomStrength = composite->GetUniformLocation("bloomStrength");
+            glUniform1i(composite->GetUniformLocation("bloom"), 1);
+        }
+    }
+    glUseProgram(0);
+
+    m_maxBloomLevels = m_settings.bloomLevels;
+    bool complete = CreateTargets(width, height);
+    m_vao.Create("Post-process vertex array");
+    m_initialized = true;
+    if (!complete)
+    {
+        printf("Post-processing targets are incomplete\n");
+        return false;
+    }
+
+    printf("Post-processing: %dx%d HDR target, bloom %s (%d levels), tone mapping %s%s\n", width, height,
+        m_settings.bloom ? "on" : "off", m_settings.bloomLevels, m_settings.tonemap ? "on" : "off",
+        m_settings.upscale ? ", sharpened upscale" : "");
+    return true;
+}
+
+bool PostProcess::Resize(int width, int height)
+{
+    if (!m_initialized || width <= 0 || height <= 0)
+        return false;
+    if (width == m_scene.width && height == m_scene.height)
+        return true;
+
+    if (!CreateTargets(width, height))
+    {
+        printf("Post-processing targets are incomplete at %dx%d\n", width, height);
+        return false;
+    }
+    SetRenderScale(m_renderScale);
+    return true;
+}
+
+// Replaces whatever targets there were; leaves the framebuffer binding alone
+bool PostProcess::CreateTargets(int width, int height)
+{
+    GLint output = 0;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &output);
+
+    // At least half and quarter resolution, and no level smaller than a pixel
+    int levels = 2;
+    while (levels < m_maxBloomLevels && (std::min(width, height) >> (levels + 1)) > 0)
+        levels++;
+    m_settings.bloomLevels = levels;
+
+    m_sceneDepth.Create("Post-process scene depth");
+    glBindRenderbuffer(GL_RENDERBUFFER, m_sceneDepth.Get());
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    m_sceneDepth.SetBytes(GpuResources::TextureBytes(GL_DEPTH_COMPONENT24, width, height));
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    bool complete = CreateTarget(m_scene, kHdrFormat, width, height, m_sceneDepth.Get());
+    if (m_settings.upscale)
+        complete = CreateTarget(m_display, GL_RGBA8, width, height, 0) && complete;
+    delete[] m_bloom;
+    m_bloom = NULL;
+    if (m_settings.bloom)
+    {
+        m_bloom = new Target[levels];
+        for (int i = 0; i < levels; i++)
+            complete = CreateTarget(m_bloom[i], kHdrFormat, std::max(width >> (i + 1), 1), std::max(height >> (i + 1), 1), 0) && complete;
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, output);
+    return complete;
+}
+
+bool PostProcess::CreateTarget(Target& target, GLenum format, int width, int height, GLuint depth)
+{
+    target.width = target.usedWidth = width;
+    target.height = target.usedHeight = height;
+
+    target.texture.Create("Post-process target");
+    glBindTexture(GL_TEXTURE_2D, target.texture.Get());
+    glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    target.texture.SetBytes(GpuResources::TextureBytes(format, width, height));
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    target.fbo.Create("Post-process target");
+    glBindFramebuffer(GL_FRAMEBUFFER, target.fbo.Get());
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, target.texture.Get(), 0);
+    if (depth != 0)
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth);
+    return glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+}
+
+void PostProcess::SetRenderScale(float scale)
+{
+    if (!m_initialized || !m_settings.upscale)
+        return;
+
+    scale = std::min(std::max(scale, 0.0f), 1.0f);
+    m_renderScale = scale;
+    m_scene.usedWidth = std::max((int)lroundf(m_scene.width * scale), 1);
+    m_scene.usedHeight = std::max((int)lroundf(m_scene.height * scale), 1);
+    m_display.usedWidth = m_scene.usedWidth;
+    m_display.usedHeight = m_scene.usedHeight;
+    for (int i = 0; m_bloom != NULL && i < m_settings.bloomLevels; i++)
+    {
+        m_bloom[i].usedWidth = std::max(m_scene.usedWidth >> (i + 1), 1);
+        m_bloom[i].usedHeight = std::max(m_scene.usedHeight >> (i + 1), 1);
+    }
+}
+
+void PostProcess::BeginScene()
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, m_scene.fbo.Get());
+    glViewport(0, 0, m_scene.usedWidth, m_scene.usedHeight);
+}
+
+void PostProcess::SetRegion(GLint location, const Target& source)
+{
+    glUniform4f(location, (float)source.usedWidth / source.width, (float)source.usedHeight / source.height,
+        (source.usedWidth - 0.5f) / source.width, (source.usedHeight - 0.5f) / source.height);
+}
+
+void PostProcess::RunPass(const Target& target, GLuint source)
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, target.fbo.Get());
+    glViewport(0, 0, target.usedWidth, target.usedHeight);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, source);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+}
+
+void PostProcess::Bloom()
+{
+    PROFILE_GPU_SCOPE("Bloom");
+    int levels = m_settings.bloomLevels;
+
+    m_prefilter->Enable();
+    glUniform1f(m_prefilterThreshold, m_settings.bloomThreshold);
+    SetRegion(m_prefilterRegion, m_scene);
+    RunPass(m_bloom[0], m_scene.texture.Get());
+
+    m_downsample->Enable();
+    for (int i = 1; i < levels; i++)
+    {
+        SetRegion(m_downRegion, m_bloom[i - 1]);
+        glUniform2f(m_downTexel, 1.0f / m_bloom[i - 1].width, 1.0f / m_bloom[i - 1].height);
+        RunPass(m_bloom[i], m_bloom[i - 1].texture.Get());
+    }
+
+    // Each level is overwritten by the blur of the one below it, up to
+    // quarter resolution; the glow is wide enough by then that bilinear
+    // filtering in the composite hides the rest
+    m_upsample->Enable();
+    for (int i = levels - 2; i >= 1; i--)
+    {
+        SetRegion(m_upRegion, m_bloom[i + 1]);
+        glUniform2f(m_upTexel, 1.0f / m_bloom[i + 1].width, 1.0f / m_bloom[i + 1].height);
+        RunPass(m_bloom[i], m_bloom[i + 1].texture.Get());
+    }
+}
+
+void PostProcess::Upscale(GLuint output)
+{
+    PROFILE_GPU_SCOPE("Upscale");
+    glBindFramebuffer(GL_FRAMEBUFFER, output);
+    glViewport(0, 0, m_display.width, m_display.height);
+    m_sharpen->Enable();
+    SetRegion(m_sharpenRegion, m_display);
+    glUniform2f(m_sharpenTexel, 1.0f / m_display.width, 1.0f / m_display.height);
+    glUniform1f(m_sharpenAmount, m_settings.sharpness);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, m_display.texture.Get());
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+}
+
+int PostProcess::Apply(GLuint output)
+{
+    if (!m_initialized)
+        return 0;
+
+    glDisable(GL_DEPTH_TEST);
+    glDepthMask(GL_FALSE);
+    glBindVertexArray(m_vao.Get());
+
+    int draws = 0;
+    if (m_settings.bloom)
+    {
+        Bloom();
+        draws += 2 * m_settings.bloomLevels - 2;
+    }
+
+    bool scaled = m_scene.usedWidth != m_scene.width || m_scene.usedHeight != m_scene.height;
+    if (m_settings.bloom || m_settings.tonemap || scaled)
+    {
+        PROFILE_GPU_SCOPE("Tonemap");
+        glBindFramebuffer(GL_FRAMEBUFFER, scaled ? m_display.fbo.Get() : output);
+        glViewport(0, 0, m_scene.usedWidth, m_scene.usedHeight);
+        Composite& composite = m_composite;
+        composite.shader->Enable();
+        SetRegion(composite.sceneRegion, m_scene);
+        glUniform1f(composite.exposure, m_settings.exposure);
+        if (m_settings.bloom)
+        {
+            SetRegion(composite.bloomRegion, m_bloom[1]);
+            glUniform1f(composite.bloomStrength, m_settings.bloomStrength);
+            glActiveTexture(GL_TEXTURE1);
+            glBindTexture(GL_TEXTURE_2D, m_bloom[1].texture.Get());
+        }
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, m_scene.texture.Get());
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        draws++;
+    }
+    else
+    {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, m_scene.fbo.Get());
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, output);
+        glBlitFramebuffer(0, 0, m_scene.width, m_scene.height, 0, 0, m_scene.width, m_scene.height,
+            GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    }
+
+    if (scaled)
+    {
+        Upscale(output);
+        draws++;
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, output);
+    glViewport(0, 0, m_scene.width, m_scene.height);
+    glBindVertexArray(0);
+    glDepthMask(GL_TRUE);
+    glEnable(GL_DEPTH_TEST);
+    return draws;
+}
@@ -0,0 +1,131 @@
+#ifndef POSTPROCESS_H
+#define POSTPROCESS_H
+
+#include "graphics_headers.h"
+#include "shader.h"
+#include "gpuresources.h"
+
+struct PostProcessSettings
+{
+    bool bloom = true;
+    bool tonemap = true;
+    int bloomLevels = 4;            // half, quarter, ... resolution; at least 2
+    float bloomThreshold = 1.0f;    // brightness where glow starts, with a soft knee below
+    float bloomStrength = 0.3f;
+    float exposure = 1.0f;
+    bool upscale = false;           // the scene may be drawn below full size (SetRenderScale)
+    float sharpness = 0.5f;         // of the upscale, 0-1
+};
+
+// Renders the scene into an HDR target and runs the effect passes over it
+// on the way to the output framebuffer:
+//
+//   Bloom:   dual-filter (Kawase) blur of what is brighter than the
+//            threshold, taken at half resolution. Five-tap downsamples to
+//            1/2^bloomLevels, then eight-tap upsamples back to quarter
+//            resolution; each pass reads a handful of bilinear taps of a
+//            target a quarter the size of the one before, so the whole
+//            chain costs about as much as one half-resolution pass.
+//   Tonemap: exposure and a filmic curve (ACES fit), so what is brighter
+//            than white rolls off instead of clipping. Off, the HDR
+//            color is clamped.
+//   Upscale: with upscale set, the scene can be drawn into the lower left
+//            of the target at a fraction of the output size. Everything
+//            above runs at that size into an 8-bit target, which is then
+//            stretched to the output with a five-tap sharpen, clamped to
+//            the neighbours so edges don't ring.
+//
+// Either effect can be turned off (--post); with both off, at full size, the
+// scene is copied out. Passes are fullscreen triangles built from gl_VertexID.
+class PostProcess
+{
+public:
+    PostProcess();
+    ~PostProcess();
+
+    // Starts compiling the programs the settings need (see
+    // Shader::BeginFinalize)
+    void BeginShaders(const PostProcessSettings& settings);
+    // Needs a current GL context, after BeginShaders
+    bool Initialize(int width, int height);
+    // Recreates the targets for a new output size, keeping the render
+    // scale; between frames
+    bool Resize(int width, int height);
+
+    // Fraction of the output size the scene is drawn at, from the next
+    // BeginScene. Needs upscale; 1 without it.
+    void SetRenderScale(float scale);
+    int GetRenderWidth() const { return m_scene.usedWidth; }
+    int GetRenderHeight() const { return m_scene.usedHeight; }
+
+    // Binds the HDR target for the scene to be drawn into, with the
+    // viewport set to the render size
+    void BeginScene();
+    // Runs the enabled passes into output, which is left bound; returns
+    // the draw calls made
+    int Apply(GLuint output);
+
+private:
+    // Allocated at its largest; passes draw into and read from the lower
+    // left usedWidth x usedHeight
+    struct Target
+    {
+        GpuFramebuffer fbo;
+        GpuTexture texture;
+        int width = 0;
+        int height = 0;
+        int usedWidth = 0;
+        int usedHeight = 0;
+    };
+
+    // Bloom and tone mapping in one pass, built for the passes that are on
+    // (llvmpipe runs both sides even of uniform branches); with neither, at
+    // full size, the scene is blitted instead
+    struct Composite
+    {
+        Shader* shader = NULL;
+        GLint sceneRegion = -1;
+        GLint bloomRegion = -1;
+        GLint bloomStrength = -1;
+        GLint exposure = -1;
+    };
+    bool CreateTargets(int width, int height);
+    bool CreateTarget(Target& target, GLenum format, int width, int height, GLuint depth);
+    // The used part of source to a sourceRegion uniform
+    static void SetRegion(GLint location, const Target& source);
+    // Draws a fullscreen triangle into the used part of target with shader
+    // bound, reading source on unit 0
+    void RunPass(const Target& target, GLuint source);
+    void Bloom();
+    void Upscale(GLuint output);
+
+    Shader* m_prefilter;        // the first downsample
+    Shader* m_downsample;
+    Shader* m_upsample;
+    Composite m_composite;
+    Shader* m_sharpen;          // upscale only
+    bool m_shadersStarted;
+    bool m_initialized;
+    PostProcessSettings m_settings;
+    int m_maxBloomLevels;       // as asked for; m_settings has what fits
+    float m_renderScale;
+
+    Target m_scene;
+    GpuRenderbuffer m_sceneDepth;
+    Target m_display;           // tone mapped, before the upscale
+    Target* m_bloom;            // m_settings.bloomLevels, from half resolution down; NULL without bloom
+    GpuVertexArray m_vao;       // no attributes
+
+    // Uniforms
+    GLint m_prefilterRegion;
+    GLint m_prefilterThreshold;
+    GLint m_downRegion;
+    GLint m_downTexel;
+    GLint m_upRegion;
+    GLint m_upTexel;
+    GLint m_sharpenRegion;
+    GLint m_sharpenTexel;
+    GLint m_sharpenAmount;
+};
+
+#endif /* POSTPROCESS_H */
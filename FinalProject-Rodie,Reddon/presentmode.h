@@ -0,0 +1,33 @@
+#ifndef PRESENTMODE_H
+#define PRESENTMODE_H
+
+#include <cstring>
+
+// How frames are presented (--present)
+enum class PresentMode {
+    VSync,      // swap interval 1
+    Adaptive,   // swap interval -1: tear instead of waiting when a frame is late
+    Uncapped,   // swap interval 0, no limit
+    Limit       // swap interval 0, limited to --fps with a sleep-then-spin wait
+};
+
+inline const char* PresentModeName(PresentMode mode)
+{
+    static const char* names[] = { "vsync", "adaptive", "uncapped", "limit" };
+    return names[(int)mode];
+}
+
+inline bool ParsePresentMode(const char* name, PresentMode& mode)
+{
+    for (int i = 0; i <= (int)PresentMode::Limit; i++)
+    {
+        if (strcmp(name, PresentModeName((PresentMode)i)) == 0)
+        {
+            mode = (PresentMode)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+#endif /* PRESENTMODE_H */
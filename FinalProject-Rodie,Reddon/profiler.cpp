@@ -0,0 +1,317 @@
+#include "profiler.h"
+#include "alloctracker.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+using namespace std;
+
+Profiler& Profiler::Get()
+{
+    static Profiler profiler;
+    return profiler;
+}
+
+Profiler::Profiler() : m_gpuQueries(kMaxGpuScopes)
+{
+    m_enabled = false;
+    m_full = false;
+    m_frame = -1;
+    m_depth = 0;
+    m_originUs = 0.0;
+    m_frameStartUs = 0.0;
+    m_gpuActive = false;
+    m_gpuDropped = 0;
+}
+
+void Profiler::Enable()
+{
+    if (m_enabled)
+        return;
+    m_enabled = true;
+    m_originUs = 0.0;
+    m_originUs = NowUs();
+    m_events.reserve(4096);
+}
+
+double Profiler::NowUs() const
+{
+    using namespace std::chrono;
+    double now = duration<double, micro>(steady_clock::now().time_since_epoch()).count();
+    return now - m_originUs;
+}
+
+void Profiler::BeginFrame()
+{
+    if (!m_enabled)
+        return;
+    m_frame++;
+    m_frameStartUs = NowUs();
+    m_gpuDropped += m_gpuQueries.Advance([this](int set, int count) { ReadGpu(set, count); });
+}
+
+void Profiler::EndFrame()
+{
+    if (!m_enabled || m_frame < 0)
+        return;
+    m_frameTimes.push_back((NowUs() - m_frameStartUs) / 1000.0);
+    m_gpuQueries.Resolve(false, [this](int set, int count) { ReadGpu(set, count); });
+}
+
+// Whether another event fits; the first time one doesn't, says so and
+// stops recording
+bool Profiler::HasRoom()
+{
+    if (m_full)
+        return false;
+    if ((int)m_events.size() < kMaxEvents)
+        return true;
+    printf("Profiler: event buffer full, recording stopped at frame %d\n", m_frame);
+    m_full = true;
+    return false;
+}
+
+int Profiler::BeginCpu(const char* name)
+{
+    if (!m_enabled || !HasRoom())
+        return -1;
+
+    ALLOC_SCOPE("Profiler");
+    ProfileEvent event;
+    event.name = name;
+    event.frame = m_frame;
+    event.startUs = NowUs();
+    event.durationUs = 0.0;
+    event.depth = m_depth++;
+    event.gpu = false;
+    m_events.push_back(event);
+    return (int)m_events.size() - 1;
+}
+
+void Profiler::EndCpu(int event)
+{
+    if (event < 0)
+        return;
+    m_depth--;
+    m_events[event].durationUs = NowUs() - m_events[event].startUs;
+}
+
+bool Profiler::BeginGpu(const char* name, double cpuStartUs)
+{
+    if (!m_enabled || m_full || m_gpuActive || m_frame < 0)
+        return false;
+    GLuint query = m_gpuQueries.Add();
+    if (query == 0)
+        return false;
+
+    int set = m_gpuQueries.GetSet();
+    PendingGpu& pending = m_pending[set][m_gpuQueries.GetCount(set) - 1];
+    pending.name = name;
+    pending.frame = m_frame;
+    pending.startUs = cpuStartUs;
+    pending.depth = m_depth;
+
+    glBeginQuery(GL_TIME_ELAPSED, query);
+    m_gpuActive = true;
+    return true;
+}
+
+void Profiler::EndGpu()
+{
+    if (!m_gpuActive)
+        return;
+    glEndQuery(GL_TIME_ELAPSED);
+    m_gpuActive = false;
+}
+
+void Profiler::ReadGpu(int set, int count)
+{
+    double nowUs = NowUs();
+    for (int i = 0; i < count; i++)
+    {
+        GLuint64 elapsedNs = 0;
+        glGetQueryObjectui64v(m_gpuQueries.GetQuery(set, i), GL_QUERY_RESULT, &elapsedNs);
+
+        // llvmpipe reports an absolute timestamp for a query begun before its
+        // first draw; anything longer than we've been running can't be real
+        if (elapsedNs / 1000.0 > nowUs)
+        {
+            m_gpuDropped++;
+            continue;
+        }
+
+        if (!HasRoom())
+            break;
+
+        // TIME_ELAPSED has no start time; line the bar up with its CPU scope
+        const PendingGpu& pending = m_pending[set][i];
+        ProfileEvent event;
+        event.name = pending.name;
+        event.frame = pending.frame;
+        event.startUs = pending.startUs;
+        event.durationUs = elapsedNs / 1000.0;
+        event.depth = pending.depth;
+        event.gpu = true;
+        m_events.push_back(event);
+    }
+}
+
+void Profiler::Flush()
+{
+    if (!m_enabled)
+        return;
+    m_gpuQueries.Resolve(true, [this](int set, int count) { ReadGpu(set, count); });
+    m_gpuQueries.Release();
+}
+
+static void WriteJsonString(FILE* file, const char* text)
+{
+    fputc('"', file);
+    for (const char* c = text; *c; c++)
+    {
+        if (*c == '"' || *c == '\\')
+            fputc('\\', file);
+        fputc(*c, file);
+    }
+    fputc('"', file);
+}
+
+bool Profiler::WriteChromeTrace(const char* path) const
+{
+    FILE* file = fopen(path, "w");
+    if (file == NULL)
+    {
+        printf("Could not write %s\n", path);
+        return false;
+    }
+
+    fprintf(file, "{\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"CPU\"}},\n");
+    fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"GPU\"}}");
+    for (const ProfileEvent& e : m_events)
+    {
+        fprintf(file, ",\n{\"name\":");
+        WriteJsonString(file, e.name);
+        fprintf(file, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d,\"args\":{\"frame\":%d}}",
+            e.gpu ? "gpu" : "cpu", e.startUs, e.durationUs, e.gpu ? 2 : 1, e.frame);
+    }
+    fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    fclose(file);
+    return true;
+}
+
+bool Profiler::WriteCsv(const char* path) const
+{
+    FILE* file = fopen(path, "w");
+    if (file == NULL)
+    {
+        printf("Could not write %s\n", path);
+        return false;
+    }
+
+    // Columns: every CPU scope name, then every GPU scope name, in first-seen
+    // order. Names are literals, so comparing pointers would mostly work, but
+    // the same literal in two translation units may not be merged.
+    vector<const char*> cpuNames, gpuNames;
+    for (const ProfileEvent& e : m_events)
+    {
+        if (e.frame < 0)
+            continue;
+        vector<const char*>& names = e.gpu ? gpuNames : cpuNames;
+        bool known = false;
+        for (const char* n : names)
+            known = known || strcmp(n, e.name) == 0;
+        if (!known)
+            names.push_back(e.name);
+    }
+
+    fprintf(file, "frame,frame_ms");
+    for (const char* n : cpuNames)
+        fprintf(file, ",%s_cpu_ms", n);
+    for (const char* n : gpuNames)
+        fprintf(file, ",%s_gpu_ms", n);
+    fprintf(file, "\n");
+
+    // Scopes hit more than once in a frame are summed
+    size_t columns = cpuNames.size() + gpuNames.size();
+    vector<vector<double>> rows(m_frameTimes.size(), vector<double>(columns, 0.0));
+    for (const ProfileEvent& e : m_events)
+    {
+        if (e.frame < 0 || e.frame >= (int)rows.size())
+            continue;
+        const vector<const char*>& names = e.gpu ? gpuNames : cpuNames;
+        size_t column = e.gpu ? cpuNames.size() : 0;
+        for (size_t i = 0; i < names.size(); i++)
+        {
+            if (strcmp(names[i], e.name) == 0)
+            {
+                rows[e.frame][column + i] += e.durationUs / 1000.0;
+                break;
+            }
+        }
+    }
+
+    for (size_t f = 0; f < rows.size(); f++)
+    {
+        fprintf(file, "%d,%.4f", (int)f, m_frameTimes[f]);
+        for (double ms : rows[f])
+            fprintf(file, ",%.4f", ms);
+        fprintf(file, "\n");
+    }
+    fclose(file);
+    return true;
+}
+
+void Profiler::PrintSummary() const
+{
+    if (m_frameTimes.empty())
+        return;
+
+    struct Total
+    {
+        const char* name;
+        bool gpu;
+        double ms;
+    };
+    vector<Total> totals;
+    for (const ProfileEvent& e : m_events)
+    {
+        if (e.frame < 0)
+            continue;
+        auto it = find_if(totals.begin(), totals.end(), [&](const Total& t) {
+            return t.gpu == e.gpu && strcmp(t.name, e.name) == 0;
+            });
+        if (it == totals.end())
+            totals.push_back({ e.name, e.gpu, e.durationUs / 1000.0 });
+        else
+            it->ms += e.durationUs / 1000.0;
+    }
+
+    double frameTotal = 0.0;
+    for (double ms : m_frameTimes)
+        frameTotal += ms;
+    int frames = (int)m_frameTimes.size();
+
+    printf("Profile over %d frames: %.3f ms/frame CPU\n", frames, frameTotal / frames);
+    for (const Total& t : totals)
+        printf("  %-22s %s %8.3f ms/frame\n", t.name, t.gpu ? "GPU" : "CPU", t.ms / frames);
+    if (m_gpuDropped > 0)
+        printf("  (%d GPU timings dropped: not ready within %d frames, or bogus)\n", m_gpuDropped, GpuQueryRing::kSets);
+}
+
+ProfileScope::ProfileScope(const char* name, bool gpu)
+{
+    Profiler& profiler = Profiler::Get();
+    m_event = profiler.BeginCpu(name);
+    m_gpu = m_event >= 0 && gpu && profiler.BeginGpu(name, profiler.GetEvents()[m_event].startUs);
+}
+
+ProfileScope::~ProfileScope()
+{
+    Profiler& profiler = Profiler::Get();
+    if (m_gpu)
+        profiler.EndGpu();
+    profiler.EndCpu(m_event);
+}
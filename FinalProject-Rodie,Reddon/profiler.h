@@ -0,0 +1,107 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <vector>
+#include "graphics_headers.h"
+#include "gpuqueryring.h"
+
+// Frame profiler (--profile). CPU scopes nest freely; GPU scopes use
+// GL_TIME_ELAPSED queries, which can't nest, so only the outermost open GPU
+// scope is timed on the GPU. Each frame's queries come from the next set of
+// a GpuQueryRing, read back once their results are there, so reading never
+// stalls the pipeline.
+//
+//     PROFILE_SCOPE("HierarchicalUpdate2");   // CPU only
+//     PROFILE_GPU_SCOPE("Planets");           // CPU and GPU
+//
+// Scope names must be string literals (only the pointer is kept).
+
+struct ProfileEvent
+{
+    const char* name;
+    int frame;          // -1 for anything recorded before the first frame
+    double startUs;     // since the profiler was enabled
+    double durationUs;
+    int depth;
+    bool gpu;
+};
+
+class Profiler
+{
+public:
+    static Profiler& Get();
+
+    void Enable();
+    bool IsEnabled() const { return m_enabled; }
+
+    void BeginFrame();
+    void EndFrame();
+
+    int BeginCpu(const char* name);
+    void EndCpu(int event);
+    // Returns false when no query was started (nested, disabled or out of queries)
+    bool BeginGpu(const char* name, double cpuStartUs);
+    void EndGpu();
+
+    // Waits for outstanding GPU results and releases the queries; call once
+    // the last frame is done, while the context is still current
+    void Flush();
+
+    // Chrome about://tracing / Perfetto "trace_event" format
+    bool WriteChromeTrace(const char* path) const;
+    // One row per frame, one column per scope (milliseconds)
+    bool WriteCsv(const char* path) const;
+    void PrintSummary() const;
+
+    double NowUs() const;
+    const std::vector<ProfileEvent>& GetEvents() const { return m_events; }
+    int GetFrameCount() const { return (int)m_frameTimes.size(); }
+
+    static const int kMaxGpuScopes = 32;       // per frame
+    static const int kMaxEvents = 1 << 20;     // recording stops after this
+
+private:
+    Profiler();
+    bool HasRoom();
+    void ReadGpu(int set, int count);
+
+    struct PendingGpu
+    {
+        const char* name;
+        int frame;
+        double startUs;
+        int depth;
+    };
+
+    bool m_enabled;
+    bool m_full;
+    int m_frame;
+    int m_depth;
+    double m_originUs;
+    double m_frameStartUs;
+    std::vector<ProfileEvent> m_events;
+    std::vector<double> m_frameTimes;   // CPU ms, indexed by frame
+
+    GpuQueryRing m_gpuQueries;
+    bool m_gpuActive;
+    PendingGpu m_pending[GpuQueryRing::kSets][kMaxGpuScopes];     // by set and query
+    int m_gpuDropped;
+};
+
+class ProfileScope
+{
+public:
+    ProfileScope(const char* name, bool gpu);
+    ~ProfileScope();
+
+private:
+    int m_event;
+    bool m_gpu;
+};
+
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_CONCAT(profileScope_, __LINE__)(name, false)
+#define PROFILE_GPU_SCOPE(name) ProfileScope PROFILE_CONCAT(profileScope_, __LINE__)(name, true)
+
+#endif /* PROFILER_H */
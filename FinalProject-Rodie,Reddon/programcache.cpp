@@ -0,0 +1,171 @@
+#include "programcache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#if defined(_WIN32)
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+static const char kMagic[4] = { 'S', 'S', 'P', 'B' };
+static const uint32_t kVersion = 1;
+
+ProgramCache& ProgramCache::Get()
+{
+    static ProgramCache cache;
+    return cache;
+}
+
+ProgramCache::ProgramCache()
+{
+    m_enabled = false;
+    m_driverHash = 0;
+    m_hits = 0;
+    m_misses = 0;
+}
+
+uint64_t ProgramCache::Hash(const void* data, size_t size, uint64_t seed)
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+    uint64_t hash = seed;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+bool ProgramCache::Enable(const char* directory)
+{
+    GLint formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    if (formats <= 0)
+    {
+        printf("Shader cache disabled: the driver can't save program binaries\n");
+        return false;
+    }
+
+#if defined(_WIN32)
+    _mkdir(directory);
+#else
+    mkdir(directory, 0755);
+#endif
+
+    m_directory = directory;
+    m_driver.clear();
+    const GLenum strings[] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+    for (GLenum name : strings)
+    {
+        const GLubyte* value = glGetString(name);
+        m_driver += value != NULL ? (const char*)value : "?";
+        m_driver += '\n';
+    }
+    m_driverHash = Hash(m_driver.data(), m_driver.size());
+    m_enabled = true;
+    return true;
+}
+
+std::string ProgramCache::PathFor(uint64_t sourceHash) const
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)Hash(&sourceHash, sizeof(sourceHash), m_driverHash));
+    return m_directory + "/" + name;
+}
+
+bool ProgramCache::Load(GLuint program, uint64_t sourceHash)
+{
+    if (!m_enabled)
+        return false;
+
+    std::string path = PathFor(sourceHash);
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == NULL)
+    {
+        m_misses++;
+        return false;
+    }
+    std::vector<char> data;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (size > 0)
+    {
+        data.resize((size_t)size);
+        if (fread(data.data(), 1, data.size(), file) != data.size())
+            data.clear();
+    }
+    fclose(file);
+
+    // magic, version, driver length, driver, format, binary length, binary
+    const size_t headerSize = sizeof(kMagic) + 3 * sizeof(uint32_t) + m_driver.size() + sizeof(uint32_t);
+    uint32_t version = 0, driverLength = 0, format = 0, length = 0;
+    bool valid = data.size() >= headerSize && memcmp(data.data(), kMagic, sizeof(kMagic)) == 0;
+    if (valid)
+    {
+        const char* p = data.data() + sizeof(kMagic);
+        memcpy(&version, p, sizeof(uint32_t));
+        memcpy(&driverLength, p + 4, sizeof(uint32_t));
+        p += 8;
+        // The file name is only a hash: check it really is this driver
+        valid = version == kVersion && driverLength == m_driver.size() &&
+            memcmp(p, m_driver.data(), m_driver.size()) == 0;
+        p += m_driver.size();
+        if (valid)
+        {
+            memcpy(&format, p, sizeof(uint32_t));
+            memcpy(&length, p + 4, sizeof(uint32_t));
+            valid = headerSize + length == data.size();
+        }
+    }
+
+    if (valid)
+    {
+        glProgramBinary(program, format, data.data() + headerSize, (GLsizei)length);
+        GLint linked = 0;
+        glGetProgramiv(program, GL_LINK_STATUS, &linked);
+        valid = linked != 0;
+    }
+
+    if (!valid)
+    {
+        remove(path.c_str());
+        m_misses++;
+        return false;
+    }
+    m_hits++;
+    return true;
+}
+
+void ProgramCache::Store(GLuint program, uint64_t sourceHash)
+{
+    if (!m_enabled)
+        return;
+
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
+        return;
+    std::vector<char> binary((size_t)length);
+    GLenum format = 0;
+    glGetProgramBinary(program, length, NULL, &format, binary.data());
+
+    std::string path = PathFor(sourceHash);
+    FILE* file = fopen(path.c_str(), "wb");
+    if (file == NULL)
+    {
+        printf("Could not write %s\n", path.c_str());
+        return;
+    }
+    uint32_t header[2] = { kVersion, (uint32_t)m_driver.size() };
+    uint32_t formatAndLength[2] = { (uint32_t)format, (uint32_t)length };
+    fwrite(kMagic, 1, sizeof(kMagic), file);
+    fwrite(header, sizeof(uint32_t), 2, file);
+    fwrite(m_driver.data(), 1, m_driver.size(), file);
+    fwrite(formatAndLength, sizeof(uint32_t), 2, file);
+    fwrite(binary.data(), 1, binary.size(), file);
+    fclose(file);
+}
@@ -0,0 +1,45 @@
+#ifndef PROGRAMCACHE_H
+#define PROGRAMCACHE_H
+
+#include <cstdint>
+#include <string>
+
+#include "graphics_headers.h"
+
+// On-disk cache of linked program binaries (--shader-cache). Each program is
+// stored under a hash of its sources and of the driver (GL_VENDOR,
+// GL_RENDERER, GL_VERSION), so editing a shader or updating the driver just
+// misses and recompiles. A binary the driver rejects is deleted.
+class ProgramCache
+{
+public:
+    static ProgramCache& Get();
+
+    // False when the driver offers no binary formats; the cache stays off
+    bool Enable(const char* directory);
+    bool IsEnabled() const { return m_enabled; }
+
+    // Loads into a program that has nothing attached; false on a miss
+    bool Load(GLuint program, uint64_t sourceHash);
+    // Program must be linked, with GL_PROGRAM_BINARY_RETRIEVABLE_HINT set before linking
+    void Store(GLuint program, uint64_t sourceHash);
+
+    int GetHits() const { return m_hits; }
+    int GetMisses() const { return m_misses; }
+
+    // FNV-1a, chainable through seed
+    static uint64_t Hash(const void* data, size_t size, uint64_t seed = 14695981039346656037ull);
+
+private:
+    ProgramCache();
+    std::string PathFor(uint64_t sourceHash) const;
+
+    bool m_enabled;
+    std::string m_directory;
+    std::string m_driver;
+    uint64_t m_driverHash;
+    int m_hits;
+    int m_misses;
+};
+
+#endif /* PROGRAMCACHE_H */
@@ -1,23 +1,23 @@
 #include "shader.h"
+#include "programcache.h"
 
 Shader::Shader()
 {
-    m_shaderProg = 0;
+    m_sourceHash = 0;
+    m_started = false;
+    m_fromCache = false;
 }
 
 Shader::~Shader()
 {
     for (auto shader : m_shaderObjList)
         glDeleteShader(shader);
-
-    if (m_shaderProg != 0)
-        glDeleteProgram(m_shaderProg);
 }
 
 bool Shader::Initialize()
 {
-    m_shaderProg = glCreateProgram();
-    if (m_shaderProg == 0)
+    m_program.Create("Shader program");
+    if (!m_program)
     {
         std::cerr << "Error creating shader program\n";
         return false;
@@ -25,116 +25,47 @@ bool Shader::Initialize()
     return true;
 }
 
-bool Shader::AddShader(GLenum ShaderType)
+bool Shader::BeginFinalize()
 {
-    std::string s;
+    if (m_started)
+        return true;
+    m_started = true;
 
-    if (ShaderType == GL_VERTEX_SHADER)
-    {
-        s = R"(
-            #version 460
-            layout (location = 0) in vec3 v_position;
-            layout (location = 1) in vec3 v_normal;
-            layout (location = 2) in vec2 v_tc;
-
-            out vec3 fragPos;
-            out vec3 normal;
-            out vec2 tc;
-
-            uniform mat4 projectionMatrix;
-            uniform mat4 viewMatrix;
-            uniform mat4 modelMatrix;
-
-            void main()
-            {
-                fragPos = vec3(modelMatrix * vec4(v_position, 1.0));
-                normal = mat3(transpose(inverse(modelMatrix))) * v_normal;
-                tc = v_tc;
-                gl_Position = projectionMatrix * viewMatrix * vec4(fragPos, 1.0);
-            }
-        )";
-    }
-    else if (ShaderType == GL_FRAGMENT_SHADER)
+    uint64_t hash = ProgramCache::Hash(NULL, 0);
+    for (const auto& source : m_sources)
     {
-        s = R"(
-#version 460
-
-in vec3 fragPos;
-in vec3 normal;
-in vec2 tc;
-
-uniform sampler2D sp;
-uniform bool hasTexture;
-uniform vec3 overrideColor;
-
-uniform vec3 lightColor;
-uniform vec3 lightDir;
-
-uniform vec3 nightColor;
-uniform vec3 ambientColor;
-
-uniform bool isEmissive;
-
-out vec4 frag_color;
-
-void main()
-{
-    if (isEmissive) {
-        vec3 baseColor = hasTexture ? texture(sp, tc).rgb : vec3(1.0);
-        frag_color = vec4(baseColor * 5.0, 1.0); // Glowing Sun
-        return;
-    }
-
-    vec3 norm = normalize(normal);
-
-    // Light facing factor
-    float NdotL = max(dot(norm, -lightDir), 0.0);
-
-    float distance = length(fragPos); // distance from origin (Sun)
-    float attenuation = 1.0 / (distance * distance); 
-
-    
-    attenuation = clamp(attenuation * 20.0, 0.0, 1.0); 
-
-    vec3 blendedLight = mix(nightColor, lightColor, NdotL);
-    vec3 lighting = ambientColor + blendedLight * attenuation;
-
-
-    // Texture or fallback color
-    vec3 baseColor = hasTexture ? texture(sp, tc).rgb : vec3(1.0);
-    vec3 finalColor = (overrideColor != vec3(0.0)) ? overrideColor : baseColor;
-
-    frag_color = vec4(finalColor * lighting, 1.0);
-}
-)";
+        hash = ProgramCache::Hash(&source.first, sizeof(source.first), hash);
+        hash = ProgramCache::Hash(source.second.data(), source.second.size(), hash);
     }
+    m_sourceHash = hash;
 
-    GLuint ShaderObj = glCreateShader(ShaderType);
-    if (ShaderObj == 0)
+    ProgramCache& cache = ProgramCache::Get();
+    if (cache.Load(m_program.Get(), m_sourceHash))
     {
-        std::cerr << "Error creating shader type " << ShaderType << std::endl;
-        return false;
+        m_fromCache = true;
+        return true;
     }
 
-    m_shaderObjList.push_back(ShaderObj);
-
-    const GLchar* p[1] = { s.c_str() };
-    GLint Lengths[1] = { (GLint)s.size() };
-
-    glShaderSource(ShaderObj, 1, p, Lengths);
-    glCompileShader(ShaderObj);
-
-    GLint success;
-    glGetShaderiv(ShaderObj, GL_COMPILE_STATUS, &success);
-    if (!success)
+    for (const auto& source : m_sources)
     {
-        GLchar InfoLog[1024];
-        glGetShaderInfoLog(ShaderObj, 1024, NULL, InfoLog);
-        std::cerr << "Error compiling: " << InfoLog << std::endl;
-        return false;
+        GLuint ShaderObj = glCreateShader(source.first);
+        if (ShaderObj == 0)
+        {
+            std::cerr << "Error creating shader type " << source.first << std::endl;
+            return false;
+        }
+        m_shaderObjList.push_back(ShaderObj);
+
+        const GLchar* p[1] = { source.second.c_str() };
+        GLint Lengths[1] = { (GLint)source.second.size() };
+        glShaderSource(ShaderObj, 1, p, Lengths);
+        glCompileShader(ShaderObj);
+        glAttachShader(m_program.Get(), ShaderObj);
     }
 
-    glAttachShader(m_shaderProg, ShaderObj);
+    if (cache.IsEnabled())
+        glProgramParameteri(m_program.Get(), GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glLinkProgram(m_program.Get());
     return true;
 }
 
@@ -143,48 +74,78 @@ bool Shader::Finalize()
     GLint Success = 0;
     GLchar ErrorLog[1024] = { 0 };
 
-    glLinkProgram(m_shaderProg);
-    glGetProgramiv(m_shaderProg, GL_LINK_STATUS, &Success);
+    if (!BeginFinalize())
+        return false;
+
+    if (m_fromCache)
+    {
+        m_sources.clear();
+        return true;
+    }
+
+    // Compile errors first; asking for any status waits for the driver
+    for (auto shader : m_shaderObjList)
+    {
+        glGetShaderiv(shader, GL_COMPILE_STATUS, &Success);
+        if (!Success)
+        {
+            glGetShaderInfoLog(shader, sizeof(ErrorLog), NULL, ErrorLog);
+            std::cerr << "Error compiling shader: " << ErrorLog << std::endl;
+            return false;
+        }
+    }
+
+    glGetProgramiv(m_program.Get(), GL_LINK_STATUS, &Success);
     if (Success == 0)
     {
-        glGetProgramInfoLog(m_shaderProg, sizeof(ErrorLog), NULL, ErrorLog);
+        glGetProgramInfoLog(m_program.Get(), sizeof(ErrorLog), NULL, ErrorLog);
         std::cerr << "Error linking shader program: " << ErrorLog << std::endl;
         return false;
     }
 
-    glValidateProgram(m_shaderProg);
-    glGetProgramiv(m_shaderProg, GL_VALIDATE_STATUS, &Success);
+    glValidateProgram(m_program.Get());
+    glGetProgramiv(m_program.Get(), GL_VALIDATE_STATUS, &Success);
     if (!Success)
     {
-        glGetProgramInfoLog(m_shaderProg, sizeof(ErrorLog), NULL, ErrorLog);
+        glGetProgramInfoLog(m_program.Get(), sizeof(ErrorLog), NULL, ErrorLog);
         std::cerr << "Invalid shader program: " << ErrorLog << std::endl;
         return false;
     }
 
     for (auto shader : m_shaderObjList)
+    {
+        glDetachShader(m_program.Get(), shader);
         glDeleteShader(shader);
+    }
     m_shaderObjList.clear();
+    m_sources.clear();
 
+    ProgramCache::Get().Store(m_program.Get(), m_sourceHash);
     return true;
 }
 
 void Shader::Enable()
 {
-    glUseProgram(m_shaderProg);
+    glUseProgram(m_program.Get());
 }
 
 GLint Shader::GetUniformLocation(const char* pUniformName)
 {
-    GLuint Location = glGetUniformLocation(m_shaderProg, pUniformName);
+    GLuint Location = glGetUniformLocation(m_program.Get(), pUniformName);
     if (Location == INVALID_UNIFORM_LOCATION) {
         fprintf(stderr, "Warning! Unable to get the location of uniform '%s'\n", pUniformName);
     }
     return Location;
 }
 
+GLint Shader::FindUniformLocation(const char* pUniformName)
+{
+    return glGetUniformLocation(m_program.Get(), pUniformName);
+}
+
 GLint Shader::GetAttribLocation(const char* pAttribName)
 {
-    GLuint Location = glGetAttribLocation(m_shaderProg, pAttribName);
+    GLuint Location = glGetAttribLocation(m_program.Get(), pAttribName);
     if (Location == -1) {
         fprintf(stderr, "Warning! Unable to get the location of attribute '%s'\n", pAttribName);
     }
@@ -193,28 +154,33 @@ GLint Shader::GetAttribLocation(const char* pAttribName)
 
 bool Shader::AddShader(GLenum ShaderType, const char* shaderSource)
 {
-    GLuint ShaderObj = glCreateShader(ShaderType);
-    if (ShaderObj == 0)
+    if (m_started)
     {
-        std::cerr << "Error creating shader type " << ShaderType << std::endl;
+        std::cerr << "Shader added after the program was finalized\n";
         return false;
     }
-
-    m_shaderObjList.push_back(ShaderObj);
-
-    glShaderSource(ShaderObj, 1, &shaderSource, NULL);
-    glCompileShader(ShaderObj);
-
-    GLint success;
-    glGetShaderiv(ShaderObj, GL_COMPILE_STATUS, &success);
-    if (!success)
+    std::string source = shaderSource;
+    if (!m_defines.empty())
     {
-        GLchar InfoLog[1024];
-        glGetShaderInfoLog(ShaderObj, 1024, NULL, InfoLog);
-        std::cerr << "Error compiling shader: " << InfoLog << std::endl;
-        return false;
+        // #defines have to come after #version
+        size_t version = source.find("#version");
+        size_t lineEnd = version == std::string::npos ? std::string::npos : source.find('\n', version);
+        if (lineEnd == std::string::npos)
+            source = m_defines + source;
+        else
+            source.insert(lineEnd + 1, m_defines);
     }
-
-    glAttachShader(m_shaderProg, ShaderObj);
+    m_sources.push_back(std::make_pair(ShaderType, source));
     return true;
-}
\ No newline at end of file
+}
+
+void Shader::SetDefines(const std::string& defines)
+{
+    m_defines = defines;
+}
+
+void Shader::EnableParallelCompile()
+{
+    if (GLEW_KHR_parallel_shader_compile)
+        glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+}
@@ -1,9 +1,12 @@
 #ifndef SHADER_H
 #define SHADER_H
 
+#include <string>
+#include <utility>
 #include <vector>
 
 #include "graphics_headers.h"
+#include "gpuresources.h"
 
 class Shader
 {
@@ -12,18 +15,35 @@ public:
     ~Shader();
     bool Initialize();
     void Enable();
-    bool AddShader(GLenum ShaderType);
+    // Starts building the program: loads it from the ProgramCache, or
+    // compiles and links it. Errors are only looked at in Finalize, so with
+    // KHR_parallel_shader_compile the driver works in the background until
+    // then. Finalize calls it if nobody did.
+    bool BeginFinalize();
     bool Finalize();
     GLint GetUniformLocation(const char* pUniformName);
+    // Same, without the warning: for uniforms a variant may have compiled out
+    GLint FindUniformLocation(const char* pUniformName);
     GLint GetAttribLocation(const char* pAttribName);
 
+    // Sources are kept and compiled by BeginFinalize
     bool AddShader(GLenum ShaderType, const char* shaderSource);
+    // Lines inserted after #version in every source added afterwards
+    void SetDefines(const std::string& defines);
+
+    // Lets the driver compile on as many threads as it likes
+    static void EnableParallelCompile();
 
 
 
 private:
-    GLuint m_shaderProg;
+    GpuProgram m_program;
     std::vector<GLuint> m_shaderObjList;
+    std::vector<std::pair<GLenum, std::string>> m_sources;
+    std::string m_defines;
+    uint64_t m_sourceHash;
+    bool m_started;
+    bool m_fromCache;
 
 
 };
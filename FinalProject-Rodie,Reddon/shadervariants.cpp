@@ -0,0 +1,522 @@
+#include "shadervariants.h"
+#include "alloctracker.h"
+
+#include <cstdio>
+
+static const char* kFeatureNames[SHADER_FEATURE_COUNT] = {
+    "EMISSIVE", "TEXTURED", "INSTANCED", "FLAT_COLOR", "NIGHT_BLEND", "DEPTH_ONLY", "OVERDRAW",
+    "BATCHED", "TEXTURE_ARRAY", "BINDLESS", "NORMAL_MAP", "DERIVATIVE_TANGENTS", "PROCEDURAL_SPHERE",
+    "IMPOSTOR"
+};
+
+// Features that change the geometry rather than the shading, kept by the
+// depth-only and overdraw variants
+static const unsigned kGeometryFeatures = SHADER_INSTANCED | SHADER_BATCHED | SHADER_PROCEDURAL_SPHERE |
+    SHADER_IMPOSTOR;
+
+// BodyBatch::GpuBody, std430. The bindless handles are uvec2s so the struct
+// compiles without the extension.
+#define BODY_BUFFER \
+    "struct Body\n" \
+    "{\n" \
+    "    mat4 model;\n" \
+    "    vec4 lightColor;\n" \
+    "    vec4 nightColor;\n" \
+    "    vec4 lightDir;\n" \
+    "    uvec2 handle;\n" \
+    "    uvec2 normalHandle;\n" \
+    "    uint layer;\n" \
+    "    uint normalMap;\n" \
+    "    uint pad0;\n" \
+    "    uint pad1;\n" \
+    "};\n" \
+    "layout (std430, binding = 0) readonly buffer Bodies\n" \
+    "{\n" \
+    "    Body bodies[];\n" \
+    "};\n"
+
+static const char* kVertexShader = R"(
+#version 430
+#if !defined(PROCEDURAL_SPHERE) && !defined(IMPOSTOR)
+layout (location = 0) in vec3 v_position;
+layout (location = 1) in vec3 v_normal;
+layout (location = 2) in vec2 v_tc;
+#endif
+#ifdef INSTANCED
+layout (location = 3) in mat4 v_instanceModel;
+#endif
+#ifdef BATCHED
+layout (location = 7) in uint v_body;
+)" BODY_BUFFER R"(flat out uint bodyIndex;
+#endif
+
+#ifdef IMPOSTOR
+out vec3 impostorPos;
+flat out vec3 eye;
+flat out vec4 sphere;           // world centre and radius
+flat out mat3 objectFromWorld;
+#else
+out vec3 fragPos;
+out vec3 normal;
+out vec2 tc;
+#if defined(NORMAL_MAP) && !defined(DERIVATIVE_TANGENTS)
+out vec3 tangent;
+#endif
+#endif
+
+// The depth prepass and the shading pass must produce identical depths
+invariant gl_Position;
+
+uniform mat4 projectionMatrix;
+uniform mat4 viewMatrix;
+#if !defined(INSTANCED) && !defined(BATCHED)
+uniform mat4 modelMatrix;
+#endif
+
+#ifdef PROCEDURAL_SPHERE
+uniform int spherePrecision;
+
+// Vertex gl_VertexID of Sphere's triangle list: quad (i, j) of the
+// latitude/longitude grid is two triangles, six vertices
+void SphereVertex(out vec3 position, out vec2 uv)
+{
+    const ivec2 corners[6] = ivec2[6](ivec2(0, 0), ivec2(0, 1), ivec2(1, 0),
+                                      ivec2(0, 1), ivec2(1, 1), ivec2(1, 0));
+    int quad = gl_VertexID / 6;
+    ivec2 corner = corners[gl_VertexID % 6];
+    int i = quad / spherePrecision + corner.x;
+    int j = quad % spherePrecision + corner.y;
+
+    float latitude = radians(180.0 - float(i) * 180.0 / float(spherePrecision));
+    float longitude = radians(float(j) * 360.0 / float(spherePrecision));
+    float y = cos(latitude);
+    float ring = sqrt(max(1.0 - y * y, 0.0));
+    position = vec3(-cos(longitude) * ring, y, sin(longitude) * ring);
+    uv = vec2(float(j), float(i)) / float(spherePrecision);
+}
+#endif
+
+#ifdef IMPOSTOR
+uniform float impostorRadius;   // object space, before the model's scale
+
+// Corner gl_VertexID (0-3 of a triangle strip) of the smallest square that
+// covers the sphere: it faces the eye and touches the sphere at its
+// nearest point, where the cone of rays that hit the sphere is narrowest
+vec3 ImpostorCorner(vec3 center, float radius)
+{
+    vec3 axis = center - eye;
+    float d = length(axis);
+    axis /= d;
+    float near = max(d - radius, 0.0);
+    float halfSize = near * radius / sqrt(max(d * d - radius * radius, 1e-8));
+
+    vec3 up = abs(axis.y) < 0.99 ? vec3(0.0, 1.0, 0.0) : vec3(1.0, 0.0, 0.0);
+    vec3 right = normalize(cross(axis, up));
+    up = cross(right, axis);
+    vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1) * 2.0 - 1.0;
+    return eye + axis * near + (right * corner.x + up * corner.y) * halfSize;
+}
+#endif
+
+void main()
+{
+#if defined(BATCHED)
+    bodyIndex = v_body;
+    mat4 model = bodies[v_body].model;
+#elif defined(INSTANCED)
+    mat4 model = v_instanceModel;
+#else
+    mat4 model = modelMatrix;
+#endif
+
+#ifdef IMPOSTOR
+    // The fragment shader finds the surface; pass it the sphere
+    eye = inverse(viewMatrix)[3].xyz;
+    sphere = vec4(model[3].xyz, impostorRadius * length(model[0].xyz));
+    objectFromWorld = inverse(mat3(model));
+    impostorPos = ImpostorCorner(sphere.xyz, sphere.w);
+    gl_Position = projectionMatrix * viewMatrix * vec4(impostorPos, 1.0);
+#else
+#ifdef PROCEDURAL_SPHERE
+    vec3 position;
+    vec2 uv;
+    SphereVertex(position, uv);
+    vec3 objectNormal = position;
+#else
+    vec3 position = v_position;
+    vec3 objectNormal = v_normal;
+    vec2 uv = v_tc;
+#endif
+
+    fragPos = vec3(model * vec4(position, 1.0));
+    normal = mat3(transpose(inverse(model))) * objectNormal;
+    tc = uv;
+#if defined(NORMAL_MAP) && !defined(DERIVATIVE_TANGENTS)
+    // Sphere's u runs along the lines of latitude, so the object-space
+    // tangent follows from the position alone
+    tangent = mat3(model) * vec3(position.z, 0.0, -position.x);
+#endif
+    gl_Position = projectionMatrix * viewMatrix * vec4(fragPos, 1.0);
+#endif
+}
+)";
+
+static const char* kFragmentShader = R"(
+#version 430
+#ifdef BINDLESS
+#extension GL_ARB_bindless_texture : require
+#endif
+
+#ifdef IMPOSTOR
+in vec3 impostorPos;
+flat in vec3 eye;
+flat in vec4 sphere;
+flat in mat3 objectFromWorld;
+uniform mat4 projectionMatrix;
+uniform mat4 viewMatrix;
+
+// Every hit is behind the square, so early depth testing against the
+// square's own depth still holds
+layout (depth_greater) out float gl_FragDepth;
+
+// What the mesh path interpolates, filled in by TraceSphere()
+vec3 fragPos;
+vec3 normal;
+vec2 tc;
+#ifdef NORMAL_MAP
+vec3 tangent;
+#endif
+#else
+in vec3 fragPos;
+in vec3 normal;
+in vec2 tc;
+#endif
+
+#ifdef TEXTURED
+uniform sampler2D sp;
+#endif
+#ifdef TEXTURE_ARRAY
+uniform sampler2DArray spArray;
+#endif
+#ifdef FLAT_COLOR
+uniform vec3 overrideColor;
+#endif
+#ifdef NORMAL_MAP
+#if defined(TEXTURE_ARRAY)
+uniform sampler2DArray normalMapArray;
+#elif !defined(BINDLESS)
+uniform sampler2D normalMap;
+#endif
+#if !defined(DERIVATIVE_TANGENTS) && !defined(IMPOSTOR)
+in vec3 tangent;
+#endif
+#endif
+
+#ifdef BATCHED
+)" BODY_BUFFER R"(flat in uint bodyIndex;
+#define lightColor bodies[bodyIndex].lightColor.rgb
+#define lightDir bodies[bodyIndex].lightDir.xyz
+#define nightColor bodies[bodyIndex].nightColor.rgb
+#else
+uniform vec3 lightColor;
+uniform vec3 lightDir;
+#ifdef NIGHT_BLEND
+uniform vec3 nightColor;
+#endif
+#endif
+uniform vec3 ambientColor;
+
+out vec4 frag_color;
+
+vec3 BaseColor()
+{
+#if defined(FLAT_COLOR)
+    return overrideColor;
+#elif defined(BINDLESS)
+    return texture(sampler2D(bodies[bodyIndex].handle), tc).rgb;
+#elif defined(TEXTURE_ARRAY)
+    return texture(spArray, vec3(tc, float(bodies[bodyIndex].layer))).rgb;
+#elif defined(TEXTURED)
+    return texture(sp, tc).rgb;
+#else
+    return vec3(1.0);
+#endif
+}
+
+vec3 SurfaceNormal()
+{
+    vec3 N = normalize(normal);
+#ifdef NORMAL_MAP
+#ifdef BATCHED
+    if (bodies[bodyIndex].normalMap == 0u)
+        return N;
+#endif
+#if defined(BINDLESS)
+    vec3 n = texture(sampler2D(bodies[bodyIndex].normalHandle), tc).xyz;
+#elif defined(TEXTURE_ARRAY)
+    vec3 n = texture(normalMapArray, vec3(tc, float(bodies[bodyIndex].layer))).xyz;
+#else
+    vec3 n = texture(normalMap, tc).xyz;
+#endif
+    n = n * 2.0 - 1.0;
+
+#ifdef DERIVATIVE_TANGENTS
+    // Cotangent frame from how the position and uv change across the pixel
+    vec3 dp1 = dFdx(fragPos);
+    vec3 dp2 = dFdy(fragPos);
+    vec2 duv1 = dFdx(tc);
+    vec2 duv2 = dFdy(tc);
+    vec3 dp2perp = cross(dp2, N);
+    vec3 dp1perp = cross(N, dp1);
+    vec3 T = dp2perp * duv1.x + dp1perp * duv2.x;
+    vec3 B = dp2perp * duv1.y + dp1perp * duv2.y;
+    float size = max(dot(T, T), dot(B, B));
+    if (size < 1e-20)
+        return N;
+    mat3 tbn = mat3(T * inversesqrt(size), B * inversesqrt(size), N);
+#else
+    // Orthogonalised against the interpolated normal; the poles have none
+    vec3 t = tangent - N * dot(N, tangent);
+    if (dot(t, t) < 1e-12)
+        return N;
+    vec3 T = normalize(t);
+    mat3 tbn = mat3(T, cross(N, T), N);
+#endif
+    return normalize(tbn * n);
+#else
+    return N;
+#endif
+}
+
+#ifdef IMPOSTOR
+// Intersects the eye ray through this pixel with the sphere; the surface
+// point, normal, uv and tangent come out as the mesh would have them
+void TraceSphere()
+{
+    vec3 dir = normalize(impostorPos - eye);
+    vec3 oc = eye - sphere.xyz;
+    float b = dot(oc, dir);
+    float h = b * b - (dot(oc, oc) - sphere.w * sphere.w);
+    if (h < 0.0)
+        discard;
+    fragPos = eye + dir * (-b - sqrt(h));
+
+    // The same in the depth prepass as in the shading pass
+    precise vec4 clip = projectionMatrix * viewMatrix * vec4(fragPos, 1.0);
+    gl_FragDepth = clip.z / clip.w * 0.5 + 0.5;
+
+    normal = (fragPos - sphere.xyz) / sphere.w;
+    vec3 p = normalize(objectFromWorld * normal);
+
+    // Sphere::init's uv, inverted. u jumps from 1 back to 0 at the seam;
+    // of it and a copy that jumps on the far side, take whichever is
+    // continuous across this pixel, or the seam samples the smallest mip
+    float u = atan(p.z, -p.x) / 6.28318531;
+    float u1 = fract(u);
+    float u2 = fract(u + 0.5) - 0.5;
+    tc = vec2(fwidth(u1) <= fwidth(u2) ? u1 : u2, acos(clamp(-p.y, -1.0, 1.0)) / 3.14159265);
+#ifdef NORMAL_MAP
+    // Along the lines of latitude, as the vertex shader's: the object's
+    // y axis crossed with the normal
+    tangent = cross(transpose(objectFromWorld)[1], normal);
+#endif
+}
+#endif
+
+void main()
+{
+#ifdef IMPOSTOR
+    TraceSphere();
+#endif
+#if defined(DEPTH_ONLY)
+    // Depth is all the prepass writes
+#elif defined(OVERDRAW)
+    frag_color = vec4(0.1, 0.05, 0.025, 1.0); // same step as the skybox's
+#elif defined(EMISSIVE)
+    frag_color = vec4(BaseColor() * 5.0, 1.0); // Glowing Sun
+#elif defined(FLAT_COLOR)
+    frag_color = vec4(BaseColor(), 1.0);
+#else
+    vec3 norm = SurfaceNormal();
+
+    // Light facing factor
+    float NdotL = max(dot(norm, -lightDir), 0.0);
+
+    float distance = length(fragPos); // distance from origin (Sun)
+    float attenuation = clamp(20.0 / (distance * distance), 0.0, 1.0);
+
+#ifdef NIGHT_BLEND
+    vec3 blendedLight = mix(nightColor, lightColor, NdotL);
+#else
+    vec3 blendedLight = lightColor * NdotL;
+#endif
+    vec3 lighting = ambientColor + blendedLight * attenuation;
+
+    frag_color = vec4(BaseColor() * lighting, 1.0);
+#endif
+}
+)";
+
+ShaderVariants::ShaderVariants()
+{
+    for (ShaderVariant*& variant : m_variants)
+        variant = NULL;
+    for (bool& failed : m_failed)
+        failed = false;
+}
+
+ShaderVariants::~ShaderVariants()
+{
+    for (ShaderVariant* variant : m_variants)
+    {
+        if (variant != NULL)
+            delete variant->shader;
+        delete variant;
+    }
+}
+
+std::string ShaderVariants::Defines(unsigned features)
+{
+    std::string defines;
+    for (int i = 0; i < SHADER_FEATURE_COUNT; i++)
+    {
+        if (features & (1u << i))
+            defines += std::string("#define ") + kFeatureNames[i] + "\n";
+    }
+    return defines;
+}
+
+ShaderVariant* ShaderVariants::Create(unsigned features)
+{
+    ShaderVariant* variant = new ShaderVariant();
+    variant->features = features;
+    variant->frame = 0;
+    variant->shader = new Shader();
+    if (!variant->shader->Initialize())
+    {
+        delete variant->shader;
+        delete variant;
+        return NULL;
+    }
+    variant->shader->SetDefines(Defines(features));
+    variant->shader->AddShader(GL_VERTEX_SHADER, kVertexShader);
+    variant->shader->AddShader(GL_FRAGMENT_SHADER, kFragmentShader);
+    variant->shader->BeginFinalize();
+    return variant;
+}
+
+bool ShaderVariants::Finish(ShaderVariant* variant)
+{
+    Shader* shader = variant->shader;
+    if (!shader->Finalize())
+    {
+        printf("Shader variant%s failed to build\n", Defines(variant->features).c_str());
+        return false;
+    }
+
+    variant->projectionMatrix = shader->FindUniformLocation("projectionMatrix");
+    variant->viewMatrix = shader->FindUniformLocation("viewMatrix");
+    variant->modelMatrix = shader->FindUniformLocation("modelMatrix");
+    variant->lightColor = shader->FindUniformLocation("lightColor");
+    variant->lightDir = shader->FindUniformLocation("lightDir");
+    variant->nightColor = shader->FindUniformLocation("nightColor");
+    variant->ambientColor = shader->FindUniformLocation("ambientColor");
+    variant->overrideColor = shader->FindUniformLocation("overrideColor");
+    variant->spherePrecision = shader->FindUniformLocation("spherePrecision");
+    variant->impostorRadius = shader->FindUniformLocation("impostorRadius");
+
+    // Every textured variant samples unit 0
+    if (variant->features & (SHADER_TEXTURED | SHADER_TEXTURE_ARRAY))
+    {
+        shader->Enable();
+        glUniform1i(shader->FindUniformLocation(variant->features & SHADER_TEXTURE_ARRAY ? "spArray" : "sp"), 0);
+    }
+    // and normal maps unit 1
+    if ((variant->features & SHADER_NORMAL_MAP) && !(variant->features & SHADER_BINDLESS))
+    {
+        shader->Enable();
+        glUniform1i(shader->FindUniformLocation(variant->features & SHADER_TEXTURE_ARRAY ? "normalMapArray" : "normalMap"), 1);
+    }
+    return true;
+}
+
+unsigned ShaderVariants::Canonical(unsigned features)
+{
+    if (features & (SHADER_TEXTURE_ARRAY | SHADER_BINDLESS))
+        features |= SHADER_BATCHED;
+    if (features & SHADER_IMPOSTOR)
+        features &= ~(SHADER_PROCEDURAL_SPHERE | SHADER_DERIVATIVE_TANGENTS);
+    if (!(features & SHADER_NORMAL_MAP))
+        features &= ~SHADER_DERIVATIVE_TANGENTS;
+    if (features & SHADER_DEPTH_ONLY)
+        return features & (SHADER_DEPTH_ONLY | kGeometryFeatures);
+    if (features & SHADER_OVERDRAW)
+        return features & (SHADER_OVERDRAW | kGeometryFeatures);
+    return features;
+}
+
+unsigned ShaderVariants::Fallback(unsigned features)
+{
+    return Canonical(features) & (kGeometryFeatures | SHADER_DEPTH_ONLY | SHADER_OVERDRAW);
+}
+
+bool ShaderVariants::Precompile(const std::vector<unsigned>& features)
+{
+    // Every started variant is finished, even after one fails to start, so
+    // m_variants never holds one without its uniform locations
+    bool ok = true;
+    std::vector<ShaderVariant*> started;
+    for (unsigned requested : features)
+    {
+        unsigned f = Canonical(requested);
+        if (m_variants[f] != NULL || m_failed[f])
+            continue;
+        ShaderVariant* variant = Create(f);
+        if (variant == NULL)
+        {
+            m_failed[f] = true;
+            ok = false;
+            continue;
+        }
+        started.push_back(variant);
+        m_variants[f] = variant;
+    }
+
+    for (ShaderVariant* variant : started)
+    {
+        if (!Finish(variant))
+        {
+            m_variants[variant->features] = NULL;
+            m_failed[variant->features] = true;
+            delete variant->shader;
+            delete variant;
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+ShaderVariant* ShaderVariants::Get(unsigned features)
+{
+    if (features >= (1u << SHADER_FEATURE_COUNT))
+        return NULL;
+    features = Canonical(features);
+    if (m_variants[features] == NULL && !m_failed[features])
+    {
+        ALLOC_SCOPE("ShaderVariants");
+        std::vector<unsigned> one(1, features);
+        Precompile(one);
+    }
+    return m_variants[features];
+}
+
+int ShaderVariants::GetCompiledCount() const
+{
+    int count = 0;
+    for (ShaderVariant* variant : m_variants)
+    {
+        if (variant != NULL)
+            count++;
+    }
+    return count;
+}
@@ -0,0 +1,81 @@
+#ifndef SHADERVARIANTS_H
+#define SHADERVARIANTS_H
+
+#include <string>
+#include <vector>
+
+#include "shader.h"
+
+// Feature flags of the object shader. Each combination is its own program,
+// built from one source with a #define per flag, so the fragment shader has
+// no runtime branches.
+enum ShaderFeature {
+    SHADER_EMISSIVE = 1 << 0,       // unlit, texture (or white) times 5: the Sun
+    SHADER_TEXTURED = 1 << 1,       // sample sp at unit 0, otherwise white
+    SHADER_INSTANCED = 1 << 2,      // model matrix from attributes 3-6, one per instance
+    SHADER_FLAT_COLOR = 1 << 3,     // unlit overrideColor: lines
+    SHADER_NIGHT_BLEND = 1 << 4,    // light blends from nightColor to lightColor
+    SHADER_DEPTH_ONLY = 1 << 5,     // no color output: the depth prepass
+    SHADER_OVERDRAW = 1 << 6,       // a constant step, blended additively: the overdraw view
+    SHADER_BATCHED = 1 << 7,        // model and lighting from the BodyBatch buffer, by body index
+    SHADER_TEXTURE_ARRAY = 1 << 8,  // BATCHED: sample spArray at the body's layer
+    SHADER_BINDLESS = 1 << 9,       // BATCHED: sample the body's bindless handle
+    SHADER_NORMAL_MAP = 1 << 10,    // tangent-space normal map at unit 1, sphere tangents from position
+    SHADER_DERIVATIVE_TANGENTS = 1 << 11,  // NORMAL_MAP: tangent frame from screen-space derivatives (meshes)
+    SHADER_PROCEDURAL_SPHERE = 1 << 12,    // no vertex attributes: a UV sphere of spherePrecision from gl_VertexID
+    SHADER_IMPOSTOR = 1 << 13,      // a 4-vertex strip facing the eye, ray-traced against a sphere of impostorRadius
+    SHADER_FEATURE_COUNT = 14
+};
+
+// One compiled variant and its uniform locations (-1 where compiled out)
+struct ShaderVariant
+{
+    Shader* shader;
+    unsigned features;
+    GLint projectionMatrix;
+    GLint viewMatrix;
+    GLint modelMatrix;
+    GLint lightColor;
+    GLint lightDir;
+    GLint nightColor;
+    GLint ambientColor;
+    GLint overrideColor;
+    GLint spherePrecision;
+    GLint impostorRadius;
+    unsigned frame;     // last frame its per-frame uniforms were set (see Graphics::UseVariant)
+};
+
+class ShaderVariants
+{
+public:
+    ShaderVariants();
+    ~ShaderVariants();
+
+    // Builds the listed variants together, so a driver with
+    // KHR_parallel_shader_compile (or the program cache) handles them at once
+    bool Precompile(const std::vector<unsigned>& features);
+
+    // The variant for a feature mask, compiled on first use. NULL if it
+    // doesn't compile; a mask that failed once isn't tried again.
+    ShaderVariant* Get(unsigned features);
+
+    int GetCompiledCount() const;
+    static std::string Defines(unsigned features);
+    // DEPTH_ONLY and OVERDRAW replace the fragment output, so the material
+    // features don't matter to them and are dropped. TEXTURE_ARRAY and
+    // BINDLESS imply BATCHED; DERIVATIVE_TANGENTS needs NORMAL_MAP. IMPOSTOR
+    // replaces PROCEDURAL_SPHERE and works out its own tangents.
+    static unsigned Canonical(unsigned features);
+    // What to draw with when a variant fails: the same geometry and pass
+    // without the material features
+    static unsigned Fallback(unsigned features);
+
+private:
+    ShaderVariant* Create(unsigned features);
+    bool Finish(ShaderVariant* variant);
+
+    ShaderVariant* m_variants[1 << SHADER_FEATURE_COUNT];
+    bool m_failed[1 << SHADER_FEATURE_COUNT];
+};
+
+#endif /* SHADERVARIANTS_H */
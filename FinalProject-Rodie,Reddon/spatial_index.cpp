@@ -0,0 +1,588 @@
+#include "spatial_index.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <vector>
+
+namespace
+{
+    const int kNull = -1;
+    const int kStackSize = 256;
+    const float kFatMargin = 0.1f;              // plus 10% of the radius
+    const float kDisplacementMultiplier = 2.0f; // predict this many frames of motion
+
+    inline float SurfaceArea(const glm::vec3& lo, const glm::vec3& hi)
+    {
+        glm::vec3 d = hi - lo;
+        return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+
+    inline bool Contains(const glm::vec3& outerLo, const glm::vec3& outerHi,
+        const glm::vec3& lo, const glm::vec3& hi)
+    {
+        return outerLo.x <= lo.x && outerLo.y <= lo.y && outerLo.z <= lo.z &&
+            hi.x <= outerHi.x && hi.y <= outerHi.y && hi.z <= outerHi.z;
+    }
+
+    // Slab test. Returns the entry t, or FLT_MAX if the ray misses the box
+    // within [0, maxT].
+    inline float RayBoxEntry(const glm::vec3& origin, const glm::vec3& invDir,
+        const glm::vec3& lo, const glm::vec3& hi, float maxT)
+    {
+        float tMin = 0.0f, tMax = maxT;
+        for (int a = 0; a < 3; a++) {
+            float t1 = (lo[a] - origin[a]) * invDir[a];
+            float t2 = (hi[a] - origin[a]) * invDir[a];
+            if (t1 > t2)
+                std::swap(t1, t2);
+            tMin = std::max(tMin, t1);
+            tMax = std::min(tMax, t2);
+            if (tMin > tMax)
+                return FLT_MAX;
+        }
+        return tMin;
+    }
+
+    // Traversal stack. A balanced tree is only a few dozen levels deep, so
+    // the fixed part is all any query uses; past it, nodes spill to the
+    // heap rather than being dropped.
+    class NodeStack
+    {
+    public:
+        NodeStack() : m_top(0) {}
+
+        bool Empty() const { return m_top == 0 && m_spill.empty(); }
+        void Push(int node)
+        {
+            if (m_top < kStackSize)
+                m_fixed[m_top++] = node;
+            else
+                m_spill.push_back(node);
+        }
+        int Pop()
+        {
+            if (m_spill.empty())
+                return m_fixed[--m_top];
+            int node = m_spill.back();
+            m_spill.pop_back();
+            return node;
+        }
+
+    private:
+        int m_fixed[kStackSize];
+        int m_top;
+        std::vector<int> m_spill;
+    };
+
+    // Keeps hits sorted by distanceSq, dropping anything past capacity
+    inline void InsertSorted(SpatialHit* hits, int& count, int capacity, const SpatialHit& hit)
+    {
+        int i = count < capacity ? count++ : capacity - 1;
+        while (i > 0 && hits[i - 1].distanceSq > hit.distanceSq) {
+            hits[i] = hits[i - 1];
+            i--;
+        }
+        hits[i] = hit;
+    }
+}
+
+SpatialIndex::SpatialIndex()
+{
+    m_root = kNull;
+    m_freeList = kNull;
+    m_proxyCount = 0;
+    m_reinserts = 0;
+}
+
+SpatialIndex::~SpatialIndex()
+{
+
+}
+
+void SpatialIndex::Clear()
+{
+    m_nodes.clear();
+    m_root = kNull;
+    m_freeList = kNull;
+    m_proxyCount = 0;
+}
+
+int SpatialIndex::AllocateNode()
+{
+    int index;
+    if (m_freeList != kNull) {
+        index = m_freeList;
+        m_freeList = m_nodes[index].parent;
+    }
+    else {
+        index = (int)m_nodes.size();
+        m_nodes.push_back(Node());
+    }
+
+    Node& node = m_nodes[index];
+    node.parent = kNull;
+    node.child1 = kNull;
+    node.child2 = kNull;
+    node.height = 0;
+    node.radius = 0.0f;
+    node.body = { BodyKind::Asteroid, -1 };
+    return index;
+}
+
+void SpatialIndex::FreeNode(int node)
+{
+    m_nodes[node].parent = m_freeList;
+    m_nodes[node].height = -1;
+    m_freeList = node;
+}
+
+void SpatialIndex::FitLeaf(int leaf, const glm::vec3& center, float radius, const glm::vec3& displacement)
+{
+    Node& node = m_nodes[leaf];
+    float margin = radius + kFatMargin + radius * 0.1f;
+    node.center = center;
+    node.radius = radius;
+    node.lo = center - glm::vec3(margin);
+    node.hi = center + glm::vec3(margin);
+
+    // Stretch the box the way the body is heading
+    glm::vec3 d = displacement * kDisplacementMultiplier;
+    for (int a = 0; a < 3; a++) {
+        if (d[a] < 0.0f)
+            node.lo[a] += d[a];
+        else
+            node.hi[a] += d[a];
+    }
+}
+
+int SpatialIndex::CreateProxy(const glm::vec3& center, float radius, BodyRef body)
+{
+    int proxy = AllocateNode();
+    m_nodes[proxy].body = body;
+    FitLeaf(proxy, center, radius, glm::vec3(0.0f));
+    InsertLeaf(proxy);
+    m_proxyCount++;
+    return proxy;
+}
+
+void SpatialIndex::DestroyProxy(int proxy)
+{
+    RemoveLeaf(proxy);
+    FreeNode(proxy);
+    m_proxyCount--;
+}
+
+bool SpatialIndex::MoveProxy(int proxy, const glm::vec3& center, float radius)
+{
+    Node& node = m_nodes[proxy];
+    glm::vec3 lo = center - glm::vec3(radius);
+    glm::vec3 hi = center + glm::vec3(radius);
+
+    if (Contains(node.lo, node.hi, lo, hi)) {
+        // Still inside the fat box: only the exact sphere changes
+        node.center = center;
+        node.radius = radius;
+        return false;
+    }
+
+    glm::vec3 displacement = center - node.center;
+    RemoveLeaf(proxy);
+    FitLeaf(proxy, center, radius, displacement);
+    InsertLeaf(proxy);
+    m_reinserts++;
+    return true;
+}
+
+void SpatialIndex::InsertLeaf(int leaf)
+{
+    if (m_root == kNull) {
+        m_root = leaf;
+        m_nodes[leaf].parent = kNull;
+        return;
+    }
+
+    // Find the best sibling with the surface area heuristic
+    glm::vec3 leafLo = m_nodes[leaf].lo;
+    glm::vec3 leafHi = m_nodes[leaf].hi;
+    int index = m_root;
+    while (!m_nodes[index].IsLeaf()) {
+        const Node& node = m_nodes[index];
+        int child1 = node.child1;
+        int child2 = node.child2;
+
+        float area = SurfaceArea(node.lo, node.hi);
+        float combinedArea = SurfaceArea(glm::min(node.lo, leafLo), glm::max(node.hi, leafHi));
+
+        // Cost of making a new parent for this node and the new leaf
+        float cost = 2.0f * combinedArea;
+        // Minimum cost of pushing the leaf further down the tree
+        float inheritanceCost = 2.0f * (combinedArea - area);
+
+        float childCost[2];
+        int children[2] = { child1, child2 };
+        for (int c = 0; c < 2; c++) {
+            const Node& child = m_nodes[children[c]];
+            float unionArea = SurfaceArea(glm::min(child.lo, leafLo), glm::max(child.hi, leafHi));
+            if (child.IsLeaf())
+                childCost[c] = unionArea + inheritanceCost;
+            else
+                childCost[c] = (unionArea - SurfaceArea(child.lo, child.hi)) + inheritanceCost;
+        }
+
+        if (cost < childCost[0] && cost < childCost[1])
+            break;
+
+        index = childCost[0] < childCost[1] ? child1 : child2;
+    }
+
+    int sibling = index;
+
+    // New parent for the sibling and the leaf. AllocateNode may grow m_nodes,
+    // so no references are held across it.
+    int oldParent = m_nodes[sibling].parent;
+    int newParent = AllocateNode();
+    m_nodes[newParent].parent = oldParent;
+    m_nodes[newParent].lo = glm::min(leafLo, m_nodes[sibling].lo);
+    m_nodes[newParent].hi = glm::max(leafHi, m_nodes[sibling].hi);
+    m_nodes[newParent].height = m_nodes[sibling].height + 1;
+    m_nodes[newParent].child1 = sibling;
+    m_nodes[newParent].child2 = leaf;
+    m_nodes[sibling].parent = newParent;
+    m_nodes[leaf].parent = newParent;
+
+    if (oldParent != kNull) {
+        if (m_nodes[oldParent].child1 == sibling)
+            m_nodes[oldParent].child1 = newParent;
+        else
+            m_nodes[oldParent].child2 = newParent;
+    }
+    else {
+        m_root = newParent;
+    }
+
+    // Walk back up refitting bounds and rebalancing
+    index = m_nodes[leaf].parent;
+    while (index != kNull) {
+        index = Balance(index);
+
+        Node& node = m_nodes[index];
+        const Node& child1 = m_nodes[node.child1];
+        const Node& child2 = m_nodes[node.child2];
+        node.height = 1 + std::max(child1.height, child2.height);
+        node.lo = glm::min(child1.lo, child2.lo);
+        node.hi = glm::max(child1.hi, child2.hi);
+
+        index = node.parent;
+    }
+}
+
+void SpatialIndex::RemoveLeaf(int leaf)
+{
+    if (leaf == m_root) {
+        m_root = kNull;
+        return;
+    }
+
+    int parent = m_nodes[leaf].parent;
+    int grandParent = m_nodes[parent].parent;
+    int sibling = m_nodes[parent].child1 == leaf ? m_nodes[parent].child2 : m_nodes[parent].child1;
+
+    if (grandParent != kNull) {
+        // Replace the parent with the sibling
+        if (m_nodes[grandParent].child1 == parent)
+            m_nodes[grandParent].child1 = sibling;
+        else
+            m_nodes[grandParent].child2 = sibling;
+        m_nodes[sibling].parent = grandParent;
+        FreeNode(parent);
+
+        int index = grandParent;
+        while (index != kNull) {
+            index = Balance(index);
+
+            Node& node = m_nodes[index];
+            const Node& child1 = m_nodes[node.child1];
+            const Node& child2 = m_nodes[node.child2];
+            node.lo = glm::min(child1.lo, child2.lo);
+            node.hi = glm::max(child1.hi, child2.hi);
+            node.height = 1 + std::max(child1.height, child2.height);
+
+            index = node.parent;
+        }
+    }
+    else {
+        m_root = sibling;
+        m_nodes[sibling].parent = kNull;
+        FreeNode(parent);
+    }
+}
+
+// Rotates the subtree at iA if it is imbalanced. Returns the new subtree root.
+int SpatialIndex::Balance(int iA)
+{
+    Node* A = &m_nodes[iA];
+    if (A->IsLeaf() || A->height < 2)
+        return iA;
+
+    int iB = A->child1;
+    int iC = A->child2;
+    Node* B = &m_nodes[iB];
+    Node* C = &m_nodes[iC];
+
+    int balance = C->height - B->height;
+
+    // Rotate C up
+    if (balance > 1) {
+        int iF = C->child1;
+        int iG = C->child2;
+        Node* F = &m_nodes[iF];
+        Node* G = &m_nodes[iG];
+
+        C->child1 = iA;
+        C->parent = A->parent;
+        A->parent = iC;
+
+        if (C->parent != kNull) {
+            if (m_nodes[C->parent].child1 == iA)
+                m_nodes[C->parent].child1 = iC;
+            else
+                m_nodes[C->parent].child2 = iC;
+        }
+        else {
+            m_root = iC;
+        }
+
+        if (F->height > G->height) {
+            C->child2 = iF;
+            A->child2 = iG;
+            G->parent = iA;
+            A->lo = glm::min(B->lo, G->lo);
+            A->hi = glm::max(B->hi, G->hi);
+            C->lo = glm::min(A->lo, F->lo);
+            C->hi = glm::max(A->hi, F->hi);
+            A->height = 1 + std::max(B->height, G->height);
+            C->height = 1 + std::max(A->height, F->height);
+        }
+        else {
+            C->child2 = iG;
+            A->child2 = iF;
+            F->parent = iA;
+            A->lo = glm::min(B->lo, F->lo);
+            A->hi = glm::max(B->hi, F->hi);
+            C->lo = glm::min(A->lo, G->lo);
+            C->hi = glm::max(A->hi, G->hi);
+            A->height = 1 + std::max(B->height, F->height);
+            C->height = 1 + std::max(A->height, G->height);
+        }
+        return iC;
+    }
+
+    // Rotate B up
+    if (balance < -1) {
+        int iD = B->child1;
+        int iE = B->child2;
+        Node* D = &m_nodes[iD];
+        Node* E = &m_nodes[iE];
+
+        B->child1 = iA;
+        B->parent = A->parent;
+        A->parent = iB;
+
+        if (B->parent != kNull) {
+            if (m_nodes[B->parent].child1 == iA)
+                m_nodes[B->parent].child1 = iB;
+            else
+                m_nodes[B->parent].child2 = iB;
+        }
+        else {
+            m_root = iB;
+        }
+
+        if (D->height > E->height) {
+            B->child2 = iD;
+            A->child1 = iE;
+            E->parent = iA;
+            A->lo = glm::min(C->lo, E->lo);
+            A->hi = glm::max(C->hi, E->hi);
+            B->lo = glm::min(A->lo, D->lo);
+            B->hi = glm::max(A->hi, D->hi);
+            A->height = 1 + std::max(C->height, E->height);
+            B->height = 1 + std::max(A->height, D->height);
+        }
+        else {
+            B->child2 = iE;
+            A->child1 = iD;
+            D->parent = iA;
+            A->lo = glm::min(C->lo, D->lo);
+            A->hi = glm::max(C->hi, D->hi);
+            B->lo = glm::min(A->lo, E->lo);
+            B->hi = glm::max(A->hi, E->hi);
+            A->height = 1 + std::max(C->height, D->height);
+            B->height = 1 + std::max(A->height, E->height);
+        }
+        return iB;
+    }
+
+    return iA;
+}
+
+float SpatialIndex::DistanceSqToBox(const glm::vec3& p, const glm::vec3& lo, const glm::vec3& hi)
+{
+    glm::vec3 d = glm::max(lo - p, glm::max(glm::vec3(0.0f), p - hi));
+    return glm::dot(d, d);
+}
+
+bool SpatialIndex::QueryNearest(const glm::vec3& point, SpatialHit& hit, uint32_t kindMask) const
+{
+    return QueryKNearest(point, 1, &hit, kindMask) == 1;
+}
+
+int SpatialIndex::QueryKNearest(const glm::vec3& point, int k, SpatialHit* hits, uint32_t kindMask) const
+{
+    if (m_root == kNull || k <= 0)
+        return 0;
+
+    int count = 0;
+    NodeStack stack;
+    stack.Push(m_root);
+
+    while (!stack.Empty()) {
+        const Node& node = m_nodes[stack.Pop()];
+        float worst = count < k ? FLT_MAX : hits[count - 1].distanceSq;
+
+        if (DistanceSqToBox(point, node.lo, node.hi) > worst)
+            continue;
+
+        if (node.IsLeaf()) {
+            if (!(KindBit(node.body.kind) & kindMask))
+                continue;
+            glm::vec3 d = node.center - point;
+            float distSq = glm::dot(d, d);
+            if (distSq < worst) {
+                SpatialHit h = { (int)(&node - &m_nodes[0]), node.body, distSq, 0.0f };
+                InsertSorted(hits, count, k, h);
+            }
+            continue;
+        }
+
+        // Visit the nearer child first so the bound tightens sooner
+        const Node& c1 = m_nodes[node.child1];
+        const Node& c2 = m_nodes[node.child2];
+        float d1 = DistanceSqToBox(point, c1.lo, c1.hi);
+        float d2 = DistanceSqToBox(point, c2.lo, c2.hi);
+        if (d1 < d2) {
+            stack.Push(node.child2);
+            stack.Push(node.child1);
+        }
+        else {
+            stack.Push(node.child1);
+            stack.Push(node.child2);
+        }
+    }
+
+    return count;
+}
+
+int SpatialIndex::QueryRadius(const glm::vec3& point, float radius, SpatialHit* hits, int maxHits,
+    uint32_t kindMask) const
+{
+    if (m_root == kNull || maxHits <= 0)
+        return 0;
+
+    int count = 0;
+    NodeStack stack;
+    stack.Push(m_root);
+
+    while (!stack.Empty() && count < maxHits) {
+        const Node& node = m_nodes[stack.Pop()];
+
+        if (DistanceSqToBox(point, node.lo, node.hi) > radius * radius)
+            continue;
+
+        if (node.IsLeaf()) {
+            if (!(KindBit(node.body.kind) & kindMask))
+                continue;
+            glm::vec3 d = node.center - point;
+            float distSq = glm::dot(d, d);
+            float reach = radius + node.radius;
+            if (distSq <= reach * reach) {
+                SpatialHit& h = hits[count++];
+                h.proxy = (int)(&node - &m_nodes[0]);
+                h.body = node.body;
+                h.distanceSq = distSq;
+                h.t = 0.0f;
+            }
+            continue;
+        }
+
+        stack.Push(node.child1);
+        stack.Push(node.child2);
+    }
+
+    return count;
+}
+
+bool SpatialIndex::Raycast(const glm::vec3& origin, const glm::vec3& dir, float maxT, SpatialHit& hit,
+    uint32_t kindMask) const
+{
+    if (m_root == kNull)
+        return false;
+
+    glm::vec3 invDir;
+    for (int a = 0; a < 3; a++)
+        invDir[a] = dir[a] != 0.0f ? 1.0f / dir[a] : FLT_MAX;
+
+    float a = glm::dot(dir, dir);
+    if (a <= 0.0f)
+        return false;
+
+    float bestT = maxT;
+    bool found = false;
+
+    NodeStack stack;
+    stack.Push(m_root);
+
+    while (!stack.Empty()) {
+        int index = stack.Pop();
+        const Node& node = m_nodes[index];
+
+        if (RayBoxEntry(origin, invDir, node.lo, node.hi, bestT) == FLT_MAX)
+            continue;
+
+        if (node.IsLeaf()) {
+            if (!(KindBit(node.body.kind) & kindMask))
+                continue;
+
+            // |origin + t*dir - center|^2 = radius^2
+            glm::vec3 m = origin - node.center;
+            float b = glm::dot(m, dir);
+            float c = glm::dot(m, m) - node.radius * node.radius;
+            float t;
+            if (c <= 0.0f) {
+                t = 0.0f;   // starts inside the sphere
+            }
+            else {
+                float disc = b * b - a * c;
+                if (b > 0.0f || disc < 0.0f)
+                    continue;
+                t = (-b - sqrtf(disc)) / a;
+            }
+
+            if (t <= bestT) {
+                bestT = t;
+                hit.proxy = index;
+                hit.body = node.body;
+                hit.distanceSq = glm::dot(m, m);
+                hit.t = t;
+                found = true;
+            }
+            continue;
+        }
+
+        stack.Push(node.child1);
+        stack.Push(node.child2);
+    }
+
+    return found;
+}
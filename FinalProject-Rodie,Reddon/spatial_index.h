@@ -0,0 +1,106 @@
+#ifndef SPATIAL_INDEX_H
+#define SPATIAL_INDEX_H
+
+#include <cstdint>
+#include <vector>
+#include "graphics_headers.h"
+
+enum class BodyKind : uint8_t
+{
+    Sun,
+    Planet,
+    Moon,
+    Comet,
+    Asteroid
+};
+
+// Bit masks for filtering queries by kind
+inline uint32_t KindBit(BodyKind kind) { return 1u << (uint32_t)kind; }
+const uint32_t kAllBodies = 0xffffffffu;
+
+// What a proxy stands for: a kind plus an index into that kind's array
+// (planets, moons, asteroid transforms...).
+struct BodyRef
+{
+    BodyKind kind;
+    int index;
+};
+
+struct SpatialHit
+{
+    int proxy;
+    BodyRef body;
+    float distanceSq;   // centre distance squared from the query point or ray origin
+    float t;            // Raycast: ray parameter of the hit; 0 for the other queries
+};
+
+// Dynamic AABB tree holding every celestial body and asteroid as a bounding
+// sphere. Leaves are stored with a fattened box so bodies that move a little
+// each frame don't need reinserting; MoveProxy only touches the tree when a
+// body leaves its fat box. Queries don't allocate for any tree the balancing
+// can build, so gameplay code can call them thousands of times per frame.
+class SpatialIndex
+{
+public:
+    SpatialIndex();
+    ~SpatialIndex();
+
+    int CreateProxy(const glm::vec3& center, float radius, BodyRef body);
+    void DestroyProxy(int proxy);
+    // Returns true if the proxy had to be reinserted
+    bool MoveProxy(int proxy, const glm::vec3& center, float radius);
+    void Clear();
+
+    const glm::vec3& GetCenter(int proxy) const { return m_nodes[proxy].center; }
+    float GetRadius(int proxy) const { return m_nodes[proxy].radius; }
+    BodyRef GetBody(int proxy) const { return m_nodes[proxy].body; }
+
+    // Nearest body by centre distance. Returns false if nothing matches the mask.
+    bool QueryNearest(const glm::vec3& point, SpatialHit& hit, uint32_t kindMask = kAllBodies) const;
+    // Up to k nearest bodies, closest first. Returns the number written to hits.
+    int QueryKNearest(const glm::vec3& point, int k, SpatialHit* hits, uint32_t kindMask = kAllBodies) const;
+    // Bodies whose sphere overlaps the query sphere. Returns the number written
+    // (at most maxHits) to hits.
+    int QueryRadius(const glm::vec3& point, float radius, SpatialHit* hits, int maxHits,
+        uint32_t kindMask = kAllBodies) const;
+    // Closest body hit by the ray within maxT, with the ray parameter in hit.t.
+    // dir does not need to be normalized, t is in units of dir.
+    bool Raycast(const glm::vec3& origin, const glm::vec3& dir, float maxT, SpatialHit& hit,
+        uint32_t kindMask = kAllBodies) const;
+
+    int GetProxyCount() const { return m_proxyCount; }
+    int GetHeight() const { return m_root < 0 ? 0 : m_nodes[m_root].height; }
+    int GetReinsertCount() const { return m_reinserts; }
+    void ResetReinsertCount() { m_reinserts = 0; }
+
+private:
+    struct Node
+    {
+        glm::vec3 lo, hi;       // (fat) bounds
+        glm::vec3 center;       // leaf: exact sphere
+        float radius;
+        BodyRef body;
+        int parent;             // also the free-list link
+        int child1, child2;
+        int height;             // leaf = 0, free = -1
+
+        bool IsLeaf() const { return child1 < 0; }
+    };
+
+    int AllocateNode();
+    void FreeNode(int node);
+    void InsertLeaf(int leaf);
+    void RemoveLeaf(int leaf);
+    int Balance(int a);
+    void FitLeaf(int leaf, const glm::vec3& center, float radius, const glm::vec3& displacement);
+
+    static float DistanceSqToBox(const glm::vec3& p, const glm::vec3& lo, const glm::vec3& hi);
+
+    std::vector<Node> m_nodes;
+    int m_root;
+    int m_freeList;
+    int m_proxyCount;
+    int m_reinserts;
+};
+
+#endif /* SPATIAL_INDEX_H */
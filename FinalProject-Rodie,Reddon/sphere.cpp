@@ -1,27 +1,36 @@
 #include "sphere.h"
 
+bool Sphere::s_procedural = false;
+GpuVertexArray* Sphere::s_emptyVAO = NULL;
+
 Sphere::Sphere()
 {
-    init(48);
-    setupVertices();
-    setupBuffers();
+    create(48);
     //setupModelMatrix(glm::vec3(0., 0., 0.), 0., 1.);
 }
 
+Sphere::~Sphere()
+{
+    delete m_texture;
+    delete m_normalMap;
+}
+
+void Sphere::ReleaseShared()
+{
+    delete s_emptyVAO;
+    s_emptyVAO = NULL;
+}
+
 Sphere::Sphere(int prec) { // prec is precision, or number of slices
 
-    init(prec);
-    setupVertices();
-    setupBuffers();
+    create(prec);
     //setupModelMatrix(glm::vec3(0., 0., 0.), 0., 1.);
     hasTex = false;
 }
 
 Sphere::Sphere(int prec, const char* fname) { // prec is precision, or number of slices
 
-    init(prec);
-    setupVertices();
-    setupBuffers();
+    create(prec);
     //setupModelMatrix(glm::vec3(0., 0., 0.), 0., 1.);
 
         // load texture from file
@@ -33,21 +42,46 @@ Sphere::Sphere(int prec, const char* fname) { // prec is precision, or number of
 }
 
 
+void Sphere::create(int prec) {
+    m_prec = prec;
+    m_procedural = s_procedural;
+    if (!m_procedural) {
+        init(prec);
+        setupVertices();
+        setupBuffers();
+        return;
+    }
+
+    // Only the counts; the vertex shader computes the rest
+    numVertices = (prec + 1) * (prec + 1);
+    numIndices = prec * prec * 6;
+    if (s_emptyVAO == NULL) {
+        s_emptyVAO = new GpuVertexArray();
+        s_emptyVAO->Create("Procedural sphere vertex array");
+    }
+}
+
 void Sphere::Render(GLint positionAttribLoc, GLint colorAttribLoc)
 {
+    if (m_procedural) {
+        glBindVertexArray(GetVAO());
+        glDrawArrays(GL_TRIANGLES, 0, getNumIndices());
+        return;
+    }
+
     //glBindVertexArray(vao);
     // Enable Vertext Attributes
     glEnableVertexAttribArray(positionAttribLoc);
     glEnableVertexAttribArray(colorAttribLoc);
 
     // Bind your VBO buffer(s) and then setup vertex attribute pointers
-    glBindBuffer(GL_ARRAY_BUFFER, VB);
+    glBindBuffer(GL_ARRAY_BUFFER, VB.Get());
     glVertexAttribPointer(positionAttribLoc, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), 0);
     glVertexAttribPointer(colorAttribLoc, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, normal));
 
 
     // Bind your index buffer
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, IB);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, IB.Get());
 
     // Render
     glDrawArrays(GL_TRIANGLES, 0, getNumIndices());
@@ -59,32 +93,30 @@ void Sphere::Render(GLint positionAttribLoc, GLint colorAttribLoc)
 
 void Sphere::Render(GLint posAttribLoc, GLint colAttribLoc, GLint tcAttribLoc, GLint hasTextureLoc)
 {
-    glBindVertexArray(vao);
+    glBindVertexArray(GetVAO());
+    if (m_procedural) {
+        bindTextures(hasTextureLoc);
+        glDrawArrays(GL_TRIANGLES, 0, getNumIndices());
+        return;
+    }
+
     // Enable vertex attibute arrays for each vertex attrib
     glEnableVertexAttribArray(posAttribLoc);
     glEnableVertexAttribArray(colAttribLoc);
     glEnableVertexAttribArray(tcAttribLoc);
 
     // Bind your VBO
-    glBindBuffer(GL_ARRAY_BUFFER, VB);
+    glBindBuffer(GL_ARRAY_BUFFER, VB.Get());
 
     // Set vertex attribute pointers to the load correct data. Update here to load the correct attributes.
     glVertexAttribPointer(posAttribLoc, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, vertex));
     glVertexAttribPointer(colAttribLoc, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, normal));
     glVertexAttribPointer(tcAttribLoc, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, texcoord));
 
-    // If has texture, set up texture unit(s): update here for texture rendering
-    if (m_texture != NULL) {
-        glUniform1i(hasTextureLoc, true);
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, m_texture->getTextureID());
-    }
-    else
-        glUniform1i(hasTextureLoc, false);
-
+    bindTextures(hasTextureLoc);
 
     // Bind your Element Array
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, IB);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, IB.Get());
 
     // Render
     glDrawElements(GL_TRIANGLES, Indices.size(), GL_UNSIGNED_INT, 0);
@@ -97,6 +129,23 @@ void Sphere::Render(GLint posAttribLoc, GLint colAttribLoc, GLint tcAttribLoc, G
 }
 
 
+void Sphere::bindTextures(GLint hasTextureLoc) {
+    // If has texture, set up texture unit(s): update here for texture rendering
+    if (m_texture != NULL) {
+        glUniform1i(hasTextureLoc, true);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, m_texture->getTextureID());
+    }
+    else
+        glUniform1i(hasTextureLoc, false);
+
+    if (m_normalMap != NULL) {
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, m_normalMap->getTextureID());
+        glActiveTexture(GL_TEXTURE0);
+    }
+}
+
 void Sphere::setupVertices() {
     std::vector<int> ind = getIndices();
     std::vector<glm::vec3> vert = getVertices();
@@ -125,16 +174,18 @@ void Sphere::setupVertices() {
 
 void Sphere::setupBuffers() {
     // For OpenGL 3
-    glGenVertexArrays(1, &vao);
-    glBindVertexArray(vao);
+    vao.Create("Sphere vertex array");
+    glBindVertexArray(vao.Get());
 
-    glGenBuffers(1, &VB);
-    glBindBuffer(GL_ARRAY_BUFFER, VB);
+    VB.Create("Sphere vertices");
+    glBindBuffer(GL_ARRAY_BUFFER, VB.Get());
     glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * Vertices.size(), &Vertices[0], GL_STATIC_DRAW);
+    VB.SetBytes(sizeof(Vertex) * Vertices.size());
 
-    glGenBuffers(1, &IB);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, IB);
+    IB.Create("Sphere indices");
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, IB.Get());
     glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(unsigned int) * Indices.size(), &Indices[0], GL_STATIC_DRAW);
+    IB.SetBytes(sizeof(unsigned int) * Indices.size());
 }
 
 void Sphere::setupModelMatrix(glm::vec3 pivot, float angle, float scale) {
@@ -150,6 +201,10 @@ void Sphere::Update(glm::mat4 matModel) {
 
 }
 
+void Sphere::setNormalMap(const char* fname) {
+    m_normalMap = new Texture(fname, true);
+}
+
 glm::vec3 Sphere::GetPosition() const {
     return glm::vec3(model[3]);
 }
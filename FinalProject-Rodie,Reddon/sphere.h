@@ -6,6 +6,7 @@ class Sphere :
 {
 public:
     Sphere();
+    ~Sphere();
 
 
     void Render(GLint positionAttribLoc, GLint colorAttribLoc);
@@ -28,23 +29,53 @@ public:
 
 
     GLuint getTextureID() { return m_texture->getTextureID(); }
+    GLuint getVBO() const { return VB.Get(); }
+    GLuint getIBO() const { return IB.Get(); }
+
+    // Tangent-space normal map on unit 1; the shader derives the tangents
+    // from the position, so the vertices don't carry them
+    void setNormalMap(const char* fname);
+    bool hasNormalMap() const { return m_normalMap != NULL; }
+    GLuint getNormalMapID() { return m_normalMap->getTextureID(); }
+
+    // Procedural spheres keep no vertices at all, on the CPU or the GPU:
+    // the PROCEDURAL_SPHERE shader builds each one from gl_VertexID, drawn
+    // with glDrawArrays on an empty VAO. Applies to spheres created after
+    // the call. Set spherePrecision to getPrecision() before Render.
+    static void SetProcedural(bool enabled) { s_procedural = enabled; }
+    bool isProcedural() const { return m_procedural; }
+    int getPrecision() const { return m_prec; }
+    // The empty VAO procedural spheres share; before the context goes
+    static void ReleaseShared();
 
     bool hasTex;
 
 private:
+    // --microbench times the private setup steps directly
+    friend class MicroBenchAccess;
+
+    static bool s_procedural;
+    static GpuVertexArray* s_emptyVAO;
+    bool m_procedural = false;
+    int m_prec = 0;
+
     glm::vec3 pivotLocation;
     glm::mat4 model;
     std::vector<Vertex> Vertices;
     std::vector<unsigned int> Indices;
-    GLuint VB;
-    GLuint IB;
-    Texture* m_texture;
+    GpuBuffer VB;       // both empty when procedural
+    GpuBuffer IB;
+    Texture* m_texture = NULL;
+    Texture* m_normalMap = NULL;
 
 
-    GLuint vao;
+    GpuVertexArray vao;
+    GLuint GetVAO() const { return m_procedural ? s_emptyVAO->Get() : vao.Get(); }
 
     float angle;
 
+    void create(int prec);
+    void bindTextures(GLint hasTextureLoc);
     void setupVertices();
     void setupBuffers();
     void setupModelMatrix(glm::vec3 pivotLoc, float angle, float scale);
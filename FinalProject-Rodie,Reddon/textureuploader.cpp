@@ -0,0 +1,576 @@
+#include "textureuploader.h"
+#include "alloctracker.h"
+#include "profiler.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+#include <SOIL2/SOIL2.h>
+
+static const int kSlots = 3;
+// Enough for several rows of the widest texture we'd ever load
+static const size_t kMinSlotSize = 256 * 1024;
+
+TextureUploader& TextureUploader::Get()
+{
+    static TextureUploader uploader;
+    return uploader;
+}
+
+TextureUploader::TextureUploader()
+{
+    m_initialized = false;
+    m_persistent = false;
+    m_slotSize = 0;
+    m_mapped = NULL;
+    for (GLsync& fence : m_fences)
+        fence = NULL;
+    m_slot = 0;
+    m_decoding = NULL;
+    m_stop = false;
+    m_pending = 0;
+    m_textures = 0;
+    m_bytes = 0;
+    m_frames = 0;
+    m_stalls = 0;
+    m_latencySumMs = 0.0;
+    m_latencyMaxMs = 0.0;
+    m_decodeSumMs = 0.0;
+}
+
+TextureUploader::~TextureUploader()
+{
+    // Normally Shutdown has already run; the GL objects can't be touched here
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+    if (m_worker.joinable())
+        m_worker.join();
+}
+
+bool TextureUploader::Initialize(size_t budgetBytes)
+{
+    if (m_initialized)
+        return true;
+
+    m_slotSize = std::max(budgetBytes, kMinSlotSize);
+    size_t total = m_slotSize * kSlots;
+
+    m_buffer.Create("Texture upload staging");
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_buffer.Get());
+    m_persistent = GLEW_ARB_buffer_storage;
+    if (m_persistent)
+    {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_PIXEL_UNPACK_BUFFER, total, NULL, flags);
+        m_mapped = (unsigned char*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, total, flags);
+        if (m_mapped == NULL)
+        {
+            // Buffer storage is immutable, so start over with a plain buffer
+            printf("Persistent mapping failed; texture uploads will map per frame\n");
+            m_persistent = false;
+            m_buffer.Create("Texture upload staging");
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_buffer.Get());
+        }
+    }
+    if (!m_persistent)
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, total, NULL, GL_STREAM_DRAW);
+    m_buffer.SetBytes(total);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    m_stop = false;
+    m_worker = std::thread(&TextureUploader::DecodeLoop, this);
+    m_initialized = true;
+    return true;
+}
+
+void TextureUploader::Shutdown()
+{
+    if (!m_initialized)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+    m_worker.join();
+
+    // Whatever didn't finish is dropped; the placeholders stay
+    for (Job* job : m_toDecode)
+        FreeJob(job);
+    for (Job* job : m_decoded)
+        FreeJob(job);
+    for (Job* job : m_uploading)
+        FreeJob(job);
+    m_toDecode.clear();
+    m_decoded.clear();
+    m_uploading.clear();
+    m_pending = 0;
+
+    for (GLsync& fence : m_fences)
+    {
+        if (fence != NULL)
+            glDeleteSync(fence);
+        fence = NULL;
+    }
+    if (m_persistent)
+    {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_buffer.Get());
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        m_mapped = NULL;
+    }
+    m_buffer.Reset();
+    m_initialized = false;
+}
+
+void TextureUploader::QueueTexture2D(const char* path, GpuTexture* handle, bool flipY, bool normalMap)
+{
+    Job* job = new Job();
+    job->target = GL_TEXTURE_2D;
+    job->handle = handle;
+    job->flipY = flipY;
+    job->normalMap = normalMap;
+    job->forceChannels = SOIL_LOAD_AUTO;
+    job->images.resize(1);
+    job->images[0].path = path;
+    Queue(job);
+}
+
+void TextureUploader::QueueCubemap(const std::vector<std::string>& faces, GpuTexture* handle)
+{
+    Job* job = new Job();
+    job->target = GL_TEXTURE_CUBE_MAP;
+    job->handle = handle;
+    job->flipY = false;
+    job->forceChannels = SOIL_LOAD_RGB;
+    job->images.resize(faces.size());
+    for (size_t i = 0; i < faces.size(); i++)
+        job->images[i].path = faces[i];
+    Queue(job);
+}
+
+void TextureUploader::Cancel(GpuTexture* handle)
+{
+    // The worker never reads handle, so clearing it under the lock is enough
+    // wherever the job is; Pump and Complete see it on this thread
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const std::deque<Job*>* queues[] = { &m_toDecode, &m_decoded, &m_uploading };
+    for (const std::deque<Job*>* queue : queues)
+    {
+        for (Job* job : *queue)
+        {
+            if (job->handle == handle)
+                job->handle = NULL;
+        }
+    }
+    if (m_decoding != NULL && m_decoding->handle == handle)
+        m_decoding->handle = NULL;
+}
+
+void TextureUploader::Queue(Job* job)
+{
+    job->queued = Clock::now();
+    if (!m_initialized)
+    {
+        Decode(job);
+        UploadNow(job);
+        return;
+    }
+
+    *job->handle = CreatePlaceholder(job->target, job->normalMap);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_toDecode.push_back(job);
+        m_pending++;
+    }
+    m_wake.notify_one();
+}
+
+void TextureUploader::DecodeLoop()
+{
+    for (;;)
+    {
+        Job* job;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wake.wait(lock, [this] { return m_stop || !m_toDecode.empty(); });
+            if (m_stop)
+                return;
+            job = m_toDecode.front();
+            m_toDecode.pop_front();
+            m_decoding = job;
+        }
+
+        Decode(job);
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_decoded.push_back(job);
+            m_decoding = NULL;
+        }
+        m_decodedSignal.notify_all();
+    }
+}
+
+void TextureUploader::Decode(Job* job)
+{
+    Clock::time_point start = Clock::now();
+    for (Image& image : job->images)
+    {
+        image.pixels = SOIL_load_image(image.path.c_str(), &image.width, &image.height,
+            &image.channels, job->forceChannels);
+        if (job->forceChannels != SOIL_LOAD_AUTO)
+            image.channels = job->forceChannels;
+
+        if (image.pixels == NULL)
+        {
+            printf("Failed to load texture: %s\n", image.path.c_str());
+            if (job->target == GL_TEXTURE_CUBE_MAP)
+            {
+                // Fallback: an empty black face instead of a missing one
+                image.pixels = (unsigned char*)calloc(3, 1);
+                image.width = image.height = 1;
+                image.channels = 3;
+                image.fallback = true;
+            }
+            else
+                job->failed = true;
+            continue;
+        }
+
+        if (job->flipY)
+        {
+            size_t rowBytes = (size_t)image.width * image.channels;
+            std::vector<unsigned char> swap(rowBytes);
+            for (int y = 0; y < image.height / 2; y++)
+            {
+                unsigned char* top = image.pixels + y * rowBytes;
+                unsigned char* bottom = image.pixels + (image.height - 1 - y) * rowBytes;
+                memcpy(swap.data(), top, rowBytes);
+                memcpy(top, bottom, rowBytes);
+                memcpy(bottom, swap.data(), rowBytes);
+            }
+        }
+    }
+    job->decodeMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+void TextureUploader::Update()
+{
+    if (!m_initialized)
+        return;
+    PROFILE_SCOPE("TextureUpload");
+    ALLOC_SCOPE("TextureUploader");
+    if (Pump(false))
+        m_frames++;
+}
+
+void TextureUploader::Finish()
+{
+    if (!m_initialized)
+        return;
+    PROFILE_SCOPE("TextureUploadFinish");
+    while (!IsIdle())
+        Pump(true);
+}
+
+bool TextureUploader::IsIdle()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_pending == 0;
+}
+
+bool TextureUploader::Pump(bool block)
+{
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (block && m_uploading.empty() && m_decoded.empty() && m_pending > 0)
+            m_decodedSignal.wait(lock, [this] { return !m_decoded.empty(); });
+        while (!m_decoded.empty())
+        {
+            m_uploading.push_back(m_decoded.front());
+            m_decoded.pop_front();
+        }
+    }
+    if (m_uploading.empty())
+        return false;
+
+    // The GPU may still be reading this slot from kSlots frames ago
+    GLsync& fence = m_fences[m_slot];
+    if (fence != NULL)
+    {
+        GLenum status = glClientWaitSync(fence, block ? GL_SYNC_FLUSH_COMMANDS_BIT : 0, block ? 1000000000ull : 0);
+        while (block && status == GL_TIMEOUT_EXPIRED)
+            status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000ull);
+        if (status == GL_TIMEOUT_EXPIRED)
+        {
+            m_stalls++;
+            return false;
+        }
+        glDeleteSync(fence);
+        fence = NULL;
+    }
+
+    size_t base = (size_t)m_slot * m_slotSize;
+    unsigned char* slot;
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_buffer.Get());
+    if (m_persistent)
+        slot = m_mapped + base;
+    else
+    {
+        // Unsynchronized is safe: the fence above says the GPU is done with it
+        slot = (unsigned char*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, base, m_slotSize,
+            GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+        if (slot == NULL)
+        {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            return false;
+        }
+    }
+
+    // Fill the slot, oldest job first
+    m_copies.clear();
+    size_t offset = 0;
+    bool full = false;
+    for (size_t j = 0; j < m_uploading.size() && !full; j++)
+    {
+        Job* job = m_uploading[j];
+        if (job->failed || job->handle == NULL)
+            job->image = job->images.size();
+        while (job->image < job->images.size())
+        {
+            Image& image = job->images[job->image];
+            size_t rowBytes = (size_t)image.width * image.channels;
+            int rows = std::min(image.height - job->row, (int)((m_slotSize - offset) / rowBytes));
+            if (rows <= 0)
+            {
+                full = true;
+                break;
+            }
+            memcpy(slot + offset, image.pixels + job->row * rowBytes, rows * rowBytes);
+
+            PendingCopy copy = { job, job->image, job->row, rows, base + offset };
+            m_copies.push_back(copy);
+            offset += rows * rowBytes;
+            job->row += rows;
+            if (job->row == image.height)
+            {
+                job->image++;
+                job->row = 0;
+            }
+        }
+    }
+    if (!m_persistent)
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+    // Storage for images starting this frame. With a buffer bound, a NULL
+    // pointer would be read as offset 0, so unbind first.
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    for (const PendingCopy& copy : m_copies)
+    {
+        if (copy.row != 0)
+            continue;
+        Job* job = copy.job;
+        const Image& image = job->images[copy.image];
+        if (!job->texture)
+            job->texture.Create(LabelFor(job->target));
+        glBindTexture(job->target, job->texture.Get());
+        GLenum face = job->target == GL_TEXTURE_CUBE_MAP ? GL_TEXTURE_CUBE_MAP_POSITIVE_X + (GLenum)copy.image : GL_TEXTURE_2D;
+        GLenum format = FormatFor(image.channels);
+        glTexImage2D(face, 0, SizedFormatFor(image.channels), image.width, image.height, 0, format, GL_UNSIGNED_BYTE, NULL);
+    }
+
+    // The copies themselves, sourced from the slot
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_buffer.Get());
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    for (const PendingCopy& copy : m_copies)
+    {
+        Job* job = copy.job;
+        const Image& image = job->images[copy.image];
+        glBindTexture(job->target, job->texture.Get());
+        GLenum face = job->target == GL_TEXTURE_CUBE_MAP ? GL_TEXTURE_CUBE_MAP_POSITIVE_X + (GLenum)copy.image : GL_TEXTURE_2D;
+        glTexSubImage2D(face, 0, 0, copy.row, image.width, copy.rows, FormatFor(image.channels),
+            GL_UNSIGNED_BYTE, (void*)copy.offset);
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    if (!m_copies.empty())
+    {
+        fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        m_slot = (m_slot + 1) % kSlots;
+    }
+
+    // Jobs finish in order, so the finished ones are at the front
+    while (!m_uploading.empty() && m_uploading.front()->image == m_uploading.front()->images.size())
+    {
+        Complete(m_uploading.front());
+        m_uploading.pop_front();
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_pending--;
+    }
+    return !m_copies.empty();
+}
+
+// Without a staging buffer: straight from client memory
+void TextureUploader::UploadNow(Job* job)
+{
+    if (!job->failed)
+    {
+        job->texture.Create(LabelFor(job->target));
+        glBindTexture(job->target, job->texture.Get());
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        for (size_t i = 0; i < job->images.size(); i++)
+        {
+            const Image& image = job->images[i];
+            GLenum face = job->target == GL_TEXTURE_CUBE_MAP ? GL_TEXTURE_CUBE_MAP_POSITIVE_X + (GLenum)i : GL_TEXTURE_2D;
+            GLenum format = FormatFor(image.channels);
+            glTexImage2D(face, 0, SizedFormatFor(image.channels), image.width, image.height, 0, format, GL_UNSIGNED_BYTE, image.pixels);
+        }
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    }
+    Complete(job);
+}
+
+void TextureUploader::Complete(Job* job)
+{
+    if (job->failed || job->handle == NULL)
+    {
+        FreeJob(job);
+        return;
+    }
+
+    glBindTexture(job->target, job->texture.Get());
+    size_t bytes = 0, gpuBytes = 0;
+    for (const Image& image : job->images)
+    {
+        bytes += (size_t)image.width * image.height * image.channels;
+        gpuBytes += GpuResources::TextureBytes(SizedFormatFor(image.channels), image.width, image.height,
+            1, job->target == GL_TEXTURE_2D);
+    }
+    job->texture.SetBytes(gpuBytes);
+
+    if (job->target == GL_TEXTURE_2D)
+    {
+        // Mipmaps
+        glGenerateMipmap(GL_TEXTURE_2D);
+
+        // Texture filtering
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+        // Wrapping (for repeating textures)
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+
+        // Grey and grey-alpha images sample as they would from a luminance texture
+        int channels = job->images[0].channels;
+        if (channels < 3)
+        {
+            GLint swizzle[4] = { GL_RED, GL_RED, GL_RED, channels == 2 ? GL_GREEN : GL_ONE };
+            glTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_RGBA, swizzle);
+        }
+    }
+    else
+    {
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    }
+    glBindTexture(job->target, 0);
+
+    // Swap out the placeholder, which goes with the assignment
+    *job->handle = std::move(job->texture);
+
+    double latencyMs = std::chrono::duration<double, std::milli>(Clock::now() - job->queued).count();
+    m_textures++;
+    m_bytes += bytes;
+    m_latencySumMs += latencyMs;
+    m_latencyMaxMs = std::max(m_latencyMaxMs, latencyMs);
+    m_decodeSumMs += job->decodeMs;
+    FreeJob(job);
+}
+
+void TextureUploader::FreeJob(Job* job)
+{
+    for (Image& image : job->images)
+    {
+        if (image.fallback)
+            free(image.pixels);
+        else if (image.pixels != NULL)
+            SOIL_free_image_data(image.pixels);
+    }
+    delete job;
+}
+
+GpuTexture TextureUploader::CreatePlaceholder(GLenum target, bool normalMap)
+{
+    // Mid grey for surfaces, black for the sky, straight up for normal maps
+    static const unsigned char grey[3] = { 128, 128, 128 };
+    static const unsigned char black[3] = { 0, 0, 0 };
+    static const unsigned char flat[3] = { 128, 128, 255 };
+
+    GpuTexture texture;
+    texture.Create("Texture placeholder");
+    glBindTexture(target, texture.Get());
+    texture.SetBytes(GpuResources::TextureBytes(GL_RGB8, 1, 1, target == GL_TEXTURE_CUBE_MAP ? 6 : 1));
+    if (target == GL_TEXTURE_CUBE_MAP)
+    {
+        for (GLenum face = 0; face < 6; face++)
+            glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, 0, GL_RGB8, 1, 1, 0, GL_RGB, GL_UNSIGNED_BYTE, black);
+    }
+    else
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, 1, 1, 0, GL_RGB, GL_UNSIGNED_BYTE, normalMap ? flat : grey);
+    glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glBindTexture(target, 0);
+    return texture;
+}
+
+const char* TextureUploader::LabelFor(GLenum target)
+{
+    return target == GL_TEXTURE_CUBE_MAP ? "Streamed cubemap" : "Streamed texture";
+}
+
+GLenum TextureUploader::FormatFor(int channels)
+{
+    switch (channels)
+    {
+    case 1: return GL_RED;
+    case 2: return GL_RG;
+    case 4: return GL_RGBA;
+    default: return GL_RGB;
+    }
+}
+
+// Sized, so BodyBatch can glCopyImageSubData the textures into arrays
+GLenum TextureUploader::SizedFormatFor(int channels)
+{
+    switch (channels)
+    {
+    case 1: return GL_R8;
+    case 2: return GL_RG8;
+    case 4: return GL_RGBA8;
+    default: return GL_RGB8;
+    }
+}
+
+void TextureUploader::PrintSummary() const
+{
+    if (m_textures == 0)
+        return;
+    printf("Texture uploads: %d textures, %.1f MB over %d frames (%.1f MB a frame, %s staging)\n",
+        m_textures, m_bytes / 1048576.0, m_frames, m_slotSize / 1048576.0,
+        m_persistent ? "persistently mapped" : "mapped per frame");
+    printf("  latency avg %.1f ms, max %.1f ms (decode avg %.1f ms); %d frame%s stalled on a busy slot\n",
+        m_latencySumMs / m_textures, m_latencyMaxMs, m_decodeSumMs / m_textures,
+        m_stalls, m_stalls == 1 ? "" : "s");
+}
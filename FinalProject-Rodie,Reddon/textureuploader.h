@@ -0,0 +1,140 @@
+#ifndef TEXTUREUPLOADER_H
+#define TEXTUREUPLOADER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "graphics_headers.h"
+#include "gpuresources.h"
+
+// Streams textures in without stalling the GL thread. Images are decoded on
+// a worker thread, copied into a ring of pixel buffer slots (persistently
+// mapped where ARB_buffer_storage is available) and handed to GL from
+// there, so glTexSubImage2D returns without waiting for the copy. Each
+// frame copies at most one slot's worth of rows (the byte budget), so
+// large maps arrive over several frames instead of in one hitch.
+//
+// Until Initialize is called, textures are decoded and uploaded on the spot.
+class TextureUploader
+{
+public:
+    static TextureUploader& Get();
+
+    // Needs a current GL context. budgetBytes is the most copied per frame.
+    bool Initialize(size_t budgetBytes);
+    // Releases the GL objects; call before the context goes away
+    void Shutdown();
+
+    // Puts a 1x1 placeholder texture in *handle and swaps the real one in
+    // when it has been uploaded. handle must outlive the upload, or be
+    // passed to Cancel first. A normal map's placeholder is flat rather
+    // than grey.
+    void QueueTexture2D(const char* path, GpuTexture* handle, bool flipY, bool normalMap = false);
+    // Faces in GL_TEXTURE_CUBE_MAP_POSITIVE_X order
+    void QueueCubemap(const std::vector<std::string>& faces, GpuTexture* handle);
+    // Forgets handle: whatever is still queued for it is dropped instead of
+    // swapped in. GL thread; call before the handle goes away.
+    void Cancel(GpuTexture* handle);
+
+    // Once a frame: uploads up to the budget. Skips the frame, counting a
+    // stall, if the GPU is still reading the next slot.
+    void Update();
+    // Uploads everything queued, waiting on the decoder and the GPU
+    void Finish();
+    bool IsIdle();
+
+    void PrintSummary() const;
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Image
+    {
+        std::string path;
+        unsigned char* pixels = NULL;
+        int width = 0;
+        int height = 0;
+        int channels = 0;
+        bool fallback = false;  // a 1x1 black face standing in for one that failed
+    };
+
+    struct Job
+    {
+        GLenum target;          // GL_TEXTURE_2D or GL_TEXTURE_CUBE_MAP
+        GpuTexture* handle;     // NULL once cancelled
+        bool flipY;             // done by the decoder
+        bool normalMap = false; // flat placeholder
+        bool failed = false;    // keeps the placeholder
+        int forceChannels;      // SOIL_LOAD_AUTO, or SOIL_LOAD_RGB for cubemaps
+        std::vector<Image> images;
+        GpuTexture texture;     // being filled; replaces *handle when done
+        size_t image = 0;       // next image (face) to copy
+        int row = 0;            // next row of it
+        Clock::time_point queued;
+        double decodeMs = 0.0;
+    };
+
+    // A copy recorded while the slot was mapped, issued after
+    struct PendingCopy
+    {
+        Job* job;
+        size_t image;
+        int row;
+        int rows;
+        size_t offset;
+    };
+
+    TextureUploader();
+    ~TextureUploader();
+
+    void Queue(Job* job);
+    void DecodeLoop();
+    static void Decode(Job* job);
+
+    bool Pump(bool block);
+    void Complete(Job* job);
+    void UploadNow(Job* job);
+    static void FreeJob(Job* job);
+    static GpuTexture CreatePlaceholder(GLenum target, bool normalMap);
+    static const char* LabelFor(GLenum target);
+    static GLenum FormatFor(int channels);
+    static GLenum SizedFormatFor(int channels);
+
+    bool m_initialized;
+    bool m_persistent;
+    size_t m_slotSize;
+    GpuBuffer m_buffer;
+    unsigned char* m_mapped;    // persistent mapping of the whole ring
+    GLsync m_fences[3];
+    int m_slot;
+
+    // Decode thread
+    std::thread m_worker;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_decodedSignal;
+    std::deque<Job*> m_toDecode;
+    std::deque<Job*> m_decoded;
+    Job* m_decoding;            // on the worker now, in neither queue
+    bool m_stop;
+    int m_pending;              // queued and not yet complete
+
+    std::deque<Job*> m_uploading;   // GL thread only
+    std::vector<PendingCopy> m_copies;
+
+    // Statistics
+    int m_textures;
+    size_t m_bytes;
+    int m_frames;               // frames that uploaded something
+    int m_stalls;
+    double m_latencySumMs;
+    double m_latencyMaxMs;
+    double m_decodeSumMs;
+};
+
+#endif /* TEXTUREUPLOADER_H */
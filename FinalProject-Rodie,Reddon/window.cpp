@@ -1,10 +1,59 @@
 #include "window.h"
 
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+// Headless rendering uses EGL surfaceless contexts (Mesa llvmpipe on the
+// render farm). Elsewhere it falls back to a hidden GLFW window.
+#if defined(__linux__)
+#define HEADLESS_EGL 1
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
 using namespace std;
 
+static double SteadySeconds()
+{
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
 Window::Window(const char* name, int* width, int* height)
+{
+    Create(name, width, height, false);
+}
+
+Window::Window(const char* name, int* width, int* height, bool headless)
+{
+    Create(name, width, height, headless);
+}
+
+void Window::Create(const char* name, int* width, int* height, bool headless)
 {
     gWindow = NULL;
+    m_headless = headless;
+    m_closeRequested = false;
+    m_ready = false;
+    m_width = *width;
+    m_height = *height;
+    m_captureWidth = 0;
+    m_captureHeight = 0;
+    m_startTime = SteadySeconds();
+    m_eglDisplay = NULL;
+    m_eglContext = NULL;
+
+#if defined(HEADLESS_EGL)
+    if (m_headless)
+    {
+        // No display and no GLFW at all: an EGL context with no surface
+        if (!CreateHeadlessContext())
+            return;
+        this->Initialize();
+        return;
+    }
+#endif
 
     if (!glfwInit())
     {
@@ -18,6 +67,8 @@ Window::Window(const char* name, int* width, int* height)
 
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    if (m_headless)
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
 
     // Create window
     gWindow = glfwCreateWindow(*width, *height, name, NULL, NULL);
@@ -29,6 +80,18 @@ Window::Window(const char* name, int* width, int* height)
 
 Window::~Window()
 {
+    // Now, while the context is still there
+    m_fbo.Reset();
+    m_colorRB.Reset();
+    m_depthRB.Reset();
+    m_captureFbo.Reset();
+    m_captureRB.Reset();
+
+    if (m_eglContext != NULL)
+    {
+        DestroyHeadlessContext();
+        return;
+    }
 
     glfwDestroyWindow(gWindow);
     gWindow = NULL;
@@ -37,17 +100,281 @@ Window::~Window()
 
 bool Window::Initialize()
 {
-    // Start SDL
-    if (glewInit() != GLEW_OK) { exit(EXIT_FAILURE); }
-    glfwSwapInterval(1);
+    // Initialize is called by the constructor and again by the engine
+    if (m_ready)
+        return true;
+    if (gWindow == NULL && m_eglContext == NULL)
+        return false;   // no context was created
 
+    glewExperimental = GL_TRUE;
+
+    if (m_eglContext != NULL)
+    {
+        // glewInit insists on a GLX display; the context-only loader doesn't
+        if (glewContextInit() != GLEW_OK)
+        {
+            printf("GLEW failed to load GL functions for the headless context.\n");
+            return false;
+        }
+    }
+    else
+    {
+        if (glewInit() != GLEW_OK) { exit(EXIT_FAILURE); }
+        glfwSwapInterval(m_headless ? 0 : 1);
+    }
+
+    // This is here to grab the error that comes from glew init.
+    // This error is an GL_INVALID_ENUM that has no effects on the performance
+    glGetError();
+
+    if (m_headless && !CreateFramebuffer())
+        return false;
 
     // Any other Window Initialization goes here
 
+    m_ready = true;
     return true;
 }
 
 void Window::Swap()
 {
+    if (m_headless)
+    {
+        // Nothing to present; wait for the frame so timings stay honest
+        glFinish();
+        return;
+    }
     glfwSwapBuffers(gWindow);
 }
+
+bool Window::ShouldClose()
+{
+    if (m_closeRequested)
+        return true;
+    if (gWindow == NULL)
+        return !m_headless;
+    return glfwWindowShouldClose(gWindow);
+}
+
+void Window::RequestClose()
+{
+    m_closeRequested = true;
+    if (gWindow != NULL)
+        glfwSetWindowShouldClose(gWindow, true);
+}
+
+double Window::GetTime()
+{
+    if (gWindow == NULL)
+        return SteadySeconds() - m_startTime;
+    return glfwGetTime();
+}
+
+bool Window::CreateFramebuffer()
+{
+    m_colorRB.Create("Offscreen color");
+    glBindRenderbuffer(GL_RENDERBUFFER, m_colorRB.Get());
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, m_width, m_height);
+    m_colorRB.SetBytes(GpuResources::TextureBytes(GL_RGBA8, m_width, m_height));
+
+    m_depthRB.Create("Offscreen depth");
+    glBindRenderbuffer(GL_RENDERBUFFER, m_depthRB.Get());
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, m_width, m_height);
+    m_depthRB.SetBytes(GpuResources::TextureBytes(GL_DEPTH_COMPONENT24, m_width, m_height));
+
+    m_fbo.Create("Offscreen framebuffer");
+    glBindFramebuffer(GL_FRAMEBUFFER, m_fbo.Get());
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, m_colorRB.Get());
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, m_depthRB.Get());
+
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    {
+        printf("Offscreen framebuffer is incomplete.\n");
+        return false;
+    }
+
+    // Left bound: the renderer draws into whatever is current
+    glViewport(0, 0, m_width, m_height);
+    printf("Headless rendering into a %dx%d offscreen framebuffer\n", m_width, m_height);
+    return true;
+}
+
+bool Window::CheckResize(int& width, int& height)
+{
+    if (m_headless || gWindow == NULL)
+        return false;
+    glfwGetFramebufferSize(gWindow, &width, &height);
+    if (width <= 0 || height <= 0 || (width == m_width && height == m_height))
+        return false;
+    m_width = width;
+    m_height = height;
+    return true;
+}
+
+void Window::CaptureFrame()
+{
+    if (m_headless || gWindow == NULL)
+        return;
+
+    // The window may have been resized since the last capture
+    int width, height;
+    glfwGetFramebufferSize(gWindow, &width, &height);
+    if (width <= 0 || height <= 0)
+        return;
+    if (width != m_captureWidth || height != m_captureHeight)
+    {
+        m_captureRB.Create("Screenshot color");
+        glBindRenderbuffer(GL_RENDERBUFFER, m_captureRB.Get());
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+        m_captureRB.SetBytes(GpuResources::TextureBytes(GL_RGBA8, width, height));
+
+        m_captureFbo.Create("Screenshot framebuffer");
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, m_captureFbo.Get());
+        glFramebufferRenderbuffer(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, m_captureRB.Get());
+        m_captureWidth = width;
+        m_captureHeight = height;
+    }
+
+    // A GPU-side copy; nothing waits on it until SaveFramebuffer
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, m_captureFbo.Get());
+    glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+bool Window::SaveFramebuffer(const char* path)
+{
+    GLuint source = m_fbo.Get();
+    int width = m_width, height = m_height;
+    if (!m_headless)
+    {
+        if (!m_captureFbo)
+        {
+            printf("No frame was captured for %s\n", path);
+            return false;
+        }
+        source = m_captureFbo.Get();
+        width = m_captureWidth;
+        height = m_captureHeight;
+    }
+
+    std::vector<unsigned char> pixels((size_t)width * height * 3);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, source);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+
+    FILE* file = fopen(path, "wb");
+    if (file == NULL)
+    {
+        printf("Could not write %s\n", path);
+        return false;
+    }
+
+    // GL rows start at the bottom, PPM rows at the top
+    fprintf(file, "P6\n%d %d\n255\n", width, height);
+    for (int y = height - 1; y >= 0; y--)
+        fwrite(&pixels[(size_t)y * width * 3], 1, (size_t)width * 3, file);
+    fclose(file);
+    return true;
+}
+
+#if defined(HEADLESS_EGL)
+
+bool Window::CreateHeadlessContext()
+{
+    EGLDisplay display = EGL_NO_DISPLAY;
+
+    // Prefer Mesa's surfaceless platform: needs neither X nor a GPU
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay != NULL)
+        display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    if (display == EGL_NO_DISPLAY)
+        display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+    EGLint major, minor;
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor))
+    {
+        printf("EGL failed to initialize (error 0x%x)\n", eglGetError());
+        return false;
+    }
+
+    if (!eglBindAPI(EGL_OPENGL_API))
+    {
+        printf("EGL has no desktop OpenGL support\n");
+        eglTerminate(display);
+        return false;
+    }
+
+    const EGLint configAttribs[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_RED_SIZE, 8,
+        EGL_GREEN_SIZE, 8,
+        EGL_BLUE_SIZE, 8,
+        EGL_DEPTH_SIZE, 24,
+        EGL_NONE
+    };
+    EGLConfig config;
+    EGLint numConfigs = 0;
+    if (!eglChooseConfig(display, configAttribs, &config, 1, &numConfigs) || numConfigs == 0)
+    {
+        printf("No suitable EGL config\n");
+        eglTerminate(display);
+        return false;
+    }
+
+    // Same version the windowed path asks GLFW for; compatibility profile to
+    // match GLFW's default
+    const EGLint contextAttribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 4,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_COMPATIBILITY_PROFILE_BIT,
+        EGL_NONE
+    };
+    EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttribs);
+    if (context == EGL_NO_CONTEXT)
+    {
+        printf("EGL context creation failed (error 0x%x)\n", eglGetError());
+        eglTerminate(display);
+        return false;
+    }
+
+    // Surfaceless: all rendering goes to our own framebuffer object
+    if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context))
+    {
+        printf("EGL surfaceless make-current failed (error 0x%x)\n", eglGetError());
+        eglDestroyContext(display, context);
+        eglTerminate(display);
+        return false;
+    }
+
+    m_eglDisplay = display;
+    m_eglContext = context;
+    printf("Headless EGL %d.%d context created\n", major, minor);
+    return true;
+}
+
+void Window::DestroyHeadlessContext()
+{
+    EGLDisplay display = (EGLDisplay)m_eglDisplay;
+    eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(display, (EGLContext)m_eglContext);
+    eglTerminate(display);
+    m_eglContext = NULL;
+    m_eglDisplay = NULL;
+}
+
+#else
+
+bool Window::CreateHeadlessContext()
+{
+    return false;
+}
+
+void Window::DestroyHeadlessContext()
+{
+
+}
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
+#include "gpuresources.h"
 #include <iostream>
 #include <string>
 using namespace std;
@@ -11,6 +12,8 @@ class Window
 {
 public:
     Window(const char* name, int* width, int* height);
+    // headless: no visible window, render into an offscreen framebuffer
+    Window(const char* name, int* width, int* height, bool headless);
     ~Window();
     bool Initialize();
     void Swap();
@@ -19,10 +22,56 @@ public:
         return gWindow;
     };
 
+    bool IsHeadless() const { return m_headless; }
+    bool ShouldClose();
+    void RequestClose();
+    double GetTime();
+
+    // Framebuffer everything should end up in: the offscreen FBO when
+    // headless, the default framebuffer (0) otherwise
+    GLuint GetFramebuffer() const { return m_fbo.Get(); }
+    int GetWidth() const { return m_width; }
+    int GetHeight() const { return m_height; }
+    // True once each time the window's framebuffer has changed size, with
+    // the new size. Never while minimized, or headless.
+    bool CheckResize(int& width, int& height);
+    // Keeps a copy of the frame just drawn; call before Swap, after which
+    // a window's back buffer is undefined. Headless frames stay in the
+    // offscreen FBO, so there it does nothing.
+    void CaptureFrame();
+    // Writes the last captured frame (headless: the offscreen FBO) as a
+    // binary PPM
+    bool SaveFramebuffer(const char* path);
+
 private:
+    void Create(const char* name, int* width, int* height, bool headless);
+    bool CreateHeadlessContext();
+    bool CreateFramebuffer();
+    void DestroyHeadlessContext();
+
     GLFWwindow* gWindow;
 
+    bool m_headless;
+    bool m_closeRequested;
+    bool m_ready;
+    int m_width;
+    int m_height;
+    double m_startTime;
+
+    // Offscreen target
+    GpuFramebuffer m_fbo;
+    GpuRenderbuffer m_colorRB;
+    GpuRenderbuffer m_depthRB;
+
+    // Windowed: where CaptureFrame copies the back buffer
+    GpuFramebuffer m_captureFbo;
+    GpuRenderbuffer m_captureRB;
+    int m_captureWidth;
+    int m_captureHeight;
 
+    // EGL handles (void* so this header doesn't need EGL)
+    void* m_eglDisplay;
+    void* m_eglContext;
 };
 
 #endif /* WINDOW_H */